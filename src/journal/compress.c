@@ -22,21 +22,47 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_XZ
 #include <lzma.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
 
 #include "macro.h"
+#include "util.h"
+#include "sparse-endian.h"
+#include "journal-def.h"
 #include "compress.h"
 
-bool compress_blob(const void *src, uint64_t src_size, void *dst, uint64_t *dst_size) {
+static const char* const object_compressed_table[_OBJECT_COMPRESSED_MAX] = {
+        [OBJECT_COMPRESSED_XZ] = "XZ",
+        [OBJECT_COMPRESSED_LZ4] = "LZ4",
+};
+
+const char* object_compressed_to_string(int compression) {
+        if (compression <= 0 || compression >= _OBJECT_COMPRESSED_MAX)
+                return NULL;
+
+        return object_compressed_table[compression];
+}
+
+#ifdef HAVE_XZ
+/* The buffers for the streaming functions are on the stack */
+#define STREAM_BUFFER_SIZE (16*1024)
+
+/* A small dictionary keeps the memory needed for compressing a
+ * stream of any size at a few MiB */
+#define STREAM_XZ_PRESET 1
+
+static bool compress_blob_xz(const void *src, uint64_t src_size, void *dst, uint64_t *dst_size) {
         lzma_stream s = LZMA_STREAM_INIT;
         lzma_ret ret;
         bool b = false;
 
-        assert(src);
-        assert(src_size > 0);
-        assert(dst);
-        assert(dst_size);
-
         /* Returns false if we couldn't compress the data or the
          * compressed result is longer than the original */
 
@@ -66,21 +92,14 @@ fail:
         return b;
 }
 
-bool uncompress_blob(const void *src, uint64_t src_size,
-                     void **dst, uint64_t *dst_alloc_size, uint64_t* dst_size, uint64_t dst_max) {
+static bool uncompress_blob_xz(const void *src, uint64_t src_size,
+                               void **dst, uint64_t *dst_alloc_size, uint64_t* dst_size, uint64_t dst_max) {
 
         lzma_stream s = LZMA_STREAM_INIT;
         lzma_ret ret;
         uint64_t space;
         bool b = false;
 
-        assert(src);
-        assert(src_size > 0);
-        assert(dst);
-        assert(dst_alloc_size);
-        assert(dst_size);
-        assert(*dst_alloc_size == 0 || *dst);
-
         ret = lzma_stream_decoder(&s, UINT64_MAX, 0);
         if (ret != LZMA_OK)
                 return false;
@@ -139,26 +158,15 @@ fail:
         return b;
 }
 
-bool uncompress_startswith(const void *src, uint64_t src_size,
-                           void **buffer, uint64_t *buffer_size,
-                           const void *prefix, uint64_t prefix_len,
-                           uint8_t extra) {
+static bool uncompress_startswith_xz(const void *src, uint64_t src_size,
+                                     void **buffer, uint64_t *buffer_size,
+                                     const void *prefix, uint64_t prefix_len,
+                                     uint8_t extra) {
 
         lzma_stream s = LZMA_STREAM_INIT;
         lzma_ret ret;
         bool b = false;
 
-        /* Checks whether the uncompressed blob starts with the
-         * mentioned prefix. The byte extra needs to follow the
-         * prefix */
-
-        assert(src);
-        assert(src_size > 0);
-        assert(buffer);
-        assert(buffer_size);
-        assert(prefix);
-        assert(*buffer_size == 0 || *buffer);
-
         ret = lzma_stream_decoder(&s, UINT64_MAX, 0);
         if (ret != LZMA_OK)
                 return false;
@@ -214,3 +222,399 @@ fail:
 
         return b;
 }
+
+static int compress_stream_xz(int fdf, int fdt, uint64_t max_bytes) {
+        uint8_t in[STREAM_BUFFER_SIZE], out[STREAM_BUFFER_SIZE];
+        uint64_t left = max_bytes;
+        lzma_stream s = LZMA_STREAM_INIT;
+        lzma_action action = LZMA_RUN;
+        lzma_ret ret;
+        int r = 0;
+
+        ret = lzma_easy_encoder(&s, STREAM_XZ_PRESET, LZMA_CHECK_CRC64);
+        if (ret != LZMA_OK)
+                return -ENOMEM;
+
+        s.next_out = out;
+        s.avail_out = sizeof(out);
+
+        for (;;) {
+                if (s.avail_in == 0 && action == LZMA_RUN) {
+                        size_t m = sizeof(in);
+                        ssize_t n = 0;
+
+                        if (max_bytes > 0)
+                                m = MIN(m, left);
+
+                        if (m > 0) {
+                                n = loop_read(fdf, in, m, false);
+                                if (n < 0) {
+                                        r = (int) n;
+                                        goto finish;
+                                }
+                        } else if (loop_read(fdf, in, 1, false) > 0)
+                                /* There is more, which we drop */
+                                r = -EFBIG;
+
+                        if (n == 0)
+                                action = LZMA_FINISH;
+                        else {
+                                s.next_in = in;
+                                s.avail_in = n;
+                                left -= n;
+                        }
+                }
+
+                ret = lzma_code(&s, action);
+                if (ret != LZMA_OK && ret != LZMA_STREAM_END) {
+                        r = -EBADMSG;
+                        goto finish;
+                }
+
+                if (s.avail_out == 0 || ret == LZMA_STREAM_END) {
+                        size_t n = sizeof(out) - s.avail_out;
+                        ssize_t k;
+
+                        k = loop_write(fdt, out, n, false);
+                        if (k < 0) {
+                                r = (int) k;
+                                goto finish;
+                        }
+                        if ((size_t) k != n) {
+                                r = -EIO;
+                                goto finish;
+                        }
+
+                        s.next_out = out;
+                        s.avail_out = sizeof(out);
+                }
+
+                if (ret == LZMA_STREAM_END)
+                        break;
+        }
+
+finish:
+        lzma_end(&s);
+
+        return r;
+}
+
+static int uncompress_stream_xz(int fdf, int fdt, uint64_t max_bytes) {
+        uint8_t in[STREAM_BUFFER_SIZE], out[STREAM_BUFFER_SIZE];
+        lzma_stream s = LZMA_STREAM_INIT;
+        lzma_action action = LZMA_RUN;
+        lzma_ret ret;
+        int r = 0;
+
+        ret = lzma_stream_decoder(&s, UINT64_MAX, 0);
+        if (ret != LZMA_OK)
+                return -ENOMEM;
+
+        s.next_out = out;
+        s.avail_out = sizeof(out);
+
+        for (;;) {
+                if (s.avail_in == 0 && action == LZMA_RUN) {
+                        ssize_t n;
+
+                        n = loop_read(fdf, in, sizeof(in), false);
+                        if (n < 0) {
+                                r = (int) n;
+                                goto finish;
+                        }
+
+                        if (n == 0)
+                                action = LZMA_FINISH;
+                        else {
+                                s.next_in = in;
+                                s.avail_in = n;
+                        }
+                }
+
+                ret = lzma_code(&s, action);
+                if (ret != LZMA_OK && ret != LZMA_STREAM_END) {
+                        r = -EBADMSG;
+                        goto finish;
+                }
+
+                if (s.avail_out == 0 || ret == LZMA_STREAM_END) {
+                        size_t n = sizeof(out) - s.avail_out;
+                        ssize_t k;
+
+                        if (max_bytes > 0) {
+                                if (n > max_bytes) {
+                                        r = -EFBIG;
+                                        goto finish;
+                                }
+
+                                max_bytes -= n;
+                        }
+
+                        k = loop_write(fdt, out, n, false);
+                        if (k < 0) {
+                                r = (int) k;
+                                goto finish;
+                        }
+                        if ((size_t) k != n) {
+                                r = -EIO;
+                                goto finish;
+                        }
+
+                        s.next_out = out;
+                        s.avail_out = sizeof(out);
+                }
+
+                if (ret == LZMA_STREAM_END)
+                        break;
+        }
+
+finish:
+        lzma_end(&s);
+
+        return r;
+}
+#endif
+
+#ifdef HAVE_LZ4
+/* LZ4 blocks do not record their uncompressed size, hence we
+ * prefix them with it, as little endian 64bit value. */
+#define LZ4_HEADER_SIZE sizeof(le64_t)
+
+static bool ensure_buffer(void **buffer, uint64_t *buffer_size, uint64_t need) {
+        void *p;
+
+        if (*buffer_size >= need)
+                return true;
+
+        p = realloc(*buffer, need);
+        if (!p)
+                return false;
+
+        *buffer = p;
+        *buffer_size = need;
+
+        return true;
+}
+
+static bool compress_blob_lz4(const void *src, uint64_t src_size, void *dst, uint64_t *dst_size) {
+        int r;
+
+        /* The compressed result must be at least one byte shorter
+         * than the original, including our size prefix */
+        if (src_size <= LZ4_HEADER_SIZE + 1 || src_size > LZ4_MAX_INPUT_SIZE)
+                return false;
+
+        r = LZ4_compress_limitedOutput(src, (char*) dst + LZ4_HEADER_SIZE,
+                                       src_size, src_size - LZ4_HEADER_SIZE - 1);
+        if (r <= 0)
+                return false;
+
+        *(le64_t*) dst = htole64(src_size);
+        *dst_size = r + LZ4_HEADER_SIZE;
+
+        return true;
+}
+
+static bool uncompress_blob_lz4(const void *src, uint64_t src_size,
+                                void **dst, uint64_t *dst_alloc_size, uint64_t* dst_size, uint64_t dst_max) {
+
+        uint64_t size, want;
+        int r;
+
+        if (src_size <= LZ4_HEADER_SIZE)
+                return false;
+
+        size = le64toh(*(const le64_t*) src);
+        if (size == 0 || size > LZ4_MAX_INPUT_SIZE)
+                return false;
+
+        /* If the caller is only interested in the beginning of the
+         * blob, we don't bother decompressing the rest */
+        want = dst_max > 0 ? MIN(size, dst_max) : size;
+
+        if (!ensure_buffer(dst, dst_alloc_size, want))
+                return false;
+
+        if (want == size) {
+                r = LZ4_decompress_safe((const char*) src + LZ4_HEADER_SIZE, *dst,
+                                        src_size - LZ4_HEADER_SIZE, size);
+                if (r < 0 || (uint64_t) r != size)
+                        return false;
+        } else {
+                r = LZ4_decompress_safe_partial((const char*) src + LZ4_HEADER_SIZE, *dst,
+                                                src_size - LZ4_HEADER_SIZE, want, want);
+                if (r < 0 || (uint64_t) r < want)
+                        return false;
+        }
+
+        *dst_size = r;
+        return true;
+}
+
+static bool uncompress_startswith_lz4(const void *src, uint64_t src_size,
+                                      void **buffer, uint64_t *buffer_size,
+                                      const void *prefix, uint64_t prefix_len,
+                                      uint8_t extra) {
+
+        uint64_t size;
+        int r;
+
+        if (src_size <= LZ4_HEADER_SIZE)
+                return false;
+
+        size = le64toh(*(const le64_t*) src);
+        if (size <= prefix_len || size > LZ4_MAX_INPUT_SIZE)
+                return false;
+
+        if (!ensure_buffer(buffer, buffer_size, prefix_len + 1))
+                return false;
+
+        r = LZ4_decompress_safe_partial((const char*) src + LZ4_HEADER_SIZE, *buffer,
+                                        src_size - LZ4_HEADER_SIZE, prefix_len + 1, prefix_len + 1);
+        if (r < 0 || (uint64_t) r <= prefix_len)
+                return false;
+
+        return memcmp(*buffer, prefix, prefix_len) == 0 &&
+                ((const uint8_t*) *buffer)[prefix_len] == extra;
+}
+#endif
+
+bool compress_blob(int compression,
+                   const void *src, uint64_t src_size,
+                   void *dst, uint64_t *dst_size) {
+
+        assert(src);
+        assert(src_size > 0);
+        assert(dst);
+        assert(dst_size);
+
+        /* The destination buffer must be at least src_size bytes
+         * large. Returns false if we couldn't compress the data or
+         * the compressed result is longer than the original */
+
+        switch (compression) {
+
+#ifdef HAVE_XZ
+        case OBJECT_COMPRESSED_XZ:
+                return compress_blob_xz(src, src_size, dst, dst_size);
+#endif
+
+#ifdef HAVE_LZ4
+        case OBJECT_COMPRESSED_LZ4:
+                return compress_blob_lz4(src, src_size, dst, dst_size);
+#endif
+
+        default:
+                return false;
+        }
+}
+
+int uncompress_blob(int compression,
+                    const void *src, uint64_t src_size,
+                    void **dst, uint64_t *dst_alloc_size, uint64_t* dst_size, uint64_t dst_max) {
+
+        assert(src);
+        assert(src_size > 0);
+        assert(dst);
+        assert(dst_alloc_size);
+        assert(dst_size);
+        assert(*dst_alloc_size == 0 || *dst);
+
+        /* Returns -EBADMSG if the data couldn't be decompressed, and
+         * -EPROTONOSUPPORT if the algorithm wasn't compiled in */
+
+        switch (compression) {
+
+#ifdef HAVE_XZ
+        case OBJECT_COMPRESSED_XZ:
+                return uncompress_blob_xz(src, src_size, dst, dst_alloc_size, dst_size, dst_max) ? 0 : -EBADMSG;
+#endif
+
+#ifdef HAVE_LZ4
+        case OBJECT_COMPRESSED_LZ4:
+                return uncompress_blob_lz4(src, src_size, dst, dst_alloc_size, dst_size, dst_max) ? 0 : -EBADMSG;
+#endif
+
+        default:
+                return -EPROTONOSUPPORT;
+        }
+}
+
+int uncompress_startswith(int compression,
+                          const void *src, uint64_t src_size,
+                          void **buffer, uint64_t *buffer_size,
+                          const void *prefix, uint64_t prefix_len,
+                          uint8_t extra) {
+
+        /* Checks whether the uncompressed blob starts with the
+         * mentioned prefix. The byte extra needs to follow the
+         * prefix. Returns > 0 if so, 0 if not or if the data is
+         * corrupt, and -EPROTONOSUPPORT if the algorithm wasn't
+         * compiled in */
+
+        assert(src);
+        assert(src_size > 0);
+        assert(buffer);
+        assert(buffer_size);
+        assert(prefix);
+        assert(*buffer_size == 0 || *buffer);
+
+        switch (compression) {
+
+#ifdef HAVE_XZ
+        case OBJECT_COMPRESSED_XZ:
+                return uncompress_startswith_xz(src, src_size, buffer, buffer_size, prefix, prefix_len, extra);
+#endif
+
+#ifdef HAVE_LZ4
+        case OBJECT_COMPRESSED_LZ4:
+                return uncompress_startswith_lz4(src, src_size, buffer, buffer_size, prefix, prefix_len, extra);
+#endif
+
+        default:
+                return -EPROTONOSUPPORT;
+        }
+}
+
+int compress_stream(int compression, int fdf, int fdt, uint64_t max_bytes) {
+
+        assert(fdf >= 0);
+        assert(fdt >= 0);
+
+        /* Reads from fdf until EOF, or until max_bytes have been
+         * read unless that is 0, and writes the compressed data to
+         * fdt. The memory needed does not depend on the amount of
+         * data. Returns -EFBIG if the input was cut off, in which
+         * case fdt still contains a complete compressed stream. */
+
+        switch (compression) {
+
+#ifdef HAVE_XZ
+        case OBJECT_COMPRESSED_XZ:
+                return compress_stream_xz(fdf, fdt, max_bytes);
+#endif
+
+        default:
+                return -EPROTONOSUPPORT;
+        }
+}
+
+int uncompress_stream(int compression, int fdf, int fdt, uint64_t max_bytes) {
+
+        assert(fdf >= 0);
+        assert(fdt >= 0);
+
+        /* Returns -EFBIG if the uncompressed data would be larger
+         * than max_bytes, unless that is 0 */
+
+        switch (compression) {
+
+#ifdef HAVE_XZ
+        case OBJECT_COMPRESSED_XZ:
+                return uncompress_stream_xz(fdf, fdt, max_bytes);
+#endif
+
+        default:
+                return -EPROTONOSUPPORT;
+        }
+}
@@ -24,12 +24,28 @@
 #include <inttypes.h>
 #include <stdbool.h>
 
-bool compress_blob(const void *src, uint64_t src_size, void *dst, uint64_t *dst_size);
-
-bool uncompress_blob(const void *src, uint64_t src_size,
-                     void **dst, uint64_t *dst_alloc_size, uint64_t* dst_size, uint64_t dst_max);
-
-bool uncompress_startswith(const void *src, uint64_t src_size,
-                           void **buffer, uint64_t *buffer_size,
-                           const void *prefix, uint64_t prefix_len,
-                           uint8_t extra);
+const char* object_compressed_to_string(int compression);
+
+/* The compression argument is one of the OBJECT_COMPRESSED_xyz
+ * object flags, selecting the algorithm to use. Compressing with an
+ * algorithm that wasn't compiled in fails like any other error, and
+ * the data is stored uncompressed. Uncompressing with it returns
+ * -EPROTONOSUPPORT. */
+
+bool compress_blob(int compression,
+                   const void *src, uint64_t src_size,
+                   void *dst, uint64_t *dst_size);
+
+int uncompress_blob(int compression,
+                    const void *src, uint64_t src_size,
+                    void **dst, uint64_t *dst_alloc_size, uint64_t* dst_size, uint64_t dst_max);
+
+int uncompress_startswith(int compression,
+                          const void *src, uint64_t src_size,
+                          void **buffer, uint64_t *buffer_size,
+                          const void *prefix, uint64_t prefix_len,
+                          uint8_t extra);
+
+/* These only support XZ so far */
+int compress_stream(int compression, int fdf, int fdt, uint64_t max_bytes);
+int uncompress_stream(int compression, int fdf, int fdt, uint64_t max_bytes);
@@ -22,7 +22,11 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
 
 #include <systemd/sd-journal.h>
 
@@ -36,13 +40,29 @@
 #include "mkdir.h"
 #include "special.h"
 #include "cgroup-util.h"
+#include "journal-def.h"
+#include "compress.h"
+
+/* The core is not stored in the journal itself, but in a file of its
+ * own, which the journal entry refers to. It is compressed while it
+ * is read, hence it never needs to fit into memory. */
+#define COREDUMP_DIR "/var/lib/systemd/coredump"
+
+#ifdef HAVE_XZ
+#  define COREDUMP_SUFFIX ".xz"
+#else
+#  define COREDUMP_SUFFIX ""
+#endif
 
-/* Few programs have less than 3MiB resident */
-#define COREDUMP_MIN_START (3*1024*1024)
-/* Make sure to not make this larger than the maximum journal entry
- * size. See ENTRY_SIZE_MAX in journald-native.c. */
+/* Cores are cut off after this many bytes */
 #define COREDUMP_MAX (768*1024*1024)
 
+/* All stored cores together may use at most 10% of the file system,
+ * and leave at least 15% of it free, like the journal files do by
+ * default. Both are capped at this. */
+#define COREDUMP_MAX_USE_UPPER (4ULL*1024ULL*1024ULL*1024ULL)   /* 4 GiB */
+#define COREDUMP_KEEP_FREE_UPPER (4ULL*1024ULL*1024ULL*1024ULL) /* 4 GiB */
+
 enum {
         ARG_PID = 1,
         ARG_UID,
@@ -58,9 +78,9 @@ static int divert_coredump(void) {
 
         log_info("Detected coredump of the journal daemon itself, diverting coredump to /var/lib/systemd/coredump/.");
 
-        mkdir_p_label("/var/lib/systemd/coredump", 0755);
+        mkdir_p_label(COREDUMP_DIR, 0755);
 
-        f = fopen("/var/lib/systemd/coredump/core.systemd-journald", "we");
+        f = fopen(COREDUMP_DIR "/core.systemd-journald", "we");
         if (!f) {
                 log_error("Failed to create coredump file: %m");
                 return -errno;
@@ -97,18 +117,219 @@ static int divert_coredump(void) {
         return 0;
 }
 
+#ifndef HAVE_XZ
+static int copy_coredump(int fdf, int fdt, uint64_t max_bytes) {
+
+        while (max_bytes > 0) {
+                uint8_t buffer[16*1024];
+                ssize_t n, k;
+
+                n = loop_read(fdf, buffer, MIN(sizeof(buffer), max_bytes), false);
+                if (n < 0)
+                        return (int) n;
+                if (n == 0)
+                        return 0;
+
+                k = loop_write(fdt, buffer, n, false);
+                if (k < 0)
+                        return (int) k;
+                if (k != n)
+                        return -EIO;
+
+                max_bytes -= n;
+        }
+
+        return 0;
+}
+#endif
+
+static int vacuum_coredumps(uint64_t *allowance) {
+        _cleanup_closedir_ DIR *d = NULL;
+        struct statvfs ss;
+        uint64_t fs_size, max_use, keep_free;
+
+        assert(allowance);
+
+        /* Removes the oldest cores until the rest fits into the
+         * limits, and returns how many bytes a new core may take
+         * up. That is 0 if there is no room even though no cores
+         * are left. */
+
+        d = opendir(COREDUMP_DIR);
+        if (!d) {
+                log_error("Failed to open coredump directory: %m");
+                return -errno;
+        }
+
+        if (fstatvfs(dirfd(d), &ss) < 0) {
+                log_error("Failed to determine size of coredump file system: %m");
+                return -errno;
+        }
+
+        fs_size = (uint64_t) ss.f_frsize * (uint64_t) ss.f_blocks;
+        max_use = MIN(PAGE_ALIGN(fs_size / 10), COREDUMP_MAX_USE_UPPER);
+        keep_free = MIN(PAGE_ALIGN(fs_size * 3 / 20), COREDUMP_KEEP_FREE_UPPER);
+
+        for (;;) {
+                _cleanup_free_ char *oldest = NULL;
+                usec_t oldest_mtime = 0;
+                uint64_t usage = 0, available;
+                struct dirent *de;
+
+                rewinddir(d);
+
+                FOREACH_DIRENT(de, d, log_error("Failed to read coredump directory: %m"); return -errno) {
+                        struct stat st;
+
+                        if (!startswith(de->d_name, "core."))
+                                continue;
+
+                        if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                                continue;
+
+                        if (!S_ISREG(st.st_mode))
+                                continue;
+
+                        usage += 512UL * (uint64_t) st.st_blocks;
+
+                        if (!oldest || timespec_load(&st.st_mtim) < oldest_mtime) {
+                                free(oldest);
+                                oldest = strdup(de->d_name);
+                                if (!oldest)
+                                        return log_oom();
+
+                                oldest_mtime = timespec_load(&st.st_mtim);
+                        }
+                }
+
+                if (fstatvfs(dirfd(d), &ss) < 0) {
+                        log_error("Failed to determine free space for coredumps: %m");
+                        return -errno;
+                }
+
+                available = (uint64_t) ss.f_bavail * (uint64_t) ss.f_bsize;
+
+                if (usage < max_use && available > keep_free) {
+                        *allowance = MIN(max_use - usage, available - keep_free);
+                        return 0;
+                }
+
+                if (!oldest) {
+                        *allowance = 0;
+                        return 0;
+                }
+
+                if (unlinkat(dirfd(d), oldest, 0) < 0 && errno != ENOENT) {
+                        log_warning("Failed to delete old coredump %s/%s: %m", COREDUMP_DIR, oldest);
+                        *allowance = 0;
+                        return 0;
+                }
+
+                log_info("Deleted old coredump %s/%s to make room.", COREDUMP_DIR, oldest);
+        }
+}
+
+static int save_coredump(const char *comm, uid_t uid, gid_t gid, const char *pid, const char *timestamp, char **ret) {
+        _cleanup_free_ char *c = NULL, *fn = NULL;
+        char tmp[] = COREDUMP_DIR "/.#coredumpXXXXXX";
+        char boot[33];
+        sd_id128_t boot_id;
+        uint64_t max_bytes;
+        int fd, r;
+
+        assert(comm);
+        assert(pid);
+        assert(timestamp);
+        assert(ret);
+
+        r = sd_id128_get_boot(&boot_id);
+        if (r < 0) {
+                log_error("Failed to determine boot ID: %s", strerror(-r));
+                return r;
+        }
+
+        c = xescape(comm, "/. ");
+        if (!c)
+                return log_oom();
+
+        if (asprintf(&fn, COREDUMP_DIR "/core.%s.%lu.%s.%s.%s000000" COREDUMP_SUFFIX,
+                     c, (unsigned long) uid, sd_id128_to_string(boot_id, boot), pid, timestamp) < 0)
+                return log_oom();
+
+        mkdir_p_label(COREDUMP_DIR, 0755);
+
+        r = vacuum_coredumps(&max_bytes);
+        if (r < 0)
+                return r;
+
+        if (max_bytes <= 0) {
+                log_info("Not storing coredump of %s (%s), no room left in %s.", pid, comm, COREDUMP_DIR);
+                return -ENOSPC;
+        }
+
+        /* Limiting the input also limits the output, whether it is
+         * compressed or not */
+        max_bytes = MIN(max_bytes, (uint64_t) COREDUMP_MAX);
+
+        fd = mkostemp(tmp, O_WRONLY|O_CLOEXEC);
+        if (fd < 0) {
+                log_error("Failed to create coredump file: %m");
+                return -errno;
+        }
+
+#ifdef HAVE_XZ
+        r = compress_stream(OBJECT_COMPRESSED_XZ, STDIN_FILENO, fd, max_bytes);
+#else
+        r = copy_coredump(STDIN_FILENO, fd, max_bytes);
+#endif
+        if (r == -EFBIG)
+                log_info("Coredump of %s (%s) is larger than %llu bytes, truncated.",
+                         pid, comm, (unsigned long long) max_bytes);
+        else if (r < 0) {
+                log_error("Failed to store coredump: %s", strerror(-r));
+                goto fail;
+        }
+
+        /* The user who owns the crashed process may read the core,
+         * but not remove it */
+        if (fchown(fd, uid, gid) < 0 ||
+            fchmod(fd, 0400) < 0) {
+                log_error("Failed to fix coredump file ownership: %m");
+                r = -errno;
+                goto fail;
+        }
+
+        if (rename(tmp, fn) < 0) {
+                log_error("Failed to rename coredump file: %m");
+                r = -errno;
+                goto fail;
+        }
+
+        close_nointr_nofail(fd);
+
+        *ret = fn;
+        fn = NULL;
+
+        return 0;
+
+fail:
+        unlink(tmp);
+        close_nointr_nofail(fd);
+
+        return r;
+}
+
 int main(int argc, char* argv[]) {
         int r, j = 0;
         char *t;
-        ssize_t n;
         pid_t pid;
         uid_t uid;
         gid_t gid;
         struct iovec iovec[14];
-        size_t coredump_bufsize, coredump_size;
         _cleanup_free_ char *core_pid = NULL, *core_uid = NULL, *core_gid = NULL, *core_signal = NULL,
                 *core_timestamp = NULL, *core_comm = NULL, *core_exe = NULL, *core_unit = NULL,
-                *core_session = NULL, *core_message = NULL, *core_cmdline = NULL, *coredump_data = NULL;
+                *core_session = NULL, *core_message = NULL, *core_cmdline = NULL, *core_filename = NULL,
+                *coredump_filename = NULL;
 
         prctl(PR_SET_DUMPABLE, 0);
 
@@ -224,11 +445,18 @@ int main(int argc, char* argv[]) {
         if (core_message)
                 IOVEC_SET_STRING(iovec[j++], core_message);
 
+        r = save_coredump(argv[ARG_COMM], uid, gid, argv[ARG_PID], argv[ARG_TIMESTAMP], &coredump_filename);
+        if (r >= 0) {
+                core_filename = strappend("COREDUMP_FILENAME=", coredump_filename);
+                if (core_filename)
+                        IOVEC_SET_STRING(iovec[j++], core_filename);
+        }
+
         /* Now, let's drop privileges to become the user who owns the
-         * segfaulted process and allocate the coredump memory under
-         * his uid. This also ensures that the credentials journald
-         * will see are the ones of the coredumping user, thus making
-         * sure the user himself gets access to the core dump. */
+         * segfaulted process. This ensures that the credentials
+         * journald will see are the ones of the coredumping user,
+         * thus making sure the user himself gets access to the
+         * entry. */
 
         if (setresgid(gid, gid, gid) < 0 ||
             setresuid(uid, uid, uid) < 0) {
@@ -237,37 +465,6 @@ int main(int argc, char* argv[]) {
                 goto finish;
         }
 
-        coredump_bufsize = COREDUMP_MIN_START;
-        coredump_data = malloc(coredump_bufsize);
-        if (!coredump_data) {
-                r = log_oom();
-                goto finish;
-        }
-
-        memcpy(coredump_data, "COREDUMP=", 9);
-        coredump_size = 9;
-
-        for (;;) {
-                n = loop_read(STDIN_FILENO, coredump_data + coredump_size,
-                              coredump_bufsize - coredump_size, false);
-                if (n < 0) {
-                        log_error("Failed to read core dump data: %s", strerror(-n));
-                        r = (int) n;
-                        goto finish;
-                } else if (n == 0)
-                        break;
-
-                coredump_size += n;
-                if (!GREEDY_REALLOC(coredump_data, coredump_bufsize, coredump_size + 1)) {
-                        r = log_oom();
-                        goto finish;
-                }
-        }
-
-        iovec[j].iov_base = coredump_data;
-        iovec[j].iov_len = coredump_size;
-        j++;
-
         r = sd_journal_sendv(iovec, j);
         if (r < 0)
                 log_error("Failed to send coredump: %s", strerror(-r));
@@ -36,6 +36,8 @@
 #include "pager.h"
 #include "macro.h"
 #include "journal-internal.h"
+#include "journal-def.h"
+#include "compress.h"
 
 static enum {
         ACTION_NONE,
@@ -378,25 +380,66 @@ static int focus(sd_journal *j) {
         return r;
 }
 
-static int dump_core(sd_journal* j) {
+static int copy_core(int fdf, int fdt) {
+
+        for (;;) {
+                uint8_t buffer[16*1024];
+                ssize_t n, k;
+
+                n = loop_read(fdf, buffer, sizeof(buffer), false);
+                if (n < 0)
+                        return (int) n;
+                if (n == 0)
+                        return 0;
+
+                k = loop_write(fdt, buffer, n, false);
+                if (k < 0)
+                        return (int) k;
+                if (k != n)
+                        return -EIO;
+        }
+}
+
+static int save_core(sd_journal *j, int fd) {
         const void *data;
-        size_t len, ret;
+        size_t len;
+        ssize_t sz;
         int r;
 
         assert(j);
+        assert(fd >= 0);
+
+        /* Cores are either stored in a file of their own, which the
+         * entry refers to, or in the entry itself */
+        r = sd_journal_get_data(j, "COREDUMP_FILENAME", (const void**) &data, &len);
+        if (r >= 0) {
+                _cleanup_free_ char *filename = NULL;
+                _cleanup_close_ int fdf = -1;
+
+                assert(len >= 18);
+                filename = strndup((const char*) data + 18, len - 18);
+                if (!filename)
+                        return log_oom();
+
+                fdf = open(filename, O_RDONLY|O_CLOEXEC);
+                if (fdf < 0) {
+                        log_error("Failed to open %s: %m", filename);
+                        return -errno;
+                }
 
-        /* We want full data, nothing truncated. */
-        sd_journal_set_data_threshold(j, 0);
+                if (endswith(filename, ".xz"))
+                        r = uncompress_stream(OBJECT_COMPRESSED_XZ, fdf, fd, 0);
+                else
+                        r = copy_core(fdf, fd);
+                if (r < 0) {
+                        log_error("Failed to copy coredump from %s: %s", filename, strerror(-r));
+                        return r;
+                }
 
-        r = focus(j);
-        if (r < 0)
+                return 0;
+        } else if (r != -ENOENT) {
+                log_error("Failed to retrieve COREDUMP_FILENAME field: %s", strerror(-r));
                 return r;
-
-        print_entry(output ? stdout : stderr, j, false);
-
-        if (on_tty() && !output) {
-                log_error("Refusing to dump core to tty");
-                return -ENOTTY;
         }
 
         r = sd_journal_get_data(j, "COREDUMP", (const void**) &data, &len);
@@ -409,12 +452,44 @@ static int dump_core(sd_journal* j) {
         data = (const uint8_t*) data + 9;
         len -= 9;
 
-        ret = fwrite(data, len, 1, output ? output : stdout);
-        if (ret != 1) {
-                log_error("dumping coredump: %m (%zu)", ret);
-                return -errno;
+        sz = loop_write(fd, data, len, false);
+        if (sz < 0) {
+                log_error("Failed to write coredump: %s", strerror(-sz));
+                return (int) sz;
+        }
+        if (sz != (ssize_t) len) {
+                log_error("Short write of coredump.");
+                return -EIO;
         }
 
+        return 0;
+}
+
+static int dump_core(sd_journal* j) {
+        int r;
+
+        assert(j);
+
+        /* We want full data, nothing truncated. */
+        sd_journal_set_data_threshold(j, 0);
+
+        r = focus(j);
+        if (r < 0)
+                return r;
+
+        print_entry(output ? stdout : stderr, j, false);
+
+        if (on_tty() && !output) {
+                log_error("Refusing to dump core to tty");
+                return -ENOTTY;
+        }
+
+        fflush(output ? output : stdout);
+
+        r = save_core(j, fileno(output ? output : stdout));
+        if (r < 0)
+                return r;
+
         r = sd_journal_previous(j);
         if (r >= 0)
                 log_warning("More than one entry matches, ignoring rest.\n");
@@ -426,7 +501,6 @@ static int run_gdb(sd_journal *j) {
         char path[] = "/var/tmp/coredump-XXXXXX";
         const void *data;
         size_t len;
-        ssize_t sz;
         pid_t pid;
         _cleanup_free_ char *exe = NULL;
         int r;
@@ -462,33 +536,15 @@ static int run_gdb(sd_journal *j) {
                 return -ENOENT;
         }
 
-        r = sd_journal_get_data(j, "COREDUMP", (const void**) &data, &len);
-        if (r < 0) {
-                log_error("Failed to retrieve COREDUMP field: %s", strerror(-r));
-                return r;
-        }
-
-        assert(len >= 9);
-        data = (const uint8_t*) data + 9;
-        len -= 9;
-
         fd = mkostemp(path, O_WRONLY);
         if (fd < 0) {
                 log_error("Failed to create temporary file: %m");
                 return -errno;
         }
 
-        sz = write(fd, data, len);
-        if (sz < 0) {
-                log_error("Failed to write temporary file: %s", strerror(errno));
-                r = -errno;
-                goto finish;
-        }
-        if (sz != (ssize_t) len) {
-                log_error("Short write to temporary file.");
-                r = -EIO;
+        r = save_core(j, fd);
+        if (r < 0)
                 goto finish;
-        }
 
         close_nointr_nofail(fd);
         fd = -1;
@@ -273,6 +273,8 @@ int journal_file_hmac_put_object(JournalFile *f, int type, Object *o, uint64_t p
 
         case OBJECT_FIELD_HASH_TABLE:
         case OBJECT_DATA_HASH_TABLE:
+        case OBJECT_DATA_OVERFLOW_TABLE:
+        case OBJECT_FIELD_OVERFLOW_TABLE:
         case OBJECT_ENTRY_ARRAY:
                 /* Nothing: everything is mutable */
                 break;
@@ -306,7 +308,8 @@ int journal_file_hmac_put_header(JournalFile *f) {
          * tail_entry_seqnum, head_entry_seqnum, entry_array_offset,
          * head_entry_realtime, tail_entry_realtime,
          * tail_entry_monotonic, n_data, n_fields, n_tags,
-         * n_entry_arrays. */
+         * n_entry_arrays, data_overflow_table_offset,
+         * field_overflow_table_offset. */
 
         gcry_md_write(f->hmac, f->header->signature, offsetof(Header, state) - offsetof(Header, signature));
         gcry_md_write(f->hmac, &f->header->file_id, offsetof(Header, boot_id) - offsetof(Header, file_id));
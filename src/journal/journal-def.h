@@ -43,11 +43,14 @@ typedef struct DataObject DataObject;
 typedef struct FieldObject FieldObject;
 typedef struct EntryObject EntryObject;
 typedef struct HashTableObject HashTableObject;
+typedef struct OverflowTableObject OverflowTableObject;
 typedef struct EntryArrayObject EntryArrayObject;
+typedef struct CompactEntryArrayObject CompactEntryArrayObject;
 typedef struct TagObject TagObject;
 
 typedef struct EntryItem EntryItem;
 typedef struct HashItem HashItem;
+typedef struct OverflowItem OverflowItem;
 
 typedef struct FSSHeader FSSHeader;
 
@@ -61,14 +64,20 @@ enum {
         OBJECT_FIELD_HASH_TABLE,
         OBJECT_ENTRY_ARRAY,
         OBJECT_TAG,
+        OBJECT_DATA_OVERFLOW_TABLE,
+        OBJECT_FIELD_OVERFLOW_TABLE,
         _OBJECT_TYPE_MAX
 };
 
 /* Object flags */
 enum {
-        OBJECT_COMPRESSED = 1
+        OBJECT_COMPRESSED_XZ = 1 << 0,
+        OBJECT_COMPRESSED_LZ4 = 1 << 1,
+        _OBJECT_COMPRESSED_MAX
 };
 
+#define OBJECT_COMPRESSION_MASK (OBJECT_COMPRESSED_XZ | OBJECT_COMPRESSED_LZ4)
+
 struct ObjectHeader {
         uint8_t type;
         uint8_t flags;
@@ -121,12 +130,36 @@ struct HashTableObject {
         HashItem items[];
 } _packed_;
 
+/* Once the fixed size hash tables fill up, data and field objects are
+ * additionally indexed in open addressing tables, which are replaced
+ * by one twice the size whenever they are 75% full. The objects are
+ * still linked into the hash chains, for readers that do not know
+ * about these tables. The number of items is a power of two, and an
+ * object_offset of 0 marks an empty slot. */
+struct OverflowItem {
+        le64_t hash;
+        le64_t object_offset;
+} _packed_;
+
+struct OverflowTableObject {
+        ObjectHeader object;
+        OverflowItem items[];
+} _packed_;
+
 struct EntryArrayObject {
         ObjectHeader object;
         le64_t next_entry_array_offset;
         le64_t items[];
 } _packed_;
 
+/* In files with HEADER_INCOMPATIBLE_COMPACT set entry arrays carry
+ * 32bit offsets, and such files never grow beyond 4GiB */
+struct CompactEntryArrayObject {
+        ObjectHeader object;
+        le64_t next_entry_array_offset;
+        le32_t items[];
+} _packed_;
+
 #define TAG_LENGTH (256/8)
 
 struct TagObject {
@@ -142,7 +175,9 @@ union Object {
         FieldObject field;
         EntryObject entry;
         HashTableObject hash_table;
+        OverflowTableObject overflow_table;
         EntryArrayObject entry_array;
+        CompactEntryArrayObject compact_entry_array;
         TagObject tag;
 };
 
@@ -155,13 +190,36 @@ enum {
 
 /* Header flags */
 enum {
-        HEADER_INCOMPATIBLE_COMPRESSED = 1
+        HEADER_INCOMPATIBLE_COMPRESSED_XZ = 1 << 0,
+        HEADER_INCOMPATIBLE_COMPRESSED_LZ4 = 1 << 1,
+        HEADER_INCOMPATIBLE_COMPACT = 1 << 2,
 };
 
+#define HEADER_INCOMPATIBLE_ANY (HEADER_INCOMPATIBLE_COMPRESSED_XZ|HEADER_INCOMPATIBLE_COMPRESSED_LZ4|HEADER_INCOMPATIBLE_COMPACT)
+
+#if defined(HAVE_XZ) && defined(HAVE_LZ4)
+#  define HEADER_INCOMPATIBLE_SUPPORTED HEADER_INCOMPATIBLE_ANY
+#elif defined(HAVE_XZ)
+#  define HEADER_INCOMPATIBLE_SUPPORTED (HEADER_INCOMPATIBLE_COMPRESSED_XZ|HEADER_INCOMPATIBLE_COMPACT)
+#elif defined(HAVE_LZ4)
+#  define HEADER_INCOMPATIBLE_SUPPORTED (HEADER_INCOMPATIBLE_COMPRESSED_LZ4|HEADER_INCOMPATIBLE_COMPACT)
+#else
+#  define HEADER_INCOMPATIBLE_SUPPORTED HEADER_INCOMPATIBLE_COMPACT
+#endif
+
 enum {
-        HEADER_COMPATIBLE_SEALED = 1
+        HEADER_COMPATIBLE_SEALED = 1 << 0,
+        HEADER_COMPATIBLE_OVERFLOW_TABLES = 1 << 1,
 };
 
+#define HEADER_COMPATIBLE_ANY (HEADER_COMPATIBLE_SEALED|HEADER_COMPATIBLE_OVERFLOW_TABLES)
+
+#ifdef HAVE_GCRYPT
+#  define HEADER_COMPATIBLE_SUPPORTED HEADER_COMPATIBLE_ANY
+#else
+#  define HEADER_COMPATIBLE_SUPPORTED HEADER_COMPATIBLE_OVERFLOW_TABLES
+#endif
+
 #define HEADER_SIGNATURE ((char[]) { 'L', 'P', 'K', 'S', 'H', 'H', 'R', 'H' })
 
 struct Header {
@@ -195,8 +253,13 @@ struct Header {
         /* Added in 189 */
         le64_t n_tags;
         le64_t n_entry_arrays;
+        /* Added with HEADER_COMPATIBLE_OVERFLOW_TABLES. These point
+         * to the objects, not their items, so that readers never see
+         * the offset of one table with the size of another */
+        le64_t data_overflow_table_offset;
+        le64_t field_overflow_table_offset;
 
-        /* Size: 224 */
+        /* Size: 256 */
 } _packed_;
 
 #define FSS_HEADER_SIGNATURE ((char[]) { 'K', 'S', 'H', 'H', 'R', 'H', 'L', 'P' })
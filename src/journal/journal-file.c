@@ -34,6 +34,8 @@
 #include "journal-def.h"
 #include "journal-file.h"
 #include "journal-authenticate.h"
+#include "journal-index.h"
+#include "journal-vacuum.h"
 #include "lookup3.h"
 #include "compress.h"
 #include "fsprg.h"
@@ -41,6 +43,9 @@
 #define DEFAULT_DATA_HASH_TABLE_SIZE (2047ULL*sizeof(HashItem))
 #define DEFAULT_FIELD_HASH_TABLE_SIZE (333ULL*sizeof(HashItem))
 
+/* The smallest overflow table we add, in items */
+#define OVERFLOW_TABLE_ITEMS_MIN 4096ULL
+
 #define COMPRESSION_SIZE_THRESHOLD (512ULL)
 
 /* This is the minimum journal file size */
@@ -65,8 +70,16 @@
 /* n_data was the first entry we added after the initial file format design */
 #define HEADER_SIZE_MIN ALIGN64(offsetof(Header, n_data))
 
-/* How many entries to keep in the entry array chain cache at max */
-#define CHAIN_CACHE_MAX 20
+/* How many entries to keep in the entry array chain cache at max.
+ * When writing, each field that repeats a lot takes one. */
+#define CHAIN_CACHE_MAX 256
+
+/* How many data objects to remember the offsets of when writing. The
+ * fields that repeat on almost every entry should fit. */
+#define DATA_CACHE_MAX 256
+
+/* Only fields up to this size are cached */
+#define DATA_CACHE_PAYLOAD_MAX 256
 
 int journal_file_set_online(JournalFile *f) {
         assert(f);
@@ -121,6 +134,10 @@ void journal_file_close(JournalFile *f) {
                 journal_file_append_tag(f);
 #endif
 
+        /* Wake up readers still waiting for a deferred notification */
+        if (f->fd >= 0)
+                journal_file_flush_post_change(f);
+
         /* Sync everything to disk, before we mark the file offline */
         if (f->mmap && f->fd >= 0)
                 mmap_cache_close_fd(f->mmap, f->fd);
@@ -139,10 +156,11 @@ void journal_file_close(JournalFile *f) {
                 mmap_cache_unref(f->mmap);
 
         hashmap_free_free(f->chain_cache);
+        hashmap_free_free(f->data_cache);
+
+        journal_index_close(f->index);
 
-#ifdef HAVE_XZ
         free(f->compress_buffer);
-#endif
 
 #ifdef HAVE_GCRYPT
         if (f->fss_file)
@@ -171,10 +189,15 @@ static int journal_file_init_header(JournalFile *f, JournalFile *template) {
         h.header_size = htole64(ALIGN64(sizeof(h)));
 
         h.incompatible_flags =
-                htole32(f->compress ? HEADER_INCOMPATIBLE_COMPRESSED : 0);
+                htole32(f->compress_xz * HEADER_INCOMPATIBLE_COMPRESSED_XZ |
+                        f->compress_lz4 * HEADER_INCOMPATIBLE_COMPRESSED_LZ4 |
+                        f->compact * HEADER_INCOMPATIBLE_COMPACT);
 
+        /* The flags are covered by the seal, hence sealed files
+         * announce the overflow tables right away, and not only once
+         * they get one */
         h.compatible_flags =
-                htole32(f->seal ? HEADER_COMPATIBLE_SEALED : 0);
+                htole32(f->seal ? HEADER_COMPATIBLE_SEALED|HEADER_COMPATIBLE_OVERFLOW_TABLES : 0);
 
         r = sd_id128_randomize(&h.file_id);
         if (r < 0)
@@ -232,25 +255,18 @@ static int journal_file_verify_header(JournalFile *f) {
 
         /* In both read and write mode we refuse to open files with
          * incompatible flags we don't know */
-#ifdef HAVE_XZ
-        if ((le32toh(f->header->incompatible_flags) & ~HEADER_INCOMPATIBLE_COMPRESSED) != 0)
-                return -EPROTONOSUPPORT;
-#else
-        if (f->header->incompatible_flags != 0)
+        if ((le32toh(f->header->incompatible_flags) & ~HEADER_INCOMPATIBLE_SUPPORTED) != 0)
                 return -EPROTONOSUPPORT;
-#endif
+
+        /* A file is compressed with one algorithm only */
+        if (JOURNAL_HEADER_COMPRESSED_XZ(f->header) && JOURNAL_HEADER_COMPRESSED_LZ4(f->header))
+                return -EBADMSG;
 
         /* When open for writing we refuse to open files with
-         * compatible flags, too */
-        if (f->writable) {
-#ifdef HAVE_GCRYPT
-                if ((le32toh(f->header->compatible_flags) & ~HEADER_COMPATIBLE_SEALED) != 0)
-                        return -EPROTONOSUPPORT;
-#else
-                if (f->header->compatible_flags != 0)
-                        return -EPROTONOSUPPORT;
-#endif
-        }
+         * compatible flags we don't know, too */
+        if (f->writable &&
+            (le32toh(f->header->compatible_flags) & ~HEADER_COMPATIBLE_SUPPORTED) != 0)
+                return -EPROTONOSUPPORT;
 
         if (f->header->state >= _STATE_MAX)
                 return -EBADMSG;
@@ -274,6 +290,11 @@ static int journal_file_verify_header(JournalFile *f) {
             !VALID64(le64toh(f->header->entry_array_offset)))
                 return -ENODATA;
 
+        if (JOURNAL_HEADER_CONTAINS(f->header, field_overflow_table_offset) &&
+            (!VALID64(le64toh(f->header->data_overflow_table_offset)) ||
+             !VALID64(le64toh(f->header->field_overflow_table_offset))))
+                return -ENODATA;
+
         if (le64toh(f->header->data_hash_table_offset) < le64toh(f->header->header_size) ||
             le64toh(f->header->field_hash_table_offset) < le64toh(f->header->header_size) ||
             le64toh(f->header->tail_object_offset) < le64toh(f->header->header_size) ||
@@ -305,15 +326,28 @@ static int journal_file_verify_header(JournalFile *f) {
                 }
         }
 
-        f->compress = JOURNAL_HEADER_COMPRESSED(f->header);
+        f->compress_xz = JOURNAL_HEADER_COMPRESSED_XZ(f->header);
+        f->compress_lz4 = JOURNAL_HEADER_COMPRESSED_LZ4(f->header);
+        f->compact = JOURNAL_HEADER_COMPACT(f->header);
 
         f->seal = JOURNAL_HEADER_SEALED(f->header);
 
         return 0;
 }
 
+static void journal_file_account_usage(JournalFile *f, blkcnt_t old_blocks) {
+        assert(f);
+
+        if (!f->metrics.usage || f->last_stat.st_blocks <= old_blocks)
+                return;
+
+        /* The counter may be read from other threads */
+        __sync_fetch_and_add(f->metrics.usage, 512ULL * (uint64_t) (f->last_stat.st_blocks - old_blocks));
+}
+
 static int journal_file_allocate(JournalFile *f, uint64_t offset, uint64_t size) {
         uint64_t old_size, new_size;
+        blkcnt_t old_blocks;
         int r;
 
         assert(f);
@@ -337,6 +371,10 @@ static int journal_file_allocate(JournalFile *f, uint64_t offset, uint64_t size)
             new_size > f->metrics.max_size)
                 return -E2BIG;
 
+        /* Compact entry arrays can only refer to the first 4GiB */
+        if (f->compact && new_size > UINT32_MAX)
+                return -E2BIG;
+
         if (new_size > f->metrics.min_size &&
             f->metrics.keep_free > 0) {
                 struct statvfs svfs;
@@ -363,9 +401,13 @@ static int journal_file_allocate(JournalFile *f, uint64_t offset, uint64_t size)
         if (r != 0)
                 return -r;
 
+        old_blocks = f->last_stat.st_blocks;
+
         if (fstat(f->fd, &f->last_stat) < 0)
                 return -errno;
 
+        journal_file_account_usage(f, old_blocks);
+
         f->header->arena_size = htole64(new_size - le64toh(f->header->header_size));
 
         return 0;
@@ -401,6 +443,8 @@ static uint64_t minimum_header_size(Object *o) {
                 [OBJECT_FIELD_HASH_TABLE] = sizeof(HashTableObject),
                 [OBJECT_ENTRY_ARRAY] = sizeof(EntryArrayObject),
                 [OBJECT_TAG] = sizeof(TagObject),
+                [OBJECT_DATA_OVERFLOW_TABLE] = sizeof(OverflowTableObject),
+                [OBJECT_FIELD_OVERFLOW_TABLE] = sizeof(OverflowTableObject),
         };
 
         if (o->object.type >= ELEMENTSOF(table) || table[o->object.type] <= 0)
@@ -592,13 +636,16 @@ static int journal_file_setup_field_hash_table(JournalFile *f) {
         return 0;
 }
 
-static int journal_file_map_data_hash_table(JournalFile *f) {
+int journal_file_map_data_hash_table(JournalFile *f) {
         uint64_t s, p;
         void *t;
         int r;
 
         assert(f);
 
+        if (f->data_hash_table)
+                return 0;
+
         p = le64toh(f->header->data_hash_table_offset);
         s = le64toh(f->header->data_hash_table_size);
 
@@ -614,13 +661,16 @@ static int journal_file_map_data_hash_table(JournalFile *f) {
         return 0;
 }
 
-static int journal_file_map_field_hash_table(JournalFile *f) {
+int journal_file_map_field_hash_table(JournalFile *f) {
         uint64_t s, p;
         void *t;
         int r;
 
         assert(f);
 
+        if (f->field_hash_table)
+                return 0;
+
         p = le64toh(f->header->field_hash_table_offset);
         s = le64toh(f->header->field_hash_table_size);
 
@@ -636,6 +686,209 @@ static int journal_file_map_field_hash_table(JournalFile *f) {
         return 0;
 }
 
+static int overflow_table_type(int type) {
+        assert(type == OBJECT_DATA || type == OBJECT_FIELD);
+
+        return type == OBJECT_DATA ? OBJECT_DATA_OVERFLOW_TABLE : OBJECT_FIELD_OVERFLOW_TABLE;
+}
+
+static le64_t *overflow_table_offset(JournalFile *f, int type) {
+        assert(f);
+        assert(type == OBJECT_DATA || type == OBJECT_FIELD);
+
+        return type == OBJECT_DATA ? &f->header->data_overflow_table_offset : &f->header->field_overflow_table_offset;
+}
+
+int journal_file_move_to_overflow_table(JournalFile *f, int type, Object **ret, uint64_t *n) {
+        uint64_t p, k;
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(ret);
+        assert(n);
+
+        /* Returns 0 if the file has no overflow table of this type
+         * (yet), in which case the hash chains are walked */
+
+        if (!JOURNAL_HEADER_CONTAINS(f->header, field_overflow_table_offset))
+                return 0;
+
+        p = le64toh(*overflow_table_offset(f, type));
+        if (p == 0)
+                return 0;
+
+        r = journal_file_move_to_object(f, overflow_table_type(type), p, &o);
+        if (r < 0)
+                return r;
+
+        k = journal_file_overflow_table_n_items(o);
+        if (k == 0 || (k & (k - 1)) != 0)
+                return -EBADMSG;
+
+        *ret = o;
+        *n = k;
+        return 1;
+}
+
+static int overflow_table_put(Object *t, uint64_t n, uint64_t hash, uint64_t offset) {
+        uint64_t i, k;
+
+        assert(t);
+        assert(offset > 0);
+
+        for (i = hash & (n - 1), k = 0; k < n; i = (i + 1) & (n - 1), k++)
+                if (t->overflow_table.items[i].object_offset == 0) {
+                        t->overflow_table.items[i].hash = htole64(hash);
+                        t->overflow_table.items[i].object_offset = htole64(offset);
+                        return 0;
+                }
+
+        return -EBADMSG;
+}
+
+static int journal_file_reserve_overflow_table(JournalFile *f, int type) {
+        uint64_t n_items, n_buckets, n, p, old, old_n = 0;
+        Object *o, *t;
+        int r;
+
+        assert(f);
+
+        /* Makes sure that the overflow table can take one more
+         * object while staying below 75% fill level. Once the hash
+         * table proper reaches that level, an overflow table is
+         * added, and filled from the hash chains; once that one
+         * reaches it, it is replaced by one twice the size. Returns
+         * > 0 if a table was added, which might alter the window we
+         * are looking at. */
+
+        if (!JOURNAL_HEADER_CONTAINS(f->header, field_overflow_table_offset))
+                return 0;
+
+        if (type == OBJECT_DATA) {
+                n_items = le64toh(f->header->n_data);
+                n_buckets = le64toh(f->header->data_hash_table_size) / sizeof(HashItem);
+        } else {
+                n_items = le64toh(f->header->n_fields);
+                n_buckets = le64toh(f->header->field_hash_table_size) / sizeof(HashItem);
+        }
+
+        old = le64toh(*overflow_table_offset(f, type));
+        if (old == 0) {
+                if ((n_items + 1) * 4ULL <= n_buckets * 3ULL)
+                        return 0;
+        } else {
+                r = journal_file_move_to_object(f, overflow_table_type(type), old, &t);
+                if (r < 0)
+                        return r;
+
+                old_n = journal_file_overflow_table_n_items(t);
+                if ((n_items + 1) * 4ULL <= old_n * 3ULL)
+                        return 0;
+        }
+
+        n = OVERFLOW_TABLE_ITEMS_MIN;
+        while (n < (n_items + 1) * 2)
+                n *= 2;
+
+        log_debug("Adding %s overflow table with %"PRIu64" entries for %"PRIu64" objects.",
+                  type == OBJECT_DATA ? "data" : "field", n, n_items);
+
+        r = journal_file_append_object(f,
+                                       overflow_table_type(type),
+                                       offsetof(Object, overflow_table.items) + n * sizeof(OverflowItem),
+                                       &o, &p);
+        if (r < 0)
+                return r;
+
+        memset(o->overflow_table.items, 0, n * sizeof(OverflowItem));
+
+#ifdef HAVE_GCRYPT
+        r = journal_file_hmac_put_object(f, overflow_table_type(type), o, p);
+        if (r < 0)
+                return r;
+#endif
+
+        if (old != 0) {
+                void *v;
+                uint64_t i;
+
+                /* The old table goes through the catch-all context,
+                 * so that it does not replace the window of the new
+                 * one */
+                r = journal_file_move_to(f, 0, false, old,
+                                         offsetof(Object, overflow_table.items) + old_n * sizeof(OverflowItem),
+                                         &v);
+                if (r < 0)
+                        return r;
+
+                t = v;
+                for (i = 0; i < old_n; i++) {
+                        if (t->overflow_table.items[i].object_offset == 0)
+                                continue;
+
+                        r = overflow_table_put(o, n,
+                                               le64toh(t->overflow_table.items[i].hash),
+                                               le64toh(t->overflow_table.items[i].object_offset));
+                        if (r < 0)
+                                return r;
+                }
+        } else {
+                HashItem *h;
+                uint64_t i;
+
+                if (type == OBJECT_DATA) {
+                        r = journal_file_map_data_hash_table(f);
+                        h = f->data_hash_table;
+                } else {
+                        r = journal_file_map_field_hash_table(f);
+                        h = f->field_hash_table;
+                }
+                if (r < 0)
+                        return r;
+
+                for (i = 0; i < n_buckets; i++) {
+                        uint64_t q;
+
+                        q = le64toh(h[i].head_hash_offset);
+                        while (q > 0) {
+                                r = journal_file_move_to_object(f, type, q, &t);
+                                if (r < 0)
+                                        return r;
+
+                                if (type == OBJECT_DATA) {
+                                        r = overflow_table_put(o, n, le64toh(t->data.hash), q);
+                                        q = le64toh(t->data.next_hash_offset);
+                                } else {
+                                        r = overflow_table_put(o, n, le64toh(t->field.hash), q);
+                                        q = le64toh(t->field.next_hash_offset);
+                                }
+                                if (r < 0)
+                                        return r;
+                        }
+                }
+        }
+
+        *overflow_table_offset(f, type) = htole64(p);
+        f->header->compatible_flags = htole32(le32toh(f->header->compatible_flags) | HEADER_COMPATIBLE_OVERFLOW_TABLES);
+
+        return 1;
+}
+
+static int journal_file_overflow_table_add(JournalFile *f, int type, uint64_t hash, uint64_t offset) {
+        Object *t;
+        uint64_t n;
+        int r;
+
+        assert(f);
+
+        r = journal_file_move_to_overflow_table(f, type, &t, &n);
+        if (r <= 0)
+                return r;
+
+        return overflow_table_put(t, n, hash, offset);
+}
+
 static int journal_file_link_field(
                 JournalFile *f,
                 Object *o,
@@ -654,6 +907,15 @@ static int journal_file_link_field(
 
         /* This might alter the window we are looking at */
 
+        r = journal_file_reserve_overflow_table(f, OBJECT_FIELD);
+        if (r < 0)
+                return r;
+        if (r > 0) {
+                r = journal_file_move_to_object(f, OBJECT_FIELD, offset, &o);
+                if (r < 0)
+                        return r;
+        }
+
         o->field.next_hash_offset = o->field.head_data_offset = 0;
 
         h = hash % (le64toh(f->header->field_hash_table_size) / sizeof(HashItem));
@@ -673,7 +935,7 @@ static int journal_file_link_field(
         if (JOURNAL_HEADER_CONTAINS(f->header, n_fields))
                 f->header->n_fields = htole64(le64toh(f->header->n_fields) + 1);
 
-        return 0;
+        return journal_file_overflow_table_add(f, OBJECT_FIELD, hash, offset);
 }
 
 static int journal_file_link_data(
@@ -694,6 +956,15 @@ static int journal_file_link_data(
 
         /* This might alter the window we are looking at */
 
+        r = journal_file_reserve_overflow_table(f, OBJECT_DATA);
+        if (r < 0)
+                return r;
+        if (r > 0) {
+                r = journal_file_move_to_object(f, OBJECT_DATA, offset, &o);
+                if (r < 0)
+                        return r;
+        }
+
         o->data.next_hash_offset = o->data.next_field_offset = 0;
         o->data.entry_offset = o->data.entry_array_offset = 0;
         o->data.n_entries = 0;
@@ -719,7 +990,7 @@ static int journal_file_link_data(
         if (JOURNAL_HEADER_CONTAINS(f->header, n_data))
                 f->header->n_data = htole64(le64toh(f->header->n_data) + 1);
 
-        return 0;
+        return journal_file_overflow_table_add(f, OBJECT_DATA, hash, offset);
 }
 
 int journal_file_find_field_object_with_hash(
@@ -727,7 +998,8 @@ int journal_file_find_field_object_with_hash(
                 const void *field, uint64_t size, uint64_t hash,
                 Object **ret, uint64_t *offset) {
 
-        uint64_t p, osize, h;
+        uint64_t p, osize, h, n;
+        Object *t;
         int r;
 
         assert(f);
@@ -738,6 +1010,45 @@ int journal_file_find_field_object_with_hash(
         if (f->header->field_hash_table_size == 0)
                 return -EBADMSG;
 
+        r = journal_file_move_to_overflow_table(f, OBJECT_FIELD, &t, &n);
+        if (r < 0)
+                return r;
+        if (r > 0) {
+                uint64_t i, k;
+
+                for (i = hash & (n - 1), k = 0; k < n; i = (i + 1) & (n - 1), k++) {
+                        Object *o;
+
+                        p = le64toh(t->overflow_table.items[i].object_offset);
+                        if (p == 0)
+                                break;
+
+                        if (le64toh(t->overflow_table.items[i].hash) != hash)
+                                continue;
+
+                        r = journal_file_move_to_object(f, OBJECT_FIELD, p, &o);
+                        if (r < 0)
+                                return r;
+
+                        if (le64toh(o->object.size) == osize &&
+                            memcmp(o->field.payload, field, size) == 0) {
+
+                                if (ret)
+                                        *ret = o;
+                                if (offset)
+                                        *offset = p;
+
+                                return 1;
+                        }
+                }
+
+                return 0;
+        }
+
+        r = journal_file_map_field_hash_table(f);
+        if (r < 0)
+                return r;
+
         h = hash % (le64toh(f->header->field_hash_table_size) / sizeof(HashItem));
         p = le64toh(f->field_hash_table[h].head_hash_offset);
 
@@ -783,22 +1094,96 @@ int journal_file_find_field_object(
                                                         ret, offset);
 }
 
+static int data_object_matches(JournalFile *f, Object *o, const void *data, uint64_t size) {
+        uint64_t osize;
+        int r;
+
+        assert(f);
+        assert(o);
+
+        osize = offsetof(Object, data.payload) + size;
+
+        if (o->object.flags & OBJECT_COMPRESSION_MASK) {
+                uint64_t l, rsize;
+
+                l = le64toh(o->object.size);
+                if (l <= offsetof(Object, data.payload))
+                        return -EBADMSG;
+
+                l -= offsetof(Object, data.payload);
+
+                r = uncompress_blob(o->object.flags & OBJECT_COMPRESSION_MASK,
+                                    o->data.payload, l, &f->compress_buffer, &f->compress_buffer_size, &rsize, 0);
+                if (r < 0)
+                        return r;
+
+                return rsize == size &&
+                        memcmp(f->compress_buffer, data, size) == 0;
+        }
+
+        return le64toh(o->object.size) == osize &&
+                memcmp(o->data.payload, data, size) == 0;
+}
+
 int journal_file_find_data_object_with_hash(
                 JournalFile *f,
                 const void *data, uint64_t size, uint64_t hash,
                 Object **ret, uint64_t *offset) {
 
-        uint64_t p, osize, h;
+        uint64_t p, h, n;
+        Object *t;
         int r;
 
         assert(f);
         assert(data || size == 0);
 
-        osize = offsetof(Object, data.payload) + size;
-
         if (f->header->data_hash_table_size == 0)
                 return -EBADMSG;
 
+        r = journal_file_move_to_overflow_table(f, OBJECT_DATA, &t, &n);
+        if (r < 0)
+                return r;
+        if (r > 0) {
+                uint64_t i, k;
+
+                /* The table lives in a different context than the
+                 * data objects, hence it stays mapped while we look
+                 * at them */
+                for (i = hash & (n - 1), k = 0; k < n; i = (i + 1) & (n - 1), k++) {
+                        Object *o;
+
+                        p = le64toh(t->overflow_table.items[i].object_offset);
+                        if (p == 0)
+                                break;
+
+                        if (le64toh(t->overflow_table.items[i].hash) != hash)
+                                continue;
+
+                        r = journal_file_move_to_object(f, OBJECT_DATA, p, &o);
+                        if (r < 0)
+                                return r;
+
+                        r = data_object_matches(f, o, data, size);
+                        if (r < 0)
+                                return r;
+                        if (r > 0) {
+                                if (ret)
+                                        *ret = o;
+
+                                if (offset)
+                                        *offset = p;
+
+                                return 1;
+                        }
+                }
+
+                return 0;
+        }
+
+        r = journal_file_map_data_hash_table(f);
+        if (r < 0)
+                return r;
+
         h = hash % (le64toh(f->header->data_hash_table_size) / sizeof(HashItem));
         p = le64toh(f->data_hash_table[h].head_hash_offset);
 
@@ -809,25 +1194,11 @@ int journal_file_find_data_object_with_hash(
                 if (r < 0)
                         return r;
 
-                if (le64toh(o->data.hash) != hash)
-                        goto next;
-
-                if (o->object.flags & OBJECT_COMPRESSED) {
-#ifdef HAVE_XZ
-                        uint64_t l, rsize;
-
-                        l = le64toh(o->object.size);
-                        if (l <= offsetof(Object, data.payload))
-                                return -EBADMSG;
-
-                        l -= offsetof(Object, data.payload);
-
-                        if (!uncompress_blob(o->data.payload, l, &f->compress_buffer, &f->compress_buffer_size, &rsize, 0))
-                                return -EBADMSG;
-
-                        if (rsize == size &&
-                            memcmp(f->compress_buffer, data, size) == 0) {
-
+                if (le64toh(o->data.hash) == hash) {
+                        r = data_object_matches(f, o, data, size);
+                        if (r < 0)
+                                return r;
+                        if (r > 0) {
                                 if (ret)
                                         *ret = o;
 
@@ -836,23 +1207,8 @@ int journal_file_find_data_object_with_hash(
 
                                 return 1;
                         }
-#else
-                        return -EPROTONOSUPPORT;
-#endif
-
-                } else if (le64toh(o->object.size) == osize &&
-                           memcmp(o->data.payload, data, size) == 0) {
-
-                        if (ret)
-                                *ret = o;
-
-                        if (offset)
-                                *offset = p;
-
-                        return 1;
                 }
 
-        next:
                 p = le64toh(o->data.next_hash_offset);
         }
 
@@ -936,28 +1292,110 @@ static int journal_file_append_field(
         return 0;
 }
 
-static int journal_file_append_data(
+typedef struct DataCacheItem {
+        uint64_t hash;   /* the hash of the payload */
+        uint64_t offset; /* the data object */
+        uint64_t size;   /* the size of the uncompressed payload */
+        uint8_t payload[];
+} DataCacheItem;
+
+static bool data_cache_find(
                 JournalFile *f,
-                const void *data, uint64_t size,
+                const void *data, uint64_t size, uint64_t hash,
+                uint64_t *offset) {
+
+        DataCacheItem *ci;
+
+        assert(f);
+        assert(offset);
+
+        if (!f->data_cache)
+                return false;
+
+        /* The hash is easy to collide on purpose, hence we compare
+         * the payload, like we do when walking the hash chain. But
+         * we keep a copy of it, so that we don't have to look at
+         * the object at all. */
+        ci = hashmap_get(f->data_cache, &hash);
+        if (!ci ||
+            ci->size != size ||
+            memcmp(ci->payload, data, size) != 0)
+                return false;
+
+        *offset = ci->offset;
+        return true;
+}
+
+static void data_cache_put(
+                JournalFile *f,
+                const void *data, uint64_t size, uint64_t hash,
+                uint64_t offset) {
+
+        DataCacheItem *ci;
+
+        assert(f);
+
+        /* Large fields rarely repeat, and are expensive to keep */
+        if (!f->data_cache || size > DATA_CACHE_PAYLOAD_MAX)
+                return;
+
+        ci = hashmap_remove(f->data_cache, &hash);
+        if (!ci && hashmap_size(f->data_cache) >= DATA_CACHE_MAX)
+                ci = hashmap_steal_first(f->data_cache);
+        free(ci);
+
+        ci = malloc(offsetof(DataCacheItem, payload) + size);
+        if (!ci)
+                return;
+
+        ci->hash = hash;
+        ci->offset = offset;
+        ci->size = size;
+        memcpy(ci->payload, data, size);
+
+        if (hashmap_put(f->data_cache, &ci->hash, ci) < 0)
+                free(ci);
+}
+
+static int journal_file_append_data_with_hash(
+                JournalFile *f,
+                const void *data, uint64_t size, uint64_t hash,
                 Object **ret, uint64_t *offset) {
 
-        uint64_t hash, p;
+        uint64_t p;
         uint64_t osize;
         Object *o;
         int r;
         bool compressed = false;
+        int compression = 0;
         const void *eq;
 
         assert(f);
         assert(data || size == 0);
 
-        hash = hash64(data, size);
+        /* Most fields repeat on almost every entry, which we find
+         * without walking the hash chain */
+        if (data_cache_find(f, data, size, hash, &p)) {
+
+                if (ret) {
+                        r = journal_file_move_to_object(f, OBJECT_DATA, p, ret);
+                        if (r < 0)
+                                return r;
+                }
+
+                if (offset)
+                        *offset = p;
+
+                return 0;
+        }
 
         r = journal_file_find_data_object_with_hash(f, data, size, hash, &o, &p);
         if (r < 0)
                 return r;
         else if (r > 0) {
 
+                data_cache_put(f, data, size, hash, p);
+
                 if (ret)
                         *ret = o;
 
@@ -974,21 +1412,25 @@ static int journal_file_append_data(
 
         o->data.hash = htole64(hash);
 
-#ifdef HAVE_XZ
-        if (f->compress &&
+        if (f->compress_lz4)
+                compression = OBJECT_COMPRESSED_LZ4;
+        else if (f->compress_xz)
+                compression = OBJECT_COMPRESSED_XZ;
+
+        if (compression != 0 &&
             size >= COMPRESSION_SIZE_THRESHOLD) {
                 uint64_t rsize;
 
-                compressed = compress_blob(data, size, o->data.payload, &rsize);
+                compressed = compress_blob(compression, data, size, o->data.payload, &rsize);
 
                 if (compressed) {
                         o->object.size = htole64(offsetof(Object, data.payload) + rsize);
-                        o->object.flags |= OBJECT_COMPRESSED;
+                        o->object.flags |= compression;
 
-                        log_debug("Compressed data object %"PRIu64" -> %"PRIu64, size, rsize);
+                        log_debug("Compressed data object %"PRIu64" -> %"PRIu64" using %s",
+                                  size, rsize, object_compressed_to_string(compression));
                 }
         }
-#endif
 
         if (!compressed && size > 0)
                 memcpy(o->data.payload, data, size);
@@ -1024,6 +1466,8 @@ static int journal_file_append_data(
                 return r;
 #endif
 
+        data_cache_put(f, data, size, hash, p);
+
         if (ret)
                 *ret = o;
 
@@ -1033,6 +1477,17 @@ static int journal_file_append_data(
         return 0;
 }
 
+static int journal_file_append_data(
+                JournalFile *f,
+                const void *data, uint64_t size,
+                Object **ret, uint64_t *offset) {
+
+        assert(f);
+        assert(data || size == 0);
+
+        return journal_file_append_data_with_hash(f, data, size, hash64(data, size), ret, offset);
+}
+
 uint64_t journal_file_entry_n_items(Object *o) {
         assert(o);
 
@@ -1042,13 +1497,41 @@ uint64_t journal_file_entry_n_items(Object *o) {
         return (le64toh(o->object.size) - offsetof(Object, entry.items)) / sizeof(EntryItem);
 }
 
-uint64_t journal_file_entry_array_n_items(Object *o) {
+static uint64_t entry_array_item_size(JournalFile *f) {
+        assert(f);
+
+        return f->compact ? sizeof(le32_t) : sizeof(le64_t);
+}
+
+uint64_t journal_file_entry_array_n_items(JournalFile *f, Object *o) {
+        assert(f);
         assert(o);
 
         if (o->object.type != OBJECT_ENTRY_ARRAY)
                 return 0;
 
-        return (le64toh(o->object.size) - offsetof(Object, entry_array.items)) / sizeof(uint64_t);
+        return (le64toh(o->object.size) - offsetof(Object, entry_array.items)) / entry_array_item_size(f);
+}
+
+static void entry_array_set_item(JournalFile *f, Object *o, uint64_t i, uint64_t p) {
+        assert(f);
+        assert(o);
+
+        if (f->compact) {
+                assert(p <= UINT32_MAX);
+                o->compact_entry_array.items[i] = htole32(p);
+        } else
+                o->entry_array.items[i] = htole64(p);
+}
+
+uint64_t journal_file_overflow_table_n_items(Object *o) {
+        assert(o);
+
+        if (o->object.type != OBJECT_DATA_OVERFLOW_TABLE &&
+            o->object.type != OBJECT_FIELD_OVERFLOW_TABLE)
+                return 0;
+
+        return (le64toh(o->object.size) - offsetof(Object, overflow_table.items)) / sizeof(OverflowItem);
 }
 
 uint64_t journal_file_hash_table_n_items(Object *o) {
@@ -1061,13 +1544,57 @@ uint64_t journal_file_hash_table_n_items(Object *o) {
         return (le64toh(o->object.size) - offsetof(Object, hash_table.items)) / sizeof(HashItem);
 }
 
+typedef struct ChainCacheItem {
+        uint64_t first; /* the array at the begin of the chain */
+        uint64_t array; /* the cached array */
+        uint64_t begin; /* the first item in the cached array */
+        uint64_t total; /* the total number of items in all arrays before this one in the chain */
+} ChainCacheItem;
+
+static void chain_cache_put(
+                Hashmap *h,
+                ChainCacheItem *ci,
+                uint64_t first,
+                uint64_t array,
+                uint64_t begin,
+                uint64_t total) {
+
+        if (!ci) {
+                /* If the chain item to cache for this chain is the
+                 * first one it's not worth caching anything */
+                if (array == first)
+                        return;
+
+                if (hashmap_size(h) >= CHAIN_CACHE_MAX)
+                        ci = hashmap_steal_first(h);
+                else {
+                        ci = new(ChainCacheItem, 1);
+                        if (!ci)
+                                return;
+                }
+
+                ci->first = first;
+
+                if (hashmap_put(h, &ci->first, ci) < 0) {
+                        free(ci);
+                        return;
+                }
+        } else
+                assert(ci->first == first);
+
+        ci->array = array;
+        ci->begin = begin;
+        ci->total = total;
+}
+
 static int link_entry_into_array(JournalFile *f,
                                  le64_t *first,
                                  le64_t *idx,
                                  uint64_t p) {
         int r;
-        uint64_t n = 0, ap = 0, q, i, a, hidx;
+        uint64_t n = 0, ap = 0, q, i, a, hidx, t = 0;
         Object *o;
+        ChainCacheItem *ci;
 
         assert(f);
         assert(first);
@@ -1076,20 +1603,34 @@ static int link_entry_into_array(JournalFile *f,
 
         a = le64toh(*first);
         i = hidx = le64toh(*idx);
+
+        /* The arrays of the fields that are on almost every entry
+         * grow long, hence skip ahead to where we appended the last
+         * time, if we can */
+        ci = a > 0 ? hashmap_get(f->chain_cache, &a) : NULL;
+        if (ci && i >= ci->total) {
+                a = ci->array;
+                i -= ci->total;
+                t = ci->total;
+        }
+
         while (a > 0) {
 
                 r = journal_file_move_to_object(f, OBJECT_ENTRY_ARRAY, a, &o);
                 if (r < 0)
                         return r;
 
-                n = journal_file_entry_array_n_items(o);
+                n = journal_file_entry_array_n_items(f, o);
                 if (i < n) {
-                        o->entry_array.items[i] = htole64(p);
+                        entry_array_set_item(f, o, i, p);
                         *idx = htole64(hidx + 1);
+
+                        chain_cache_put(f->chain_cache, ci, le64toh(*first), a, journal_file_entry_array_item(f, o, 0), t);
                         return 0;
                 }
 
                 i -= n;
+                t += n;
                 ap = a;
                 a = le64toh(o->entry_array.next_entry_array_offset);
         }
@@ -1103,7 +1644,7 @@ static int link_entry_into_array(JournalFile *f,
                 n = 4;
 
         r = journal_file_append_object(f, OBJECT_ENTRY_ARRAY,
-                                       offsetof(Object, entry_array.items) + n * sizeof(uint64_t),
+                                       offsetof(Object, entry_array.items) + n * entry_array_item_size(f),
                                        &o, &q);
         if (r < 0)
                 return r;
@@ -1114,11 +1655,13 @@ static int link_entry_into_array(JournalFile *f,
                 return r;
 #endif
 
-        o->entry_array.items[i] = htole64(p);
+        entry_array_set_item(f, o, i, p);
 
         if (ap == 0)
                 *first = htole64(q);
         else {
+                chain_cache_put(f->chain_cache, ci, le64toh(*first), q, journal_file_entry_array_item(f, o, 0), t);
+
                 r = journal_file_move_to_object(f, OBJECT_ENTRY_ARRAY, ap, &o);
                 if (r < 0)
                         return r;
@@ -1275,7 +1818,7 @@ static int journal_file_append_entry_internal(
         return 0;
 }
 
-void journal_file_post_change(JournalFile *f) {
+static void journal_file_notify(JournalFile *f) {
         assert(f);
 
         /* inotify() does not receive IN_MODIFY events from file
@@ -1289,6 +1832,33 @@ void journal_file_post_change(JournalFile *f) {
                 log_error("Failed to truncate file to its own size: %m");
 }
 
+void journal_file_post_change(JournalFile *f) {
+        assert(f);
+
+        /* If the owner of the file asked for it, only remember
+         * that readers need to be woken up, and leave it to
+         * journal_file_flush_post_change() to actually do so. This
+         * allows coalescing the notifications for many appends
+         * into one. */
+
+        if (f->defer_post_change) {
+                f->post_change_pending = true;
+                return;
+        }
+
+        journal_file_notify(f);
+}
+
+void journal_file_flush_post_change(JournalFile *f) {
+        assert(f);
+
+        if (!f->post_change_pending)
+                return;
+
+        f->post_change_pending = false;
+        journal_file_notify(f);
+}
+
 static int entry_item_cmp(const void *_a, const void *_b) {
         const EntryItem *a = _a, *b = _b;
 
@@ -1299,7 +1869,7 @@ static int entry_item_cmp(const void *_a, const void *_b) {
         return 0;
 }
 
-int journal_file_append_entry(JournalFile *f, const dual_timestamp *ts, const struct iovec iovec[], unsigned n_iovec, uint64_t *seqnum, Object **ret, uint64_t *offset) {
+static int journal_file_append_entry_no_post(JournalFile *f, const dual_timestamp *ts, const sd_id128_t *boot_id, const struct iovec iovec[], unsigned n_iovec, uint64_t *seqnum, Object **ret, uint64_t *offset) {
         unsigned i;
         EntryItem *items;
         int r;
@@ -1314,6 +1884,15 @@ int journal_file_append_entry(JournalFile *f, const dual_timestamp *ts, const st
                 ts = &_ts;
         }
 
+        if (boot_id && !sd_id128_equal(*boot_id, f->header->boot_id)) {
+                /* The entry is from another boot, whose monotonic
+                 * clock cannot be compared with the one of the
+                 * previous entry. The header boot id always is the
+                 * one of the last entry written. */
+                f->header->boot_id = *boot_id;
+                f->tail_entry_monotonic_valid = false;
+        }
+
         if (f->tail_entry_monotonic_valid &&
             ts->monotonic < le64toh(f->header->tail_entry_monotonic))
                 return -EINVAL;
@@ -1328,70 +1907,72 @@ int journal_file_append_entry(JournalFile *f, const dual_timestamp *ts, const st
         items = alloca(sizeof(EntryItem) * MAX(1u, n_iovec));
 
         for (i = 0; i < n_iovec; i++) {
-                uint64_t p;
-                Object *o;
+                uint64_t p, h;
 
-                r = journal_file_append_data(f, iovec[i].iov_base, iovec[i].iov_len, &o, &p);
+                /* We don't need to look at the data object
+                 * itself, if we know the hash already */
+                h = hash64(iovec[i].iov_base, iovec[i].iov_len);
+
+                r = journal_file_append_data_with_hash(f, iovec[i].iov_base, iovec[i].iov_len, h, NULL, &p);
                 if (r < 0)
                         return r;
 
-                xor_hash ^= le64toh(o->data.hash);
+                xor_hash ^= h;
                 items[i].object_offset = htole64(p);
-                items[i].hash = o->data.hash;
+                items[i].hash = htole64(h);
         }
 
         /* Order by the position on disk, in order to improve seek
          * times for rotating media. */
         qsort(items, n_iovec, sizeof(EntryItem), entry_item_cmp);
 
-        r = journal_file_append_entry_internal(f, ts, xor_hash, items, n_iovec, seqnum, ret, offset);
+        return journal_file_append_entry_internal(f, ts, xor_hash, items, n_iovec, seqnum, ret, offset);
+}
+
+int journal_file_append_entry(JournalFile *f, const dual_timestamp *ts, const struct iovec iovec[], unsigned n_iovec, uint64_t *seqnum, Object **ret, uint64_t *offset) {
+        int r;
+
+        r = journal_file_append_entry_no_post(f, ts, NULL, iovec, n_iovec, seqnum, ret, offset);
 
         journal_file_post_change(f);
 
         return r;
 }
 
-typedef struct ChainCacheItem {
-        uint64_t first; /* the array at the begin of the chain */
-        uint64_t array; /* the cached array */
-        uint64_t begin; /* the first item in the cached array */
-        uint64_t total; /* the total number of items in all arrays before this one in the chain */
-} ChainCacheItem;
+int journal_file_append_entries(JournalFile *f, const JournalAppendEntry entries[], unsigned n_entries, uint64_t *seqnum, unsigned *n_appended) {
+        unsigned i;
+        int r = 0;
 
-static void chain_cache_put(
-                Hashmap *h,
-                ChainCacheItem *ci,
-                uint64_t first,
-                uint64_t array,
-                uint64_t begin,
-                uint64_t total) {
+        assert(f);
+        assert(entries || n_entries == 0);
 
-        if (!ci) {
-                /* If the chain item to cache for this chain is the
-                 * first one it's not worth caching anything */
-                if (array == first)
-                        return;
+        /* Appends a series of entries, but notifies readers only
+         * once for all of them. On failure the entries before the
+         * failing one have been written, and n_appended tells how
+         * many these are. */
 
-                if (hashmap_size(h) >= CHAIN_CACHE_MAX)
-                        ci = hashmap_steal_first(h);
-                else {
-                        ci = new(ChainCacheItem, 1);
-                        if (!ci)
-                                return;
-                }
+        for (i = 0; i < n_entries; i++) {
+                const JournalAppendEntry *e = entries + i;
 
-                ci->first = first;
+                if (e->seqnum > 0) {
+                        uint64_t q = e->seqnum - 1;
 
-                if (hashmap_put(h, &ci->first, ci) < 0) {
-                        free(ci);
-                        return;
-                }
-        } else
-                assert(ci->first == first);
+                        r = journal_file_append_entry_no_post(f, &e->ts, e->boot_id, e->iovec, e->n_iovec, &q, NULL, NULL);
+                        if (r >= 0 && seqnum && q > *seqnum)
+                                *seqnum = q;
+                } else
+                        r = journal_file_append_entry_no_post(f, &e->ts, e->boot_id, e->iovec, e->n_iovec, seqnum, NULL, NULL);
+                if (r < 0)
+                        break;
+        }
 
-        ci->array = array;
-        ci->begin = begin;
-        ci->total = total;
+        if (i > 0)
+                journal_file_post_change(f);
+
+        if (n_appended)
+                *n_appended = i;
+
+        return r;
 }
 
 static int generic_array_get(JournalFile *f,
@@ -1423,9 +2004,9 @@ static int generic_array_get(JournalFile *f,
                 if (r < 0)
                         return r;
 
-                k = journal_file_entry_array_n_items(o);
+                k = journal_file_entry_array_n_items(f, o);
                 if (i < k) {
-                        p = le64toh(o->entry_array.items[i]);
+                        p = journal_file_entry_array_item(f, o, i);
                         goto found;
                 }
 
@@ -1438,7 +2019,7 @@ static int generic_array_get(JournalFile *f,
 
 found:
         /* Let's cache this item for the next invocation */
-        chain_cache_put(f->chain_cache, ci, first, a, o->entry_array.items[0], t);
+        chain_cache_put(f->chain_cache, ci, first, a, journal_file_entry_array_item(f, o, 0), t);
 
         r = journal_file_move_to_object(f, OBJECT_ENTRY, p, &o);
         if (r < 0)
@@ -1541,13 +2122,13 @@ static int generic_array_bisect(JournalFile *f,
                 if (r < 0)
                         return r;
 
-                k = journal_file_entry_array_n_items(array);
+                k = journal_file_entry_array_n_items(f, array);
                 right = MIN(k, n);
                 if (right <= 0)
                         return 0;
 
                 i = right - 1;
-                lp = p = le64toh(array->entry_array.items[i]);
+                lp = p = journal_file_entry_array_item(f, array, i);
                 if (p <= 0)
                         return -EBADMSG;
 
@@ -1573,7 +2154,7 @@ static int generic_array_bisect(JournalFile *f,
                                 assert(left < right);
 
                                 i = (left + right) / 2;
-                                p = le64toh(array->entry_array.items[i]);
+                                p = journal_file_entry_array_item(f, array, i);
                                 if (p <= 0)
                                         return -EBADMSG;
 
@@ -1615,14 +2196,14 @@ found:
                 return 0;
 
         /* Let's cache this item for the next invocation */
-        chain_cache_put(f->chain_cache, ci, first, a, array->entry_array.items[0], t);
+        chain_cache_put(f->chain_cache, ci, first, a, journal_file_entry_array_item(f, array, 0), t);
 
         if (subtract_one && i == 0)
                 p = last_p;
         else if (subtract_one)
-                p = le64toh(array->entry_array.items[i-1]);
+                p = journal_file_entry_array_item(f, array, i-1);
         else
-                p = le64toh(array->entry_array.items[i]);
+                p = journal_file_entry_array_item(f, array, i);
 
         r = journal_file_move_to_object(f, OBJECT_ENTRY, p, &o);
         if (r < 0)
@@ -2241,6 +2822,16 @@ void journal_file_dump(JournalFile *f) {
                         printf("Type: OBJECT_DATA_HASH_TABLE\n");
                         break;
 
+                case OBJECT_DATA_OVERFLOW_TABLE:
+                        printf("Type: OBJECT_DATA_OVERFLOW_TABLE n_items=%"PRIu64"\n",
+                               journal_file_overflow_table_n_items(o));
+                        break;
+
+                case OBJECT_FIELD_OVERFLOW_TABLE:
+                        printf("Type: OBJECT_FIELD_OVERFLOW_TABLE n_items=%"PRIu64"\n",
+                               journal_file_overflow_table_n_items(o));
+                        break;
+
                 case OBJECT_ENTRY_ARRAY:
                         printf("Type: OBJECT_ENTRY_ARRAY\n");
                         break;
@@ -2256,8 +2847,9 @@ void journal_file_dump(JournalFile *f) {
                         break;
                 }
 
-                if (o->object.flags & OBJECT_COMPRESSED)
-                        printf("Flags: COMPRESSED\n");
+                if (o->object.flags & OBJECT_COMPRESSION_MASK)
+                        printf("Flags: COMPRESSED(%s)\n",
+                               strna(object_compressed_to_string(o->object.flags & OBJECT_COMPRESSION_MASK)));
 
                 if (p == le64toh(f->header->tail_object_offset))
                         p = 0;
@@ -2293,8 +2885,8 @@ void journal_file_print_header(JournalFile *f) {
                "Boot ID: %s\n"
                "Sequential Number ID: %s\n"
                "State: %s\n"
-               "Compatible Flags:%s%s\n"
-               "Incompatible Flags:%s%s\n"
+               "Compatible Flags:%s%s%s\n"
+               "Incompatible Flags:%s%s%s%s\n"
                "Header size: %"PRIu64"\n"
                "Arena size: %"PRIu64"\n"
                "Data Hash Table Size: %"PRIu64"\n"
@@ -2316,9 +2908,12 @@ void journal_file_print_header(JournalFile *f) {
                f->header->state == STATE_ONLINE ? "ONLINE" :
                f->header->state == STATE_ARCHIVED ? "ARCHIVED" : "UNKNOWN",
                JOURNAL_HEADER_SEALED(f->header) ? " SEALED" : "",
-               (le32toh(f->header->compatible_flags) & ~HEADER_COMPATIBLE_SEALED) ? " ???" : "",
-               JOURNAL_HEADER_COMPRESSED(f->header) ? " COMPRESSED" : "",
-               (le32toh(f->header->incompatible_flags) & ~HEADER_INCOMPATIBLE_COMPRESSED) ? " ???" : "",
+               JOURNAL_HEADER_OVERFLOW_TABLES(f->header) ? " OVERFLOW-TABLES" : "",
+               (le32toh(f->header->compatible_flags) & ~HEADER_COMPATIBLE_ANY) ? " ???" : "",
+               JOURNAL_HEADER_COMPRESSED_XZ(f->header) ? " COMPRESSED-XZ" : "",
+               JOURNAL_HEADER_COMPRESSED_LZ4(f->header) ? " COMPRESSED-LZ4" : "",
+               JOURNAL_HEADER_COMPACT(f->header) ? " COMPACT" : "",
+               (le32toh(f->header->incompatible_flags) & ~HEADER_INCOMPATIBLE_ANY) ? " ???" : "",
                le64toh(f->header->header_size),
                le64toh(f->header->arena_size),
                le64toh(f->header->data_hash_table_size) / sizeof(HashItem),
@@ -2351,10 +2946,42 @@ void journal_file_print_header(JournalFile *f) {
                 printf("Entry Array Objects: %"PRIu64"\n",
                        le64toh(f->header->n_entry_arrays));
 
+        if (JOURNAL_HEADER_CONTAINS(f->header, field_overflow_table_offset)) {
+                Object *o;
+                uint64_t n;
+
+                if (journal_file_move_to_overflow_table(f, OBJECT_DATA, &o, &n) > 0)
+                        printf("Data Overflow Table Size: %"PRIu64"\n"
+                               "Data Overflow Table Fill: %.1f%%\n",
+                               n, 100.0 * (double) le64toh(f->header->n_data) / (double) n);
+
+                if (journal_file_move_to_overflow_table(f, OBJECT_FIELD, &o, &n) > 0)
+                        printf("Field Overflow Table Size: %"PRIu64"\n"
+                               "Field Overflow Table Fill: %.1f%%\n",
+                               n, 100.0 * (double) le64toh(f->header->n_fields) / (double) n);
+        }
+
         if (fstat(f->fd, &st) >= 0)
                 printf("Disk usage: %s\n", format_bytes(bytes, sizeof(bytes), (off_t) st.st_blocks * 512ULL));
 }
 
+static bool journal_file_compact_default(void) {
+        const char *e;
+        int r;
+
+        e = getenv("SYSTEMD_JOURNAL_COMPACT");
+        if (!e)
+                return true;
+
+        r = parse_boolean(e);
+        if (r < 0) {
+                log_debug("Failed to parse $SYSTEMD_JOURNAL_COMPACT, ignoring.");
+                return true;
+        }
+
+        return r;
+}
+
 int journal_file_open(
                 const char *fname,
                 int flags,
@@ -2391,12 +3018,23 @@ int journal_file_open(
         f->flags = flags;
         f->prot = prot_from_flags(flags);
         f->writable = (flags & O_ACCMODE) != O_RDONLY;
-#ifdef HAVE_XZ
-        f->compress = compress;
+        /* New files are compressed with LZ4 if we have it, since
+         * it is a lot cheaper than XZ on both the write and the read
+         * path. Existing files keep the algorithm they were created
+         * with, see journal_file_verify_header(). */
+#if defined(HAVE_LZ4)
+        f->compress_lz4 = compress;
+#elif defined(HAVE_XZ)
+        f->compress_xz = compress;
 #endif
 #ifdef HAVE_GCRYPT
         f->seal = seal;
 #endif
+        /* New files use 32bit entry array items, unless explicitly
+         * turned off for readers that don't know them yet. Like the
+         * compression algorithm this is overridden by the header of
+         * existing files. */
+        f->compact = journal_file_compact_default();
 
         if (mmap_cache)
                 f->mmap = mmap_cache_ref(mmap_cache);
@@ -2420,6 +3058,14 @@ int journal_file_open(
                 goto fail;
         }
 
+        if (f->writable) {
+                f->data_cache = hashmap_new(uint64_hash_func, uint64_compare_func);
+                if (!f->data_cache) {
+                        r = -ENOMEM;
+                        goto fail;
+                }
+        }
+
         f->fd = open(f->path, f->flags|O_CLOEXEC, f->mode);
         if (f->fd < 0) {
                 r = -errno;
@@ -2504,6 +3150,16 @@ int journal_file_open(
                 } else if (template)
                         f->metrics = template->metrics;
 
+                if (template) {
+                        f->defer_post_change = template->defer_post_change;
+                        f->write_index = template->write_index;
+                }
+
+                /* Account for the header written above, the rest
+                 * is accounted for as it is allocated */
+                if (newly_created)
+                        journal_file_account_usage(f, 0);
+
                 r = journal_file_refresh_header(f);
                 if (r < 0)
                         goto fail;
@@ -2531,13 +3187,17 @@ int journal_file_open(
 #endif
         }
 
-        r = journal_file_map_field_hash_table(f);
-        if (r < 0)
-                goto fail;
+        /* Readers map the hash tables only once they look something
+         * up, which many of them never do for most files */
+        if (f->writable) {
+                r = journal_file_map_field_hash_table(f);
+                if (r < 0)
+                        goto fail;
 
-        r = journal_file_map_data_hash_table(f);
-        if (r < 0)
-                goto fail;
+                r = journal_file_map_data_hash_table(f);
+                if (r < 0)
+                        goto fail;
+        }
 
         *ret = f;
         return 0;
@@ -2580,13 +3240,43 @@ int journal_file_rotate(JournalFile **f, bool compress, bool seal) {
                  le64toh((*f)->header->head_entry_realtime));
 
         r = rename(old_file->path, p);
-        free(p);
-
-        if (r < 0)
+        if (r < 0) {
+                free(p);
                 return -errno;
+        }
 
         old_file->header->state = STATE_ARCHIVED;
 
+        if (old_file->write_index) {
+                char *t;
+
+                /* The archived file will not change anymore, so
+                 * this is a good time to write its index. Failing
+                 * to do so is not fatal, readers will just be
+                 * slower. */
+
+                t = journal_index_path(p);
+                if (t) {
+                        struct stat st;
+
+                        r = journal_index_write(old_file, t);
+                        if (r < 0)
+                                log_warning("Failed to write index %s: %s", t, strerror(-r));
+                        else if (old_file->metrics.usage && stat(t, &st) >= 0)
+                                __sync_fetch_and_add(old_file->metrics.usage, 512ULL * (uint64_t) st.st_blocks);
+
+                        free(t);
+                }
+        }
+
+        if (old_file->metrics.vacuum) {
+                r = journal_vacuum_add(old_file->metrics.vacuum, p);
+                if (r < 0)
+                        log_debug("Failed to register %s for vacuuming: %s", p, strerror(-r));
+        }
+
+        free(p);
+
         r = journal_file_open(old_file->path, old_file->flags, old_file->mode, compress, seal, NULL, old_file->mmap, old_file, &new_file);
         journal_file_close(old_file);
 
@@ -2608,6 +3298,7 @@ int journal_file_open_reliably(
         int r;
         size_t l;
         _cleanup_free_ char *p = NULL;
+        JournalMetrics *m;
 
         r = journal_file_open(fname, flags, mode, compress, seal,
                               metrics, mmap_cache, template, ret);
@@ -2643,6 +3334,10 @@ int journal_file_open_reliably(
 
         log_warning("File %s corrupted or uncleanly shut down, renaming and replacing.", fname);
 
+        m = metrics ? metrics : template ? &template->metrics : NULL;
+        if (m && m->vacuum)
+                journal_vacuum_add(m->vacuum, p);
+
         return journal_file_open(fname, flags, mode, compress, seal,
                                  metrics, mmap_cache, template, ret);
 }
@@ -2696,18 +3391,16 @@ int journal_file_copy_entry(JournalFile *from, JournalFile *to, Object *o, uint6
                 if ((uint64_t) t != l)
                         return -E2BIG;
 
-                if (o->object.flags & OBJECT_COMPRESSED) {
-#ifdef HAVE_XZ
+                if (o->object.flags & OBJECT_COMPRESSION_MASK) {
                         uint64_t rsize;
 
-                        if (!uncompress_blob(o->data.payload, l, &from->compress_buffer, &from->compress_buffer_size, &rsize, 0))
-                                return -EBADMSG;
+                        r = uncompress_blob(o->object.flags & OBJECT_COMPRESSION_MASK,
+                                            o->data.payload, l, &from->compress_buffer, &from->compress_buffer_size, &rsize, 0);
+                        if (r < 0)
+                                return r;
 
                         data = from->compress_buffer;
                         l = rsize;
-#else
-                        return -EPROTONOSUPPORT;
-#endif
                 } else
                         data = o->data.payload;
 
@@ -2875,33 +3568,9 @@ bool journal_file_rotate_suggested(JournalFile *f, usec_t max_file_usec) {
                 return true;
         }
 
-        /* Let's check if the hash tables grew over a certain fill
-         * level (75%, borrowing this value from Java's hash table
-         * implementation), and if so suggest a rotation. To calculate
-         * the fill level we need the n_data field, which only exists
-         * in newer versions. */
-
-        if (JOURNAL_HEADER_CONTAINS(f->header, n_data))
-                if (le64toh(f->header->n_data) * 4ULL > (le64toh(f->header->data_hash_table_size) / sizeof(HashItem)) * 3ULL) {
-                        log_debug("Data hash table of %s has a fill level at %.1f (%"PRIu64" of %"PRIu64" items, %llu file size, %"PRIu64" bytes per hash table item), suggesting rotation.",
-                                  f->path,
-                                  100.0 * (double) le64toh(f->header->n_data) / ((double) (le64toh(f->header->data_hash_table_size) / sizeof(HashItem))),
-                                  le64toh(f->header->n_data),
-                                  le64toh(f->header->data_hash_table_size) / sizeof(HashItem),
-                                  (unsigned long long) f->last_stat.st_size,
-                                  f->last_stat.st_size / le64toh(f->header->n_data));
-                        return true;
-                }
-
-        if (JOURNAL_HEADER_CONTAINS(f->header, n_fields))
-                if (le64toh(f->header->n_fields) * 4ULL > (le64toh(f->header->field_hash_table_size) / sizeof(HashItem)) * 3ULL) {
-                        log_debug("Field hash table of %s has a fill level at %.1f (%"PRIu64" of %"PRIu64" items), suggesting rotation.",
-                                  f->path,
-                                  100.0 * (double) le64toh(f->header->n_fields) / ((double) (le64toh(f->header->field_hash_table_size) / sizeof(HashItem))),
-                                  le64toh(f->header->n_fields),
-                                  le64toh(f->header->field_hash_table_size) / sizeof(HashItem));
-                        return true;
-                }
+        /* The fill level of the hash tables is no reason to rotate:
+         * once they reach 75%, lookups go through the overflow
+         * tables, see journal_file_reserve_overflow_table(). */
 
         /* Are the data objects properly indexed by field objects? */
         if (JOURNAL_HEADER_CONTAINS(f->header, n_data) &&
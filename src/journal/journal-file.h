@@ -34,12 +34,21 @@
 #include "util.h"
 #include "mmap-cache.h"
 #include "hashmap.h"
+#include "list.h"
 
 typedef struct JournalMetrics {
         uint64_t max_use;
         uint64_t max_size;
         uint64_t min_size;
         uint64_t keep_free;
+
+        /* If set, the disk space allocated by files written with
+         * these metrics is added to this counter */
+        uint64_t *usage;
+
+        /* If set, files written with these metrics are registered
+         * here once they are archived */
+        struct JournalVacuum *vacuum;
 } JournalMetrics;
 
 typedef enum direction {
@@ -55,11 +64,18 @@ typedef struct JournalFile {
         int flags;
         int prot;
         bool writable;
-        bool compress;
+        bool compress_xz;
+        bool compress_lz4;
+        bool compact;
         bool seal;
 
         bool tail_entry_monotonic_valid;
 
+        bool defer_post_change;
+        bool post_change_pending;
+
+        bool write_index;
+
         direction_t last_direction;
 
         char *path;
@@ -71,15 +87,34 @@ typedef struct JournalFile {
 
         uint64_t current_offset;
 
+        /* Used by sd-journal to merge files: the next entry of this
+         * file beyond the current location, and a copy of its
+         * header, so that files can be ordered without touching
+         * their maps */
+        uint64_t merge_offset;
+        uint8_t merge_entry[offsetof(EntryObject, items)];
+        unsigned merge_idx;
+        bool in_merge_queue;
+        bool in_merge_waiting;
+        uint64_t merge_n_entries;
+        LIST_FIELDS(struct JournalFile, merge_waiting);
+
+        /* The sidecar index of an archived file, loaded by sd-journal
+         * when first needed */
+        struct JournalIndex *index;
+        bool index_loaded;
+
         JournalMetrics metrics;
         MMapCache *mmap;
 
         Hashmap *chain_cache;
 
-#ifdef HAVE_XZ
+        /* Recently written or looked up small data objects, by
+         * hash, only for files we write to */
+        Hashmap *data_cache;
+
         void *compress_buffer;
         uint64_t compress_buffer_size;
-#endif
 
 #ifdef HAVE_GCRYPT
         gcry_md_hd_t hmac;
@@ -99,6 +134,19 @@ typedef struct JournalFile {
 #endif
 } JournalFile;
 
+typedef struct JournalAppendEntry {
+        dual_timestamp ts;
+        const struct iovec *iovec;
+        unsigned n_iovec;
+
+        /* For entries imported from elsewhere: the boot they were
+         * logged in, and their original seqnum, which is kept if it
+         * is beyond the tail of the file. If unset, the entry gets
+         * the boot id from the header and the next seqnum. */
+        const sd_id128_t *boot_id;
+        uint64_t seqnum;
+} JournalAppendEntry;
+
 int journal_file_open(
                 const char *fname,
                 int flags,
@@ -149,17 +197,39 @@ static inline bool VALID_EPOCH(uint64_t u) {
 #define JOURNAL_HEADER_SEALED(h) \
         (!!(le32toh((h)->compatible_flags) & HEADER_COMPATIBLE_SEALED))
 
-#define JOURNAL_HEADER_COMPRESSED(h) \
-        (!!(le32toh((h)->incompatible_flags) & HEADER_INCOMPATIBLE_COMPRESSED))
+#define JOURNAL_HEADER_COMPRESSED_XZ(h) \
+        (!!(le32toh((h)->incompatible_flags) & HEADER_INCOMPATIBLE_COMPRESSED_XZ))
+
+#define JOURNAL_HEADER_COMPRESSED_LZ4(h) \
+        (!!(le32toh((h)->incompatible_flags) & HEADER_INCOMPATIBLE_COMPRESSED_LZ4))
+
+#define JOURNAL_HEADER_COMPACT(h) \
+        (!!(le32toh((h)->incompatible_flags) & HEADER_INCOMPATIBLE_COMPACT))
+
+#define JOURNAL_HEADER_OVERFLOW_TABLES(h) \
+        (!!(le32toh((h)->compatible_flags) & HEADER_COMPATIBLE_OVERFLOW_TABLES))
 
 int journal_file_move_to_object(JournalFile *f, int type, uint64_t offset, Object **ret);
 
+int journal_file_map_data_hash_table(JournalFile *f);
+int journal_file_map_field_hash_table(JournalFile *f);
+int journal_file_move_to_overflow_table(JournalFile *f, int type, Object **ret, uint64_t *n);
+
 uint64_t journal_file_entry_n_items(Object *o) _pure_;
-uint64_t journal_file_entry_array_n_items(Object *o) _pure_;
+uint64_t journal_file_entry_array_n_items(JournalFile *f, Object *o) _pure_;
 uint64_t journal_file_hash_table_n_items(Object *o) _pure_;
+uint64_t journal_file_overflow_table_n_items(Object *o) _pure_;
+
+static inline uint64_t journal_file_entry_array_item(JournalFile *f, Object *o, uint64_t i) {
+        if (f->compact)
+                return le32toh(o->compact_entry_array.items[i]);
+
+        return le64toh(o->entry_array.items[i]);
+}
 
 int journal_file_append_object(JournalFile *f, int type, uint64_t size, Object **ret, uint64_t *offset);
 int journal_file_append_entry(JournalFile *f, const dual_timestamp *ts, const struct iovec iovec[], unsigned n_iovec, uint64_t *seqno, Object **ret, uint64_t *offset);
+int journal_file_append_entries(JournalFile *f, const JournalAppendEntry entries[], unsigned n_entries, uint64_t *seqno, unsigned *n_appended);
 
 int journal_file_find_data_object(JournalFile *f, const void *data, uint64_t size, Object **ret, uint64_t *offset);
 int journal_file_find_data_object_with_hash(JournalFile *f, const void *data, uint64_t size, uint64_t hash, Object **ret, uint64_t *offset);
@@ -190,6 +260,7 @@ void journal_file_print_header(JournalFile *f);
 int journal_file_rotate(JournalFile **f, bool compress, bool seal);
 
 void journal_file_post_change(JournalFile *f);
+void journal_file_flush_post_change(JournalFile *f);
 
 void journal_default_metrics(JournalMetrics *m, int fd);
 
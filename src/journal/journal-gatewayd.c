@@ -24,6 +24,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <sys/epoll.h>
 
 #include <microhttpd.h>
 
@@ -39,8 +40,18 @@
 #include "build.h"
 #include "fileio.h"
 
+/* Since 0.9.42 connections may only be suspended if that is requested
+ * when the daemon is started */
+#if MHD_VERSION < 0x00094200
+#  define MHD_USE_SUSPEND_RESUME 0
+#endif
+
+/* How much we serialize ahead of what the client has read */
+#define BUFFER_SIZE (64*1024)
+
 typedef struct RequestMeta {
         sd_journal *journal;
+        struct MHD_Connection *connection;
 
         OutputMode mode;
 
@@ -49,13 +60,19 @@ typedef struct RequestMeta {
         uint64_t n_entries;
         bool n_entries_set;
 
-        FILE *tmp;
+        /* Output is serialized into a memory stream that is
+         * rewound and reused whenever the client has read all of
+         * it */
+        FILE *stream;
+        char *stream_buf;
+        size_t stream_size;
         uint64_t delta, size;
 
         int argument_parse_error;
 
         bool follow;
         bool discrete;
+        bool suspended;
 
         uint64_t n_fields;
         bool n_fields_set;
@@ -68,6 +85,10 @@ static const char* const mime_types[_OUTPUT_MODE_MAX] = {
         [OUTPUT_EXPORT] = "application/vnd.fdo.journal",
 };
 
+/* Our event loop: watches the epoll fd of MHD and the journal fds of
+ * the suspended connections */
+static int epoll_fd = -1;
+
 static RequestMeta *request_meta(void **connection_cls) {
         RequestMeta *m;
 
@@ -93,16 +114,101 @@ static void request_meta_free(
         if (!m)
                 return;
 
-        if (m->journal)
+        if (m->journal) {
+                if (m->suspended)
+                        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sd_journal_get_fd(m->journal), NULL);
+
                 sd_journal_close(m->journal);
+        }
 
-        if (m->tmp)
-                fclose(m->tmp);
+        if (m->stream)
+                fclose(m->stream);
+        free(m->stream_buf);
 
         free(m->cursor);
         free(m);
 }
 
+static int request_meta_rewind(RequestMeta *m) {
+        assert(m);
+
+        if (m->stream) {
+                rewind(m->stream);
+                return 0;
+        }
+
+        m->stream = open_memstream(&m->stream_buf, &m->stream_size);
+        if (!m->stream)
+                return -errno;
+
+        return 0;
+}
+
+static int request_meta_flush(RequestMeta *m) {
+        assert(m);
+        assert(m->stream);
+
+        /* This updates stream_buf and stream_size */
+        if (fflush(m->stream) != 0)
+                return -errno;
+
+        m->size = m->stream_size;
+        return 0;
+}
+
+static ssize_t request_meta_copy(RequestMeta *m, uint64_t pos, char *buf, size_t max) {
+        size_t n;
+
+        assert(m);
+        assert(pos < m->size);
+
+        n = m->size - pos;
+        if (n > max)
+                n = max;
+
+        memcpy(buf, m->stream_buf + pos, n);
+        return (ssize_t) n;
+}
+
+static int request_meta_suspend(RequestMeta *m) {
+        struct epoll_event ev = {
+                .events = EPOLLIN,
+                .data.ptr = m,
+        };
+        int fd;
+
+        assert(m);
+        assert(!m->suspended);
+
+        fd = sd_journal_get_fd(m->journal);
+        if (fd < 0)
+                return fd;
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+                return -errno;
+
+        MHD_suspend_connection(m->connection);
+        m->suspended = true;
+
+        return 0;
+}
+
+static void request_meta_resume(RequestMeta *m) {
+        int r;
+
+        assert(m);
+        assert(m->suspended);
+
+        r = sd_journal_process(m->journal);
+        if (r < 0)
+                log_warning("Failed to process journal changes: %s", strerror(-r));
+
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sd_journal_get_fd(m->journal), NULL);
+
+        MHD_resume_connection(m->connection);
+        m->suspended = false;
+}
+
 static int open_journal(RequestMeta *m) {
         assert(m);
 
@@ -172,8 +278,8 @@ static ssize_t request_reader_entries(
                 size_t max) {
 
         RequestMeta *m = cls;
+        bool wait = false;
         int r;
-        size_t n, k;
 
         assert(m);
         assert(buf);
@@ -182,104 +288,101 @@ static ssize_t request_reader_entries(
 
         pos -= m->delta;
 
-        while (pos >= m->size) {
-                off_t sz;
+        if (pos >= m->size) {
 
-                /* End of this entry, so let's serialize the next
-                 * one */
+                /* The client has everything we serialized, so let's
+                 * refill the buffer with as many entries as it will
+                 * take at once */
 
-                if (m->n_entries_set &&
-                    m->n_entries <= 0)
-                        return MHD_CONTENT_READER_END_OF_STREAM;
-
-                if (m->n_skip < 0)
-                        r = sd_journal_previous_skip(m->journal, (uint64_t) -m->n_skip + 1);
-                else if (m->n_skip > 0)
-                        r = sd_journal_next_skip(m->journal, (uint64_t) m->n_skip + 1);
-                else
-                        r = sd_journal_next(m->journal);
+                pos -= m->size;
+                m->delta += m->size;
+                m->size = 0;
 
+                r = request_meta_rewind(m);
                 if (r < 0) {
-                        log_error("Failed to advance journal pointer: %s", strerror(-r));
+                        log_error("Failed to create memory stream: %s", strerror(-r));
                         return MHD_CONTENT_READER_END_WITH_ERROR;
-                } else if (r == 0) {
+                }
 
-                        if (m->follow) {
-                                r = sd_journal_wait(m->journal, (uint64_t) -1);
-                                if (r < 0) {
-                                        log_error("Couldn't wait for journal event: %s", strerror(-r));
-                                        return MHD_CONTENT_READER_END_WITH_ERROR;
-                                }
+                for (;;) {
+                        off_t sz;
 
-                                continue;
+                        sz = ftello(m->stream);
+                        if (sz == (off_t) -1) {
+                                log_error("Failed to retrieve stream position: %m");
+                                return MHD_CONTENT_READER_END_WITH_ERROR;
                         }
 
-                        return MHD_CONTENT_READER_END_OF_STREAM;
-                }
+                        if ((uint64_t) sz >= BUFFER_SIZE)
+                                break;
+
+                        if (m->n_entries_set &&
+                            m->n_entries <= 0)
+                                break;
 
-                if (m->discrete) {
-                        assert(m->cursor);
+                        if (m->n_skip < 0)
+                                r = sd_journal_previous_skip(m->journal, (uint64_t) -m->n_skip + 1);
+                        else if (m->n_skip > 0)
+                                r = sd_journal_next_skip(m->journal, (uint64_t) m->n_skip + 1);
+                        else
+                                r = sd_journal_next(m->journal);
 
-                        r = sd_journal_test_cursor(m->journal, m->cursor);
                         if (r < 0) {
-                                log_error("Failed to test cursor: %s", strerror(-r));
+                                log_error("Failed to advance journal pointer: %s", strerror(-r));
                                 return MHD_CONTENT_READER_END_WITH_ERROR;
+                        } else if (r == 0) {
+                                wait = m->follow;
+                                break;
                         }
 
-                        if (r == 0)
-                                return MHD_CONTENT_READER_END_OF_STREAM;
-                }
+                        if (m->discrete) {
+                                assert(m->cursor);
 
-                pos -= m->size;
-                m->delta += m->size;
+                                r = sd_journal_test_cursor(m->journal, m->cursor);
+                                if (r < 0) {
+                                        log_error("Failed to test cursor: %s", strerror(-r));
+                                        return MHD_CONTENT_READER_END_WITH_ERROR;
+                                }
 
-                if (m->n_entries_set)
-                        m->n_entries -= 1;
+                                if (r == 0)
+                                        break;
+                        }
 
-                m->n_skip = 0;
+                        if (m->n_entries_set)
+                                m->n_entries -= 1;
 
-                if (m->tmp)
-                        rewind(m->tmp);
-                else {
-                        m->tmp = tmpfile();
-                        if (!m->tmp) {
-                                log_error("Failed to create temporary file: %m");
+                        m->n_skip = 0;
+
+                        r = output_journal(m->stream, m->journal, m->mode, 0, OUTPUT_FULL_WIDTH);
+                        if (r < 0) {
+                                log_error("Failed to serialize item: %s", strerror(-r));
                                 return MHD_CONTENT_READER_END_WITH_ERROR;
                         }
                 }
 
-                r = output_journal(m->tmp, m->journal, m->mode, 0, OUTPUT_FULL_WIDTH);
+                r = request_meta_flush(m);
                 if (r < 0) {
-                        log_error("Failed to serialize item: %s", strerror(-r));
-                        return MHD_CONTENT_READER_END_WITH_ERROR;
-                }
-
-                sz = ftello(m->tmp);
-                if (sz == (off_t) -1) {
-                        log_error("Failed to retrieve file position: %m");
+                        log_error("Failed to flush memory stream: %s", strerror(-r));
                         return MHD_CONTENT_READER_END_WITH_ERROR;
                 }
 
-                m->size = (uint64_t) sz;
-        }
-
-        if (fseeko(m->tmp, pos, SEEK_SET) < 0) {
-                log_error("Failed to seek to position: %m");
-                return MHD_CONTENT_READER_END_WITH_ERROR;
-        }
+                if (m->size <= 0) {
+                        if (!wait)
+                                return MHD_CONTENT_READER_END_OF_STREAM;
 
-        n = m->size - pos;
-        if (n > max)
-                n = max;
+                        /* Nothing to send right now, so let's park
+                         * the connection until the journal changes */
+                        r = request_meta_suspend(m);
+                        if (r < 0) {
+                                log_error("Couldn't wait for journal event: %s", strerror(-r));
+                                return MHD_CONTENT_READER_END_WITH_ERROR;
+                        }
 
-        errno = 0;
-        k = fread(buf, 1, n, m->tmp);
-        if (k != n) {
-                log_error("Failed to read from file: %s", errno ? strerror(errno) : "Premature EOF");
-                return MHD_CONTENT_READER_END_WITH_ERROR;
+                        return 0;
+                }
         }
 
-        return (ssize_t) k;
+        return request_meta_copy(m, pos, buf, max);
 }
 
 static int request_parse_accept(
@@ -493,6 +596,8 @@ static int request_handler_entries(
         assert(connection);
         assert(m);
 
+        m->connection = connection;
+
         r = open_journal(m);
         if (r < 0)
                 return respond_error(connection, MHD_HTTP_INTERNAL_SERVER_ERROR, "Failed to open journal: %s\n", strerror(-r));
@@ -514,6 +619,14 @@ static int request_handler_entries(
                 m->n_entries_set = true;
         }
 
+        if (m->follow) {
+                /* Start watching before we look at the journal, so
+                 * that we don't miss what is written in between */
+                r = sd_journal_get_fd(m->journal);
+                if (r < 0)
+                        return respond_error(connection, MHD_HTTP_INTERNAL_SERVER_ERROR, "Failed to watch journal: %s\n", strerror(-r));
+        }
+
         if (m->cursor)
                 r = sd_journal_seek_cursor(m->journal, m->cursor);
         else if (m->n_skip >= 0)
@@ -523,7 +636,7 @@ static int request_handler_entries(
         if (r < 0)
                 return respond_error(connection, MHD_HTTP_BAD_REQUEST, "Failed to seek in journal.\n");
 
-        response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 4*1024, request_reader_entries, m, NULL);
+        response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, BUFFER_SIZE, request_reader_entries, m, NULL);
         if (!response)
                 return respond_oom(connection);
 
@@ -565,7 +678,6 @@ static ssize_t request_reader_fields(
 
         RequestMeta *m = cls;
         int r;
-        size_t n, k;
 
         assert(m);
         assert(buf);
@@ -574,73 +686,67 @@ static ssize_t request_reader_fields(
 
         pos -= m->delta;
 
-        while (pos >= m->size) {
-                off_t sz;
-                const void *d;
-                size_t l;
+        if (pos >= m->size) {
 
-                /* End of this field, so let's serialize the next
-                 * one */
+                /* The client has everything we serialized, so let's
+                 * refill the buffer with the next fields */
 
-                if (m->n_fields_set &&
-                    m->n_fields <= 0)
-                        return MHD_CONTENT_READER_END_OF_STREAM;
+                pos -= m->size;
+                m->delta += m->size;
+                m->size = 0;
 
-                r = sd_journal_enumerate_unique(m->journal, &d, &l);
+                r = request_meta_rewind(m);
                 if (r < 0) {
-                        log_error("Failed to advance field index: %s", strerror(-r));
+                        log_error("Failed to create memory stream: %s", strerror(-r));
                         return MHD_CONTENT_READER_END_WITH_ERROR;
-                } else if (r == 0)
-                        return MHD_CONTENT_READER_END_OF_STREAM;
+                }
 
-                pos -= m->size;
-                m->delta += m->size;
+                for (;;) {
+                        const void *d;
+                        size_t l;
+                        off_t sz;
 
-                if (m->n_fields_set)
-                        m->n_fields -= 1;
+                        sz = ftello(m->stream);
+                        if (sz == (off_t) -1) {
+                                log_error("Failed to retrieve stream position: %m");
+                                return MHD_CONTENT_READER_END_WITH_ERROR;
+                        }
 
-                if (m->tmp)
-                        rewind(m->tmp);
-                else {
-                        m->tmp = tmpfile();
-                        if (!m->tmp) {
-                                log_error("Failed to create temporary file: %m");
+                        if ((uint64_t) sz >= BUFFER_SIZE)
+                                break;
+
+                        if (m->n_fields_set &&
+                            m->n_fields <= 0)
+                                break;
+
+                        r = sd_journal_enumerate_unique(m->journal, &d, &l);
+                        if (r < 0) {
+                                log_error("Failed to advance field index: %s", strerror(-r));
+                                return MHD_CONTENT_READER_END_WITH_ERROR;
+                        } else if (r == 0)
+                                break;
+
+                        if (m->n_fields_set)
+                                m->n_fields -= 1;
+
+                        r = output_field(m->stream, m->mode, d, l);
+                        if (r < 0) {
+                                log_error("Failed to serialize item: %s", strerror(-r));
                                 return MHD_CONTENT_READER_END_WITH_ERROR;
                         }
                 }
 
-                r = output_field(m->tmp, m->mode, d, l);
+                r = request_meta_flush(m);
                 if (r < 0) {
-                        log_error("Failed to serialize item: %s", strerror(-r));
+                        log_error("Failed to flush memory stream: %s", strerror(-r));
                         return MHD_CONTENT_READER_END_WITH_ERROR;
                 }
 
-                sz = ftello(m->tmp);
-                if (sz == (off_t) -1) {
-                        log_error("Failed to retrieve file position: %m");
-                        return MHD_CONTENT_READER_END_WITH_ERROR;
-                }
-
-                m->size = (uint64_t) sz;
-        }
-
-        if (fseeko(m->tmp, pos, SEEK_SET) < 0) {
-                log_error("Failed to seek to position: %m");
-                return MHD_CONTENT_READER_END_WITH_ERROR;
-        }
-
-        n = m->size - pos;
-        if (n > max)
-                n = max;
-
-        errno = 0;
-        k = fread(buf, 1, n, m->tmp);
-        if (k != n) {
-                log_error("Failed to read from file: %s", errno ? strerror(errno) : "Premature EOF");
-                return MHD_CONTENT_READER_END_WITH_ERROR;
+                if (m->size <= 0)
+                        return MHD_CONTENT_READER_END_OF_STREAM;
         }
 
-        return (ssize_t) k;
+        return request_meta_copy(m, pos, buf, max);
 }
 
 static int request_handler_fields(
@@ -666,7 +772,7 @@ static int request_handler_fields(
         if (r < 0)
                 return respond_error(connection, MHD_HTTP_BAD_REQUEST, "Failed to query unique fields.\n");
 
-        response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 4*1024, request_reader_fields, m, NULL);
+        response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, BUFFER_SIZE, request_reader_fields, m, NULL);
         if (!response)
                 return respond_oom(connection);
 
@@ -999,6 +1105,62 @@ static int parse_argv(int argc, char *argv[]) {
         return 1;
 }
 
+static int run(struct MHD_Daemon *d) {
+        const union MHD_DaemonInfo *info;
+        struct epoll_event ev = {
+                .events = EPOLLIN,
+                .data.ptr = NULL,
+        };
+
+        assert(d);
+
+        info = MHD_get_daemon_info(d, MHD_DAEMON_INFO_EPOLL_FD_LINUX_ONLY);
+        if (!info) {
+                log_error("Failed to get MHD epoll fd.");
+                return -EINVAL;
+        }
+
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd < 0) {
+                log_error("Failed to create epoll object: %m");
+                return -errno;
+        }
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, info->listen_fd, &ev) < 0) {
+                log_error("Failed to add MHD epoll fd: %m");
+                return -errno;
+        }
+
+        for (;;) {
+                struct epoll_event events[16];
+                MHD_UNSIGNED_LONG_LONG timeout;
+                int i, k, msec = -1;
+
+                if (MHD_get_timeout(d, &timeout) == MHD_YES)
+                        msec = (int) MIN(timeout, (MHD_UNSIGNED_LONG_LONG) INT_MAX);
+
+                k = epoll_wait(epoll_fd, events, ELEMENTSOF(events), msec);
+                if (k < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        log_error("epoll_wait() failed: %m");
+                        return -errno;
+                }
+
+                /* Connections that wait for the journal to change
+                 * carry their RequestMeta, MHD's own fd has none */
+                for (i = 0; i < k; i++)
+                        if (events[i].data.ptr)
+                                request_meta_resume(events[i].data.ptr);
+
+                if (MHD_run(d) != MHD_YES) {
+                        log_error("Failed to run MHD.");
+                        return -EIO;
+                }
+        }
+}
+
 int main(int argc, char *argv[]) {
         struct MHD_Daemon *d = NULL;
         int r, n;
@@ -1031,7 +1193,7 @@ int main(int argc, char *argv[]) {
                         { MHD_OPTION_END, 0, NULL },
                         { MHD_OPTION_END, 0, NULL }};
                 int opts_pos = 2;
-                int flags = MHD_USE_THREAD_PER_CONNECTION|MHD_USE_POLL|MHD_USE_DEBUG;
+                int flags = MHD_USE_EPOLL_LINUX_ONLY|MHD_USE_SUSPEND_RESUME|MHD_USE_DEBUG;
 
                 if (n > 0)
                         opts[opts_pos++] = (struct MHD_OptionItem)
@@ -1057,13 +1219,14 @@ int main(int argc, char *argv[]) {
                 goto finish;
         }
 
-        pause();
-
-        r = EXIT_SUCCESS;
+        r = run(d) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 
 finish:
         if (d)
                 MHD_stop_daemon(d);
 
+        if (epoll_fd >= 0)
+                close_nointr_nofail(epoll_fd);
+
         return r;
 }
@@ -0,0 +1,758 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  Copyright 2013 Lennart Poettering
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <systemd/sd-id128.h>
+
+#include "build.h"
+#include "util.h"
+#include "log.h"
+#include "macro.h"
+#include "sparse-endian.h"
+#include "journal-file.h"
+
+/* Reads streams in the journal export format, as generated by
+ * "journalctl -o export", and writes the entries directly into a
+ * journal file, keeping their timestamps, boot ids and, where
+ * possible, sequence numbers. */
+
+#define READ_SIZE (64U*1024U)
+#define DATA_SIZE_MAX (1024U*1024U*768U)
+#define FIELD_NAME_MAX 64U
+
+/* Entries are written in batches of this size, so that readers are
+ * notified only once per batch */
+#define BATCH_ENTRIES_MAX 1024U
+#define BATCH_DATA_MAX (4U*1024U*1024U)
+
+typedef struct ImportEntry {
+        dual_timestamp ts;
+        bool realtime_set;
+
+        sd_id128_t boot_id;
+        bool boot_id_set;
+
+        sd_id128_t seqnum_id;
+        uint64_t seqnum;
+
+        unsigned first_iovec;
+} ImportEntry;
+
+typedef struct Importer {
+        const char *name;
+        int fd;
+
+        char *buf;
+        size_t buf_allocated, buf_start, buf_end;
+        bool eof;
+
+        /* The batch of entries to write next. The iovecs refer to
+         * the data buffer by offset, since it might be reallocated
+         * while the batch is collected. */
+        ImportEntry *entries;
+        unsigned n_entries;
+        size_t entries_allocated;
+
+        JournalAppendEntry *append;
+        size_t append_allocated;
+
+        struct iovec *iovec;
+        unsigned n_iovec;
+        size_t iovec_allocated;
+
+        char *data;
+        size_t data_size, data_allocated;
+
+        JournalFile *file;
+
+        uint64_t n_imported, n_skipped;
+} Importer;
+
+static const char *arg_output = NULL;
+static bool arg_compress = true;
+
+static int importer_fill(Importer *imp, size_t need) {
+        ssize_t k;
+
+        assert(imp);
+
+        /* Makes sure at least need bytes are buffered, unless the
+         * stream ends earlier */
+
+        while (imp->buf_end - imp->buf_start < need && !imp->eof) {
+
+                if (imp->buf_start > 0) {
+                        memmove(imp->buf, imp->buf + imp->buf_start, imp->buf_end - imp->buf_start);
+                        imp->buf_end -= imp->buf_start;
+                        imp->buf_start = 0;
+                }
+
+                if (!GREEDY_REALLOC(imp->buf, imp->buf_allocated, MAX(need, imp->buf_end + READ_SIZE)))
+                        return log_oom();
+
+                k = read(imp->fd, imp->buf + imp->buf_end, imp->buf_allocated - imp->buf_end);
+                if (k < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        log_error("Failed to read %s: %m", imp->name);
+                        return -errno;
+                }
+
+                if (k == 0)
+                        imp->eof = true;
+
+                imp->buf_end += k;
+        }
+
+        return imp->buf_end - imp->buf_start >= need;
+}
+
+static int importer_line(Importer *imp, const char **line, size_t *length) {
+        size_t scanned = 0;
+        int r;
+
+        assert(imp);
+        assert(line);
+        assert(length);
+
+        for (;;) {
+                char *nl;
+
+                nl = memchr(imp->buf + imp->buf_start + scanned, '\n', imp->buf_end - imp->buf_start - scanned);
+                if (nl) {
+                        *line = imp->buf + imp->buf_start;
+                        *length = nl - *line;
+                        imp->buf_start += *length + 1;
+                        return 1;
+                }
+
+                scanned = imp->buf_end - imp->buf_start;
+                if (scanned > DATA_SIZE_MAX) {
+                        log_error("%s: Line too long.", imp->name);
+                        return -E2BIG;
+                }
+
+                r = importer_fill(imp, scanned + 1);
+                if (r < 0)
+                        return r;
+                if (r == 0) {
+                        if (scanned > 0) {
+                                log_error("%s: Stream ends with an incomplete line.", imp->name);
+                                return -EBADMSG;
+                        }
+
+                        return 0;
+                }
+        }
+}
+
+static bool valid_field(const char *p, size_t l) {
+        const char *a;
+
+        /* Same rules as for fields journald receives, except that
+         * trusted fields, with a leading underscore, are fine */
+
+        if (l <= 0 || l > FIELD_NAME_MAX)
+                return false;
+
+        if (*p >= '0' && *p <= '9')
+                return false;
+
+        for (a = p; a < p + l; a++)
+                if (!((*a >= 'A' && *a <= 'Z') ||
+                      (*a >= '0' && *a <= '9') ||
+                      *a == '_'))
+                        return false;
+
+        return true;
+}
+
+static int parse_timestamp_field(const char *p, size_t l, usec_t *ret) {
+        char t[DECIMAL_STR_MAX(uint64_t)];
+        uint64_t u;
+        int r;
+
+        if (l >= sizeof(t))
+                return -EINVAL;
+
+        memcpy(t, p, l);
+        t[l] = 0;
+
+        r = safe_atou64(t, &u);
+        if (r < 0)
+                return r;
+
+        *ret = u;
+        return 0;
+}
+
+static int parse_cursor(const char *p, size_t l, sd_id128_t *seqnum_id, uint64_t *seqnum) {
+        const char *e = p + l;
+        bool seqnum_id_set = false, seqnum_set = false;
+
+        /* Only picks the seqnum id and the seqnum from the cursor,
+         * the rest is in the other fields */
+
+        while (p < e) {
+                const char *w;
+                size_t k;
+
+                w = memchr(p, ';', e - p);
+                k = (w ? w : e) - p;
+
+                if (k == 2 + 32 && p[0] == 's' && p[1] == '=') {
+                        char t[33];
+
+                        memcpy(t, p + 2, 32);
+                        t[32] = 0;
+
+                        if (sd_id128_from_string(t, seqnum_id) < 0)
+                                return -EINVAL;
+
+                        seqnum_id_set = true;
+
+                } else if (k > 2 && k <= 2 + 16 && p[0] == 'i' && p[1] == '=') {
+                        char t[17];
+                        unsigned long long u;
+                        char *end;
+
+                        memcpy(t, p + 2, k - 2);
+                        t[k - 2] = 0;
+
+                        errno = 0;
+                        u = strtoull(t, &end, 16);
+                        if (errno != 0 || *end)
+                                return -EINVAL;
+
+                        *seqnum = (uint64_t) u;
+                        seqnum_set = true;
+                }
+
+                p += k + 1;
+        }
+
+        return seqnum_id_set && seqnum_set ? 0 : -EINVAL;
+}
+
+static int importer_add_field(Importer *imp, const char *name, size_t name_length, const char *value, size_t value_length) {
+        ImportEntry *e;
+        size_t l;
+
+        assert(imp);
+        assert(imp->n_entries < imp->entries_allocated);
+
+        e = imp->entries + imp->n_entries;
+
+        if (name_length >= 2 && name[0] == '_' && name[1] == '_') {
+                /* Address fields are not stored as such, but some
+                 * of them carry what we need to recreate the entry */
+
+                if (name_length == 8 && memcmp(name, "__CURSOR", 8) == 0) {
+                        if (parse_cursor(value, value_length, &e->seqnum_id, &e->seqnum) < 0) {
+                                log_warning("%s: Invalid cursor, not keeping sequence number.", imp->name);
+                                e->seqnum = 0;
+                        }
+                } else if (name_length == 20 && memcmp(name, "__REALTIME_TIMESTAMP", 20) == 0) {
+                        if (parse_timestamp_field(value, value_length, &e->ts.realtime) < 0)
+                                return -EBADMSG;
+
+                        e->realtime_set = true;
+                } else if (name_length == 21 && memcmp(name, "__MONOTONIC_TIMESTAMP", 21) == 0) {
+                        if (parse_timestamp_field(value, value_length, &e->ts.monotonic) < 0)
+                                return -EBADMSG;
+                }
+
+                return 0;
+        }
+
+        if (!valid_field(name, name_length)) {
+                log_warning("%s: Invalid field name, ignoring field.", imp->name);
+                return 0;
+        }
+
+        if (name_length == 8 && memcmp(name, "_BOOT_ID", 8) == 0) {
+                char t[33];
+
+                if (value_length != 32)
+                        return -EBADMSG;
+
+                memcpy(t, value, 32);
+                t[32] = 0;
+
+                if (sd_id128_from_string(t, &e->boot_id) < 0)
+                        return -EBADMSG;
+
+                e->boot_id_set = true;
+        }
+
+        l = name_length + 1 + value_length;
+
+        if (!GREEDY_REALLOC(imp->iovec, imp->iovec_allocated, imp->n_iovec + 1) ||
+            !GREEDY_REALLOC(imp->data, imp->data_allocated, imp->data_size + l))
+                return log_oom();
+
+        memcpy(imp->data + imp->data_size, name, name_length);
+        imp->data[imp->data_size + name_length] = '=';
+        memcpy(imp->data + imp->data_size + name_length + 1, value, value_length);
+
+        imp->iovec[imp->n_iovec].iov_base = (void*) imp->data_size;
+        imp->iovec[imp->n_iovec].iov_len = l;
+        imp->n_iovec++;
+
+        imp->data_size += l;
+
+        return 0;
+}
+
+static int importer_begin_entry(Importer *imp) {
+        assert(imp);
+
+        if (!GREEDY_REALLOC(imp->entries, imp->entries_allocated, imp->n_entries + 1))
+                return log_oom();
+
+        zero(imp->entries[imp->n_entries]);
+        imp->entries[imp->n_entries].first_iovec = imp->n_iovec;
+
+        return 0;
+}
+
+static void importer_drop_entry(Importer *imp) {
+        ImportEntry *e;
+
+        assert(imp);
+
+        e = imp->entries + imp->n_entries;
+
+        if (e->first_iovec < imp->n_iovec)
+                imp->data_size = (size_t) imp->iovec[e->first_iovec].iov_base;
+        imp->n_iovec = e->first_iovec;
+}
+
+static int importer_open_file(Importer *imp) {
+        JournalMetrics metrics = {
+                .max_use = (uint64_t) -1,
+                .max_size = (uint64_t) -1,
+                .min_size = (uint64_t) -1,
+                .keep_free = (uint64_t) -1,
+        };
+        int r;
+
+        assert(imp);
+
+        r = journal_file_open_reliably(arg_output, O_RDWR|O_CREAT, 0640, arg_compress, false, &metrics, NULL, NULL, &imp->file);
+        if (r < 0)
+                log_error("Failed to open %s: %s", arg_output, strerror(-r));
+
+        return r;
+}
+
+static int importer_rotate(Importer *imp) {
+        int r;
+
+        assert(imp);
+
+        r = journal_file_rotate(&imp->file, arg_compress, false);
+        if (r < 0) {
+                log_error("Failed to rotate %s: %s", arg_output, strerror(-r));
+                return r;
+        }
+
+        return 0;
+}
+
+static int importer_write(Importer *imp) {
+        JournalAppendEntry *entries;
+        unsigned i, n, k;
+        bool rotated = false;
+        int r;
+
+        assert(imp);
+
+        if (imp->n_entries <= 0)
+                return 0;
+
+        if (!GREEDY_REALLOC(imp->append, imp->append_allocated, imp->n_entries))
+                return log_oom();
+
+        for (i = 0; i < imp->n_iovec; i++)
+                imp->iovec[i].iov_base = imp->data + (size_t) imp->iovec[i].iov_base;
+
+        for (i = 0; i < imp->n_entries; i++) {
+                ImportEntry *e = imp->entries + i;
+
+                imp->append[i] = (JournalAppendEntry) {
+                        .ts = e->ts,
+                        .iovec = imp->iovec + e->first_iovec,
+                        .n_iovec = (i + 1 < imp->n_entries ? imp->entries[i+1].first_iovec : imp->n_iovec) - e->first_iovec,
+                        .boot_id = e->boot_id_set ? &e->boot_id : NULL,
+                };
+        }
+
+        entries = imp->append;
+        n = imp->n_entries;
+
+        while (n > 0) {
+                ImportEntry *e = imp->entries + (entries - imp->append);
+                JournalFile *f = imp->file;
+
+                /* A new file takes the sequence number space over
+                 * from the first entry written to it, files created
+                 * by rotation keep the one of their predecessor */
+                if (le64toh(f->header->n_entries) == 0 &&
+                    le64toh(f->header->tail_entry_seqnum) == 0 &&
+                    e->seqnum > 0)
+                        f->header->seqnum_id = e->seqnum_id;
+
+                for (i = 0; i < n; i++)
+                        entries[i].seqnum = sd_id128_equal(e[i].seqnum_id, f->header->seqnum_id) ? e[i].seqnum : 0;
+
+                if (!rotated && journal_file_rotate_suggested(f, 0)) {
+                        log_debug("%s: Journal header limits reached or header out-of-date, rotating.", f->path);
+
+                        r = importer_rotate(imp);
+                        if (r < 0)
+                                return r;
+
+                        rotated = true;
+                        continue;
+                }
+
+                r = journal_file_append_entries(f, entries, n, NULL, &k);
+
+                imp->n_imported += k;
+                entries += k;
+                n -= k;
+
+                /* Only an entry that fails on a file that has not
+                 * taken any since the rotation doesn't fit at all */
+                if (k > 0)
+                        rotated = false;
+
+                if (r >= 0)
+                        break;
+
+                if (r == -E2BIG || r == -EFBIG || r == -EDQUOT || r == -ENOSPC) {
+                        if (rotated) {
+                                log_error("%s: Entry does not fit into an empty file, ignoring: %s", f->path, strerror(-r));
+                                goto skip;
+                        }
+
+                        log_debug("%s: Allocation limit reached, rotating.", f->path);
+
+                        r = importer_rotate(imp);
+                        if (r < 0)
+                                return r;
+
+                        rotated = true;
+                        continue;
+                }
+
+                if (r != -EINVAL) {
+                        log_error("%s: Failed to write entry: %s", f->path, strerror(-r));
+                        return r;
+                }
+
+                log_debug("%s: Entry goes back in time, ignoring.", imp->name);
+
+        skip:
+                imp->n_skipped++;
+                entries++;
+                n--;
+                rotated = false;
+        }
+
+        imp->n_entries = imp->n_iovec = 0;
+        imp->data_size = 0;
+
+        return 0;
+}
+
+static int importer_end_entry(Importer *imp) {
+        ImportEntry *e;
+        int r;
+
+        assert(imp);
+
+        e = imp->entries + imp->n_entries;
+
+        if (e->realtime_set && e->first_iovec < imp->n_iovec)
+                imp->n_entries++;
+        else if (e->realtime_set || e->first_iovec < imp->n_iovec) {
+                log_warning("%s: Entry without timestamp or fields, ignoring.", imp->name);
+                importer_drop_entry(imp);
+                imp->n_skipped++;
+        }
+
+        if (imp->n_entries >= BATCH_ENTRIES_MAX ||
+            imp->data_size >= BATCH_DATA_MAX) {
+                r = importer_write(imp);
+                if (r < 0)
+                        return r;
+        }
+
+        return importer_begin_entry(imp);
+}
+
+static int importer_process(Importer *imp) {
+        int r;
+
+        assert(imp);
+
+        r = importer_begin_entry(imp);
+        if (r < 0)
+                return r;
+
+        for (;;) {
+                const char *line, *eq;
+                size_t length;
+
+                r = importer_line(imp, &line, &length);
+                if (r < 0)
+                        return r;
+                if (r == 0)
+                        break;
+
+                if (length == 0) {
+                        r = importer_end_entry(imp);
+                        if (r < 0)
+                                return r;
+
+                        continue;
+                }
+
+                eq = memchr(line, '=', length);
+                if (eq)
+                        r = importer_add_field(imp, line, eq - line, eq + 1, length - (eq - line) - 1);
+                else {
+                        char name[FIELD_NAME_MAX];
+                        le64_t le64;
+                        size_t l;
+
+                        /* Binary field: the name is followed by
+                         * the little-endian size of the data, the
+                         * data itself, and a newline. Reading on
+                         * might move the buffer, hence save the
+                         * name first. */
+                        if (length <= sizeof(name))
+                                memcpy(name, line, length);
+
+                        r = importer_fill(imp, sizeof(le64));
+                        if (r < 0)
+                                return r;
+                        if (r == 0)
+                                goto truncated;
+
+                        memcpy(&le64, imp->buf + imp->buf_start, sizeof(le64));
+                        if (le64toh(le64) > DATA_SIZE_MAX) {
+                                log_error("%s: Binary field too large.", imp->name);
+                                return -E2BIG;
+                        }
+
+                        l = (size_t) le64toh(le64);
+
+                        r = importer_fill(imp, sizeof(le64) + l + 1);
+                        if (r < 0)
+                                return r;
+                        if (r == 0)
+                                goto truncated;
+
+                        if (imp->buf[imp->buf_start + sizeof(le64) + l] != '\n') {
+                                log_error("%s: Binary field not followed by newline.", imp->name);
+                                return -EBADMSG;
+                        }
+
+                        if (length <= sizeof(name))
+                                r = importer_add_field(imp, name, length, imp->buf + imp->buf_start + sizeof(le64), l);
+                        else {
+                                log_warning("%s: Invalid field name, ignoring field.", imp->name);
+                                r = 0;
+                        }
+
+                        imp->buf_start += sizeof(le64) + l + 1;
+                }
+
+                if (r < 0) {
+                        if (r == -EBADMSG)
+                                log_error("%s: Invalid field value.", imp->name);
+                        return r;
+                }
+        }
+
+        r = importer_end_entry(imp);
+        if (r < 0)
+                return r;
+
+        return importer_write(imp);
+
+truncated:
+        log_error("%s: Stream ends within a binary field.", imp->name);
+        return -EBADMSG;
+}
+
+static int help(void) {
+
+        printf("%s [OPTIONS...] [FILE...]\n\n"
+               "Write journal entries in export format into a journal file.\n\n"
+               "  -h --help              Show this help\n"
+               "     --version           Show package version\n"
+               "  -o --output=FILE       Journal file to write to\n"
+               "     --compress=BOOL     Compress large fields (default: yes)\n",
+               program_invocation_short_name);
+
+        return 0;
+}
+
+static int parse_argv(int argc, char *argv[]) {
+
+        enum {
+                ARG_VERSION = 0x100,
+                ARG_COMPRESS
+        };
+
+        static const struct option options[] = {
+                { "help",      no_argument,       NULL, 'h'          },
+                { "version",   no_argument,       NULL, ARG_VERSION  },
+                { "output",    required_argument, NULL, 'o'          },
+                { "compress",  required_argument, NULL, ARG_COMPRESS },
+                { NULL,        0,                 NULL, 0            }
+        };
+
+        int c, r;
+
+        assert(argc >= 0);
+        assert(argv);
+
+        while ((c = getopt_long(argc, argv, "ho:", options, NULL)) >= 0) {
+
+                switch (c) {
+
+                case 'h':
+                        help();
+                        return 0;
+
+                case ARG_VERSION:
+                        puts(PACKAGE_STRING);
+                        puts(SYSTEMD_FEATURES);
+                        return 0;
+
+                case 'o':
+                        arg_output = optarg;
+                        break;
+
+                case ARG_COMPRESS:
+                        r = parse_boolean(optarg);
+                        if (r < 0) {
+                                log_error("Failed to parse compression setting: %s", optarg);
+                                return -EINVAL;
+                        }
+
+                        arg_compress = r;
+                        break;
+
+                case '?':
+                        return -EINVAL;
+
+                default:
+                        log_error("Unknown option code %c", c);
+                        return -EINVAL;
+                }
+        }
+
+        if (!arg_output) {
+                log_error("No output file specified, use --output=.");
+                return -EINVAL;
+        }
+
+        if (!endswith(arg_output, ".journal")) {
+                log_error("Output file name must end in .journal.");
+                return -EINVAL;
+        }
+
+        return 1;
+}
+
+int main(int argc, char *argv[]) {
+        Importer imp = {
+                .fd = -1,
+        };
+        int r, i;
+
+        log_parse_environment();
+        log_open();
+
+        r = parse_argv(argc, argv);
+        if (r <= 0)
+                goto finish;
+
+        r = importer_open_file(&imp);
+        if (r < 0)
+                goto finish;
+
+        for (i = optind; i < argc || i == optind; i++) {
+                bool use_stdin = i >= argc || streq(argv[i], "-");
+
+                imp.name = use_stdin ? "stdin" : argv[i];
+
+                if (use_stdin)
+                        imp.fd = STDIN_FILENO;
+                else {
+                        imp.fd = open(argv[i], O_RDONLY|O_CLOEXEC|O_NOCTTY);
+                        if (imp.fd < 0) {
+                                log_error("Failed to open %s: %m", argv[i]);
+                                r = -errno;
+                                goto finish;
+                        }
+                }
+
+                imp.buf_start = imp.buf_end = 0;
+                imp.eof = false;
+
+                r = importer_process(&imp);
+
+                if (!use_stdin)
+                        close_nointr_nofail(imp.fd);
+
+                if (r < 0)
+                        goto finish;
+        }
+
+        log_info("Imported %"PRIu64" entries, skipped %"PRIu64".", imp.n_imported, imp.n_skipped);
+
+finish:
+        if (imp.file)
+                journal_file_close(imp.file);
+
+        free(imp.buf);
+        free(imp.entries);
+        free(imp.append);
+        free(imp.iovec);
+        free(imp.data);
+
+        return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
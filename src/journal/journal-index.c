@@ -0,0 +1,579 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  Copyright 2013 Lennart Poettering
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "macro.h"
+#include "journal-def.h"
+#include "journal-file.h"
+#include "journal-index.h"
+#include "compress.h"
+#include "lookup3.h"
+
+/* Fields with at most this many values are always indexed, fields
+ * with more only if the average value is used by at least this many
+ * entries. This keeps fields like MESSAGE= whose values are mostly
+ * unique out of the index. */
+#define INDEX_VALUES_MIN 1024ULL
+#define INDEX_VALUES_RATIO 16ULL
+
+struct JournalIndex {
+        IndexHeader *header;
+        uint64_t size;
+
+        IndexField *fields;
+        uint64_t n_fields;
+
+        IndexValue *values;
+        uint64_t n_values;
+};
+
+typedef struct IndexBuilder {
+        IndexField *fields;
+        size_t n_fields, fields_allocated;
+
+        IndexValue *values;
+        size_t n_values, values_allocated;
+
+        uint8_t *arena;
+        size_t arena_size, arena_allocated;
+
+        void *buffer;
+        uint64_t buffer_size;
+} IndexBuilder;
+
+char *journal_index_path(const char *journal_path) {
+        assert(journal_path);
+
+        return strappend(journal_path, INDEX_SUFFIX);
+}
+
+static int builder_add_payload(IndexBuilder *b, const void *data, uint64_t size, uint64_t *offset) {
+        size_t n;
+
+        assert(b);
+        assert(data || size == 0);
+        assert(offset);
+
+        if (size > (uint64_t) (SIZE_MAX - b->arena_size - 8))
+                return -E2BIG;
+
+        n = (size_t) ALIGN64(b->arena_size + size);
+        if (!GREEDY_REALLOC(b->arena, b->arena_allocated, n))
+                return -ENOMEM;
+
+        memcpy(b->arena + b->arena_size, data, size);
+        memzero(b->arena + b->arena_size + size, n - b->arena_size - size);
+
+        *offset = b->arena_size;
+        b->arena_size = n;
+
+        return 0;
+}
+
+static int value_compare(const void *_a, const void *_b) {
+        const IndexValue *a = _a, *b = _b;
+
+        if (le64toh(a->hash) < le64toh(b->hash))
+                return -1;
+        if (le64toh(a->hash) > le64toh(b->hash))
+                return 1;
+
+        return 0;
+}
+
+static int field_compare(const void *_a, const void *_b) {
+        const IndexField *a = _a, *b = _b;
+
+        if (le64toh(a->hash) < le64toh(b->hash))
+                return -1;
+        if (le64toh(a->hash) > le64toh(b->hash))
+                return 1;
+
+        return 0;
+}
+
+static int builder_add_value(JournalFile *f, IndexBuilder *b, uint64_t p, uint64_t *next) {
+        IndexValue *v;
+        Object *o;
+        uint64_t l, n, offset;
+        const void *payload;
+        int r;
+
+        r = journal_file_move_to_object(f, OBJECT_DATA, p, &o);
+        if (r < 0)
+                return r;
+
+        if (!GREEDY_REALLOC(b->values, b->values_allocated, (b->n_values + 1) * sizeof(IndexValue)))
+                return -ENOMEM;
+
+        v = b->values + b->n_values;
+        zero(*v);
+
+        v->hash = o->data.hash;
+        v->n_entries = o->data.n_entries;
+
+        *next = le64toh(o->data.next_field_offset);
+        n = le64toh(o->data.n_entries);
+
+        l = le64toh(o->object.size) - offsetof(Object, data.payload);
+        payload = o->data.payload;
+
+        if (o->object.flags & OBJECT_COMPRESSION_MASK) {
+                uint64_t rsize;
+
+                r = uncompress_blob(o->object.flags & OBJECT_COMPRESSION_MASK,
+                                    o->data.payload, l, &b->buffer, &b->buffer_size, &rsize, 0);
+                if (r < 0)
+                        return r;
+
+                payload = b->buffer;
+                l = rsize;
+        }
+
+        r = builder_add_payload(b, payload, l, &offset);
+        if (r < 0)
+                return r;
+
+        v->payload_offset = htole64(offset);
+        v->payload_size = htole64(l);
+
+        if (n > 0) {
+                r = journal_file_next_entry_for_data(f, NULL, 0, p, DIRECTION_DOWN, &o, NULL);
+                if (r < 0)
+                        return r;
+                if (r > 0)
+                        v->first_realtime = o->entry.realtime;
+
+                r = journal_file_next_entry_for_data(f, NULL, 0, p, DIRECTION_UP, &o, NULL);
+                if (r < 0)
+                        return r;
+                if (r > 0)
+                        v->last_realtime = o->entry.realtime;
+        }
+
+        b->n_values++;
+        return 0;
+}
+
+static int builder_add_field(JournalFile *f, IndexBuilder *b, uint64_t p, uint64_t *next) {
+        IndexField *field;
+        Object *o;
+        uint64_t head, q, n = 0, max, first, offset, l;
+        int r;
+
+        r = journal_file_move_to_object(f, OBJECT_FIELD, p, &o);
+        if (r < 0)
+                return r;
+
+        if (!GREEDY_REALLOC(b->fields, b->fields_allocated, (b->n_fields + 1) * sizeof(IndexField)))
+                return -ENOMEM;
+
+        field = b->fields + b->n_fields;
+        zero(*field);
+
+        l = le64toh(o->object.size) - offsetof(Object, field.payload);
+        r = builder_add_payload(b, o->field.payload, l, &offset);
+        if (r < 0)
+                return r;
+
+        field->hash = o->field.hash;
+        field->name_offset = htole64(offset);
+        field->name_size = htole64(l);
+
+        *next = le64toh(o->field.next_hash_offset);
+        head = le64toh(o->field.head_data_offset);
+
+        b->n_fields++;
+
+        /* Count the values first, so that we can leave out fields
+         * whose values are mostly unique */
+        max = MAX(INDEX_VALUES_MIN, le64toh(f->header->n_entries) / INDEX_VALUES_RATIO);
+        for (q = head; q > 0 && n <= max; n++) {
+                r = journal_file_move_to_object(f, OBJECT_DATA, q, &o);
+                if (r < 0)
+                        return r;
+
+                q = le64toh(o->data.next_field_offset);
+        }
+
+        if (n > max)
+                return 0;
+
+        first = b->n_values;
+        for (q = head; q > 0; ) {
+                r = builder_add_value(f, b, q, &q);
+                if (r < 0)
+                        return r;
+        }
+
+        field->flags = htole64(INDEX_FIELD_HAS_VALUES);
+        field->values_index = htole64(first);
+        field->n_values = htole64(b->n_values - first);
+
+        qsort(b->values + first, b->n_values - first, sizeof(IndexValue), value_compare);
+
+        return 0;
+}
+
+static int builder_write(JournalFile *f, IndexBuilder *b, const char *path) {
+        _cleanup_fclose_ FILE *file = NULL;
+        _cleanup_free_ char *t = NULL;
+        IndexHeader h = {};
+        uint64_t arena_offset;
+        size_t i;
+        int r;
+
+        memcpy(h.signature, INDEX_SIGNATURE, 8);
+        h.header_size = htole64(sizeof(IndexHeader));
+        h.file_id = f->header->file_id;
+        h.n_entries = f->header->n_entries;
+        h.tail_entry_seqnum = f->header->tail_entry_seqnum;
+        h.fields_offset = htole64(sizeof(IndexHeader));
+        h.n_fields = htole64(b->n_fields);
+        h.values_offset = htole64(sizeof(IndexHeader) + b->n_fields * sizeof(IndexField));
+        h.n_values = htole64(b->n_values);
+
+        arena_offset = le64toh(h.values_offset) + b->n_values * sizeof(IndexValue);
+        h.file_size = htole64(arena_offset + b->arena_size);
+
+        for (i = 0; i < b->n_fields; i++)
+                b->fields[i].name_offset = htole64(le64toh(b->fields[i].name_offset) + arena_offset);
+        for (i = 0; i < b->n_values; i++)
+                b->values[i].payload_offset = htole64(le64toh(b->values[i].payload_offset) + arena_offset);
+
+        r = fopen_temporary(path, &file, &t);
+        if (r < 0)
+                return r;
+
+        fchmod(fileno(file), f->mode & 0666);
+
+        fwrite(&h, 1, sizeof(h), file);
+        fwrite(b->fields, sizeof(IndexField), b->n_fields, file);
+        fwrite(b->values, sizeof(IndexValue), b->n_values, file);
+        if (b->arena_size > 0)
+                fwrite(b->arena, 1, b->arena_size, file);
+
+        fflush(file);
+        if (ferror(file))
+                r = -EIO;
+        else if (rename(t, path) < 0)
+                r = -errno;
+
+        if (r < 0)
+                unlink(t);
+
+        return r;
+}
+
+int journal_index_write(JournalFile *f, const char *path) {
+        IndexBuilder b = {};
+        uint64_t i, n;
+        int r = 0;
+
+        assert(f);
+        assert(path);
+
+        /* Walks all fields of the file via the field hash table,
+         * and writes out their names and, where it makes sense,
+         * their values. */
+
+        r = journal_file_map_field_hash_table(f);
+        if (r < 0)
+                return r;
+
+        n = le64toh(f->header->field_hash_table_size) / sizeof(HashItem);
+        for (i = 0; i < n; i++) {
+                uint64_t p;
+
+                p = le64toh(f->field_hash_table[i].head_hash_offset);
+                while (p > 0) {
+                        r = builder_add_field(f, &b, p, &p);
+                        if (r < 0)
+                                goto finish;
+                }
+        }
+
+        qsort(b.fields, b.n_fields, sizeof(IndexField), field_compare);
+
+        r = builder_write(f, &b, path);
+
+finish:
+        free(b.fields);
+        free(b.values);
+        free(b.arena);
+        free(b.buffer);
+
+        return r;
+}
+
+int journal_index_open(const char *path, JournalFile *f, JournalIndex **ret) {
+        _cleanup_close_ int fd = -1;
+        JournalIndex *i;
+        IndexHeader *h;
+        struct stat st;
+        void *p;
+        uint64_t header_size;
+        int r;
+
+        assert(path);
+        assert(f);
+        assert(ret);
+
+        fd = open(path, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+        if (fd < 0)
+                return -errno;
+
+        if (fstat(fd, &st) < 0)
+                return -errno;
+
+        if ((uint64_t) st.st_size < sizeof(IndexHeader) ||
+            (uint64_t) (size_t) st.st_size != (uint64_t) st.st_size)
+                return -EBADMSG;
+
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+                return -errno;
+
+        h = p;
+        header_size = le64toh(h->header_size);
+
+        if (memcmp(h->signature, INDEX_SIGNATURE, 8) != 0 ||
+            header_size < sizeof(IndexHeader) ||
+            le64toh(h->file_size) != (uint64_t) st.st_size) {
+                r = -EBADMSG;
+                goto fail;
+        }
+
+        if (le32toh(h->incompatible_flags) != 0) {
+                r = -EPROTONOSUPPORT;
+                goto fail;
+        }
+
+        /* Make sure the index belongs to this very file, and the file
+         * has not changed since it was written. */
+        if (!sd_id128_equal(h->file_id, f->header->file_id) ||
+            h->n_entries != f->header->n_entries ||
+            h->tail_entry_seqnum != f->header->tail_entry_seqnum) {
+                r = -ESTALE;
+                goto fail;
+        }
+
+        if (!VALID64(le64toh(h->fields_offset)) ||
+            !VALID64(le64toh(h->values_offset)) ||
+            le64toh(h->fields_offset) < header_size ||
+            le64toh(h->fields_offset) > (uint64_t) st.st_size ||
+            le64toh(h->n_fields) > ((uint64_t) st.st_size - le64toh(h->fields_offset)) / sizeof(IndexField) ||
+            le64toh(h->values_offset) < header_size ||
+            le64toh(h->values_offset) > (uint64_t) st.st_size ||
+            le64toh(h->n_values) > ((uint64_t) st.st_size - le64toh(h->values_offset)) / sizeof(IndexValue)) {
+                r = -EBADMSG;
+                goto fail;
+        }
+
+        i = new0(JournalIndex, 1);
+        if (!i) {
+                r = -ENOMEM;
+                goto fail;
+        }
+
+        i->header = h;
+        i->size = st.st_size;
+        i->fields = (IndexField*) ((uint8_t*) p + le64toh(h->fields_offset));
+        i->n_fields = le64toh(h->n_fields);
+        i->values = (IndexValue*) ((uint8_t*) p + le64toh(h->values_offset));
+        i->n_values = le64toh(h->n_values);
+
+        *ret = i;
+        return 0;
+
+fail:
+        munmap(p, st.st_size);
+        return r;
+}
+
+void journal_index_close(JournalIndex *i) {
+        if (!i)
+                return;
+
+        munmap(i->header, i->size);
+        free(i);
+}
+
+static int get_payload(JournalIndex *i, uint64_t offset, uint64_t size, const void **data) {
+        assert(i);
+        assert(data);
+
+        if (offset < le64toh(i->header->header_size) ||
+            offset > i->size ||
+            size > i->size - offset)
+                return -EBADMSG;
+
+        *data = (const uint8_t*) i->header + offset;
+        return 0;
+}
+
+int journal_index_find_field(JournalIndex *i, const void *field, uint64_t size, IndexField **ret) {
+        uint64_t hash, a, b;
+
+        assert(i);
+        assert(field);
+
+        /* Returns 1 and the field if the journal file contains it, 0
+         * if it does not. */
+
+        hash = hash64(field, size);
+
+        /* Find the first field with a matching hash */
+        a = 0;
+        b = i->n_fields;
+        while (a < b) {
+                uint64_t c = (a + b) / 2;
+
+                if (le64toh(i->fields[c].hash) < hash)
+                        a = c + 1;
+                else
+                        b = c;
+        }
+
+        for (; a < i->n_fields && le64toh(i->fields[a].hash) == hash; a++) {
+                const void *name;
+                int r;
+
+                if (le64toh(i->fields[a].name_size) != size)
+                        continue;
+
+                r = get_payload(i, le64toh(i->fields[a].name_offset), size, &name);
+                if (r < 0)
+                        return r;
+
+                if (memcmp(name, field, size) == 0) {
+                        if (ret)
+                                *ret = i->fields + a;
+
+                        return 1;
+                }
+        }
+
+        return 0;
+}
+
+int journal_index_get_value(JournalIndex *i, IndexField *field, uint64_t k, IndexValue **ret) {
+        uint64_t first, n;
+
+        assert(i);
+        assert(field);
+        assert(ret);
+
+        if (!(le64toh(field->flags) & INDEX_FIELD_HAS_VALUES))
+                return -ENOENT;
+
+        first = le64toh(field->values_index);
+        n = le64toh(field->n_values);
+
+        if (first > i->n_values || n > i->n_values - first)
+                return -EBADMSG;
+
+        if (k >= n)
+                return 0;
+
+        *ret = i->values + first + k;
+        return 1;
+}
+
+int journal_index_find_data(JournalIndex *i, IndexField *field, const void *data, uint64_t size, uint64_t hash, IndexValue **ret) {
+        uint64_t first, n, a, b;
+
+        assert(i);
+        assert(field);
+        assert(data);
+
+        /* Returns 1 and the value if the journal file contains the
+         * data, 0 if it does not, and -ENOENT if the values of this
+         * field were not indexed. */
+
+        if (!(le64toh(field->flags) & INDEX_FIELD_HAS_VALUES))
+                return -ENOENT;
+
+        first = le64toh(field->values_index);
+        n = le64toh(field->n_values);
+
+        if (first > i->n_values || n > i->n_values - first)
+                return -EBADMSG;
+
+        a = first;
+        b = first + n;
+        while (a < b) {
+                uint64_t c = (a + b) / 2;
+
+                if (le64toh(i->values[c].hash) < hash)
+                        a = c + 1;
+                else
+                        b = c;
+        }
+
+        for (; a < first + n && le64toh(i->values[a].hash) == hash; a++) {
+                const void *payload;
+                int r;
+
+                if (le64toh(i->values[a].payload_size) != size)
+                        continue;
+
+                r = get_payload(i, le64toh(i->values[a].payload_offset), size, &payload);
+                if (r < 0)
+                        return r;
+
+                if (memcmp(payload, data, size) == 0) {
+                        if (ret)
+                                *ret = i->values + a;
+
+                        return 1;
+                }
+        }
+
+        return 0;
+}
+
+int journal_index_get_payload(JournalIndex *i, IndexValue *v, const void **data, size_t *size) {
+        uint64_t l;
+        int r;
+
+        assert(i);
+        assert(v);
+        assert(data);
+        assert(size);
+
+        l = le64toh(v->payload_size);
+        if ((uint64_t) (size_t) l != l)
+                return -E2BIG;
+
+        r = get_payload(i, le64toh(v->payload_offset), l, data);
+        if (r < 0)
+                return r;
+
+        *size = (size_t) l;
+        return 0;
+}
@@ -0,0 +1,103 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+#pragma once
+
+/***
+  This file is part of systemd.
+
+  Copyright 2013 Lennart Poettering
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <inttypes.h>
+
+#include <systemd/sd-id128.h>
+
+#include "sparse-endian.h"
+#include "macro.h"
+
+/* The index is a sidecar file written next to an archived journal
+ * file when it is rotated. It lists the fields of the journal file,
+ * and for fields with not too many distinct values also the values
+ * themselves, together with the wallclock range they were used
+ * in. Since archived files never change, readers can use it to
+ * enumerate unique values and to skip files that cannot contain any
+ * entry matching a filter without looking at the journal file
+ * itself.
+ *
+ * Layout: header, sorted field array, value array (the values of
+ * each field are contiguous and sorted by hash), then the payloads
+ * of field names and values. */
+
+#define INDEX_SIGNATURE ((char[]) { 'L', 'P', 'K', 'S', 'H', 'I', 'D', 'X' })
+
+#define INDEX_SUFFIX ".index"
+
+enum {
+        INDEX_FIELD_HAS_VALUES = 1
+};
+
+typedef struct IndexHeader {
+        uint8_t signature[8]; /* "LPKSHIDX" */
+        le32_t compatible_flags;
+        le32_t incompatible_flags;
+        le64_t header_size;
+        le64_t file_size;
+
+        /* Identifies the journal file this index was written for */
+        sd_id128_t file_id;
+        le64_t n_entries;
+        le64_t tail_entry_seqnum;
+
+        le64_t fields_offset;
+        le64_t n_fields;
+        le64_t values_offset;
+        le64_t n_values;
+} _packed_ IndexHeader;
+
+typedef struct IndexField {
+        le64_t hash;
+        le64_t name_offset;
+        le64_t name_size;
+        le64_t flags;
+        le64_t values_index;
+        le64_t n_values;
+} _packed_ IndexField;
+
+typedef struct IndexValue {
+        le64_t hash;
+        le64_t payload_offset;
+        le64_t payload_size;
+        le64_t n_entries;
+        le64_t first_realtime;
+        le64_t last_realtime;
+} _packed_ IndexValue;
+
+typedef struct JournalIndex JournalIndex;
+
+struct JournalFile;
+
+char *journal_index_path(const char *journal_path);
+
+int journal_index_write(struct JournalFile *f, const char *path);
+
+int journal_index_open(const char *path, struct JournalFile *f, JournalIndex **ret);
+void journal_index_close(JournalIndex *i);
+
+int journal_index_find_field(JournalIndex *i, const void *field, uint64_t size, IndexField **ret);
+int journal_index_find_data(JournalIndex *i, IndexField *field, const void *data, uint64_t size, uint64_t hash, IndexValue **ret);
+
+int journal_index_get_value(JournalIndex *i, IndexField *field, uint64_t k, IndexValue **ret);
+int journal_index_get_payload(JournalIndex *i, IndexValue *v, const void **data, size_t *size);
@@ -31,11 +31,13 @@
 #include "list.h"
 #include "hashmap.h"
 #include "set.h"
+#include "prioq.h"
 #include "journal-file.h"
 
 typedef struct Match Match;
 typedef struct Location Location;
 typedef struct Directory Directory;
+typedef struct PendingFile PendingFile;
 
 typedef enum MatchType {
         MATCH_DISCRETE,
@@ -96,12 +98,34 @@ struct Directory {
         bool is_root;
 };
 
+/* An archived file that was found but not opened yet, and a copy of
+ * its header */
+struct PendingFile {
+        char *path;
+        Header header;
+};
+
 struct sd_journal {
         char *path;
 
         Hashmap *files;
         MMapCache *mmap;
 
+        /* Archived files are only opened once something might need
+         * them. pending_by_tail orders them by the wallclock time of
+         * their last entry, and is rebuilt when needed. */
+        Hashmap *pending_files;
+        PendingFile **pending_by_tail;
+        bool pending_by_tail_valid;
+
+        /* Files with an entry beyond the current location, ordered
+         * by that entry, and files that have none right now but
+         * might get one when written to */
+        Prioq *merge;
+        direction_t merge_direction;
+        bool merge_valid;
+        LIST_HEAD(JournalFile, merge_waiting);
+
         Location current_location;
 
         JournalFile *current_file;
@@ -115,6 +139,9 @@ struct sd_journal {
         unsigned current_invalidate_counter, last_invalidate_counter;
         usec_t last_process_usec;
 
+        /* The offset of the last data object returned from
+         * unique_file, or if the values are taken from the file's
+         * index, the number of values returned from it */
         char *unique_field;
         JournalFile *unique_file;
         uint64_t unique_offset;
@@ -133,7 +160,9 @@ struct sd_journal {
 };
 
 char *journal_make_match_string(sd_journal *j);
+int journal_open_pending_files(sd_journal *j);
 void journal_print_header(sd_journal *j);
+void journal_get_mmap_statistics(sd_journal *j, MMapCacheStatistics *ret);
 
 static inline void journal_closep(sd_journal **j) {
         sd_journal_close(*j);
@@ -31,9 +31,13 @@
 
 #include "journal-def.h"
 #include "journal-file.h"
+#include "journal-index.h"
 #include "journal-vacuum.h"
 #include "sd-id128.h"
 #include "util.h"
+#include "path-util.h"
+#include "hashmap.h"
+#include "prioq.h"
 
 struct vacuum_info {
         uint64_t usage;
@@ -44,6 +48,26 @@ struct vacuum_info {
         uint64_t seqnum;
 
         bool have_seqnum;
+
+        unsigned idx;
+};
+
+struct JournalVacuum {
+        char *directory;
+        int dir_fd;
+
+        /* All archived files we know of, by name, and ordered by
+         * age */
+        Hashmap *files;
+        Prioq *queue;
+        uint64_t usage;
+
+        /* The directory is read in steps, too. Meanwhile we add up
+         * the disk usage of all journal files in it, archived or
+         * not. */
+        DIR *scan;
+        bool scanned;
+        uint64_t scan_usage;
 };
 
 static int vacuum_compare(const void *_a, const void *_b) {
@@ -129,7 +153,8 @@ static void patch_realtime(
 }
 
 static int journal_file_empty(int dir_fd, const char *name) {
-        int fd, r;
+        _cleanup_close_ int fd = -1;
+        int r;
         le64_t n_entries;
 
         fd = openat(dir_fd, name, O_RDONLY|O_CLOEXEC|O_NOFOLLOW|O_NONBLOCK);
@@ -146,187 +171,559 @@ static int journal_file_empty(int dir_fd, const char *name) {
         return le64toh(n_entries) == 0;
 }
 
-int journal_directory_vacuum(
+static uint64_t index_usage(int dir_fd, const char *name) {
+        _cleanup_free_ char *p = NULL;
+        struct stat st;
+
+        p = journal_index_path(name);
+        if (!p)
+                return 0;
+
+        if (fstatat(dir_fd, p, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                return 0;
+
+        return 512UL * (uint64_t) st.st_blocks;
+}
+
+static uint64_t unlink_index(int dir_fd, const char *directory, const char *name) {
+        _cleanup_free_ char *p = NULL;
+        struct stat st;
+
+        /* Returns the number of bytes freed */
+
+        p = journal_index_path(name);
+        if (!p)
+                return 0;
+
+        if (fstatat(dir_fd, p, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                return 0;
+
+        if (unlinkat(dir_fd, p, 0) < 0) {
+                if (errno != ENOENT)
+                        log_warning("Failed to delete %s/%s: %m", directory, p);
+                return 0;
+        }
+
+        log_debug("Deleted index %s/%s.", directory, p);
+        return 512UL * (uint64_t) st.st_blocks;
+}
+
+static void vacuum_info_free(struct vacuum_info *i) {
+        if (!i)
+                return;
+
+        free(i->filename);
+        free(i);
+}
+
+static int vacuum_info_new(
+                int dir_fd,
                 const char *directory,
-                uint64_t max_use,
-                uint64_t min_free,
-                usec_t max_retention_usec,
-                usec_t *oldest_usec) {
-
-        _cleanup_closedir_ DIR *d = NULL;
-        int r = 0;
-        struct vacuum_info *list = NULL;
-        unsigned n_list = 0, i;
-        size_t n_allocated = 0;
-        uint64_t sum = 0;
-        usec_t retention_limit = 0;
+                const char *name,
+                struct vacuum_info **ret,
+                uint64_t *usage,
+                uint64_t *freed) {
+
+        struct vacuum_info *i;
+        struct stat st;
+        size_t q;
+        char *p;
+        unsigned long long seqnum = 0, realtime;
+        sd_id128_t seqnum_id = {};
+        bool have_seqnum;
 
+        assert(dir_fd >= 0);
         assert(directory);
+        assert(name);
+        assert(ret);
+        assert(usage);
+        assert(freed);
 
-        if (max_use <= 0 && min_free <= 0 && max_retention_usec <= 0)
+        /* Returns 1 and the vacuum information if this is an
+         * archived journal file, and 0 if the entry shall be ignored
+         * or has been deleted right-away. The disk usage of journal
+         * files that remain is returned in any case, including that
+         * of their index. */
+
+        *usage = 0;
+
+        if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
                 return 0;
 
-        if (max_retention_usec > 0) {
-                retention_limit = now(CLOCK_REALTIME);
-                if (retention_limit > max_retention_usec)
-                        retention_limit -= max_retention_usec;
-                else
-                        max_retention_usec = retention_limit = 0;
+        if (!S_ISREG(st.st_mode))
+                return 0;
+
+        q = strlen(name);
+        p = strdupa(name);
+
+        if (endswith(p, ".journal") || endswith(p, ".journal~"))
+                *usage = 512UL * (uint64_t) st.st_blocks + index_usage(dir_fd, name);
+
+        if (endswith(p, ".journal")) {
+
+                /* Vacuum archived files */
+
+                if (q < 1 + 32 + 1 + 16 + 1 + 16 + 8)
+                        return 0;
+
+                if (p[q-8-16-1] != '-' ||
+                    p[q-8-16-1-16-1] != '-' ||
+                    p[q-8-16-1-16-1-32-1] != '@')
+                        return 0;
+
+                p[q-8-16-1-16-1] = 0;
+                if (sd_id128_from_string(p + q-8-16-1-16-1-32, &seqnum_id) < 0)
+                        return 0;
+
+                if (sscanf(p + q-8-16-1-16, "%16llx-%16llx.journal", &seqnum, &realtime) != 2)
+                        return 0;
+
+                have_seqnum = true;
+
+        } else if (endswith(p, ".journal~")) {
+                unsigned long long tmp;
+
+                /* Vacuum corrupted files */
+
+                if (q < 1 + 16 + 1 + 16 + 8 + 1)
+                        return 0;
+
+                if (p[q-1-8-16-1] != '-' ||
+                    p[q-1-8-16-1-16-1] != '@')
+                        return 0;
+
+                if (sscanf(p + q-1-8-16-1-16, "%16llx-%16llx.journal~", &realtime, &tmp) != 2)
+                        return 0;
+
+                have_seqnum = false;
+        } else if (endswith(p, ".journal" INDEX_SUFFIX)) {
+
+                /* Remove indexes whose journal file is gone */
+
+                p[q - strlen(INDEX_SUFFIX)] = 0;
+                if (faccessat(dir_fd, p, F_OK, AT_SYMLINK_NOFOLLOW) < 0 && errno == ENOENT)
+                        *freed += unlink_index(dir_fd, directory, p);
+
+                return 0;
+        } else
+                /* We do not vacuum active files or unknown files! */
+                return 0;
+
+        if (journal_file_empty(dir_fd, name) > 0) {
+
+                /* Always vacuum empty non-online files. */
+
+                if (unlinkat(dir_fd, name, 0) >= 0) {
+                        log_debug("Deleted empty journal %s/%s.", directory, name);
+                        *freed += 512UL * (uint64_t) st.st_blocks;
+                        *freed += unlink_index(dir_fd, directory, name);
+                        *usage = 0;
+                } else if (errno != ENOENT)
+                        log_warning("Failed to delete %s/%s: %m", directory, name);
+
+                return 0;
         }
 
-        d = opendir(directory);
-        if (!d)
-                return -errno;
+        patch_realtime(directory, name, &st, &realtime);
 
-        for (;;) {
-                int k;
-                struct dirent *de;
-                union dirent_storage buf;
-                size_t q;
-                struct stat st;
-                char *p;
-                unsigned long long seqnum = 0, realtime;
-                sd_id128_t seqnum_id;
-                bool have_seqnum;
-
-                k = readdir_r(d, &buf.de, &de);
-                if (k != 0) {
-                        r = -k;
-                        goto finish;
-                }
+        i = new0(struct vacuum_info, 1);
+        if (!i)
+                return -ENOMEM;
 
-                if (!de)
-                        break;
+        i->filename = strdup(name);
+        if (!i->filename) {
+                free(i);
+                return -ENOMEM;
+        }
 
-                if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
-                        continue;
+        i->usage = *usage;
+        i->seqnum = seqnum;
+        i->realtime = realtime;
+        i->seqnum_id = seqnum_id;
+        i->have_seqnum = have_seqnum;
 
-                if (!S_ISREG(st.st_mode))
-                        continue;
+        *ret = i;
+        return 1;
+}
+
+JournalVacuum *journal_vacuum_new(const char *directory) {
+        JournalVacuum *v;
+
+        assert(directory);
+
+        v = new0(JournalVacuum, 1);
+        if (!v)
+                return NULL;
+
+        v->dir_fd = -1;
+
+        v->directory = strdup(directory);
+        v->files = hashmap_new(string_hash_func, string_compare_func);
+        v->queue = prioq_new(vacuum_compare);
+        if (!v->directory || !v->files || !v->queue) {
+                journal_vacuum_free(v);
+                return NULL;
+        }
+
+        return v;
+}
+
+static int journal_vacuum_open(JournalVacuum *v) {
+        assert(v);
+
+        if (v->dir_fd < 0) {
+                v->dir_fd = open(v->directory, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+                if (v->dir_fd < 0)
+                        return -errno;
+        }
+
+        return v->dir_fd;
+}
 
-                q = strlen(de->d_name);
+static void journal_vacuum_clear(JournalVacuum *v) {
+        struct vacuum_info *i;
 
-                if (endswith(de->d_name, ".journal")) {
+        assert(v);
 
-                        /* Vacuum archived files */
+        while ((i = prioq_pop(v->queue))) {
+                hashmap_remove(v->files, i->filename);
+                vacuum_info_free(i);
+        }
+
+        v->usage = 0;
+        v->scan_usage = 0;
+
+        if (v->scan) {
+                closedir(v->scan);
+                v->scan = NULL;
+        }
+
+        if (v->dir_fd >= 0) {
+                close_nointr_nofail(v->dir_fd);
+                v->dir_fd = -1;
+        }
+
+        v->scanned = false;
+}
+
+void journal_vacuum_free(JournalVacuum *v) {
+        if (!v)
+                return;
+
+        if (v->queue && v->files)
+                journal_vacuum_clear(v);
+
+        prioq_free(v->queue);
+        hashmap_free(v->files);
+        free(v->directory);
+        free(v);
+}
+
+void journal_vacuum_rescan(JournalVacuum *v) {
+        assert(v);
+
+        /* Forgets everything we know, and starts over with reading
+         * the directory on the next step, to pick up changes made by
+         * others */
+
+        journal_vacuum_clear(v);
+}
+
+static int journal_vacuum_put(JournalVacuum *v, struct vacuum_info *i) {
+        int r;
+
+        assert(v);
+        assert(i);
+
+        r = hashmap_put(v->files, i->filename, i);
+        if (r < 0)
+                return r;
+
+        r = prioq_put(v->queue, i, &i->idx);
+        if (r < 0) {
+                hashmap_remove(v->files, i->filename);
+                return r;
+        }
+
+        v->usage += i->usage;
+        return 0;
+}
+
+static void journal_vacuum_remove(JournalVacuum *v, struct vacuum_info *i) {
+        assert(v);
+        assert(i);
+
+        prioq_remove(v->queue, i, &i->idx);
+        hashmap_remove(v->files, i->filename);
 
-                        if (q < 1 + 32 + 1 + 16 + 1 + 16 + 8)
-                                continue;
+        v->usage -= MIN(i->usage, v->usage);
+        vacuum_info_free(i);
+}
+
+int journal_vacuum_add(JournalVacuum *v, const char *path) {
+        struct vacuum_info *i = NULL;
+        const char *fn;
+        uint64_t usage, freed = 0;
+        int r, fd;
+
+        assert(v);
+        assert(path);
+
+        /* Registers a file that just has been archived, so that we
+         * don't have to read the whole directory again to learn
+         * about it */
+
+        fn = path_get_file_name(path);
+        if (hashmap_get(v->files, fn))
+                return 0;
+
+        fd = journal_vacuum_open(v);
+        if (fd < 0)
+                return fd;
+
+        r = vacuum_info_new(fd, v->directory, fn, &i, &usage, &freed);
+        if (r <= 0)
+                return r;
+
+        r = journal_vacuum_put(v, i);
+        if (r < 0)
+                vacuum_info_free(i);
+
+        return r;
+}
 
-                        if (de->d_name[q-8-16-1] != '-' ||
-                            de->d_name[q-8-16-1-16-1] != '-' ||
-                            de->d_name[q-8-16-1-16-1-32-1] != '@')
-                                continue;
+static int journal_vacuum_scan(JournalVacuum *v, unsigned *budget, uint64_t *freed) {
+        int r;
 
-                        p = strdup(de->d_name);
-                        if (!p) {
-                                r = -ENOMEM;
-                                goto finish;
-                        }
+        assert(v);
+        assert(budget);
+        assert(freed);
 
-                        de->d_name[q-8-16-1-16-1] = 0;
-                        if (sd_id128_from_string(de->d_name + q-8-16-1-16-1-32, &seqnum_id) < 0) {
-                                free(p);
-                                continue;
-                        }
+        /* Reads at most *budget directory entries, returns > 0 once
+         * the directory has been read completely */
 
-                        if (sscanf(de->d_name + q-8-16-1-16, "%16llx-%16llx.journal", &seqnum, &realtime) != 2) {
-                                free(p);
-                                continue;
-                        }
+        if (!v->scanned && !v->scan)
+                v->scan_usage = 0;
 
-                        have_seqnum = true;
+        if (v->scanned)
+                return 1;
 
-                } else if (endswith(de->d_name, ".journal~")) {
-                        unsigned long long tmp;
+        if (!v->scan) {
+                v->scan = opendir(v->directory);
+                if (!v->scan) {
+                        if (errno != ENOENT)
+                                return -errno;
 
-                        /* Vacuum corrupted files */
+                        /* Nothing to vacuum yet */
+                        v->scanned = true;
+                        return 1;
+                }
+        }
 
-                        if (q < 1 + 16 + 1 + 16 + 8 + 1)
-                                continue;
+        while (*budget > 0) {
+                struct dirent *de;
+                union dirent_storage buf;
+                struct vacuum_info *i;
+                uint64_t usage;
+                int k;
 
-                        if (de->d_name[q-1-8-16-1] != '-' ||
-                            de->d_name[q-1-8-16-1-16-1] != '@')
-                                continue;
+                k = readdir_r(v->scan, &buf.de, &de);
+                if (k != 0) {
+                        closedir(v->scan);
+                        v->scan = NULL;
+                        return -k;
+                }
 
-                        p = strdup(de->d_name);
-                        if (!p) {
-                                r = -ENOMEM;
-                                goto finish;
-                        }
+                if (!de) {
+                        closedir(v->scan);
+                        v->scan = NULL;
+                        v->scanned = true;
+                        return 1;
+                }
 
-                        if (sscanf(de->d_name + q-1-8-16-1-16, "%16llx-%16llx.journal~", &realtime, &tmp) != 2) {
-                                free(p);
-                                continue;
-                        }
+                (*budget)--;
 
-                        have_seqnum = false;
-                } else
-                        /* We do not vacuum active files or unknown files! */
+                /* Files archived meanwhile have been added already */
+                i = hashmap_get(v->files, de->d_name);
+                if (i) {
+                        v->scan_usage += i->usage;
                         continue;
+                }
 
-                if (journal_file_empty(dirfd(d), de->d_name)) {
+                r = vacuum_info_new(dirfd(v->scan), v->directory, de->d_name, &i, &usage, freed);
+                if (r < 0)
+                        return r;
 
-                        /* Always vacuum empty non-online files. */
+                v->scan_usage += usage;
 
-                        if (unlinkat(dirfd(d), de->d_name, 0) >= 0)
-                                log_debug("Deleted empty journal %s/%s.", directory, de->d_name);
-                        else if (errno != ENOENT)
-                                log_warning("Failed to delete %s/%s: %m", directory, de->d_name);
+                if (r == 0)
                         continue;
+
+                r = journal_vacuum_put(v, i);
+                if (r < 0) {
+                        vacuum_info_free(i);
+                        return r;
                 }
+        }
 
-                patch_realtime(directory, de->d_name, &st, &realtime);
+        return 0;
+}
 
-                GREEDY_REALLOC(list, n_allocated, n_list + 1);
+int journal_vacuum_step(
+                JournalVacuum *v,
+                uint64_t max_use,
+                uint64_t min_free,
+                usec_t max_retention_usec,
+                unsigned budget,
+                uint64_t *usage) {
 
-                list[n_list].filename = p;
-                list[n_list].usage = 512UL * (uint64_t) st.st_blocks;
-                list[n_list].seqnum = seqnum;
-                list[n_list].realtime = realtime;
-                list[n_list].seqnum_id = seqnum_id;
-                list[n_list].have_seqnum = have_seqnum;
+        struct vacuum_info *i;
+        usec_t retention_limit = 0;
+        uint64_t n_freed = 0;
+        bool rescanned = false;
+        int r, fd;
+
+        assert(v);
+
+        /* Does at most budget units of work, where reading a
+         * directory entry or deleting a file is one unit. Returns >
+         * 0 once the limits are met, and 0 if more work is left to
+         * do. Until the directory has been read completely, we
+         * cannot know which files are the oldest, hence nothing is
+         * deleted before that.
+         *
+         * If usage is passed, it is the caller's idea of the disk
+         * usage of the journal files in the directory. It is
+         * decreased by what we delete, and replaced by what we
+         * counted whenever we finish reading the directory, so that
+         * files others added or removed are accounted for. */
+
+        if (max_use <= 0 && min_free <= 0 && max_retention_usec <= 0) {
+                r = 1;
+                goto finish;
+        }
 
-                sum += list[n_list].usage;
+        rescanned = !v->scanned;
 
-                n_list ++;
+        r = journal_vacuum_scan(v, &budget, &n_freed);
+        if (r <= 0) {
+                rescanned = false;
+                goto finish;
         }
 
-        if (n_list > 0)
-                qsort(list, n_list, sizeof(struct vacuum_info), vacuum_compare);
+        /* What the scan deleted is not included in what it counted */
+        if (rescanned)
+                n_freed = 0;
+
+        if (prioq_isempty(v->queue))
+                goto finish;
+
+        fd = journal_vacuum_open(v);
+        if (fd < 0) {
+                r = fd;
+                goto finish;
+        }
+
+        if (max_retention_usec > 0) {
+                retention_limit = now(CLOCK_REALTIME);
+                if (retention_limit > max_retention_usec)
+                        retention_limit -= max_retention_usec;
+                else
+                        max_retention_usec = retention_limit = 0;
+        }
 
-        for (i = 0; i < n_list; i++) {
+        while ((i = prioq_peek(v->queue))) {
                 struct statvfs ss;
 
-                if (fstatvfs(dirfd(d), &ss) < 0) {
+                if (statvfs(v->directory, &ss) < 0) {
                         r = -errno;
                         goto finish;
                 }
 
-                if ((max_retention_usec <= 0 || list[i].realtime >= retention_limit) &&
-                    (max_use <= 0 || sum <= max_use) &&
+                if ((max_retention_usec <= 0 || i->realtime >= retention_limit) &&
+                    (max_use <= 0 || v->usage <= max_use) &&
                     (min_free <= 0 || (uint64_t) ss.f_bavail * (uint64_t) ss.f_bsize >= min_free))
                         break;
 
-                if (unlinkat(dirfd(d), list[i].filename, 0) >= 0) {
-                        log_debug("Deleted archived journal %s/%s.", directory, list[i].filename);
+                if (budget <= 0) {
+                        r = 0;
+                        goto finish;
+                }
 
-                        if (list[i].usage < sum)
-                                sum -= list[i].usage;
-                        else
-                                sum = 0;
+                budget--;
 
-                } else if (errno != ENOENT)
-                        log_warning("Failed to delete %s/%s: %m", directory, list[i].filename);
+                if (unlinkat(fd, i->filename, 0) >= 0) {
+                        log_debug("Deleted archived journal %s/%s.", v->directory, i->filename);
+                        n_freed += i->usage;
+                } else if (errno != ENOENT) {
+                        log_warning("Failed to delete %s/%s: %m", v->directory, i->filename);
+
+                        /* Let's not try again and again */
+                        journal_vacuum_remove(v, i);
+                        continue;
+                }
+
+                /* Usage of the index is included in the file's */
+                unlink_index(fd, v->directory, i->filename);
+                journal_vacuum_remove(v, i);
         }
 
-        if (oldest_usec && i < n_list && (*oldest_usec == 0 || list[i].realtime < *oldest_usec))
-                *oldest_usec = list[i].realtime;
+        r = 1;
 
 finish:
-        for (i = 0; i < n_list; i++)
-                free(list[i].filename);
-        free(list);
+        if (usage) {
+                if (rescanned)
+                        *usage = v->scan_usage - MIN(n_freed, v->scan_usage);
+                else
+                        *usage -= MIN(n_freed, *usage);
+        }
 
         return r;
 }
+
+usec_t journal_vacuum_oldest(JournalVacuum *v) {
+        struct vacuum_info *i;
+
+        assert(v);
+
+        i = prioq_peek(v->queue);
+        return i ? i->realtime : 0;
+}
+
+int journal_directory_vacuum(
+                const char *directory,
+                uint64_t max_use,
+                uint64_t min_free,
+                usec_t max_retention_usec,
+                usec_t *oldest_usec,
+                uint64_t *usage) {
+
+        JournalVacuum *v;
+        usec_t oldest;
+        int r;
+
+        assert(directory);
+
+        /* Returns the disk usage of the journal files that are left
+         * in usage, if the limits let us read the directory at all */
+
+        if (usage)
+                *usage = 0;
+
+        if (max_use <= 0 && min_free <= 0 && max_retention_usec <= 0)
+                return 0;
+
+        v = journal_vacuum_new(directory);
+        if (!v)
+                return -ENOMEM;
+
+        r = journal_vacuum_step(v, max_use, min_free, max_retention_usec, (unsigned) -1, usage);
+
+        oldest = journal_vacuum_oldest(v);
+        if (r > 0 && oldest_usec && oldest > 0 && (*oldest_usec == 0 || oldest < *oldest_usec))
+                *oldest_usec = oldest;
+
+        journal_vacuum_free(v);
+
+        return r < 0 ? r : 0;
+}
@@ -23,4 +23,19 @@
 
 #include <inttypes.h>
 
-int journal_directory_vacuum(const char *directory, uint64_t max_use, uint64_t min_free, usec_t max_retention_usec, usec_t *oldest_usec);
+#include "time-util.h"
+
+/* The archived journal files of a directory, ordered by age, so that
+ * they can be vacuumed in small steps without reading the directory
+ * again and again. */
+typedef struct JournalVacuum JournalVacuum;
+
+JournalVacuum *journal_vacuum_new(const char *directory);
+void journal_vacuum_free(JournalVacuum *v);
+
+void journal_vacuum_rescan(JournalVacuum *v);
+int journal_vacuum_add(JournalVacuum *v, const char *path);
+int journal_vacuum_step(JournalVacuum *v, uint64_t max_use, uint64_t min_free, usec_t max_retention_usec, unsigned budget, uint64_t *usage);
+usec_t journal_vacuum_oldest(JournalVacuum *v);
+
+int journal_directory_vacuum(const char *directory, uint64_t max_use, uint64_t min_free, usec_t max_retention_usec, usec_t *oldest_usec, uint64_t *usage);
@@ -23,6 +23,7 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <stddef.h>
+#include <pthread.h>
 
 #include "util.h"
 #include "macro.h"
@@ -38,6 +39,41 @@
  * files without adding to many zeros. */
 #define OFSfmt "%06"PRIx64
 
+/* Never use more threads than this, regardless of the number of CPUs */
+#define VERIFY_THREADS_MAX 16U
+
+/* Don't bother starting a thread for less hash chains than this */
+#define HASH_CHAINS_PER_THREAD_MIN 1024ULL
+
+/* Files and parts of the data hash table may be checked by several
+ * threads at once. The helper threads check quietly and only count
+ * what they would have logged. Whatever they found is checked again
+ * by the calling thread, which then logs it, so that the output does
+ * not depend on how the threads were scheduled. */
+static __thread bool quiet = false;
+static __thread unsigned n_suppressed = 0;
+
+#define verify_full(level, ...)                                         \
+        do {                                                            \
+                if (!quiet)                                             \
+                        log_full(level, __VA_ARGS__);                   \
+                else if ((level) <= log_get_max_level())                \
+                        n_suppressed++;                                 \
+        } while (false)
+
+#define verify_debug(...)   verify_full(LOG_DEBUG,   __VA_ARGS__)
+#define verify_warning(...) verify_full(LOG_WARNING, __VA_ARGS__)
+#define verify_error(...)   verify_full(LOG_ERR,     __VA_ARGS__)
+
+typedef struct VerifyProgress {
+        bool show;
+        usec_t last_usec;
+
+        /* If set, progress is stored here, for somebody else to
+         * draw */
+        uint64_t *value;
+} VerifyProgress;
+
 static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o) {
         uint64_t i;
 
@@ -49,56 +85,61 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
          * possible field values. It does not follow any references to
          * other objects. */
 
-        if ((o->object.flags & OBJECT_COMPRESSED) &&
+        if ((o->object.flags & OBJECT_COMPRESSION_MASK) &&
             o->object.type != OBJECT_DATA)
                 return -EBADMSG;
 
+        if ((o->object.flags & OBJECT_COMPRESSION_MASK) == OBJECT_COMPRESSION_MASK)
+                return -EBADMSG;
+
         switch (o->object.type) {
 
         case OBJECT_DATA: {
                 uint64_t h1, h2;
+                int r;
 
                 if (le64toh(o->data.entry_offset) == 0)
-                        log_warning(OFSfmt": unused data (entry_offset==0)", offset);
+                        verify_warning(OFSfmt": unused data (entry_offset==0)", offset);
 
                 if ((le64toh(o->data.entry_offset) == 0) ^ (le64toh(o->data.n_entries) == 0)) {
-                        log_error(OFSfmt": bad n_entries: %"PRIu64, offset, o->data.n_entries);
+                        verify_error(OFSfmt": bad n_entries: %"PRIu64, offset, o->data.n_entries);
                         return -EBADMSG;
                 }
 
                 if (le64toh(o->object.size) - offsetof(DataObject, payload) <= 0) {
-                        log_error(OFSfmt": bad object size (<= %zu): %"PRIu64,
-                                  offset,
-                                  offsetof(DataObject, payload),
-                                  le64toh(o->object.size));
+                        verify_error(OFSfmt": bad object size (<= %zu): %"PRIu64,
+                                     offset,
+                                     offsetof(DataObject, payload),
+                                     le64toh(o->object.size));
                         return -EBADMSG;
                 }
 
                 h1 = le64toh(o->data.hash);
 
-                if (o->object.flags & OBJECT_COMPRESSED) {
-#ifdef HAVE_XZ
+                if (o->object.flags & OBJECT_COMPRESSION_MASK) {
                         void *b = NULL;
                         uint64_t alloc = 0, b_size;
 
-                        if (!uncompress_blob(o->data.payload,
-                                             le64toh(o->object.size) - offsetof(Object, data.payload),
-                                             &b, &alloc, &b_size, 0)) {
-                                log_error(OFSfmt": uncompression failed", offset);
-                                return -EBADMSG;
+                        r = uncompress_blob(o->object.flags & OBJECT_COMPRESSION_MASK,
+                                            o->data.payload,
+                                            le64toh(o->object.size) - offsetof(Object, data.payload),
+                                            &b, &alloc, &b_size, 0);
+                        if (r == -EPROTONOSUPPORT) {
+                                verify_error(OFSfmt": compression is not supported", offset);
+                                return r;
+                        }
+                        if (r < 0) {
+                                verify_error(OFSfmt": uncompression failed", offset);
+                                return r;
                         }
 
                         h2 = hash64(b, b_size);
                         free(b);
-#else
-                        log_error("Compression is not supported");
-                        return -EPROTONOSUPPORT;
-#endif
                 } else
                         h2 = hash64(o->data.payload, le64toh(o->object.size) - offsetof(Object, data.payload));
 
                 if (h1 != h2) {
-                        log_error(OFSfmt": invalid hash (%08"PRIx64" vs. %08"PRIx64, offset, h1, h2);
+                        verify_error(OFSfmt": invalid hash (%08"PRIx64" vs. %08"PRIx64, offset, h1, h2);
                         return -EBADMSG;
                 }
 
@@ -106,12 +147,12 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                     !VALID64(o->data.next_field_offset) ||
                     !VALID64(o->data.entry_offset) ||
                     !VALID64(o->data.entry_array_offset)) {
-                        log_error(OFSfmt": invalid offset (next_hash_offset="OFSfmt", next_field_offset="OFSfmt", entry_offset="OFSfmt", entry_array_offset="OFSfmt,
-                                  offset,
-                                  o->data.next_hash_offset,
-                                  o->data.next_field_offset,
-                                  o->data.entry_offset,
-                                  o->data.entry_array_offset);
+                        verify_error(OFSfmt": invalid offset (next_hash_offset="OFSfmt", next_field_offset="OFSfmt", entry_offset="OFSfmt", entry_array_offset="OFSfmt,
+                                     offset,
+                                     o->data.next_hash_offset,
+                                     o->data.next_field_offset,
+                                     o->data.entry_offset,
+                                     o->data.entry_array_offset);
                         return -EBADMSG;
                 }
 
@@ -120,67 +161,67 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
 
         case OBJECT_FIELD:
                 if (le64toh(o->object.size) - offsetof(FieldObject, payload) <= 0) {
-                        log_error(OFSfmt": bad field size (<= %zu): %"PRIu64,
-                                  offset,
-                                  offsetof(FieldObject, payload),
-                                  le64toh(o->object.size));
+                        verify_error(OFSfmt": bad field size (<= %zu): %"PRIu64,
+                                     offset,
+                                     offsetof(FieldObject, payload),
+                                     le64toh(o->object.size));
                         return -EBADMSG;
                 }
 
                 if (!VALID64(o->field.next_hash_offset) ||
                     !VALID64(o->field.head_data_offset)) {
-                        log_error(OFSfmt": invalid offset (next_hash_offset="OFSfmt", head_data_offset="OFSfmt,
-                                  offset,
-                                  o->field.next_hash_offset,
-                                  o->field.head_data_offset);
+                        verify_error(OFSfmt": invalid offset (next_hash_offset="OFSfmt", head_data_offset="OFSfmt,
+                                     offset,
+                                     o->field.next_hash_offset,
+                                     o->field.head_data_offset);
                         return -EBADMSG;
                 }
                 break;
 
         case OBJECT_ENTRY:
                 if ((le64toh(o->object.size) - offsetof(EntryObject, items)) % sizeof(EntryItem) != 0) {
-                        log_error(OFSfmt": bad entry size (<= %zu): %"PRIu64,
-                                  offset,
-                                  offsetof(EntryObject, items),
-                                  le64toh(o->object.size));
+                        verify_error(OFSfmt": bad entry size (<= %zu): %"PRIu64,
+                                     offset,
+                                     offsetof(EntryObject, items),
+                                     le64toh(o->object.size));
                         return -EBADMSG;
                 }
 
                 if ((le64toh(o->object.size) - offsetof(EntryObject, items)) / sizeof(EntryItem) <= 0) {
-                        log_error(OFSfmt": invalid number items in entry: %"PRIu64,
-                                  offset,
-                                  (le64toh(o->object.size) - offsetof(EntryObject, items)) / sizeof(EntryItem));
+                        verify_error(OFSfmt": invalid number items in entry: %"PRIu64,
+                                     offset,
+                                     (le64toh(o->object.size) - offsetof(EntryObject, items)) / sizeof(EntryItem));
                         return -EBADMSG;
                 }
 
                 if (le64toh(o->entry.seqnum) <= 0) {
-                        log_error(OFSfmt": invalid entry seqnum: %"PRIx64,
-                                  offset,
-                                  le64toh(o->entry.seqnum));
+                        verify_error(OFSfmt": invalid entry seqnum: %"PRIx64,
+                                     offset,
+                                     le64toh(o->entry.seqnum));
                         return -EBADMSG;
                 }
 
                 if (!VALID_REALTIME(le64toh(o->entry.realtime))) {
-                        log_error(OFSfmt": invalid entry realtime timestamp: %"PRIu64,
-                                  offset,
-                                  le64toh(o->entry.realtime));
+                        verify_error(OFSfmt": invalid entry realtime timestamp: %"PRIu64,
+                                     offset,
+                                     le64toh(o->entry.realtime));
                         return -EBADMSG;
                 }
 
                 if (!VALID_MONOTONIC(le64toh(o->entry.monotonic))) {
-                        log_error(OFSfmt": invalid entry monotonic timestamp: %"PRIu64,
-                                  offset,
-                                  le64toh(o->entry.monotonic));
+                        verify_error(OFSfmt": invalid entry monotonic timestamp: %"PRIu64,
+                                     offset,
+                                     le64toh(o->entry.monotonic));
                         return -EBADMSG;
                 }
 
                 for (i = 0; i < journal_file_entry_n_items(o); i++) {
                         if (o->entry.items[i].object_offset == 0 ||
                             !VALID64(o->entry.items[i].object_offset)) {
-                                log_error(OFSfmt": invalid entry item (%"PRIu64"/%"PRIu64" offset: "OFSfmt,
-                                          offset,
-                                          i, journal_file_entry_n_items(o),
-                                          o->entry.items[i].object_offset);
+                                verify_error(OFSfmt": invalid entry item (%"PRIu64"/%"PRIu64" offset: "OFSfmt,
+                                             offset,
+                                             i, journal_file_entry_n_items(o),
+                                             o->entry.items[i].object_offset);
                                 return -EBADMSG;
                         }
                 }
@@ -191,70 +232,97 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
         case OBJECT_FIELD_HASH_TABLE:
                 if ((le64toh(o->object.size) - offsetof(HashTableObject, items)) % sizeof(HashItem) != 0 ||
                     (le64toh(o->object.size) - offsetof(HashTableObject, items)) / sizeof(HashItem) <= 0) {
-                        log_error(OFSfmt": invalid %s hash table size: %"PRIu64,
-                                  offset,
-                                  o->object.type == OBJECT_DATA_HASH_TABLE ? "data" : "field",
-                                  le64toh(o->object.size));
+                        verify_error(OFSfmt": invalid %s hash table size: %"PRIu64,
+                                     offset,
+                                     o->object.type == OBJECT_DATA_HASH_TABLE ? "data" : "field",
+                                     le64toh(o->object.size));
                         return -EBADMSG;
                 }
 
                 for (i = 0; i < journal_file_hash_table_n_items(o); i++) {
                         if (o->hash_table.items[i].head_hash_offset != 0 &&
                             !VALID64(le64toh(o->hash_table.items[i].head_hash_offset))) {
-                                log_error(OFSfmt": invalid %s hash table item (%"PRIu64"/%"PRIu64") head_hash_offset: "OFSfmt,
-                                          offset,
-                                          o->object.type == OBJECT_DATA_HASH_TABLE ? "data" : "field",
-                                          i, journal_file_hash_table_n_items(o),
-                                          le64toh(o->hash_table.items[i].head_hash_offset));
+                                verify_error(OFSfmt": invalid %s hash table item (%"PRIu64"/%"PRIu64") head_hash_offset: "OFSfmt,
+                                             offset,
+                                             o->object.type == OBJECT_DATA_HASH_TABLE ? "data" : "field",
+                                             i, journal_file_hash_table_n_items(o),
+                                             le64toh(o->hash_table.items[i].head_hash_offset));
                                 return -EBADMSG;
                         }
                         if (o->hash_table.items[i].tail_hash_offset != 0 &&
                             !VALID64(le64toh(o->hash_table.items[i].tail_hash_offset))) {
-                                log_error(OFSfmt": invalid %s hash table item (%"PRIu64"/%"PRIu64") tail_hash_offset: "OFSfmt,
-                                          offset,
-                                          o->object.type == OBJECT_DATA_HASH_TABLE ? "data" : "field",
-                                          i, journal_file_hash_table_n_items(o),
-                                          le64toh(o->hash_table.items[i].tail_hash_offset));
+                                verify_error(OFSfmt": invalid %s hash table item (%"PRIu64"/%"PRIu64") tail_hash_offset: "OFSfmt,
+                                             offset,
+                                             o->object.type == OBJECT_DATA_HASH_TABLE ? "data" : "field",
+                                             i, journal_file_hash_table_n_items(o),
+                                             le64toh(o->hash_table.items[i].tail_hash_offset));
                                 return -EBADMSG;
                         }
 
                         if ((o->hash_table.items[i].head_hash_offset != 0) !=
                             (o->hash_table.items[i].tail_hash_offset != 0)) {
-                                log_error(OFSfmt": invalid %s hash table item (%"PRIu64"/%"PRIu64"): head_hash_offset="OFSfmt" tail_hash_offset="OFSfmt,
-                                          offset,
-                                          o->object.type == OBJECT_DATA_HASH_TABLE ? "data" : "field",
-                                          i, journal_file_hash_table_n_items(o),
-                                          le64toh(o->hash_table.items[i].head_hash_offset),
-                                          le64toh(o->hash_table.items[i].tail_hash_offset));
+                                verify_error(OFSfmt": invalid %s hash table item (%"PRIu64"/%"PRIu64"): head_hash_offset="OFSfmt" tail_hash_offset="OFSfmt,
+                                             offset,
+                                             o->object.type == OBJECT_DATA_HASH_TABLE ? "data" : "field",
+                                             i, journal_file_hash_table_n_items(o),
+                                             le64toh(o->hash_table.items[i].head_hash_offset),
+                                             le64toh(o->hash_table.items[i].tail_hash_offset));
                                 return -EBADMSG;
                         }
                 }
 
                 break;
 
+        case OBJECT_DATA_OVERFLOW_TABLE:
+        case OBJECT_FIELD_OVERFLOW_TABLE: {
+                uint64_t n;
+
+                n = journal_file_overflow_table_n_items(o);
+                if ((le64toh(o->object.size) - offsetof(OverflowTableObject, items)) % sizeof(OverflowItem) != 0 ||
+                    n <= 0 || (n & (n - 1)) != 0) {
+                        verify_error(OFSfmt": invalid %s overflow table size: %"PRIu64,
+                                     offset,
+                                     o->object.type == OBJECT_DATA_OVERFLOW_TABLE ? "data" : "field",
+                                     le64toh(o->object.size));
+                        return -EBADMSG;
+                }
+
+                for (i = 0; i < n; i++)
+                        if (!VALID64(le64toh(o->overflow_table.items[i].object_offset))) {
+                                verify_error(OFSfmt": invalid %s overflow table item (%"PRIu64"/%"PRIu64") object_offset: "OFSfmt,
+                                             offset,
+                                             o->object.type == OBJECT_DATA_OVERFLOW_TABLE ? "data" : "field",
+                                             i, n,
+                                             le64toh(o->overflow_table.items[i].object_offset));
+                                return -EBADMSG;
+                        }
+
+                break;
+        }
+
         case OBJECT_ENTRY_ARRAY:
-                if ((le64toh(o->object.size) - offsetof(EntryArrayObject, items)) % sizeof(le64_t) != 0 ||
-                    (le64toh(o->object.size) - offsetof(EntryArrayObject, items)) / sizeof(le64_t) <= 0) {
-                        log_error(OFSfmt": invalid object entry array size: %"PRIu64,
-                                  offset,
-                                  le64toh(o->object.size));
+                if ((le64toh(o->object.size) - offsetof(EntryArrayObject, items)) % (f->compact ? sizeof(le32_t) : sizeof(le64_t)) != 0 ||
+                    journal_file_entry_array_n_items(f, o) <= 0) {
+                        verify_error(OFSfmt": invalid object entry array size: %"PRIu64,
+                                     offset,
+                                     le64toh(o->object.size));
                         return -EBADMSG;
                 }
 
                 if (!VALID64(o->entry_array.next_entry_array_offset)) {
-                        log_error(OFSfmt": invalid object entry array next_entry_array_offset: "OFSfmt,
-                                  offset,
-                                  o->entry_array.next_entry_array_offset);
+                        verify_error(OFSfmt": invalid object entry array next_entry_array_offset: "OFSfmt,
+                                     offset,
+                                     o->entry_array.next_entry_array_offset);
                         return -EBADMSG;
                 }
 
-                for (i = 0; i < journal_file_entry_array_n_items(o); i++)
-                        if (o->entry_array.items[i] != 0 &&
-                            !VALID64(o->entry_array.items[i])) {
-                                log_error(OFSfmt": invalid object entry array item (%"PRIu64"/%"PRIu64"): "OFSfmt,
-                                          offset,
-                                          i, journal_file_entry_array_n_items(o),
-                                          o->entry_array.items[i]);
+                for (i = 0; i < journal_file_entry_array_n_items(f, o); i++)
+                        if (journal_file_entry_array_item(f, o, i) != 0 &&
+                            !VALID64(journal_file_entry_array_item(f, o, i))) {
+                                verify_error(OFSfmt": invalid object entry array item (%"PRIu64"/%"PRIu64"): "OFSfmt,
+                                             offset,
+                                             i, journal_file_entry_array_n_items(f, o),
+                                             journal_file_entry_array_item(f, o, i));
                                 return -EBADMSG;
                         }
 
@@ -262,16 +330,16 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
 
         case OBJECT_TAG:
                 if (le64toh(o->object.size) != sizeof(TagObject)) {
-                        log_error(OFSfmt": invalid object tag size: %"PRIu64,
-                                  offset,
-                                  le64toh(o->object.size));
+                        verify_error(OFSfmt": invalid object tag size: %"PRIu64,
+                                     offset,
+                                     le64toh(o->object.size));
                         return -EBADMSG;
                 }
 
                 if (!VALID_EPOCH(o->tag.epoch)) {
-                        log_error(OFSfmt": invalid object tag epoch: %"PRIu64,
-                                  offset,
-                                  o->tag.epoch);
+                        verify_error(OFSfmt": invalid object tag epoch: %"PRIu64,
+                                     offset,
+                                     o->tag.epoch);
                         return -EBADMSG;
                 }
 
@@ -333,6 +401,32 @@ static void flush_progress(void) {
         fflush(stdout);
 }
 
+static void update_progress(VerifyProgress *progress, uint64_t p) {
+        assert(progress);
+
+        if (progress->value)
+                *progress->value = p;
+        else if (progress->show)
+                draw_progress(p, &progress->last_usec);
+}
+
+static void finish_progress(VerifyProgress *progress) {
+        assert(progress);
+
+        if (progress->show && !progress->value)
+                flush_progress();
+}
+
+static unsigned verify_threads(void) {
+        long n;
+
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+        if (n <= 0)
+                return 1;
+
+        return MIN((unsigned) n, VERIFY_THREADS_MAX);
+}
+
 static int write_uint64(int fd, uint64_t p) {
         ssize_t k;
 
@@ -395,7 +489,7 @@ static int entry_points_to_data(
         assert(entry_fd >= 0);
 
         if (!contains_uint64(f->mmap, entry_fd, n_entries, entry_p)) {
-                log_error("Data object references invalid entry at %"PRIu64, data_p);
+                verify_error("Data object references invalid entry at %"PRIu64, data_p);
                 return -EBADMSG;
         }
 
@@ -411,7 +505,7 @@ static int entry_points_to_data(
                 }
 
         if (!found) {
-                log_error("Data object not referenced by linked entry at %"PRIu64, data_p);
+                verify_error("Data object not referenced by linked entry at %"PRIu64, data_p);
                 return -EBADMSG;
         }
 
@@ -430,10 +524,10 @@ static int entry_points_to_data(
                 if (r < 0)
                         return r;
 
-                m = journal_file_entry_array_n_items(o);
+                m = journal_file_entry_array_n_items(f, o);
                 u = MIN(n - i, m);
 
-                if (entry_p <= le64toh(o->entry_array.items[u-1])) {
+                if (entry_p <= journal_file_entry_array_item(f, o, u-1)) {
                         uint64_t x, y, z;
 
                         x = 0;
@@ -442,19 +536,19 @@ static int entry_points_to_data(
                         while (x < y) {
                                 z = (x + y) / 2;
 
-                                if (le64toh(o->entry_array.items[z]) == entry_p)
+                                if (journal_file_entry_array_item(f, o, z) == entry_p)
                                         return 0;
 
                                 if (x + 1 >= y)
                                         break;
 
-                                if (entry_p < le64toh(o->entry_array.items[z]))
+                                if (entry_p < journal_file_entry_array_item(f, o, z))
                                         y = z;
                                 else
                                         x = z;
                         }
 
-                        log_error("Entry object doesn't exist in main entry array at %"PRIu64, entry_p);
+                        verify_error("Entry object doesn't exist in main entry array at %"PRIu64, entry_p);
                         return -EBADMSG;
                 }
 
@@ -484,8 +578,8 @@ static int verify_data(
 
         /* Entry array means at least two objects */
         if (a && n < 2) {
-                log_error("Entry array present (entry_array_offset=%"PRIu64", but n_entries=%"PRIu64,
-                          a, n);
+                verify_error("Entry array present (entry_array_offset=%"PRIu64", but n_entries=%"PRIu64,
+                             a, n);
                 return -EBADMSG;
         }
 
@@ -505,12 +599,12 @@ static int verify_data(
                 uint64_t next, m, j;
 
                 if (a == 0) {
-                        log_error("Array chain too short at %"PRIu64, p);
+                        verify_error("Array chain too short at %"PRIu64, p);
                         return -EBADMSG;
                 }
 
                 if (!contains_uint64(f->mmap, entry_array_fd, n_entry_arrays, a)) {
-                        log_error("Invalid array at %"PRIu64, p);
+                        verify_error("Invalid array at %"PRIu64, p);
                         return -EBADMSG;
                 }
 
@@ -520,16 +614,16 @@ static int verify_data(
 
                 next = le64toh(o->entry_array.next_entry_array_offset);
                 if (next != 0 && next <= a) {
-                        log_error("Array chain has cycle at %"PRIu64, p);
+                        verify_error("Array chain has cycle at %"PRIu64, p);
                         return -EBADMSG;
                 }
 
-                m = journal_file_entry_array_n_items(o);
+                m = journal_file_entry_array_n_items(f, o);
                 for (j = 0; i < n && j < m; i++, j++) {
 
-                        q = le64toh(o->entry_array.items[j]);
+                        q = journal_file_entry_array_item(f, o, j);
                         if (q <= last) {
-                                log_error("Data object's entry array not sorted at %"PRIu64, p);
+                                verify_error("Data object's entry array not sorted at %"PRIu64, p);
                                 return -EBADMSG;
                         }
                         last = q;
@@ -550,69 +644,200 @@ static int verify_data(
         return 0;
 }
 
+static int verify_hash_chain(
+                JournalFile *f,
+                uint64_t i, uint64_t n,
+                int data_fd, uint64_t n_data,
+                int entry_fd, uint64_t n_entries,
+                int entry_array_fd, uint64_t n_entry_arrays) {
+
+        uint64_t last = 0, p;
+        int r;
+
+        assert(f);
+        assert(i < n);
+
+        p = le64toh(f->data_hash_table[i].head_hash_offset);
+        while (p != 0) {
+                Object *o;
+                uint64_t next;
+
+                if (!contains_uint64(f->mmap, data_fd, n_data, p)) {
+                        verify_error("Invalid data object at hash entry %"PRIu64" of %"PRIu64,
+                                     i, n);
+                        return -EBADMSG;
+                }
+
+                r = journal_file_move_to_object(f, OBJECT_DATA, p, &o);
+                if (r < 0)
+                        return r;
+
+                next = le64toh(o->data.next_hash_offset);
+                if (next != 0 && next <= p) {
+                        verify_error("Hash chain has a cycle in hash entry %"PRIu64" of %"PRIu64,
+                                     i, n);
+                        return -EBADMSG;
+                }
+
+                if (le64toh(o->data.hash) % n != i) {
+                        verify_error("Hash value mismatch in hash entry %"PRIu64" of %"PRIu64,
+                                     i, n);
+                        return -EBADMSG;
+                }
+
+                r = verify_data(f, o, p, entry_fd, n_entries, entry_array_fd, n_entry_arrays);
+                if (r < 0)
+                        return r;
+
+                last = p;
+                p = next;
+        }
+
+        if (last != le64toh(f->data_hash_table[i].tail_hash_offset)) {
+                verify_error("Tail hash pointer mismatch in hash table");
+                return -EBADMSG;
+        }
+
+        return 0;
+}
+
+typedef struct HashTableWorker {
+        /* A shallow copy of the file with its own mmap cache, since
+         * a cache may only be used by one thread at a time */
+        JournalFile file;
+
+        int data_fd, entry_fd, entry_array_fd;
+        uint64_t n_data, n_entries, n_entry_arrays;
+
+        /* The chains to check, and the one currently checked,
+         * respectively the first bad one */
+        uint64_t begin, end, i;
+        int r;
+
+        pthread_t thread;
+        bool thread_running;
+} HashTableWorker;
+
+static void *hash_table_worker_thread(void *userdata) {
+        HashTableWorker *w = userdata;
+        uint64_t n;
+
+        quiet = true;
+
+        w->file.mmap = mmap_cache_new();
+        if (!w->file.mmap) {
+                w->r = -ENOMEM;
+                return NULL;
+        }
+
+        n = le64toh(w->file.header->data_hash_table_size) / sizeof(HashItem);
+        for (; w->i < w->end; w->i++) {
+                w->r = verify_hash_chain(&w->file, w->i, n,
+                                         w->data_fd, w->n_data,
+                                         w->entry_fd, w->n_entries,
+                                         w->entry_array_fd, w->n_entry_arrays);
+                if (w->r < 0)
+                        break;
+        }
+
+        mmap_cache_unref(w->file.mmap);
+        return NULL;
+}
+
 static int verify_hash_table(
                 JournalFile *f,
                 int data_fd, uint64_t n_data,
                 int entry_fd, uint64_t n_entries,
                 int entry_array_fd, uint64_t n_entry_arrays,
-                usec_t *last_usec,
-                bool show_progress) {
+                unsigned n_threads,
+                VerifyProgress *progress) {
 
-        uint64_t i, n;
-        int r;
+        _cleanup_free_ HashTableWorker *workers = NULL;
+        uint64_t i, n, end;
+        unsigned k = 1, j;
+        int r = 0;
 
         assert(f);
         assert(data_fd >= 0);
         assert(entry_fd >= 0);
         assert(entry_array_fd >= 0);
-        assert(last_usec);
+        assert(progress);
 
         n = le64toh(f->header->data_hash_table_size) / sizeof(HashItem);
-        for (i = 0; i < n; i++) {
-                uint64_t last = 0, p;
-
-                if (show_progress)
-                        draw_progress(0xC000 + (0x3FFF * i / n), last_usec);
 
-                p = le64toh(f->data_hash_table[i].head_hash_offset);
-                while (p != 0) {
-                        Object *o;
-                        uint64_t next;
+        /* The chains do not depend on each other, hence the table
+         * is split into consecutive ranges that are checked in
+         * parallel. The first one is checked by this thread. */
+        if (n_threads > 1 && n >= 2 * HASH_CHAINS_PER_THREAD_MIN) {
+                k = (unsigned) MIN((uint64_t) n_threads, n / HASH_CHAINS_PER_THREAD_MIN);
 
-                        if (!contains_uint64(f->mmap, data_fd, n_data, p)) {
-                                log_error("Invalid data object at hash entry %"PRIu64" of %"PRIu64,
-                                          i, n);
-                                return -EBADMSG;
-                        }
+                workers = new0(HashTableWorker, k);
+                if (!workers)
+                        k = 1;
+        }
 
-                        r = journal_file_move_to_object(f, OBJECT_DATA, p, &o);
-                        if (r < 0)
-                                return r;
+        for (j = 1; j < k; j++) {
+                HashTableWorker *w = workers + j;
+
+                w->file = *f;
+                w->data_fd = data_fd;
+                w->n_data = n_data;
+                w->entry_fd = entry_fd;
+                w->n_entries = n_entries;
+                w->entry_array_fd = entry_array_fd;
+                w->n_entry_arrays = n_entry_arrays;
+                w->begin = w->i = n * j / k;
+                w->end = n * (j + 1) / k;
+
+                /* If we cannot start a thread, the range is checked
+                 * here, later on */
+                if (pthread_create(&w->thread, NULL, hash_table_worker_thread, w) == 0)
+                        w->thread_running = true;
+        }
 
-                        next = le64toh(o->data.next_hash_offset);
-                        if (next != 0 && next <= p) {
-                                log_error("Hash chain has a cycle in hash entry %"PRIu64" of %"PRIu64,
-                                          i, n);
-                                return -EBADMSG;
-                        }
+        end = n / k;
+        for (i = 0; i < end; i++) {
 
-                        if (le64toh(o->data.hash) % n != i) {
-                                log_error("Hash value mismatch in hash entry %"PRIu64" of %"PRIu64,
-                                          i, n);
-                                return -EBADMSG;
-                        }
+                if (progress->show || progress->value) {
+                        uint64_t done = i;
 
-                        r = verify_data(f, o, p, entry_fd, n_entries, entry_array_fd, n_entry_arrays);
-                        if (r < 0)
-                                return r;
+                        for (j = 1; j < k; j++)
+                                done += workers[j].i - workers[j].begin;
 
-                        last = p;
-                        p = next;
+                        update_progress(progress, 0xC000 + (0x3FFF * done / n));
                 }
 
-                if (last != le64toh(f->data_hash_table[i].tail_hash_offset)) {
-                        log_error("Tail hash pointer mismatch in hash table");
-                        return -EBADMSG;
+                r = verify_hash_chain(f, i, n,
+                                      data_fd, n_data,
+                                      entry_fd, n_entries,
+                                      entry_array_fd, n_entry_arrays);
+                if (r < 0)
+                        break;
+        }
+
+        for (j = 1; j < k; j++)
+                if (workers[j].thread_running)
+                        pthread_join(workers[j].thread, NULL);
+
+        if (r < 0)
+                return r;
+
+        /* Check again what the other threads found bad, or did not
+         * get to at all, and log it just like as if everything was
+         * checked here in order. */
+        for (j = 1; j < k; j++) {
+                HashTableWorker *w = workers + j;
+
+                if (w->thread_running && w->r >= 0)
+                        continue;
+
+                for (i = w->i; i < w->end; i++) {
+                        r = verify_hash_chain(f, i, n,
+                                              data_fd, n_data,
+                                              entry_fd, n_entries,
+                                              entry_array_fd, n_entry_arrays);
+                        if (r < 0)
+                                return r;
                 }
         }
 
@@ -644,6 +869,28 @@ static int data_object_in_hash_table(JournalFile *f, uint64_t hash, uint64_t p)
         return 0;
 }
 
+static int data_object_in_overflow_table(JournalFile *f, uint64_t hash, uint64_t p) {
+        uint64_t n, i, k;
+        Object *t;
+        int r;
+
+        assert(f);
+
+        r = journal_file_move_to_overflow_table(f, OBJECT_DATA, &t, &n);
+        if (r <= 0)
+                return r < 0 ? r : 1;
+
+        for (i = hash & (n - 1), k = 0; k < n; i = (i + 1) & (n - 1), k++) {
+                if (t->overflow_table.items[i].object_offset == 0)
+                        return 0;
+
+                if (le64toh(t->overflow_table.items[i].object_offset) == p)
+                        return le64toh(t->overflow_table.items[i].hash) == hash;
+        }
+
+        return 0;
+}
+
 static int verify_entry(
                 JournalFile *f,
                 Object *o, uint64_t p,
@@ -665,7 +912,7 @@ static int verify_entry(
                 h = le64toh(o->entry.items[i].hash);
 
                 if (!contains_uint64(f->mmap, data_fd, n_data, q)) {
-                        log_error("Invalid data object at entry %"PRIu64, p);
+                        verify_error("Invalid data object at entry %"PRIu64, p);
                                 return -EBADMSG;
                         }
 
@@ -674,7 +921,7 @@ static int verify_entry(
                         return r;
 
                 if (le64toh(u->data.hash) != h) {
-                        log_error("Hash mismatch for data object at entry %"PRIu64, p);
+                        verify_error("Hash mismatch for data object at entry %"PRIu64, p);
                         return -EBADMSG;
                 }
 
@@ -682,7 +929,15 @@ static int verify_entry(
                 if (r < 0)
                         return r;
                 if (r == 0) {
-                        log_error("Data object missing from hash at entry %"PRIu64, p);
+                        verify_error("Data object missing from hash at entry %"PRIu64, p);
+                        return -EBADMSG;
+                }
+
+                r = data_object_in_overflow_table(f, h, q);
+                if (r < 0)
+                        return r;
+                if (r == 0) {
+                        verify_error("Data object missing from overflow table at entry %"PRIu64, p);
                         return -EBADMSG;
                 }
         }
@@ -695,8 +950,7 @@ static int verify_entry_array(
                 int data_fd, uint64_t n_data,
                 int entry_fd, uint64_t n_entries,
                 int entry_array_fd, uint64_t n_entry_arrays,
-                usec_t *last_usec,
-                bool show_progress) {
+                VerifyProgress *progress) {
 
         uint64_t i = 0, a, n, last = 0;
         int r;
@@ -705,7 +959,7 @@ static int verify_entry_array(
         assert(data_fd >= 0);
         assert(entry_fd >= 0);
         assert(entry_array_fd >= 0);
-        assert(last_usec);
+        assert(progress);
 
         n = le64toh(f->header->n_entries);
         a = le64toh(f->header->entry_array_offset);
@@ -713,16 +967,15 @@ static int verify_entry_array(
                 uint64_t next, m, j;
                 Object *o;
 
-                if (show_progress)
-                        draw_progress(0x8000 + (0x3FFF * i / n), last_usec);
+                update_progress(progress, 0x8000 + (0x3FFF * i / n));
 
                 if (a == 0) {
-                        log_error("Array chain too short at %"PRIu64" of %"PRIu64, i, n);
+                        verify_error("Array chain too short at %"PRIu64" of %"PRIu64, i, n);
                         return -EBADMSG;
                 }
 
                 if (!contains_uint64(f->mmap, entry_array_fd, n_entry_arrays, a)) {
-                        log_error("Invalid array at %"PRIu64" of %"PRIu64, i, n);
+                        verify_error("Invalid array at %"PRIu64" of %"PRIu64, i, n);
                         return -EBADMSG;
                 }
 
@@ -732,25 +985,25 @@ static int verify_entry_array(
 
                 next = le64toh(o->entry_array.next_entry_array_offset);
                 if (next != 0 && next <= a) {
-                        log_error("Array chain has cycle at %"PRIu64" of %"PRIu64, i, n);
+                        verify_error("Array chain has cycle at %"PRIu64" of %"PRIu64, i, n);
                         return -EBADMSG;
                 }
 
-                m = journal_file_entry_array_n_items(o);
+                m = journal_file_entry_array_n_items(f, o);
                 for (j = 0; i < n && j < m; i++, j++) {
                         uint64_t p;
 
-                        p = le64toh(o->entry_array.items[j]);
+                        p = journal_file_entry_array_item(f, o, j);
                         if (p <= last) {
-                                log_error("Entry array not sorted at %"PRIu64" of %"PRIu64,
-                                          i, n);
+                                verify_error("Entry array not sorted at %"PRIu64" of %"PRIu64,
+                                             i, n);
                                 return -EBADMSG;
                         }
                         last = p;
 
                         if (!contains_uint64(f->mmap, entry_fd, n_entries, p)) {
-                                log_error("Invalid array entry at %"PRIu64" of %"PRIu64,
-                                          i, n);
+                                verify_error("Invalid array entry at %"PRIu64" of %"PRIu64,
+                                             i, n);
                                 return -EBADMSG;
                         }
 
@@ -774,11 +1027,12 @@ static int verify_entry_array(
         return 0;
 }
 
-int journal_file_verify(
+static int verify_file(
                 JournalFile *f,
                 const char *key,
                 usec_t *first_contained, usec_t *last_validated, usec_t *last_contained,
-                bool show_progress) {
+                unsigned n_threads,
+                VerifyProgress *progress) {
         int r;
         Object *o;
         uint64_t p = 0, last_epoch = 0, last_tag_realtime = 0, last_sealed_realtime = 0;
@@ -787,7 +1041,7 @@ int journal_file_verify(
         sd_id128_t entry_boot_id;
         bool entry_seqnum_set = false, entry_monotonic_set = false, entry_realtime_set = false, found_main_entry_array = false;
         uint64_t n_weird = 0, n_objects = 0, n_entries = 0, n_data = 0, n_fields = 0, n_data_hash_tables = 0, n_field_hash_tables = 0, n_entry_arrays = 0, n_tags = 0;
-        usec_t last_usec = 0;
+        bool found_data_overflow_table = false, found_field_overflow_table = false;
         int data_fd = -1, entry_fd = -1, entry_array_fd = -1;
         char data_path[] = "/var/tmp/journal-data-XXXXXX",
                 entry_path[] = "/var/tmp/journal-entry-XXXXXX",
@@ -798,12 +1052,13 @@ int journal_file_verify(
         uint64_t last_tag = 0;
 #endif
         assert(f);
+        assert(progress);
 
         if (key) {
 #ifdef HAVE_GCRYPT
                 r = journal_file_parse_verification_key(f, key);
                 if (r < 0) {
-                        log_error("Failed to parse seed.");
+                        verify_error("Failed to parse seed.");
                         return r;
                 }
 #else
@@ -812,9 +1067,15 @@ int journal_file_verify(
         } else if (f->seal)
                 return -ENOKEY;
 
+        r = journal_file_map_data_hash_table(f);
+        if (r < 0) {
+                verify_error("Failed to map data hash table: %s", strerror(-r));
+                return r;
+        }
+
         data_fd = mkostemp(data_path, O_CLOEXEC);
         if (data_fd < 0) {
-                log_error("Failed to create data file: %m");
+                verify_error("Failed to create data file: %m");
                 r = -errno;
                 goto fail;
         }
@@ -822,7 +1083,7 @@ int journal_file_verify(
 
         entry_fd = mkostemp(entry_path, O_CLOEXEC);
         if (entry_fd < 0) {
-                log_error("Failed to create entry file: %m");
+                verify_error("Failed to create entry file: %m");
                 r = -errno;
                 goto fail;
         }
@@ -830,26 +1091,21 @@ int journal_file_verify(
 
         entry_array_fd = mkostemp(entry_array_path, O_CLOEXEC);
         if (entry_array_fd < 0) {
-                log_error("Failed to create entry array file: %m");
+                verify_error("Failed to create entry array file: %m");
                 r = -errno;
                 goto fail;
         }
         unlink(entry_array_path);
 
-#ifdef HAVE_GCRYPT
-        if ((le32toh(f->header->compatible_flags) & ~HEADER_COMPATIBLE_SEALED) != 0)
-#else
-        if (f->header->compatible_flags != 0)
-#endif
-        {
-                log_error("Cannot verify file with unknown extensions.");
+        if ((le32toh(f->header->compatible_flags) & ~HEADER_COMPATIBLE_SUPPORTED) != 0) {
+                verify_error("Cannot verify file with unknown extensions.");
                 r = -ENOTSUP;
                 goto fail;
         }
 
         for (i = 0; i < sizeof(f->header->reserved); i++)
                 if (f->header->reserved[i] != 0) {
-                        log_error("Reserved field in non-zero.");
+                        verify_error("Reserved field in non-zero.");
                         r = -EBADMSG;
                         goto fail;
                 }
@@ -859,17 +1115,16 @@ int journal_file_verify(
 
         p = le64toh(f->header->header_size);
         while (p != 0) {
-                if (show_progress)
-                        draw_progress(0x7FFF * p / le64toh(f->header->tail_object_offset), &last_usec);
+                update_progress(progress, 0x7FFF * p / le64toh(f->header->tail_object_offset));
 
                 r = journal_file_move_to_object(f, -1, p, &o);
                 if (r < 0) {
-                        log_error("Invalid object at "OFSfmt, p);
+                        verify_error("Invalid object at "OFSfmt, p);
                         goto fail;
                 }
 
                 if (p > le64toh(f->header->tail_object_offset)) {
-                        log_error("Invalid tail object pointer");
+                        verify_error("Invalid tail object pointer");
                         r = -EBADMSG;
                         goto fail;
                 }
@@ -881,12 +1136,18 @@ int journal_file_verify(
 
                 r = journal_file_object_verify(f, p, o);
                 if (r < 0) {
-                        log_error("Invalid object contents at "OFSfmt": %s", p, strerror(-r));
+                        verify_error("Invalid object contents at "OFSfmt": %s", p, strerror(-r));
                         goto fail;
                 }
 
-                if ((o->object.flags & OBJECT_COMPRESSED) && !JOURNAL_HEADER_COMPRESSED(f->header)) {
-                        log_error("Compressed object in file without compression at "OFSfmt, p);
+                if ((o->object.flags & OBJECT_COMPRESSED_XZ) && !JOURNAL_HEADER_COMPRESSED_XZ(f->header)) {
+                        verify_error("XZ compressed object in file without XZ compression at "OFSfmt, p);
+                        r = -EBADMSG;
+                        goto fail;
+                }
+
+                if ((o->object.flags & OBJECT_COMPRESSED_LZ4) && !JOURNAL_HEADER_COMPRESSED_LZ4(f->header)) {
+                        verify_error("LZ4 compressed object in file without LZ4 compression at "OFSfmt, p);
                         r = -EBADMSG;
                         goto fail;
                 }
@@ -907,7 +1168,7 @@ int journal_file_verify(
 
                 case OBJECT_ENTRY:
                         if (JOURNAL_HEADER_SEALED(f->header) && n_tags <= 0) {
-                                log_error("First entry before first tag at "OFSfmt, p);
+                                verify_error("First entry before first tag at "OFSfmt, p);
                                 r = -EBADMSG;
                                 goto fail;
                         }
@@ -917,21 +1178,21 @@ int journal_file_verify(
                                 goto fail;
 
                         if (le64toh(o->entry.realtime) < last_tag_realtime) {
-                                log_error("Older entry after newer tag at "OFSfmt, p);
+                                verify_error("Older entry after newer tag at "OFSfmt, p);
                                 r = -EBADMSG;
                                 goto fail;
                         }
 
                         if (!entry_seqnum_set &&
                             le64toh(o->entry.seqnum) != le64toh(f->header->head_entry_seqnum)) {
-                                log_error("Head entry sequence number incorrect at "OFSfmt, p);
+                                verify_error("Head entry sequence number incorrect at "OFSfmt, p);
                                 r = -EBADMSG;
                                 goto fail;
                         }
 
                         if (entry_seqnum_set &&
                             entry_seqnum >= le64toh(o->entry.seqnum)) {
-                                log_error("Entry sequence number out of synchronization at "OFSfmt, p);
+                                verify_error("Entry sequence number out of synchronization at "OFSfmt, p);
                                 r = -EBADMSG;
                                 goto fail;
                         }
@@ -942,7 +1203,7 @@ int journal_file_verify(
                         if (entry_monotonic_set &&
                             sd_id128_equal(entry_boot_id, o->entry.boot_id) &&
                             entry_monotonic > le64toh(o->entry.monotonic)) {
-                                log_error("Entry timestamp out of synchronization at "OFSfmt, p);
+                                verify_error("Entry timestamp out of synchronization at "OFSfmt, p);
                                 r = -EBADMSG;
                                 goto fail;
                         }
@@ -953,7 +1214,7 @@ int journal_file_verify(
 
                         if (!entry_realtime_set &&
                             le64toh(o->entry.realtime) != le64toh(f->header->head_entry_realtime)) {
-                                log_error("Head entry realtime timestamp incorrect");
+                                verify_error("Head entry realtime timestamp incorrect");
                                 r = -EBADMSG;
                                 goto fail;
                         }
@@ -966,14 +1227,14 @@ int journal_file_verify(
 
                 case OBJECT_DATA_HASH_TABLE:
                         if (n_data_hash_tables > 1) {
-                                log_error("More than one data hash table at "OFSfmt, p);
+                                verify_error("More than one data hash table at "OFSfmt, p);
                                 r = -EBADMSG;
                                 goto fail;
                         }
 
                         if (le64toh(f->header->data_hash_table_offset) != p + offsetof(HashTableObject, items) ||
                             le64toh(f->header->data_hash_table_size) != le64toh(o->object.size) - offsetof(HashTableObject, items)) {
-                                log_error("Header fields for data hash table invalid");
+                                verify_error("Header fields for data hash table invalid");
                                 r = -EBADMSG;
                                 goto fail;
                         }
@@ -983,14 +1244,14 @@ int journal_file_verify(
 
                 case OBJECT_FIELD_HASH_TABLE:
                         if (n_field_hash_tables > 1) {
-                                log_error("More than one field hash table at "OFSfmt, p);
+                                verify_error("More than one field hash table at "OFSfmt, p);
                                 r = -EBADMSG;
                                 goto fail;
                         }
 
                         if (le64toh(f->header->field_hash_table_offset) != p + offsetof(HashTableObject, items) ||
                             le64toh(f->header->field_hash_table_size) != le64toh(o->object.size) - offsetof(HashTableObject, items)) {
-                                log_error("Header fields for field hash table invalid");
+                                verify_error("Header fields for field hash table invalid");
                                 r = -EBADMSG;
                                 goto fail;
                         }
@@ -998,6 +1259,26 @@ int journal_file_verify(
                         n_field_hash_tables++;
                         break;
 
+                case OBJECT_DATA_OVERFLOW_TABLE:
+                case OBJECT_FIELD_OVERFLOW_TABLE:
+                        /* Tables replaced by larger ones stay around,
+                         * only the current one is referenced */
+                        if (!JOURNAL_HEADER_OVERFLOW_TABLES(f->header)) {
+                                verify_error("Overflow table in file without overflow tables at "OFSfmt, p);
+                                r = -EBADMSG;
+                                goto fail;
+                        }
+
+                        if (o->object.type == OBJECT_DATA_OVERFLOW_TABLE) {
+                                if (p == le64toh(f->header->data_overflow_table_offset))
+                                        found_data_overflow_table = true;
+                        } else {
+                                if (p == le64toh(f->header->field_overflow_table_offset))
+                                        found_field_overflow_table = true;
+                        }
+
+                        break;
+
                 case OBJECT_ENTRY_ARRAY:
                         r = write_uint64(entry_array_fd, p);
                         if (r < 0)
@@ -1005,7 +1286,7 @@ int journal_file_verify(
 
                         if (p == le64toh(f->header->entry_array_offset)) {
                                 if (found_main_entry_array) {
-                                        log_error("More than one main entry array at "OFSfmt, p);
+                                        verify_error("More than one main entry array at "OFSfmt, p);
                                         r = -EBADMSG;
                                         goto fail;
                                 }
@@ -1018,19 +1299,19 @@ int journal_file_verify(
 
                 case OBJECT_TAG:
                         if (!JOURNAL_HEADER_SEALED(f->header)) {
-                                log_error("Tag object in file without sealing at "OFSfmt, p);
+                                verify_error("Tag object in file without sealing at "OFSfmt, p);
                                 r = -EBADMSG;
                                 goto fail;
                         }
 
                         if (le64toh(o->tag.seqnum) != n_tags + 1) {
-                                log_error("Tag sequence number out of synchronization at "OFSfmt, p);
+                                verify_error("Tag sequence number out of synchronization at "OFSfmt, p);
                                 r = -EBADMSG;
                                 goto fail;
                         }
 
                         if (le64toh(o->tag.epoch) < last_epoch) {
-                                log_error("Epoch sequence out of synchronization at "OFSfmt, p);
+                                verify_error("Epoch sequence out of synchronization at "OFSfmt, p);
                                 r = -EBADMSG;
                                 goto fail;
                         }
@@ -1039,11 +1320,11 @@ int journal_file_verify(
                         if (f->seal) {
                                 uint64_t q, rt;
 
-                                log_debug("Checking tag %"PRIu64"...", le64toh(o->tag.seqnum));
+                                verify_debug("Checking tag %"PRIu64"...", le64toh(o->tag.seqnum));
 
                                 rt = f->fss_start_usec + o->tag.epoch * f->fss_interval_usec;
                                 if (entry_realtime_set && entry_realtime >= rt + f->fss_interval_usec) {
-                                        log_error("Tag/entry realtime timestamp out of synchronization at "OFSfmt, p);
+                                        verify_error("Tag/entry realtime timestamp out of synchronization at "OFSfmt, p);
                                         r = -EBADMSG;
                                         goto fail;
                                 }
@@ -1086,7 +1367,7 @@ int journal_file_verify(
                                         goto fail;
 
                                 if (memcmp(o->tag.tag, gcry_md_read(f->hmac, 0), TAG_LENGTH) != 0) {
-                                        log_error("Tag failed verification at "OFSfmt, p);
+                                        verify_error("Tag failed verification at "OFSfmt, p);
                                         r = -EBADMSG;
                                         goto fail;
                                 }
@@ -1115,72 +1396,80 @@ int journal_file_verify(
         }
 
         if (!found_last) {
-                log_error("Tail object pointer dead");
+                verify_error("Tail object pointer dead");
                 r = -EBADMSG;
                 goto fail;
         }
 
         if (n_objects != le64toh(f->header->n_objects)) {
-                log_error("Object number mismatch");
+                verify_error("Object number mismatch");
                 r = -EBADMSG;
                 goto fail;
         }
 
         if (n_entries != le64toh(f->header->n_entries)) {
-                log_error("Entry number mismatch");
+                verify_error("Entry number mismatch");
                 r = -EBADMSG;
                 goto fail;
         }
 
         if (JOURNAL_HEADER_CONTAINS(f->header, n_data) &&
             n_data != le64toh(f->header->n_data)) {
-                log_error("Data number mismatch");
+                verify_error("Data number mismatch");
                 r = -EBADMSG;
                 goto fail;
         }
 
         if (JOURNAL_HEADER_CONTAINS(f->header, n_fields) &&
             n_fields != le64toh(f->header->n_fields)) {
-                log_error("Field number mismatch");
+                verify_error("Field number mismatch");
                 r = -EBADMSG;
                 goto fail;
         }
 
         if (JOURNAL_HEADER_CONTAINS(f->header, n_tags) &&
             n_tags != le64toh(f->header->n_tags)) {
-                log_error("Tag number mismatch");
+                verify_error("Tag number mismatch");
                 r = -EBADMSG;
                 goto fail;
         }
 
         if (JOURNAL_HEADER_CONTAINS(f->header, n_entry_arrays) &&
             n_entry_arrays != le64toh(f->header->n_entry_arrays)) {
-                log_error("Entry array number mismatch");
+                verify_error("Entry array number mismatch");
                 r = -EBADMSG;
                 goto fail;
         }
 
         if (n_data_hash_tables != 1) {
-                log_error("Missing data hash table");
+                verify_error("Missing data hash table");
                 r = -EBADMSG;
                 goto fail;
         }
 
         if (n_field_hash_tables != 1) {
-                log_error("Missing field hash table");
+                verify_error("Missing field hash table");
+                r = -EBADMSG;
+                goto fail;
+        }
+
+        if (JOURNAL_HEADER_CONTAINS(f->header, field_overflow_table_offset) &&
+            ((f->header->data_overflow_table_offset != 0 && !found_data_overflow_table) ||
+             (f->header->field_overflow_table_offset != 0 && !found_field_overflow_table))) {
+                verify_error("Missing overflow table");
                 r = -EBADMSG;
                 goto fail;
         }
 
         if (!found_main_entry_array) {
-                log_error("Missing entry array");
+                verify_error("Missing entry array");
                 r = -EBADMSG;
                 goto fail;
         }
 
         if (entry_seqnum_set &&
             entry_seqnum != le64toh(f->header->tail_entry_seqnum)) {
-                log_error("Invalid tail seqnum");
+                verify_error("Invalid tail seqnum");
                 r = -EBADMSG;
                 goto fail;
         }
@@ -1188,13 +1477,13 @@ int journal_file_verify(
         if (entry_monotonic_set &&
             (!sd_id128_equal(entry_boot_id, f->header->boot_id) ||
              entry_monotonic != le64toh(f->header->tail_entry_monotonic))) {
-                log_error("Invalid tail monotonic timestamp");
+                verify_error("Invalid tail monotonic timestamp");
                 r = -EBADMSG;
                 goto fail;
         }
 
         if (entry_realtime_set && entry_realtime != le64toh(f->header->tail_entry_realtime)) {
-                log_error("Invalid tail realtime timestamp");
+                verify_error("Invalid tail realtime timestamp");
                 r = -EBADMSG;
                 goto fail;
         }
@@ -1211,8 +1500,7 @@ int journal_file_verify(
                                data_fd, n_data,
                                entry_fd, n_entries,
                                entry_array_fd, n_entry_arrays,
-                               &last_usec,
-                               show_progress);
+                               progress);
         if (r < 0)
                 goto fail;
 
@@ -1220,13 +1508,12 @@ int journal_file_verify(
                               data_fd, n_data,
                               entry_fd, n_entries,
                               entry_array_fd, n_entry_arrays,
-                              &last_usec,
-                              show_progress);
+                              n_threads,
+                              progress);
         if (r < 0)
                 goto fail;
 
-        if (show_progress)
-                flush_progress();
+        finish_progress(progress);
 
         mmap_cache_close_fd(f->mmap, data_fd);
         mmap_cache_close_fd(f->mmap, entry_fd);
@@ -1246,14 +1533,13 @@ int journal_file_verify(
         return 0;
 
 fail:
-        if (show_progress)
-                flush_progress();
+        finish_progress(progress);
 
-        log_error("File corruption detected at %s:"OFSfmt" (of %llu bytes, %"PRIu64"%%).",
-                  f->path,
-                  p,
-                  (unsigned long long) f->last_stat.st_size,
-                  100 * p / f->last_stat.st_size);
+        verify_error("File corruption detected at %s:"OFSfmt" (of %llu bytes, %"PRIu64"%%).",
+                     f->path,
+                     p,
+                     (unsigned long long) f->last_stat.st_size,
+                     100 * p / f->last_stat.st_size);
 
         if (data_fd >= 0) {
                 mmap_cache_close_fd(f->mmap, data_fd);
@@ -1272,3 +1558,202 @@ fail:
 
         return r;
 }
+
+int journal_file_verify(
+                JournalFile *f,
+                const char *key,
+                usec_t *first_contained, usec_t *last_validated, usec_t *last_contained,
+                bool show_progress) {
+
+        VerifyProgress progress = {
+                .show = show_progress,
+        };
+
+        return verify_file(f, key, first_contained, last_validated, last_contained, verify_threads(), &progress);
+}
+
+typedef struct FileVerification {
+        JournalFile *file;
+
+        int r;
+        usec_t first_contained, last_validated, last_contained;
+
+        /* Whether something would have been logged */
+        bool noisy;
+
+        uint64_t progress;
+        bool done;
+} FileVerification;
+
+typedef struct FilesVerification {
+        FileVerification *files;
+        unsigned n_files;
+        const char *key;
+
+        /* The threads each file gets for its hash table */
+        unsigned n_threads;
+
+        pthread_mutex_t lock;
+        pthread_cond_t done;
+        unsigned next;
+        bool exit;
+} FilesVerification;
+
+static void *file_worker_thread(void *userdata) {
+        FilesVerification *v = userdata;
+
+        quiet = true;
+
+        assert_se(pthread_mutex_lock(&v->lock) == 0);
+
+        while (!v->exit && v->next < v->n_files) {
+                FileVerification *x = v->files + v->next++;
+                VerifyProgress progress = {
+                        .value = &x->progress,
+                };
+                JournalFile *f;
+                int r;
+
+                assert_se(pthread_mutex_unlock(&v->lock) == 0);
+
+                /* The file object belongs to the caller, and its mmap
+                 * cache is probably shared with other files, hence
+                 * use a private instance of the file */
+                n_suppressed = 0;
+
+                r = journal_file_open(x->file->path, O_RDONLY, 0, false, false, NULL, NULL, NULL, &f);
+                if (r >= 0) {
+                        r = verify_file(f, v->key,
+                                        &x->first_contained, &x->last_validated, &x->last_contained,
+                                        v->n_threads, &progress);
+                        journal_file_close(f);
+                }
+
+                assert_se(pthread_mutex_lock(&v->lock) == 0);
+
+                x->r = r;
+                x->noisy = n_suppressed > 0;
+                x->done = true;
+
+                assert_se(pthread_cond_broadcast(&v->done) == 0);
+        }
+
+        assert_se(pthread_mutex_unlock(&v->lock) == 0);
+
+        return NULL;
+}
+
+static void draw_files_progress(FileVerification *x, unsigned n, usec_t *last_usec) {
+        uint64_t total = 0, done = 0;
+        unsigned i;
+
+        for (i = 0; i < n; i++) {
+                uint64_t size = (uint64_t) x[i].file->last_stat.st_size;
+
+                total += size;
+                done += x[i].done ? size : size * x[i].progress / 0xFFFF;
+        }
+
+        if (total > 0)
+                draw_progress(0xFFFF * done / total, last_usec);
+}
+
+int journal_files_verify(
+                JournalFile **files, unsigned n_files,
+                const char *key,
+                bool show_progress,
+                journal_verify_callback_t callback,
+                void *userdata) {
+
+        _cleanup_free_ FileVerification *x = NULL;
+        _cleanup_free_ pthread_t *threads = NULL;
+        FilesVerification v = {};
+        unsigned n_cpus, n_workers, n_busy, n_threads = 0, i;
+        usec_t last_usec = 0;
+        int r = 0;
+
+        assert(files || n_files <= 0);
+        assert(callback);
+
+        n_cpus = verify_threads();
+        n_workers = MIN(n_cpus, n_files);
+
+        x = new0(FileVerification, n_files);
+        threads = new(pthread_t, n_workers);
+        if (!x || !threads)
+                return -ENOMEM;
+
+        for (i = 0; i < n_files; i++)
+                x[i].file = files[i];
+
+        v.files = x;
+        v.n_files = n_files;
+        v.key = key;
+
+        /* With fewer files than CPUs, the spare ones help with
+         * checking the hash tables */
+        n_busy = MAX(n_workers, 1U);
+        v.n_threads = MAX(n_cpus / n_busy, 1U);
+
+        assert_se(pthread_mutex_init(&v.lock, NULL) == 0);
+        assert_se(pthread_cond_init(&v.done, NULL) == 0);
+
+        for (; n_threads < n_workers; n_threads++)
+                if (pthread_create(threads + n_threads, NULL, file_worker_thread, &v) != 0)
+                        break;
+
+        /* The files are checked in any order, but reported in the
+         * order they were passed in */
+        for (i = 0; i < n_files; i++) {
+
+                if (n_threads > 0) {
+                        assert_se(pthread_mutex_lock(&v.lock) == 0);
+
+                        while (!x[i].done) {
+                                if (show_progress) {
+                                        struct timespec ts;
+
+                                        timespec_store(&ts, now(CLOCK_REALTIME) + 40 * USEC_PER_MSEC);
+                                        pthread_cond_timedwait(&v.done, &v.lock, &ts);
+
+                                        draw_files_progress(x, n_files, &last_usec);
+                                } else
+                                        assert_se(pthread_cond_wait(&v.done, &v.lock) == 0);
+                        }
+
+                        assert_se(pthread_mutex_unlock(&v.lock) == 0);
+
+                        if (show_progress)
+                                flush_progress();
+                }
+
+                if (n_threads <= 0 || x[i].r < 0 || x[i].noisy) {
+                        VerifyProgress progress = {
+                                .show = show_progress && n_threads <= 0,
+                        };
+
+                        /* Check the file (again) right here, so
+                         * that whatever is found is logged in
+                         * order */
+                        x[i].r = verify_file(files[i], key,
+                                             &x[i].first_contained, &x[i].last_validated, &x[i].last_contained,
+                                             n_threads > 0 ? v.n_threads : n_cpus, &progress);
+                }
+
+                r = callback(files[i], x[i].r, x[i].first_contained, x[i].last_validated, x[i].last_contained, userdata);
+                if (r < 0)
+                        break;
+        }
+
+        assert_se(pthread_mutex_lock(&v.lock) == 0);
+        v.exit = true;
+        assert_se(pthread_mutex_unlock(&v.lock) == 0);
+
+        for (i = 0; i < n_threads; i++)
+                pthread_join(threads[i], NULL);
+
+        pthread_cond_destroy(&v.done);
+        pthread_mutex_destroy(&v.lock);
+
+        return r < 0 ? r : 0;
+}
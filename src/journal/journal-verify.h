@@ -24,3 +24,8 @@
 #include "journal-file.h"
 
 int journal_file_verify(JournalFile *f, const char *key, usec_t *first_contained, usec_t *last_validated, usec_t *last_contained, bool show_progress);
+
+/* Called for each file in turn, once it has been checked */
+typedef int (*journal_verify_callback_t)(JournalFile *f, int r, usec_t first_contained, usec_t last_validated, usec_t last_contained, void *userdata);
+
+int journal_files_verify(JournalFile **files, unsigned n_files, const char *key, bool show_progress, journal_verify_callback_t callback, void *userdata);
@@ -1124,8 +1124,45 @@ finish:
 #endif
 }
 
+static int verify_report(JournalFile *f, int k, usec_t first, usec_t validated, usec_t last, void *userdata) {
+        int *r = userdata;
+
+#ifdef HAVE_GCRYPT
+        if (!arg_verify_key && JOURNAL_HEADER_SEALED(f->header))
+                log_notice("Journal file %s has sealing enabled but verification key has not been passed using --verify-key=.", f->path);
+#endif
+
+        if (k == -EINVAL) {
+                /* If the key was invalid give up right-away. */
+                return k;
+        } else if (k < 0) {
+                log_warning("FAIL: %s (%s)", f->path, strerror(-k));
+                *r = k;
+        } else {
+                char a[FORMAT_TIMESTAMP_MAX], b[FORMAT_TIMESTAMP_MAX], c[FORMAT_TIMESPAN_MAX];
+                log_info("PASS: %s", f->path);
+
+                if (arg_verify_key && JOURNAL_HEADER_SEALED(f->header)) {
+                        if (validated > 0) {
+                                log_info("=> Validated from %s to %s, final %s entries not sealed.",
+                                         format_timestamp(a, sizeof(a), first),
+                                         format_timestamp(b, sizeof(b), validated),
+                                         format_timespan(c, sizeof(c), last > validated ? last - validated : 0, 0));
+                        } else if (last > 0)
+                                log_info("=> No sealing yet, %s of entries not sealed.",
+                                         format_timespan(c, sizeof(c), last - first, 0));
+                        else
+                                log_info("=> No sealing yet, no entries in file.");
+                }
+        }
+
+        return 0;
+}
+
 static int verify(sd_journal *j) {
-        int r = 0;
+        _cleanup_free_ JournalFile **files = NULL;
+        unsigned n = 0;
+        int r = 0, k;
         Iterator i;
         JournalFile *f;
 
@@ -1133,40 +1170,23 @@ static int verify(sd_journal *j) {
 
         log_show_color(true);
 
-        HASHMAP_FOREACH(f, j->files, i) {
-                int k;
-                usec_t first, validated, last;
+        journal_open_pending_files(j);
 
-#ifdef HAVE_GCRYPT
-                if (!arg_verify_key && JOURNAL_HEADER_SEALED(f->header))
-                        log_notice("Journal file %s has sealing enabled but verification key has not been passed using --verify-key=.", f->path);
-#endif
+        if (hashmap_isempty(j->files))
+                return 0;
 
-                k = journal_file_verify(f, arg_verify_key, &first, &validated, &last, true);
-                if (k == -EINVAL) {
-                        /* If the key was invalid give up right-away. */
-                        return k;
-                } else if (k < 0) {
-                        log_warning("FAIL: %s (%s)", f->path, strerror(-k));
-                        r = k;
-                } else {
-                        char a[FORMAT_TIMESTAMP_MAX], b[FORMAT_TIMESTAMP_MAX], c[FORMAT_TIMESPAN_MAX];
-                        log_info("PASS: %s", f->path);
-
-                        if (arg_verify_key && JOURNAL_HEADER_SEALED(f->header)) {
-                                if (validated > 0) {
-                                        log_info("=> Validated from %s to %s, final %s entries not sealed.",
-                                                 format_timestamp(a, sizeof(a), first),
-                                                 format_timestamp(b, sizeof(b), validated),
-                                                 format_timespan(c, sizeof(c), last > validated ? last - validated : 0, 0));
-                                } else if (last > 0)
-                                        log_info("=> No sealing yet, %s of entries not sealed.",
-                                                 format_timespan(c, sizeof(c), last - first, 0));
-                                else
-                                        log_info("=> No sealing yet, no entries in file.");
-                        }
-                }
-        }
+        files = new(JournalFile*, hashmap_size(j->files));
+        if (!files)
+                return log_oom();
+
+        HASHMAP_FOREACH(f, j->files, i)
+                files[n++] = f;
+
+        /* The files are checked in parallel, but reported in the
+         * same order as always */
+        k = journal_files_verify(files, n, arg_verify_key, true, verify_report, &r);
+        if (k < 0)
+                return k;
 
         return r;
 }
@@ -1228,7 +1248,7 @@ static int access_check(sd_journal *j) {
         assert(j);
 
         if (set_isempty(j->errors)) {
-                if (hashmap_isempty(j->files))
+                if (hashmap_isempty(j->files) && hashmap_isempty(j->pending_files))
                         log_notice("No journal files were found.");
                 return 0;
         }
@@ -1260,7 +1280,7 @@ static int access_check(sd_journal *j) {
                 }
 #endif
 
-                if (hashmap_isempty(j->files)) {
+                if (hashmap_isempty(j->files) && hashmap_isempty(j->pending_files)) {
                         log_error("No journal files were opened due to insufficient permissions.");
                         r = -EACCES;
                 }
@@ -1631,6 +1651,8 @@ int main(int argc, char *argv[]) {
                         break;
                 }
 
+                fflush(stdout);
+
                 r = sd_journal_wait(j, (uint64_t) -1);
                 if (r < 0) {
                         log_error("Couldn't wait for journal event: %s", strerror(-r));
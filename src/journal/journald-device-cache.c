@@ -0,0 +1,323 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  Copyright 2013 Lennart Poettering
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <errno.h>
+
+#include "journald-device-cache.h"
+#include "hashmap.h"
+#include "strv.h"
+#include "log.h"
+
+/* Upper bound on the number of devices we keep fields for. A
+ * misbehaving driver usually complains about a handful of them. */
+#define ENTRIES_MAX 256
+
+/* If we couldn't subscribe to udev events, we don't learn about
+ * changes to a device, hence we trust cached fields only this long */
+#define ENTRY_MAX_AGE_USEC (1*USEC_PER_SEC)
+
+struct DeviceCache {
+        struct udev *udev;
+        struct udev_monitor *monitor;
+        unsigned max_fields;
+
+        Hashmap *entries;
+        DeviceCacheEntry *lru, *lru_tail;
+
+        unsigned long long n_hits;
+        unsigned long long n_misses;
+};
+
+DeviceCache *device_cache_new(struct udev *udev, unsigned max_fields) {
+        DeviceCache *c;
+
+        assert(udev);
+
+        c = new0(DeviceCache, 1);
+        if (!c)
+                return NULL;
+
+        c->entries = hashmap_new(string_hash_func, string_compare_func);
+        if (!c->entries) {
+                free(c);
+                return NULL;
+        }
+
+        c->udev = udev_ref(udev);
+        c->max_fields = max_fields;
+
+        /* We only care about devices after udev is done with them,
+         * since that's when their device nodes and symlinks change */
+        c->monitor = udev_monitor_new_from_netlink(udev, "udev");
+        if (!c->monitor || udev_monitor_enable_receiving(c->monitor) < 0) {
+                log_warning("Failed to subscribe to udev events, not caching device metadata for long.");
+
+                if (c->monitor) {
+                        udev_monitor_unref(c->monitor);
+                        c->monitor = NULL;
+                }
+        }
+
+        return c;
+}
+
+static void device_cache_entry_clear(DeviceCacheEntry *e) {
+        assert(e);
+
+        strv_free(e->fields);
+        e->fields = NULL;
+        e->n_fields = 0;
+}
+
+static void device_cache_entry_free(DeviceCacheEntry *e) {
+        assert(e);
+
+        if (e->cache) {
+                if (e->cache->lru_tail == e)
+                        e->cache->lru_tail = e->lru_prev;
+
+                LIST_REMOVE(DeviceCacheEntry, lru, e->cache->lru, e);
+                hashmap_remove(e->cache->entries, e->id);
+        }
+
+        device_cache_entry_clear(e);
+        free(e->id);
+        free(e);
+}
+
+static void device_cache_flush(DeviceCache *c) {
+        assert(c);
+
+        while (c->lru)
+                device_cache_entry_free(c->lru);
+}
+
+void device_cache_free(DeviceCache *c) {
+        if (!c)
+                return;
+
+        device_cache_flush(c);
+        hashmap_free(c->entries);
+
+        if (c->monitor)
+                udev_monitor_unref(c->monitor);
+
+        udev_unref(c->udev);
+        free(c);
+}
+
+static void device_cache_entry_add(DeviceCacheEntry *e, const char *prefix, const char *value) {
+        char *b;
+
+        assert(e);
+        assert(prefix);
+
+        if (!value || e->n_fields >= e->cache->max_fields)
+                return;
+
+        b = strappend(prefix, value);
+        if (!b)
+                return;
+
+        e->fields[e->n_fields++] = b;
+}
+
+static void device_cache_entry_fill(DeviceCacheEntry *e) {
+        struct udev_device *ud;
+        struct udev_list_entry *ll;
+
+        assert(e);
+
+        /* Like for the rest of the metadata, a field we can't
+         * determine is simply left out */
+
+        ud = udev_device_new_from_device_id(e->cache->udev, e->id);
+        if (!ud)
+                return;
+
+        e->fields = new0(char*, e->cache->max_fields + 1);
+        if (!e->fields)
+                goto finish;
+
+        device_cache_entry_add(e, "_UDEV_DEVNODE=", udev_device_get_devnode(ud));
+        device_cache_entry_add(e, "_UDEV_SYSNAME=", udev_device_get_sysname(ud));
+
+        ll = udev_device_get_devlinks_list_entry(ud);
+        udev_list_entry_foreach(ll, ll)
+                device_cache_entry_add(e, "_UDEV_DEVLINK=", udev_list_entry_get_name(ll));
+
+finish:
+        udev_device_unref(ud);
+}
+
+DeviceCacheEntry *device_cache_get(DeviceCache *c, const char *id) {
+        DeviceCacheEntry *e;
+        usec_t ts;
+
+        assert(c);
+        assert(id);
+
+        ts = now(CLOCK_MONOTONIC);
+
+        e = hashmap_get(c->entries, id);
+        if (e) {
+                /* Move to the front of the LRU list */
+                if (c->lru_tail == e)
+                        c->lru_tail = e->lru_prev;
+                LIST_REMOVE(DeviceCacheEntry, lru, c->lru, e);
+                LIST_PREPEND(DeviceCacheEntry, lru, c->lru, e);
+                if (!e->lru_next)
+                        c->lru_tail = e;
+
+                if (c->monitor ||
+                    e->timestamp + ENTRY_MAX_AGE_USEC > ts) {
+                        c->n_hits++;
+                        return e;
+                }
+
+                device_cache_entry_clear(e);
+        } else {
+                int r;
+
+                while (hashmap_size(c->entries) >= ENTRIES_MAX) {
+                        assert(c->lru_tail);
+                        device_cache_entry_free(c->lru_tail);
+                }
+
+                e = new0(DeviceCacheEntry, 1);
+                if (!e)
+                        return NULL;
+
+                e->id = strdup(id);
+                if (!e->id) {
+                        free(e);
+                        return NULL;
+                }
+
+                r = hashmap_put(c->entries, e->id, e);
+                if (r < 0) {
+                        free(e->id);
+                        free(e);
+                        return NULL;
+                }
+
+                e->cache = c;
+                LIST_PREPEND(DeviceCacheEntry, lru, c->lru, e);
+                if (!e->lru_next)
+                        c->lru_tail = e;
+        }
+
+        c->n_misses++;
+
+        e->timestamp = ts;
+        device_cache_entry_fill(e);
+
+        return e;
+}
+
+static char *device_id(struct udev_device *d) {
+        const char *subsystem, *ifindex, *sysname;
+        dev_t devnum;
+        char *id;
+
+        assert(d);
+
+        /* The same identifiers the kernel uses for the DEVICE=
+         * field of its messages, see udev_device_new_from_device_id() */
+
+        subsystem = udev_device_get_subsystem(d);
+
+        devnum = udev_device_get_devnum(d);
+        if (major(devnum) > 0) {
+                if (asprintf(&id, "%c%u:%u",
+                             streq_ptr(subsystem, "block") ? 'b' : 'c',
+                             major(devnum), minor(devnum)) < 0)
+                        return NULL;
+
+                return id;
+        }
+
+        ifindex = udev_device_get_property_value(d, "IFINDEX");
+        if (ifindex && !streq(ifindex, "0"))
+                return strappend("n", ifindex);
+
+        /* The sysname has '!' translated, the devpath doesn't */
+        sysname = strrchr(udev_device_get_devpath(d), '/');
+        if (!subsystem || !sysname)
+                return NULL;
+
+        return strjoin("+", subsystem, ":", sysname + 1, NULL);
+}
+
+int device_cache_get_fd(DeviceCache *c) {
+        assert(c);
+
+        if (!c->monitor)
+                return -1;
+
+        return udev_monitor_get_fd(c->monitor);
+}
+
+void device_cache_process_monitor(DeviceCache *c) {
+        assert(c);
+        assert(c->monitor);
+
+        for (;;) {
+                struct udev_device *d;
+                _cleanup_free_ char *id = NULL;
+                DeviceCacheEntry *e;
+
+                errno = 0;
+                d = udev_monitor_receive_device(c->monitor);
+                if (!d) {
+                        /* If we missed events, anything might have
+                         * changed */
+                        if (errno == ENOBUFS) {
+                                log_debug("Lost udev events, flushing device metadata cache.");
+                                device_cache_flush(c);
+                                continue;
+                        }
+
+                        break;
+                }
+
+                id = device_id(d);
+                udev_device_unref(d);
+
+                if (!id) {
+                        device_cache_flush(c);
+                        continue;
+                }
+
+                e = hashmap_get(c->entries, id);
+                if (e)
+                        device_cache_entry_free(e);
+        }
+}
+
+void device_cache_get_stats(DeviceCache *c, unsigned long long *hits, unsigned long long *misses) {
+        assert(c);
+
+        if (hits)
+                *hits = c->n_hits;
+        if (misses)
+                *misses = c->n_misses;
+}
@@ -0,0 +1,56 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+#pragma once
+
+/***
+  This file is part of systemd.
+
+  Copyright 2013 Lennart Poettering
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <libudev.h>
+
+#include "macro.h"
+#include "util.h"
+#include "list.h"
+
+typedef struct DeviceCache DeviceCache;
+typedef struct DeviceCacheEntry DeviceCacheEntry;
+
+/* The udev fields we attach to kernel messages about a device, as
+ * complete "_UDEV_XYZ=" strings. A device udev doesn't know about
+ * has no fields, which we cache as well. */
+struct DeviceCacheEntry {
+        DeviceCache *cache;
+
+        char *id;
+        usec_t timestamp;
+
+        char **fields;
+        unsigned n_fields;
+
+        LIST_FIELDS(DeviceCacheEntry, lru);
+};
+
+DeviceCache *device_cache_new(struct udev *udev, unsigned max_fields);
+void device_cache_free(DeviceCache *c);
+
+DeviceCacheEntry *device_cache_get(DeviceCache *c, const char *id);
+
+int device_cache_get_fd(DeviceCache *c);
+void device_cache_process_monitor(DeviceCache *c);
+
+void device_cache_get_stats(DeviceCache *c, unsigned long long *hits, unsigned long long *misses);
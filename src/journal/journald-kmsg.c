@@ -32,6 +32,9 @@
 #include "journald-kmsg.h"
 #include "journald-syslog.h"
 
+/* How many records we read from /dev/kmsg per wakeup */
+#define DEV_KMSG_BATCH_MAX 64U
+
 void server_forward_kmsg(
         Server *s,
         int priority,
@@ -216,54 +219,15 @@ static void dev_kmsg_record(Server *s, char *p, size_t l) {
                 k = e + 1;
         }
 
+        /* Looking up the device in sysfs and the udev database
+         * for each message would be expensive, hence the cache */
         if (kernel_device) {
-                struct udev_device *ud;
-
-                ud = udev_device_new_from_device_id(s->udev, kernel_device);
-                if (ud) {
-                        const char *g;
-                        struct udev_list_entry *ll;
-                        char *b;
-
-                        g = udev_device_get_devnode(ud);
-                        if (g) {
-                                b = strappend("_UDEV_DEVNODE=", g);
-                                if (b) {
-                                        IOVEC_SET_STRING(iovec[n++], b);
-                                        z++;
-                                }
-                        }
-
-                        g = udev_device_get_sysname(ud);
-                        if (g) {
-                                b = strappend("_UDEV_SYSNAME=", g);
-                                if (b) {
-                                        IOVEC_SET_STRING(iovec[n++], b);
-                                        z++;
-                                }
-                        }
-
-                        j = 0;
-                        ll = udev_device_get_devlinks_list_entry(ud);
-                        udev_list_entry_foreach(ll, ll) {
+                DeviceCacheEntry *de;
 
-                                if (j > N_IOVEC_UDEV_FIELDS)
-                                        break;
-
-                                g = udev_list_entry_get_name(ll);
-                                if (g) {
-                                        b = strappend("_UDEV_DEVLINK=", g);
-                                        if (b) {
-                                                IOVEC_SET_STRING(iovec[n++], b);
-                                                z++;
-                                        }
-                                }
-
-                                j++;
-                        }
-
-                        udev_device_unref(ud);
-                }
+                de = device_cache_get(s->device_cache, kernel_device);
+                if (de)
+                        for (j = 0; j < de->n_fields; j++)
+                                IOVEC_SET_STRING(iovec[n++], de->fields[j]);
         }
 
         if (asprintf(&source_time, "_SOURCE_MONOTONIC_TIMESTAMP=%llu", usec) >= 0)
@@ -322,32 +286,40 @@ finish:
 
 int server_read_dev_kmsg(Server *s) {
         char buffer[8192+1]; /* the kernel-side limit per record is 8K currently */
-        ssize_t l;
+        unsigned i;
 
         assert(s);
         assert(s->dev_kmsg_fd >= 0);
 
-        l = read(s->dev_kmsg_fd, buffer, sizeof(buffer) - 1);
-        if (l == 0)
-                return 0;
-        if (l < 0) {
-                /* Old kernels who don't allow reading from /dev/kmsg
-                 * return EINVAL when we try. So handle this cleanly,
-                 * but don' try to ever read from it again. */
-                if (errno == EINVAL) {
-                        epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, s->dev_kmsg_fd, NULL);
-                        return 0;
-                }
+        /* Each read() returns a single record. A noisy driver
+         * produces many of them at once, which we read in one go,
+         * but not so many that the other sources have to wait. */
+        for (i = 0; i < DEV_KMSG_BATCH_MAX; i++) {
+                ssize_t l;
 
-                if (errno == EAGAIN || errno == EINTR || errno == EPIPE)
-                        return 0;
+                l = read(s->dev_kmsg_fd, buffer, sizeof(buffer) - 1);
+                if (l == 0)
+                        break;
+                if (l < 0) {
+                        /* Old kernels who don't allow reading from /dev/kmsg
+                         * return EINVAL when we try. So handle this cleanly,
+                         * but don' try to ever read from it again. */
+                        if (errno == EINVAL) {
+                                epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, s->dev_kmsg_fd, NULL);
+                                break;
+                        }
 
-                log_error("Failed to read from kernel: %m");
-                return -errno;
+                        if (errno == EAGAIN || errno == EINTR || errno == EPIPE)
+                                break;
+
+                        log_error("Failed to read from kernel: %m");
+                        return -errno;
+                }
+
+                dev_kmsg_record(s, buffer, l);
         }
 
-        dev_kmsg_record(s, buffer, l);
-        return 1;
+        return i > 0;
 }
 
 int server_flush_dev_kmsg(Server *s) {
@@ -0,0 +1,220 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  Copyright 2013 Lennart Poettering
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <errno.h>
+
+#include "journald-pid-cache.h"
+#include "hashmap.h"
+#include "cgroup-util.h"
+#include "audit.h"
+
+/* Upper bound on the number of processes we keep metadata for. This
+ * needs to be at least 2, since a single message might reference
+ * both the sender and an object process. */
+#define ENTRIES_MAX 1024
+
+/* How long we trust cached metadata before we refresh it from
+ * /proc. The start time check below catches PID reuse, but not
+ * execve() or a process moving between cgroups, hence the limit. */
+#define ENTRY_MAX_AGE_USEC (1*USEC_PER_SEC)
+
+struct PidCache {
+        Hashmap *entries;
+        PidCacheEntry *lru, *lru_tail;
+
+        unsigned long long n_hits;
+        unsigned long long n_misses;
+};
+
+PidCache *pid_cache_new(void) {
+        PidCache *c;
+
+        assert_cc(ENTRIES_MAX >= 2);
+
+        c = new0(PidCache, 1);
+        if (!c)
+                return NULL;
+
+        /* journald's receiver threads have caches of their own,
+         * and the hashmap pool is not thread-safe */
+        c->entries = hashmap_new_unpooled(trivial_hash_func, trivial_compare_func);
+        if (!c->entries) {
+                free(c);
+                return NULL;
+        }
+
+        return c;
+}
+
+static void pid_cache_entry_clear(PidCacheEntry *e) {
+        assert(e);
+
+        free(e->comm);
+        free(e->exe);
+        free(e->cmdline);
+        free(e->capeff);
+        free(e->cgroup);
+        free(e->session);
+        free(e->unit);
+        free(e->user_unit);
+
+        e->comm = e->exe = e->cmdline = e->capeff = NULL;
+        e->cgroup = e->session = e->unit = e->user_unit = NULL;
+
+        e->uid_valid = e->gid_valid = false;
+        e->audit_session_valid = e->audit_loginuid_valid = false;
+        e->owner_uid_valid = false;
+}
+
+static void pid_cache_entry_free(PidCacheEntry *e) {
+        assert(e);
+
+        if (e->cache) {
+                if (e->cache->lru_tail == e)
+                        e->cache->lru_tail = e->lru_prev;
+
+                LIST_REMOVE(PidCacheEntry, lru, e->cache->lru, e);
+                hashmap_remove(e->cache->entries, UINT32_TO_PTR(e->pid));
+        }
+
+        pid_cache_entry_clear(e);
+        free(e);
+}
+
+void pid_cache_free(PidCache *c) {
+        if (!c)
+                return;
+
+        while (c->lru)
+                pid_cache_entry_free(c->lru);
+
+        hashmap_free(c->entries);
+        free(c);
+}
+
+static void pid_cache_entry_fill(PidCacheEntry *e) {
+        assert(e);
+
+        /* Everything here is best-effort: if the process is gone
+         * or some bit is not available we simply leave it unset,
+         * exactly like we'd do if we read it for each message. */
+
+        e->uid_valid = get_process_uid(e->pid, &e->uid) >= 0;
+        e->gid_valid = get_process_gid(e->pid, &e->gid) >= 0;
+
+        get_process_comm(e->pid, &e->comm);
+        get_process_exe(e->pid, &e->exe);
+        get_process_cmdline(e->pid, 0, false, &e->cmdline);
+        get_process_capeff(e->pid, &e->capeff);
+
+#ifdef HAVE_AUDIT
+        e->audit_session_valid = audit_session_from_pid(e->pid, &e->audit_session) >= 0;
+        e->audit_loginuid_valid = audit_loginuid_from_pid(e->pid, &e->audit_loginuid) >= 0;
+#endif
+
+        if (cg_pid_get_path_shifted(e->pid, NULL, &e->cgroup) < 0)
+                return;
+
+        cg_path_get_session(e->cgroup, &e->session);
+        e->owner_uid_valid = cg_path_get_owner_uid(e->cgroup, &e->owner_uid) >= 0;
+
+        if (cg_path_get_unit(e->cgroup, &e->unit) < 0)
+                cg_path_get_user_unit(e->cgroup, &e->user_unit);
+}
+
+PidCacheEntry *pid_cache_get(PidCache *c, pid_t pid) {
+        PidCacheEntry *e;
+        unsigned long long st;
+        usec_t ts;
+
+        assert(c);
+
+        if (pid <= 0)
+                return NULL;
+
+        /* Reading the start time is a single small read, and
+         * allows us to detect PID reuse reliably. If the process
+         * is already gone, there's nothing to cache anyway. */
+        if (get_starttime_of_pid(pid, &st) < 0)
+                return NULL;
+
+        ts = now(CLOCK_MONOTONIC);
+
+        e = hashmap_get(c->entries, UINT32_TO_PTR(pid));
+        if (e) {
+                /* Move to the front of the LRU list */
+                if (c->lru_tail == e)
+                        c->lru_tail = e->lru_prev;
+                LIST_REMOVE(PidCacheEntry, lru, c->lru, e);
+                LIST_PREPEND(PidCacheEntry, lru, c->lru, e);
+                if (!e->lru_next)
+                        c->lru_tail = e;
+
+                if (e->starttime == st &&
+                    e->timestamp + ENTRY_MAX_AGE_USEC > ts) {
+                        c->n_hits++;
+                        return e;
+                }
+
+                pid_cache_entry_clear(e);
+        } else {
+                int r;
+
+                while (hashmap_size(c->entries) >= ENTRIES_MAX) {
+                        assert(c->lru_tail);
+                        pid_cache_entry_free(c->lru_tail);
+                }
+
+                e = new0(PidCacheEntry, 1);
+                if (!e)
+                        return NULL;
+
+                e->pid = pid;
+
+                r = hashmap_put(c->entries, UINT32_TO_PTR(pid), e);
+                if (r < 0) {
+                        free(e);
+                        return NULL;
+                }
+
+                e->cache = c;
+                LIST_PREPEND(PidCacheEntry, lru, c->lru, e);
+                if (!e->lru_next)
+                        c->lru_tail = e;
+        }
+
+        c->n_misses++;
+
+        e->starttime = st;
+        e->timestamp = ts;
+        pid_cache_entry_fill(e);
+
+        return e;
+}
+
+void pid_cache_get_stats(PidCache *c, unsigned long long *hits, unsigned long long *misses) {
+        assert(c);
+
+        if (hits)
+                *hits = c->n_hits;
+        if (misses)
+                *misses = c->n_misses;
+}
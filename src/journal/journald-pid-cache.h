@@ -0,0 +1,75 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+#pragma once
+
+/***
+  This file is part of systemd.
+
+  Copyright 2013 Lennart Poettering
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "macro.h"
+#include "util.h"
+#include "list.h"
+
+typedef struct PidCache PidCache;
+typedef struct PidCacheEntry PidCacheEntry;
+
+/* Metadata about a client process we'd otherwise have to read from
+ * /proc for every single message it sends us. Strings that couldn't
+ * be determined are NULL, the _valid booleans cover the rest. */
+struct PidCacheEntry {
+        PidCache *cache;
+
+        pid_t pid;
+        unsigned long long starttime;
+        usec_t timestamp;
+
+        uid_t uid;
+        gid_t gid;
+        bool uid_valid:1;
+        bool gid_valid:1;
+
+        char *comm;
+        char *exe;
+        char *cmdline;
+        char *capeff;
+
+        uint32_t audit_session;
+        uid_t audit_loginuid;
+        bool audit_session_valid:1;
+        bool audit_loginuid_valid:1;
+
+        char *cgroup;
+        char *session;
+        char *unit;
+        char *user_unit;
+
+        uid_t owner_uid;
+        bool owner_uid_valid:1;
+
+        LIST_FIELDS(PidCacheEntry, lru);
+};
+
+PidCache *pid_cache_new(void);
+void pid_cache_free(PidCache *c);
+
+PidCacheEntry *pid_cache_get(PidCache *c, pid_t pid);
+
+void pid_cache_get_stats(PidCache *c, unsigned long long *hits, unsigned long long *misses);
@@ -28,8 +28,15 @@
 #include "hashmap.h"
 
 #define POOLS_MAX 5
-#define BUCKETS_MAX 127
-#define GROUPS_MAX 2047
+
+/* Groups are forgotten once they have been idle for a full interval,
+ * at which point all their buckets are full again anyway. This is
+ * only a safety net against unbounded growth. */
+#define GROUPS_MAX 65536
+
+/* Upper limit for the memory used by deferred messages of all groups
+ * together */
+#define DEFERRED_SIZE_MAX (16*1024*1024)
 
 static const int priority_map[] = {
         [LOG_EMERG]   = 0,
@@ -44,11 +51,22 @@ static const int priority_map[] = {
 
 typedef struct JournalRateLimitPool JournalRateLimitPool;
 typedef struct JournalRateLimitGroup JournalRateLimitGroup;
+typedef struct JournalRateLimitDeferred JournalRateLimitDeferred;
 
+/* A token bucket. To avoid rounding, the credit is counted in units
+ * of 1/interval messages: it grows by burst units every microsecond,
+ * up to burst * interval, and every message costs interval units. */
 struct JournalRateLimitPool {
-        usec_t begin;
-        unsigned num;
-        unsigned suppressed;
+        usec_t timestamp;
+        uint64_t credit;
+};
+
+struct JournalRateLimitDeferred {
+        void *entry;
+        size_t size;
+        int priority;
+
+        LIST_FIELDS(JournalRateLimitDeferred, deferred);
 };
 
 struct JournalRateLimitGroup {
@@ -56,50 +74,95 @@ struct JournalRateLimitGroup {
 
         char *id;
         JournalRateLimitPool pools[POOLS_MAX];
-        unsigned hash;
+        usec_t last_used;
+
+        /* Counted since they have been reported the last time */
+        unsigned suppressed;
+        unsigned deferred;
+
+        LIST_HEAD(JournalRateLimitDeferred, queue);
+        JournalRateLimitDeferred *queue_tail;
+        unsigned n_queued;
 
-        LIST_FIELDS(JournalRateLimitGroup, bucket);
         LIST_FIELDS(JournalRateLimitGroup, lru);
+        LIST_FIELDS(JournalRateLimitGroup, queued);
 };
 
 struct JournalRateLimit {
         usec_t interval;
         unsigned burst;
 
-        JournalRateLimitGroup* buckets[BUCKETS_MAX];
+        Hashmap *groups;
         JournalRateLimitGroup *lru, *lru_tail;
 
-        unsigned n_groups;
+        /* Groups with deferred messages, in the order they get to
+         * release them */
+        JournalRateLimitGroup *queued, *queued_tail;
+
+        unsigned queue_max;
+        size_t deferred_size;
+        void (*free_entry)(void *entry);
+
+        /* Messages that were suppressed or still queued in groups
+         * that had to be forgotten before they could be reported */
+        unsigned evicted;
 };
 
-JournalRateLimit *journal_rate_limit_new(usec_t interval, unsigned burst) {
+JournalRateLimit *journal_rate_limit_new(usec_t interval, unsigned burst, unsigned queue_max, void (*free_entry)(void *entry)) {
         JournalRateLimit *r;
 
         assert(interval > 0 || burst == 0);
+        assert(queue_max == 0 || free_entry);
 
         r = new0(JournalRateLimit, 1);
         if (!r)
                 return NULL;
 
+        /* The rate limit is used from the receiver threads too */
+        r->groups = hashmap_new_unpooled(string_hash_func, string_compare_func);
+        if (!r->groups) {
+                free(r);
+                return NULL;
+        }
+
         r->interval = interval;
         r->burst = burst;
+        r->queue_max = queue_max;
+        r->free_entry = free_entry;
 
         return r;
 }
 
 static void journal_rate_limit_group_free(JournalRateLimitGroup *g) {
+        JournalRateLimitDeferred *d;
+
         assert(g);
 
         if (g->parent) {
-                assert(g->parent->n_groups > 0);
-
                 if (g->parent->lru_tail == g)
                         g->parent->lru_tail = g->lru_prev;
 
                 LIST_REMOVE(JournalRateLimitGroup, lru, g->parent->lru, g);
-                LIST_REMOVE(JournalRateLimitGroup, bucket, g->parent->buckets[g->hash % BUCKETS_MAX], g);
 
-                g->parent->n_groups --;
+                if (g->n_queued > 0) {
+                        if (g->parent->queued_tail == g)
+                                g->parent->queued_tail = g->queued_prev;
+
+                        LIST_REMOVE(JournalRateLimitGroup, queued, g->parent->queued, g);
+                }
+
+                hashmap_remove(g->parent->groups, g->id);
+        }
+
+        while ((d = g->queue)) {
+                LIST_REMOVE(JournalRateLimitDeferred, deferred, g->queue, d);
+
+                if (g->parent) {
+                        g->parent->deferred_size -= d->size;
+                        g->parent->free_entry(d->entry);
+                }
+
+                free(d);
         }
 
         free(g->id);
@@ -112,30 +175,32 @@ void journal_rate_limit_free(JournalRateLimit *r) {
         while (r->lru)
                 journal_rate_limit_group_free(r->lru);
 
+        hashmap_free(r->groups);
         free(r);
 }
 
 _pure_ static bool journal_rate_limit_group_expired(JournalRateLimitGroup *g, usec_t ts) {
-        unsigned i;
-
         assert(g);
 
-        for (i = 0; i < POOLS_MAX; i++)
-                if (g->pools[i].begin + g->parent->interval >= ts)
-                        return false;
-
-        return true;
+        return g->n_queued <= 0 && g->last_used + g->parent->interval < ts;
 }
 
 static void journal_rate_limit_vacuum(JournalRateLimit *r, usec_t ts) {
         assert(r);
 
         /* Makes room for at least one new item, but drop all
-         * expored items too. */
+         * expired items too. */
+
+        while (r->lru_tail && journal_rate_limit_group_expired(r->lru_tail, ts))
+                journal_rate_limit_group_free(r->lru_tail);
 
-        while (r->n_groups >= GROUPS_MAX ||
-               (r->lru_tail && journal_rate_limit_group_expired(r->lru_tail, ts)))
+        /* Groups evicted at the cap may still be waiting to report
+         * what they suppressed, and their queued messages are lost
+         * now, too. Don't let them vanish from the statistics. */
+        while (r->lru_tail && hashmap_size(r->groups) >= GROUPS_MAX) {
+                r->evicted += r->lru_tail->suppressed + r->lru_tail->n_queued;
                 journal_rate_limit_group_free(r->lru_tail);
+        }
 }
 
 static JournalRateLimitGroup* journal_rate_limit_group_new(JournalRateLimit *r, const char *id, usec_t ts) {
@@ -152,15 +217,14 @@ static JournalRateLimitGroup* journal_rate_limit_group_new(JournalRateLimit *r,
         if (!g->id)
                 goto fail;
 
-        g->hash = string_hash_func(g->id);
-
         journal_rate_limit_vacuum(r, ts);
 
-        LIST_PREPEND(JournalRateLimitGroup, bucket, r->buckets[g->hash % BUCKETS_MAX], g);
+        if (hashmap_put(r->groups, g->id, g) < 0)
+                goto fail;
+
         LIST_PREPEND(JournalRateLimitGroup, lru, r->lru, g);
         if (!g->lru_next)
                 r->lru_tail = g;
-        r->n_groups ++;
 
         g->parent = r;
         return g;
@@ -170,6 +234,28 @@ fail:
         return NULL;
 }
 
+static JournalRateLimitGroup* journal_rate_limit_group_get(JournalRateLimit *r, const char *id, usec_t ts) {
+        JournalRateLimitGroup *g;
+
+        assert(r);
+        assert(id);
+
+        g = hashmap_get(r->groups, id);
+        if (!g)
+                return journal_rate_limit_group_new(r, id, ts);
+
+        /* Move to the front of the LRU list */
+        if (r->lru != g) {
+                if (r->lru_tail == g)
+                        r->lru_tail = g->lru_prev;
+
+                LIST_REMOVE(JournalRateLimitGroup, lru, r->lru, g);
+                LIST_PREPEND(JournalRateLimitGroup, lru, r->lru, g);
+        }
+
+        return g;
+}
+
 static unsigned burst_modulate(unsigned burst, uint64_t available) {
         unsigned k;
 
@@ -193,13 +279,54 @@ static unsigned burst_modulate(unsigned burst, uint64_t available) {
          *         4GB = rate * 4
          *        64GB = rate * 5
          *         1TB = rate * 6
+         *
+         * Between 1MB and 16MB small bursts would be rounded
+         * down to nothing, which would stop the buckets from ever
+         * refilling again.
          */
 
-        return burst;
+        return MAX(burst, 1U);
+}
+
+static void journal_rate_limit_pool_refill(JournalRateLimit *r, JournalRateLimitPool *p, unsigned burst, usec_t ts) {
+        uint64_t max;
+
+        assert(r);
+        assert(p);
+
+        max = (uint64_t) burst * r->interval;
+
+        if (p->timestamp <= 0)
+                p->credit = max;
+        else if (ts > p->timestamp) {
+                usec_t d;
+
+                d = MIN(ts - p->timestamp, r->interval);
+                p->credit = MIN(p->credit + d * burst, max);
+        }
+
+        p->timestamp = ts;
 }
 
-int journal_rate_limit_test(JournalRateLimit *r, const char *id, int priority, uint64_t available) {
-        unsigned h;
+static void journal_rate_limit_report(JournalRateLimitGroup *g, unsigned *suppressed, unsigned *deferred) {
+        assert(g);
+
+        if (suppressed)
+                *suppressed = g->suppressed;
+        if (deferred)
+                *deferred = g->deferred;
+
+        g->suppressed = g->deferred = 0;
+}
+
+int journal_rate_limit_test(
+                JournalRateLimit *r,
+                const char *id,
+                int priority,
+                uint64_t available,
+                unsigned *suppressed,
+                unsigned *deferred) {
+
         JournalRateLimitGroup *g;
         JournalRateLimitPool *p;
         unsigned burst;
@@ -207,6 +334,11 @@ int journal_rate_limit_test(JournalRateLimit *r, const char *id, int priority, u
 
         assert(id);
 
+        if (suppressed)
+                *suppressed = 0;
+        if (deferred)
+                *deferred = 0;
+
         if (!r)
                 return 1;
 
@@ -217,44 +349,205 @@ int journal_rate_limit_test(JournalRateLimit *r, const char *id, int priority, u
 
         ts = now(CLOCK_MONOTONIC);
 
-        h = string_hash_func(id);
-        g = r->buckets[h % BUCKETS_MAX];
+        g = journal_rate_limit_group_get(r, id, ts);
+        if (!g)
+                return -ENOMEM;
 
-        LIST_FOREACH(bucket, g, g)
-                if (streq(g->id, id))
-                        break;
+        g->last_used = ts;
 
-        if (!g) {
-                g = journal_rate_limit_group_new(r, id, ts);
-                if (!g)
-                        return -ENOMEM;
-        }
+        /* Messages that come in while earlier ones are still
+         * deferred have to wait their turn */
+        if (g->n_queued > 0)
+                goto limited;
 
         p = &g->pools[priority_map[priority]];
+        journal_rate_limit_pool_refill(r, p, burst, ts);
 
-        if (p->begin <= 0) {
-                p->suppressed = 0;
-                p->num = 1;
-                p->begin = ts;
+        if (p->credit >= r->interval) {
+                p->credit -= r->interval;
+                journal_rate_limit_report(g, suppressed, deferred);
                 return 1;
         }
 
-        if (p->begin + r->interval < ts) {
-                unsigned s;
+limited:
+        if (r->queue_max > 0 &&
+            g->n_queued < r->queue_max &&
+            r->deferred_size < DEFERRED_SIZE_MAX)
+                return -EAGAIN;
 
-                s = p->suppressed;
-                p->suppressed = 0;
-                p->num = 1;
-                p->begin = ts;
+        g->suppressed++;
+        return 0;
+}
 
-                return 1 + s;
-        }
+int journal_rate_limit_defer(JournalRateLimit *r, const char *id, int priority, void *entry, size_t size) {
+        JournalRateLimitGroup *g;
+        JournalRateLimitDeferred *d;
 
-        if (p->num <= burst) {
-                p->num++;
-                return 1;
+        assert(r);
+        assert(r->queue_max > 0);
+        assert(id);
+        assert(entry);
+
+        /* Takes possession of the entry, to be handed out again by
+         * journal_rate_limit_dequeue() */
+
+        g = hashmap_get(r->groups, id);
+        if (!g)
+                goto fail;
+
+        d = new0(JournalRateLimitDeferred, 1);
+        if (!d)
+                goto fail;
+
+        d->entry = entry;
+        d->size = size;
+        d->priority = priority;
+
+        LIST_INSERT_AFTER(JournalRateLimitDeferred, deferred, g->queue, g->queue_tail, d);
+        g->queue_tail = d;
+
+        if (g->n_queued++ <= 0) {
+                LIST_INSERT_AFTER(JournalRateLimitGroup, queued, r->queued, r->queued_tail, g);
+                r->queued_tail = g;
         }
 
-        p->suppressed++;
+        g->deferred++;
+        r->deferred_size += size;
+
         return 0;
+
+fail:
+        if (g)
+                g->suppressed++;
+
+        r->free_entry(entry);
+        return -ENOMEM;
+}
+
+static bool journal_rate_limit_group_ready(JournalRateLimitGroup *g, unsigned burst, usec_t ts) {
+        JournalRateLimitPool *p;
+
+        assert(g);
+        assert(g->queue);
+
+        p = &g->pools[priority_map[g->queue->priority]];
+        journal_rate_limit_pool_refill(g->parent, p, burst, ts);
+
+        return p->credit >= g->parent->interval;
+}
+
+void *journal_rate_limit_dequeue(
+                JournalRateLimit *r,
+                uint64_t available,
+                bool force,
+                const char **id,
+                unsigned *suppressed,
+                unsigned *deferred) {
+
+        JournalRateLimitGroup *g;
+        JournalRateLimitDeferred *d;
+        unsigned burst;
+        usec_t ts;
+        void *entry;
+
+        assert(r);
+        assert(id);
+
+        /* Returns the next deferred message that may be written
+         * now. The groups take turns, so that a single noisy group
+         * cannot hold back the others. Once the last message of a
+         * group has been returned, the number of messages that were
+         * suppressed and deferred since the last report is
+         * returned, too. */
+
+        burst = burst_modulate(r->burst, available);
+        ts = now(CLOCK_MONOTONIC);
+
+        LIST_FOREACH(queued, g, r->queued)
+                if (force || journal_rate_limit_group_ready(g, burst, ts))
+                        break;
+
+        if (!g)
+                return NULL;
+
+        d = g->queue;
+        LIST_REMOVE(JournalRateLimitDeferred, deferred, g->queue, d);
+        if (g->queue_tail == d)
+                g->queue_tail = NULL;
+        g->n_queued--;
+
+        if (!force)
+                g->pools[priority_map[d->priority]].credit -= r->interval;
+
+        if (r->queued_tail == g)
+                r->queued_tail = g->queued_prev;
+        LIST_REMOVE(JournalRateLimitGroup, queued, r->queued, g);
+
+        *id = g->id;
+
+        if (g->n_queued > 0) {
+                /* Back to the end of the line */
+                LIST_INSERT_AFTER(JournalRateLimitGroup, queued, r->queued, r->queued_tail, g);
+                r->queued_tail = g;
+
+                if (suppressed)
+                        *suppressed = 0;
+                if (deferred)
+                        *deferred = 0;
+        } else
+                journal_rate_limit_report(g, suppressed, deferred);
+
+        r->deferred_size -= d->size;
+        entry = d->entry;
+        free(d);
+
+        return entry;
+}
+
+unsigned journal_rate_limit_evicted(JournalRateLimit *r) {
+        unsigned n;
+
+        /* Returns the number of messages lost with groups that had
+         * to be forgotten since the last call */
+
+        if (!r)
+                return 0;
+
+        n = r->evicted;
+        r->evicted = 0;
+
+        return n;
+}
+
+usec_t journal_rate_limit_next(JournalRateLimit *r, uint64_t available) {
+        JournalRateLimitGroup *g;
+        unsigned burst;
+        usec_t ts, next = 0;
+
+        assert(r);
+
+        /* Returns when the next deferred message may be written, or
+         * 0 if there is none */
+
+        if (!r->queued)
+                return 0;
+
+        burst = burst_modulate(r->burst, available);
+        ts = now(CLOCK_MONOTONIC);
+
+        LIST_FOREACH(queued, g, r->queued) {
+                JournalRateLimitPool *p;
+                usec_t t;
+
+                if (journal_rate_limit_group_ready(g, burst, ts))
+                        return ts;
+
+                p = &g->pools[priority_map[g->queue->priority]];
+                t = ts + (r->interval - p->credit + burst - 1) / burst;
+
+                if (next <= 0 || t < next)
+                        next = t;
+        }
+
+        return next;
 }
@@ -26,6 +26,14 @@
 
 typedef struct JournalRateLimit JournalRateLimit;
 
-JournalRateLimit *journal_rate_limit_new(usec_t interval, unsigned burst);
+JournalRateLimit *journal_rate_limit_new(usec_t interval, unsigned burst, unsigned queue_max, void (*free_entry)(void *entry));
 void journal_rate_limit_free(JournalRateLimit *r);
-int journal_rate_limit_test(JournalRateLimit *r, const char *id, int priority, uint64_t available);
+
+/* Returns > 0 if the message may be written, 0 if it shall be
+ * dropped, and -EAGAIN if it shall be passed to
+ * journal_rate_limit_defer() instead. */
+int journal_rate_limit_test(JournalRateLimit *r, const char *id, int priority, uint64_t available, unsigned *suppressed, unsigned *deferred);
+int journal_rate_limit_defer(JournalRateLimit *r, const char *id, int priority, void *entry, size_t size);
+void *journal_rate_limit_dequeue(JournalRateLimit *r, uint64_t available, bool force, const char **id, unsigned *suppressed, unsigned *deferred);
+unsigned journal_rate_limit_evicted(JournalRateLimit *r);
+usec_t journal_rate_limit_next(JournalRateLimit *r, uint64_t available);
@@ -0,0 +1,301 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  Copyright 2013 Lennart Poettering
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <errno.h>
+
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "journald-server.h"
+#include "journald-stream.h"
+#include "journald-receiver.h"
+
+#define RECEIVER_THREADS_MAX 64
+
+struct Receiver {
+        Server *server;
+        pthread_t thread;
+        bool thread_running;
+
+        int epoll_fd;
+
+        DatagramBatch batch;
+        PidCache *pid_cache;
+};
+
+static void *receiver_thread(void *p) {
+        Receiver *r = p;
+        Server *s;
+
+        assert(r);
+        assert(r->server);
+
+        s = r->server;
+
+        server_set_thread_pid_cache(r->pid_cache);
+
+        for (;;) {
+                struct epoll_event ev;
+                int k;
+
+                k = epoll_wait(r->epoll_fd, &ev, 1, -1);
+                if (k < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        log_error("epoll_wait() failed in receiver thread: %m");
+                        break;
+                }
+
+                if (k == 0)
+                        continue;
+
+                if (ev.data.fd == s->receivers_exit_fd)
+                        break;
+
+                if (ev.data.fd == s->native_fd ||
+                    ev.data.fd == s->syslog_fd) {
+
+                        if (ev.events != EPOLLIN) {
+                                log_error("Got invalid event from epoll.");
+                                break;
+                        }
+
+                        server_process_datagrams(s, ev.data.fd, &r->batch);
+
+                } else if (ev.data.fd == s->stdout_fd) {
+
+                        if (ev.events != EPOLLIN) {
+                                log_error("Got invalid event from epoll.");
+                                break;
+                        }
+
+                        /* The new stream stays with this thread */
+                        stdout_stream_new(s, r->epoll_fd);
+
+                } else {
+                        StdoutStream *stream;
+
+                        /* Same trick as in process_event() */
+                        stream = ev.data.ptr;
+
+                        if (stdout_stream_process(stream) <= 0)
+                                stdout_stream_free(stream);
+                }
+        }
+
+        return NULL;
+}
+
+static int receiver_watch_fd(Receiver *r, int fd) {
+        struct epoll_event ev = {
+                .events = EPOLLIN,
+                .data.fd = fd,
+        };
+
+        assert(r);
+
+        if (fd < 0)
+                return 0;
+
+        if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+                return -errno;
+
+        return 0;
+}
+
+static int receiver_init(Receiver *r, Server *s) {
+        int k;
+
+        assert(r);
+        assert(s);
+
+        r->server = s;
+
+        r->pid_cache = pid_cache_new();
+        if (!r->pid_cache)
+                return -ENOMEM;
+
+        r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (r->epoll_fd < 0)
+                return -errno;
+
+        /* All receivers wait on the same sockets, and whoever
+         * wakes up first gets the data */
+        k = receiver_watch_fd(r, s->native_fd);
+        if (k < 0)
+                return k;
+
+        k = receiver_watch_fd(r, s->syslog_fd);
+        if (k < 0)
+                return k;
+
+        k = receiver_watch_fd(r, s->stdout_fd);
+        if (k < 0)
+                return k;
+
+        return receiver_watch_fd(r, s->receivers_exit_fd);
+}
+
+static int server_add_queue_fd(Server *s) {
+        struct epoll_event ev = {
+                .events = EPOLLIN,
+        };
+
+        assert(s);
+
+        s->queue_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+        if (s->queue_fd < 0)
+                return -errno;
+
+        ev.data.fd = s->queue_fd;
+        if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->queue_fd, &ev) < 0)
+                return -errno;
+
+        return 0;
+}
+
+int server_start_receivers(Server *s) {
+        unsigned i;
+        int r;
+
+        assert(s);
+
+        if (s->n_receiver_threads <= 0)
+                return 0;
+
+        if (s->n_receiver_threads > RECEIVER_THREADS_MAX) {
+                log_warning("Too many receiver threads requested, using %u.", RECEIVER_THREADS_MAX);
+                s->n_receiver_threads = RECEIVER_THREADS_MAX;
+        }
+
+        /* In pipeline mode, the receiver threads read, parse and
+         * enrich the messages from the sockets and queue them. The
+         * main thread remains responsible for /dev/kmsg, signals and
+         * timers, and writes everything queued, so that all journal
+         * files are accessed from one thread only, and entries are
+         * written, and get their sequence numbers assigned, in the
+         * order they have been queued. */
+
+        s->receivers_exit_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+        if (s->receivers_exit_fd < 0) {
+                log_error("Failed to create eventfd: %m");
+                return -errno;
+        }
+
+        r = server_add_queue_fd(s);
+        if (r < 0) {
+                log_error("Failed to set up queue notification: %s", strerror(-r));
+                return r;
+        }
+
+        s->receivers = new0(Receiver, s->n_receiver_threads);
+        if (!s->receivers)
+                return log_oom();
+
+        for (i = 0; i < s->n_receiver_threads; i++) {
+                s->receivers[i].epoll_fd = -1;
+                s->n_receivers++;
+
+                r = receiver_init(s->receivers + i, s);
+                if (r < 0) {
+                        log_error("Failed to set up receiver thread: %s", strerror(-r));
+                        return r;
+                }
+        }
+
+        /* From now on the sockets are served by the receivers only */
+        if (s->native_fd >= 0)
+                epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, s->native_fd, NULL);
+        if (s->syslog_fd >= 0)
+                epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, s->syslog_fd, NULL);
+        if (s->stdout_fd >= 0)
+                epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, s->stdout_fd, NULL);
+
+        for (i = 0; i < s->n_receivers; i++) {
+                r = pthread_create(&s->receivers[i].thread, NULL, receiver_thread, s->receivers + i);
+                if (r != 0) {
+                        log_error("Failed to start receiver thread: %s", strerror(r));
+                        return -r;
+                }
+
+                s->receivers[i].thread_running = true;
+        }
+
+        log_debug("Started %u receiver threads.", s->n_receivers);
+
+        return 0;
+}
+
+void server_stop_receivers(Server *s) {
+        unsigned i;
+
+        assert(s);
+
+        if (!s->receivers)
+                goto finish;
+
+        assert_se(pthread_mutex_lock(&s->lock) == 0);
+        s->receivers_exit = true;
+        assert_se(pthread_cond_broadcast(&s->queue_space) == 0);
+        assert_se(pthread_mutex_unlock(&s->lock) == 0);
+
+        /* The eventfd stays readable, hence wakes up everybody */
+        eventfd_write(s->receivers_exit_fd, 1);
+
+        for (i = 0; i < s->n_receivers; i++)
+                if (s->receivers[i].thread_running)
+                        pthread_join(s->receivers[i].thread, NULL);
+
+        /* The streams refer to the epoll objects of the receivers,
+         * hence get rid of them first */
+        while (s->stdout_streams)
+                stdout_stream_free(s->stdout_streams);
+
+        for (i = 0; i < s->n_receivers; i++) {
+                Receiver *r = s->receivers + i;
+
+                if (r->epoll_fd >= 0)
+                        close_nointr_nofail(r->epoll_fd);
+
+                datagram_batch_done(&r->batch);
+
+                if (r->pid_cache) {
+                        unsigned long long hits, misses;
+
+                        pid_cache_get_stats(r->pid_cache, &hits, &misses);
+                        log_debug("Process metadata cache of receiver %u: %llu hits, %llu misses.", i, hits, misses);
+
+                        pid_cache_free(r->pid_cache);
+                }
+        }
+
+        free(s->receivers);
+        s->receivers = NULL;
+        s->n_receivers = 0;
+
+finish:
+        if (s->receivers_exit_fd >= 0) {
+                close_nointr_nofail(s->receivers_exit_fd);
+                s->receivers_exit_fd = -1;
+        }
+}
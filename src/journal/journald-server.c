@@ -25,6 +25,7 @@
 #include <sys/statvfs.h>
 #include <sys/mman.h>
 #include <sys/timerfd.h>
+#include <sys/eventfd.h>
 
 #include <libudev.h>
 #include <systemd/sd-journal.h>
@@ -38,11 +39,13 @@
 #include "socket-util.h"
 #include "cgroup-util.h"
 #include "list.h"
+#include "strv.h"
 #include "virt.h"
 #include "missing.h"
 #include "conf-parser.h"
 #include "journal-internal.h"
 #include "journal-vacuum.h"
+#include "journal-index.h"
 #include "journal-authenticate.h"
 #include "journald-server.h"
 #include "journald-rate-limit.h"
@@ -51,6 +54,8 @@
 #include "journald-stream.h"
 #include "journald-console.h"
 #include "journald-native.h"
+#include "journald-pid-cache.h"
+#include "journald-receiver.h"
 
 #ifdef HAVE_ACL
 #include <sys/acl.h>
@@ -65,11 +70,58 @@
 #define USER_JOURNALS_MAX 1024
 
 #define DEFAULT_SYNC_INTERVAL_USEC (5*USEC_PER_MINUTE)
+#define DEFAULT_NOTIFY_INTERVAL_USEC 0
 #define DEFAULT_RATE_LIMIT_INTERVAL (30*USEC_PER_SEC)
 #define DEFAULT_RATE_LIMIT_BURST 1000
+#define DEFAULT_RATE_LIMIT_QUEUE 0
+#define DEFAULT_STDOUT_STREAMS_MAX 4096
+#define DEFAULT_LINE_MAX (48*1024)
+
+/* Lines of stdout streams are never split shorter than a terminal
+ * line, and each stream buffers at most one line, hence there is an
+ * upper bound, too */
+#define LINE_MAX_MIN 79U
+#define LINE_MAX_MAX (1024U*1024U)
 
 #define RECHECK_AVAILABLE_SPACE_USEC (30*USEC_PER_SEC)
 
+/* How many directory entries to read or files to delete per
+ * iteration of the event loop when vacuuming in the background */
+#define VACUUM_STEP_MAX 16U
+
+/* How often the vacuuming reads the directories again, at most,
+ * which also resyncs the disk usage counters with them */
+#define VACUUM_RESCAN_USEC (15*USEC_PER_MINUTE)
+
+/* Additional fields driver messages may carry */
+#define DRIVER_FIELDS_MAX 2
+
+/* Write queued entries out at the latest when this many have
+ * accumulated during a single iteration of the event loop */
+#define QUEUED_ENTRIES_MAX 1024
+#define QUEUED_DATA_MAX (4*1024*1024)
+
+/* Datagrams received with a single recvmmsg() call */
+#define DATAGRAM_BATCH_MAX 16U
+
+/* Batches received per wakeup, before the other event sources get
+ * their turn again */
+#define DATAGRAM_BATCHES_PER_WAKEUP 4U
+
+/* Slots that received larger datagrams are trimmed to this size
+ * again afterwards */
+#define DATAGRAM_SLOT_RESIDENT_MAX (64U*1024U)
+
+/* The ticket of the datagram the current receiver thread is
+ * processing */
+static __thread uint64_t current_ticket;
+static __thread bool current_ticket_valid = false;
+
+/* The process metadata cache of the current thread. Receiver
+ * threads bring their own, so that they can look up everything
+ * about a message before they take the server lock. */
+static __thread PidCache *thread_pid_cache = NULL;
+
 static const char* const storage_table[] = {
         [STORAGE_AUTO] = "auto",
         [STORAGE_VOLATILE] = "volatile",
@@ -89,14 +141,55 @@ static const char* const split_mode_table[] = {
 DEFINE_STRING_TABLE_LOOKUP(split_mode, SplitMode);
 DEFINE_CONFIG_PARSE_ENUM(config_parse_split_mode, split_mode, SplitMode, "Failed to parse split mode setting");
 
+static int scan_usage(const char *path, uint64_t *ret) {
+        _cleanup_closedir_ DIR *d = NULL;
+        uint64_t sum = 0;
+
+        assert(path);
+        assert(ret);
+
+        d = opendir(path);
+        if (!d)
+                return -errno;
+
+        for (;;) {
+                struct stat st;
+                struct dirent *de;
+                union dirent_storage buf;
+                int r;
+
+                r = readdir_r(d, &buf.de, &de);
+                if (r != 0)
+                        return -r;
+
+                if (!de)
+                        break;
+
+                if (!endswith(de->d_name, ".journal") &&
+                    !endswith(de->d_name, ".journal~") &&
+                    !endswith(de->d_name, ".journal" INDEX_SUFFIX))
+                        continue;
+
+                if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                        continue;
+
+                if (!S_ISREG(st.st_mode))
+                        continue;
+
+                sum += (uint64_t) st.st_blocks * 512UL;
+        }
+
+        *ret = sum;
+        return 0;
+}
+
 static uint64_t available_space(Server *s, bool verbose) {
         char ids[33];
         _cleanup_free_ char *p = NULL;
         sd_id128_t machine;
         struct statvfs ss;
-        uint64_t sum = 0, ss_avail = 0, avail = 0;
+        uint64_t sum, ss_avail = 0, avail = 0;
         int r;
-        _cleanup_closedir_ DIR *d = NULL;
         usec_t ts;
         const char *f;
         JournalMetrics *m;
@@ -120,42 +213,27 @@ static uint64_t available_space(Server *s, bool verbose) {
         }
 
         assert(m);
+        assert(m->usage);
 
         p = strappend(f, sd_id128_to_string(machine, ids));
         if (!p)
                 return 0;
 
-        d = opendir(p);
-        if (!d)
-                return 0;
+        /* We are called verbosely whenever the journal files are
+         * (re)opened, which is when we look at all files. Otherwise
+         * the usage is kept up-to-date by the writers and the
+         * vacuuming, and there is no need to look at each file
+         * again. */
+        if (verbose) {
+                r = scan_usage(p, m->usage);
+                if (r < 0)
+                        return 0;
+        }
 
-        if (fstatvfs(dirfd(d), &ss) < 0)
+        if (statvfs(p, &ss) < 0)
                 return 0;
 
-        for (;;) {
-                struct stat st;
-                struct dirent *de;
-                union dirent_storage buf;
-
-                r = readdir_r(d, &buf.de, &de);
-                if (r != 0)
-                        break;
-
-                if (!de)
-                        break;
-
-                if (!endswith(de->d_name, ".journal") &&
-                    !endswith(de->d_name, ".journal~"))
-                        continue;
-
-                if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
-                        continue;
-
-                if (!S_ISREG(st.st_mode))
-                        continue;
-
-                sum += (uint64_t) st.st_blocks * 512UL;
-        }
+        sum = *m->usage;
 
         ss_avail = ss.f_bsize * ss.f_bavail;
         avail = ss_avail > m->keep_free ? ss_avail - m->keep_free : 0;
@@ -163,6 +241,10 @@ static uint64_t available_space(Server *s, bool verbose) {
         s->cached_available_space = MIN(m->max_use, avail) > sum ? MIN(m->max_use, avail) - sum : 0;
         s->cached_available_space_timestamp = ts;
 
+        assert_se(pthread_mutex_lock(&s->lock) == 0);
+        s->available_space = s->cached_available_space;
+        assert_se(pthread_mutex_unlock(&s->lock) == 0);
+
         if (verbose) {
                 char    fb1[FORMAT_BYTES_MAX], fb2[FORMAT_BYTES_MAX], fb3[FORMAT_BYTES_MAX],
                         fb4[FORMAT_BYTES_MAX], fb5[FORMAT_BYTES_MAX];
@@ -295,6 +377,8 @@ static JournalFile* find_journal(Server *s, uid_t uid) {
         if (r < 0)
                 return s->system_journal;
 
+        f->defer_post_change = s->notify_interval_usec > 0;
+        f->write_index = s->index_archives;
         server_fix_perms(s, f, uid);
 
         r = hashmap_put(s->user_journals, UINT32_TO_PTR(uid), f);
@@ -306,6 +390,20 @@ static JournalFile* find_journal(Server *s, uid_t uid) {
         return f;
 }
 
+static void log_cache_stats(Server *s) {
+        unsigned long long hits, misses;
+
+        assert(s);
+
+        pid_cache_get_stats(s->pid_cache, &hits, &misses);
+        log_debug("Process metadata cache: %llu hits, %llu misses.", hits, misses);
+
+        if (s->device_cache) {
+                device_cache_get_stats(s->device_cache, &hits, &misses);
+                log_debug("Device metadata cache: %llu hits, %llu misses.", hits, misses);
+        }
+}
+
 void server_rotate(Server *s) {
         JournalFile *f;
         void *k;
@@ -313,6 +411,7 @@ void server_rotate(Server *s) {
         int r;
 
         log_debug("Rotating...");
+        log_cache_stats(s);
 
         if (s->runtime_journal) {
                 r = journal_file_rotate(&s->runtime_journal, s->compress, false);
@@ -378,40 +477,166 @@ void server_sync(Server *s) {
         s->sync_scheduled = false;
 }
 
-void server_vacuum(Server *s) {
-        char ids[33];
-        sd_id128_t machine;
+void server_post_change(Server *s) {
+        JournalFile *f;
+        Iterator i;
+
+        static const struct itimerspec notify_timer_disable = {};
+
+        /* Wake up all readers of files we wrote to since the last
+         * time we did this. */
+
+        if (s->system_journal)
+                journal_file_flush_post_change(s->system_journal);
+
+        if (s->runtime_journal)
+                journal_file_flush_post_change(s->runtime_journal);
+
+        HASHMAP_FOREACH(f, s->user_journals, i)
+                journal_file_flush_post_change(f);
+
+        if (s->notify_scheduled) {
+                if (timerfd_settime(s->notify_timer_fd, 0, &notify_timer_disable, NULL) < 0)
+                        log_error("Failed to disable notify timer: %m");
+
+                s->notify_scheduled = false;
+        }
+}
+
+static int vacuum_step(Server *s, const char *name, JournalVacuum *v, JournalMetrics *m, uint64_t *usage, unsigned budget) {
+        uint64_t old_usage;
         int r;
 
-        log_debug("Vacuuming...");
+        assert(s);
+        assert(name);
+        assert(v);
+        assert(m);
+        assert(usage);
+
+        /* This also resyncs the usage with the directory whenever it
+         * has been read again */
+        old_usage = *usage;
+
+        r = journal_vacuum_step(v, m->max_use, m->keep_free, s->max_retention_usec, budget, usage);
+        if (r < 0)
+                log_error("Failed to vacuum %s journal files: %s", name, strerror(-r));
+
+        if (*usage != old_usage)
+                s->cached_available_space_timestamp = 0;
+
+        return r;
+}
+
+static int server_vacuum_internal(Server *s, unsigned budget) {
+        usec_t oldest;
+        int r, done = 1;
+
+        assert(s);
 
+        if (s->system_journal && s->system_vacuum) {
+                r = vacuum_step(s, "system", s->system_vacuum, &s->system_metrics, &s->system_usage, budget);
+                if (r == 0)
+                        done = 0;
+        }
+
+        if (s->runtime_journal && s->runtime_vacuum) {
+                r = vacuum_step(s, "runtime", s->runtime_vacuum, &s->runtime_metrics, &s->runtime_usage, budget);
+                if (r == 0)
+                        done = 0;
+        }
+
+        if (!done)
+                return 0;
+
+        s->vacuum_scheduled = false;
+
+        /* Remember when the next file expires */
         s->oldest_file_usec = 0;
 
+        if (s->system_journal && s->system_vacuum)
+                s->oldest_file_usec = journal_vacuum_oldest(s->system_vacuum);
+
+        if (s->runtime_journal && s->runtime_vacuum) {
+                oldest = journal_vacuum_oldest(s->runtime_vacuum);
+                if (oldest > 0 && (s->oldest_file_usec <= 0 || oldest < s->oldest_file_usec))
+                        s->oldest_file_usec = oldest;
+        }
+
+        return 1;
+}
+
+static int server_init_vacuum(Server *s) {
+        char ids[33];
+        sd_id128_t machine;
+        int r;
+
+        assert(s);
+
         r = sd_id128_get_machine(&machine);
         if (r < 0) {
                 log_error("Failed to get machine ID: %s", strerror(-r));
-                return;
+                return 0;
         }
 
         sd_id128_to_string(machine, ids);
 
-        if (s->system_journal) {
-                char *p = strappenda("/var/log/journal/", ids);
+        s->system_vacuum = journal_vacuum_new(strappenda("/var/log/journal/", ids));
+        s->runtime_vacuum = journal_vacuum_new(strappenda("/run/log/journal/", ids));
+        if (!s->system_vacuum || !s->runtime_vacuum)
+                return log_oom();
 
-                r = journal_directory_vacuum(p, s->system_metrics.max_use, s->system_metrics.keep_free, s->max_retention_usec, &s->oldest_file_usec);
-                if (r < 0 && r != -ENOENT)
-                        log_error("Failed to vacuum %s: %s", p, strerror(-r));
-        }
+        /* Files archived from now on are registered right-away */
+        s->system_metrics.vacuum = s->system_vacuum;
+        s->runtime_metrics.vacuum = s->runtime_vacuum;
 
-        if (s->runtime_journal) {
-                char *p = strappenda("/run/log/journal/", ids);
+        return 0;
+}
+
+void server_vacuum(Server *s) {
+        assert(s);
+
+        /* Vacuums right-away, because we need the space now */
+
+        log_debug("Vacuuming...");
 
-                r = journal_directory_vacuum(p, s->runtime_metrics.max_use, s->runtime_metrics.keep_free, s->max_retention_usec, &s->oldest_file_usec);
-                if (r < 0 && r != -ENOENT)
-                        log_error("Failed to vacuum %s: %s", p, strerror(-r));
+        server_vacuum_internal(s, (unsigned) -1);
+}
+
+void server_schedule_vacuum(Server *s) {
+        usec_t n;
+
+        assert(s);
+
+        /* Vacuums in small steps from the event loop, so that
+         * messages don't queue up meanwhile. Until the archived files
+         * of a directory are known, each step reads a part of it. */
+
+        if (!s->vacuum_scheduled)
+                log_debug("Scheduling vacuuming...");
+
+        s->vacuum_scheduled = true;
+
+        /* Once in a while look at all files again, to pick up
+         * changes made by others */
+        n = now(CLOCK_MONOTONIC);
+        if (s->vacuum_rescan_usec + VACUUM_RESCAN_USEC <= n) {
+                if (s->system_vacuum)
+                        journal_vacuum_rescan(s->system_vacuum);
+                if (s->runtime_vacuum)
+                        journal_vacuum_rescan(s->runtime_vacuum);
+
+                s->vacuum_rescan_usec = n;
         }
+}
+
+void server_vacuum_step(Server *s) {
+        assert(s);
+
+        if (!s->vacuum_scheduled)
+                return;
 
-        s->cached_available_space_timestamp = 0;
+        if (server_vacuum_internal(s, VACUUM_STEP_MAX) > 0)
+                log_debug("Vacuuming finished.");
 }
 
 bool shall_try_append_again(JournalFile *f, int r) {
@@ -443,191 +668,433 @@ bool shall_try_append_again(JournalFile *f, int r) {
         return true;
 }
 
-static void write_to_journal(Server *s, uid_t uid, struct iovec *iovec, unsigned n) {
+static size_t entry_size(const JournalAppendEntry *e) {
+        size_t size = 0;
+        unsigned i;
+
+        for (i = 0; i < e->n_iovec; i++)
+                size += e->iovec[i].iov_len;
+
+        return size;
+}
+
+static void write_to_journal(Server *s, uid_t uid, const JournalAppendEntry *entries, unsigned n) {
         JournalFile *f;
         bool vacuumed = false;
+        unsigned k;
         int r;
 
         assert(s);
-        assert(iovec);
-        assert(n > 0);
-
-        f = find_journal(s, uid);
-        if (!f)
-                return;
-
-        if (journal_file_rotate_suggested(f, s->max_file_usec)) {
-                log_debug("%s: Journal header limits reached or header out-of-date, rotating.", f->path);
-                server_rotate(s);
-                server_vacuum(s);
-                vacuumed = true;
+        assert(entries || n == 0);
 
+        while (n > 0) {
                 f = find_journal(s, uid);
                 if (!f)
                         return;
-        }
 
-        r = journal_file_append_entry(f, NULL, iovec, n, &s->seqnum, NULL, NULL);
-        if (r >= 0) {
-                server_schedule_sync(s);
-                return;
-        }
+                if (!vacuumed && journal_file_rotate_suggested(f, s->max_file_usec)) {
+                        log_debug("%s: Journal header limits reached or header out-of-date, rotating.", f->path);
+                        server_rotate(s);
+                        server_schedule_vacuum(s);
+                        vacuumed = true;
+                        continue;
+                }
 
-        if (vacuumed || !shall_try_append_again(f, r)) {
-                size_t size = 0;
-                unsigned i;
-                for (i = 0; i < n; i++)
-                        size += iovec[i].iov_len;
+                r = journal_file_append_entries(f, entries, n, &s->seqnum, &k);
+                if (k > 0) {
+                        server_schedule_sync(s);
+                        server_schedule_notify(s);
+                }
 
-                log_error("Failed to write entry (%d items, %zu bytes), ignoring: %s", n, size, strerror(-r));
-                return;
-        }
+                entries += k;
+                n -= k;
 
-        server_rotate(s);
-        server_vacuum(s);
+                if (r >= 0)
+                        return;
 
-        f = find_journal(s, uid);
-        if (!f)
-                return;
+                if (vacuumed || !shall_try_append_again(f, r)) {
+                        log_error("Failed to write entry (%u items, %zu bytes)%s, ignoring: %s",
+                                  entries->n_iovec, entry_size(entries),
+                                  vacuumed ? " despite vacuuming" : "",
+                                  strerror(-r));
 
-        log_debug("Retrying write.");
-        r = journal_file_append_entry(f, NULL, iovec, n, &s->seqnum, NULL, NULL);
-        if (r < 0) {
-                size_t size = 0;
-                unsigned i;
-                for (i = 0; i < n; i++)
-                        size += iovec[i].iov_len;
+                        /* Skip this one, but try the rest */
+                        entries++;
+                        n--;
+                        continue;
+                }
+
+                server_rotate(s);
+                server_vacuum(s);
+                vacuumed = true;
 
-                log_error("Failed to write entry (%d items, %zu bytes) despite vacuuming, ignoring: %s", n, size, strerror(-r));
+                log_debug("Retrying write.");
         }
 }
 
-static void dispatch_message_real(
-                Server *s,
-                struct iovec *iovec, unsigned n, unsigned m,
-                struct ucred *ucred,
-                struct timeval *tv,
-                const char *label, size_t label_len,
-                const char *unit_id,
-                pid_t object_pid) {
+static bool queue_full(EntryQueue *q) {
+        assert(q);
 
-        char    pid[sizeof("_PID=") + DECIMAL_STR_MAX(pid_t)],
-                uid[sizeof("_UID=") + DECIMAL_STR_MAX(uid_t)],
-                gid[sizeof("_GID=") + DECIMAL_STR_MAX(gid_t)],
-                owner_uid[sizeof("_SYSTEMD_OWNER_UID=") + DECIMAL_STR_MAX(uid_t)],
-                source_time[sizeof("_SOURCE_REALTIME_TIMESTAMP=") + DECIMAL_STR_MAX(usec_t)],
-                boot_id[sizeof("_BOOT_ID=") + 32] = "_BOOT_ID=",
-                machine_id[sizeof("_MACHINE_ID=") + 32] = "_MACHINE_ID=",
-                o_uid[sizeof("OBJECT_UID=") + DECIMAL_STR_MAX(uid_t)],
-                o_gid[sizeof("OBJECT_GID=") + DECIMAL_STR_MAX(gid_t)],
-                o_owner_uid[sizeof("OBJECT_SYSTEMD_OWNER_UID=") + DECIMAL_STR_MAX(uid_t)];
-        uid_t object_uid;
-        gid_t object_gid;
+        return q->n_entries >= QUEUED_ENTRIES_MAX ||
+                q->data_size >= QUEUED_DATA_MAX;
+}
 
-        char *x;
-        sd_id128_t id;
-        int r;
-        char *t, *c;
-        uid_t realuid = 0, owner = 0, journal_uid;
-        bool owner_valid = false;
-#ifdef HAVE_AUDIT
-        char    audit_session[sizeof("_AUDIT_SESSION=") + DECIMAL_STR_MAX(uint32_t)],
-                audit_loginuid[sizeof("_AUDIT_LOGINUID=") + DECIMAL_STR_MAX(uid_t)],
-                o_audit_session[sizeof("OBJECT_AUDIT_SESSION=") + DECIMAL_STR_MAX(uint32_t)],
-                o_audit_loginuid[sizeof("OBJECT_AUDIT_LOGINUID=") + DECIMAL_STR_MAX(uid_t)];
+static void queue_free(EntryQueue *q) {
+        assert(q);
 
-        uint32_t audit;
-        uid_t loginuid;
-#endif
+        free(q->entries);
+        free(q->queued);
+        free(q->iovec);
+        free(q->data);
+}
+
+void server_write_queued(Server *s) {
+        EntryQueue *q = &s->writing;
+        unsigned i, j;
+        char *p;
 
         assert(s);
-        assert(iovec);
-        assert(n > 0);
-        assert(n + N_IOVEC_META_FIELDS + (object_pid ? N_IOVEC_OBJECT_FIELDS : 0) <= m);
 
-        if (ucred) {
-                realuid = ucred->uid;
+        if (s->writing_queued)
+                return;
 
-                sprintf(pid, "_PID=%lu", (unsigned long) ucred->pid);
-                IOVEC_SET_STRING(iovec[n++], pid);
+        s->writing_queued = true;
 
-                sprintf(uid, "_UID=%lu", (unsigned long) ucred->uid);
-                IOVEC_SET_STRING(iovec[n++], uid);
+        /* Entries queued while we write, for example driver
+         * messages, or anything the receiver threads got in the
+         * meantime, are picked up in the next iteration. */
+        for (;;) {
+                EntryQueue t;
 
-                sprintf(gid, "_GID=%lu", (unsigned long) ucred->gid);
-                IOVEC_SET_STRING(iovec[n++], gid);
+                assert_se(pthread_mutex_lock(&s->lock) == 0);
 
-                r = get_process_comm(ucred->pid, &t);
-                if (r >= 0) {
-                        x = strappenda("_COMM=", t);
-                        free(t);
-                        IOVEC_SET_STRING(iovec[n++], x);
+                if (s->queued.n_entries <= 0) {
+                        assert_se(pthread_mutex_unlock(&s->lock) == 0);
+                        break;
                 }
 
-                r = get_process_exe(ucred->pid, &t);
-                if (r >= 0) {
-                        x = strappenda("_EXE=", t);
-                        free(t);
-                        IOVEC_SET_STRING(iovec[n++], x);
-                }
+                t = s->writing;
+                s->writing = s->queued;
+                s->queued = t;
 
-                r = get_process_cmdline(ucred->pid, 0, false, &t);
-                if (r >= 0) {
-                        x = strappenda("_CMDLINE=", t);
-                        free(t);
-                        IOVEC_SET_STRING(iovec[n++], x);
-                }
+                assert_se(pthread_cond_broadcast(&s->queue_space) == 0);
+                assert_se(pthread_mutex_unlock(&s->lock) == 0);
 
-                r = get_process_capeff(ucred->pid, &t);
-                if (r >= 0) {
-                        x = strappenda("_CAP_EFFECTIVE=", t);
-                        free(t);
-                        IOVEC_SET_STRING(iovec[n++], x);
+                /* The data of the iovecs was copied into the buffer
+                 * back to back, in order */
+                for (i = 0, p = q->data; i < q->n_iovec; i++) {
+                        q->iovec[i].iov_base = p;
+                        p += q->iovec[i].iov_len;
                 }
 
-#ifdef HAVE_AUDIT
-                r = audit_session_from_pid(ucred->pid, &audit);
-                if (r >= 0) {
-                        sprintf(audit_session, "_AUDIT_SESSION=%lu", (unsigned long) audit);
-                        IOVEC_SET_STRING(iovec[n++], audit_session);
-                }
+                for (i = 0; i < q->n_entries; i++)
+                        q->entries[i].iovec = q->iovec + q->queued[i].iovec_offset;
 
-                r = audit_loginuid_from_pid(ucred->pid, &loginuid);
-                if (r >= 0) {
-                        sprintf(audit_loginuid, "_AUDIT_LOGINUID=%lu", (unsigned long) loginuid);
-                        IOVEC_SET_STRING(iovec[n++], audit_loginuid);
+                /* Write all entries for the same journal file in one go */
+                for (i = 0; i < q->n_entries; i = j) {
+                        for (j = i + 1; j < q->n_entries; j++)
+                                if (q->queued[j].uid != q->queued[i].uid)
+                                        break;
+
+                        write_to_journal(s, q->queued[i].uid, q->entries + i, j - i);
                 }
-#endif
 
-                r = cg_pid_get_path_shifted(ucred->pid, NULL, &c);
-                if (r >= 0) {
-                        char *session = NULL;
+                q->n_entries = q->n_iovec = 0;
+                q->data_size = 0;
+        }
+
+        /* Let the rate limit see what the writes, rotation and
+         * vacuuming left over */
+        available_space(s, false);
+
+        s->writing_queued = false;
+}
+
+void server_wait_for_queue_space(Server *s) {
+        assert(s);
+
+        /* Throttles the receiver threads while the main thread
+         * cannot keep up with writing */
+
+        assert_se(pthread_mutex_lock(&s->lock) == 0);
+
+        while (queue_full(&s->queued) && !s->receivers_exit)
+                assert_se(pthread_cond_wait(&s->queue_space, &s->lock) == 0);
+
+        assert_se(pthread_mutex_unlock(&s->lock) == 0);
+}
+
+static void queue_to_journal(Server *s, uid_t uid, struct iovec *iovec, unsigned n) {
+        EntryQueue *q = &s->queued;
+        JournalAppendEntry *e;
+        size_t size = 0;
+        unsigned i;
+
+        assert(s);
+        assert(iovec);
+        assert(n > 0);
+
+        /* Called with the server lock held */
+
+        for (i = 0; i < n; i++)
+                size += iovec[i].iov_len;
+
+        if (!GREEDY_REALLOC(q->entries, q->entries_allocated, q->n_entries + 1) ||
+            !GREEDY_REALLOC(q->queued, q->queued_allocated, q->n_entries + 1) ||
+            !GREEDY_REALLOC(q->iovec, q->iovec_allocated, q->n_iovec + n) ||
+            !GREEDY_REALLOC(q->data, q->data_allocated, q->data_size + size)) {
+                log_oom();
+                return;
+        }
+
+        e = q->entries + q->n_entries;
+        *e = (JournalAppendEntry) {
+                .n_iovec = n,
+        };
+        dual_timestamp_get(&e->ts);
+
+        q->queued[q->n_entries] = (QueuedEntry) {
+                .uid = uid,
+                .iovec_offset = q->n_iovec,
+        };
+
+        for (i = 0; i < n; i++) {
+                memcpy(q->data + q->data_size, iovec[i].iov_base, iovec[i].iov_len);
+
+                q->iovec[q->n_iovec].iov_base = NULL;
+                q->iovec[q->n_iovec].iov_len = iovec[i].iov_len;
+                q->n_iovec++;
+
+                q->data_size += iovec[i].iov_len;
+        }
+
+        q->n_entries++;
+
+        /* Wake up the main thread, if it is not the one queueing */
+        if (q->n_entries == 1 && s->queue_fd >= 0)
+                eventfd_write(s->queue_fd, 1);
+}
+
+void server_set_thread_pid_cache(PidCache *c) {
+        thread_pid_cache = c;
+}
+
+static PidCache *server_pid_cache(Server *s) {
+        assert(s);
+
+        return thread_pid_cache ? thread_pid_cache : s->pid_cache;
+}
+
+static void server_lock_queue(Server *s) {
+        assert(s);
+
+        assert_se(pthread_mutex_lock(&s->lock) == 0);
+
+        /* Wait until all datagrams received before ours are
+         * dispatched */
+        if (current_ticket_valid)
+                while (s->dispatch_ticket != current_ticket)
+                        assert_se(pthread_cond_wait(&s->dispatch_turn, &s->lock) == 0);
+}
+
+static void server_unlock_queue(Server *s) {
+        bool full;
+
+        assert(s);
+
+        full = queue_full(&s->queued);
+        assert_se(pthread_mutex_unlock(&s->lock) == 0);
+
+        /* Only the main thread writes, and never with the lock
+         * held. The receiver threads throttle themselves instead,
+         * see server_wait_for_queue_space(). */
+        if (full && is_main_thread())
+                server_write_queued(s);
+}
+
+/* A message held back by the rate limit, see RateLimitQueue= */
+typedef struct DeferredEntry {
+        uid_t uid;
+        unsigned n_iovec;
+        struct iovec iovec[];
+} DeferredEntry;
+
+static void defer_to_rate_limit(Server *s, const char *id, int priority, uid_t uid, struct iovec *iovec, unsigned n) {
+        DeferredEntry *e;
+        size_t size;
+        uint8_t *p;
+        unsigned i;
+
+        assert(s);
+        assert(id);
+        assert(iovec);
+        assert(n > 0);
 
-                        x = strappenda("_SYSTEMD_CGROUP=", c);
+        /* Called with the server lock held */
+
+        size = offsetof(DeferredEntry, iovec) + n * sizeof(struct iovec);
+        for (i = 0; i < n; i++)
+                size += iovec[i].iov_len;
+
+        e = malloc(size);
+        if (!e) {
+                log_oom();
+                return;
+        }
+
+        e->uid = uid;
+        e->n_iovec = n;
+
+        p = (uint8_t*) (e->iovec + n);
+        for (i = 0; i < n; i++) {
+                e->iovec[i].iov_base = p;
+                e->iovec[i].iov_len = iovec[i].iov_len;
+                p = mempcpy(p, iovec[i].iov_base, iovec[i].iov_len);
+        }
+
+        if (journal_rate_limit_defer(s->rate_limit, id, priority, e, size) < 0)
+                log_oom();
+}
+
+static void server_schedule_rate_limit(Server *s) {
+        struct itimerspec rate_limit_timer = {};
+        usec_t next;
+
+        assert(s);
+
+        /* Called with the server lock held */
+
+        next = journal_rate_limit_next(s->rate_limit, s->available_space);
+        if (next <= 0)
+                return;
+
+        if (s->rate_limit_timer_usec > 0 && s->rate_limit_timer_usec <= next)
+                return;
+
+        timespec_store(&rate_limit_timer.it_value, next);
+
+        if (timerfd_settime(s->rate_limit_timer_fd, TFD_TIMER_ABSTIME, &rate_limit_timer, NULL) < 0) {
+                log_error("Failed to schedule writing of deferred messages: %m");
+                return;
+        }
+
+        s->rate_limit_timer_usec = next;
+}
+
+static void rate_limit_report(Server *s, const char *id, pid_t object_pid, unsigned suppressed, unsigned deferred);
+
+static void dispatch_message_real(
+                Server *s,
+                struct iovec *iovec, unsigned n, unsigned m,
+                struct ucred *ucred,
+                PidCacheEntry *pe,
+                struct timeval *tv,
+                const char *label, size_t label_len,
+                const char *unit_id,
+                pid_t object_pid,
+                const char *rate_limit_id,
+                int priority) {
+
+        char    pid[sizeof("_PID=") + DECIMAL_STR_MAX(pid_t)],
+                uid[sizeof("_UID=") + DECIMAL_STR_MAX(uid_t)],
+                gid[sizeof("_GID=") + DECIMAL_STR_MAX(gid_t)],
+                owner_uid[sizeof("_SYSTEMD_OWNER_UID=") + DECIMAL_STR_MAX(uid_t)],
+                source_time[sizeof("_SOURCE_REALTIME_TIMESTAMP=") + DECIMAL_STR_MAX(usec_t)],
+                boot_id[sizeof("_BOOT_ID=") + 32] = "_BOOT_ID=",
+                machine_id[sizeof("_MACHINE_ID=") + 32] = "_MACHINE_ID=",
+                o_uid[sizeof("OBJECT_UID=") + DECIMAL_STR_MAX(uid_t)],
+                o_gid[sizeof("OBJECT_GID=") + DECIMAL_STR_MAX(gid_t)],
+                o_owner_uid[sizeof("OBJECT_SYSTEMD_OWNER_UID=") + DECIMAL_STR_MAX(uid_t)];
+        PidCacheEntry *oe;
+
+        char *x;
+        sd_id128_t id;
+        int r, rl = 1;
+        char *t;
+        uid_t realuid = 0, owner = 0, journal_uid;
+        bool owner_valid = false;
+        unsigned suppressed = 0, deferred = 0, evicted = 0;
+#ifdef HAVE_AUDIT
+        char    audit_session[sizeof("_AUDIT_SESSION=") + DECIMAL_STR_MAX(uint32_t)],
+                audit_loginuid[sizeof("_AUDIT_LOGINUID=") + DECIMAL_STR_MAX(uid_t)],
+                o_audit_session[sizeof("OBJECT_AUDIT_SESSION=") + DECIMAL_STR_MAX(uint32_t)],
+                o_audit_loginuid[sizeof("OBJECT_AUDIT_LOGINUID=") + DECIMAL_STR_MAX(uid_t)];
+#endif
+
+        assert(s);
+        assert(iovec);
+        assert(n > 0);
+        assert(n + N_IOVEC_META_FIELDS + (object_pid ? N_IOVEC_OBJECT_FIELDS : 0) <= m);
+
+        if (ucred) {
+                realuid = ucred->uid;
+
+                sprintf(pid, "_PID=%lu", (unsigned long) ucred->pid);
+                IOVEC_SET_STRING(iovec[n++], pid);
+
+                sprintf(uid, "_UID=%lu", (unsigned long) ucred->uid);
+                IOVEC_SET_STRING(iovec[n++], uid);
+
+                sprintf(gid, "_GID=%lu", (unsigned long) ucred->gid);
+                IOVEC_SET_STRING(iovec[n++], gid);
+        }
+
+        if (ucred && pe) {
+                if (pe->comm) {
+                        x = strappenda("_COMM=", pe->comm);
+                        IOVEC_SET_STRING(iovec[n++], x);
+                }
+
+                if (pe->exe) {
+                        x = strappenda("_EXE=", pe->exe);
+                        IOVEC_SET_STRING(iovec[n++], x);
+                }
+
+                if (pe->cmdline) {
+                        x = strappenda("_CMDLINE=", pe->cmdline);
+                        IOVEC_SET_STRING(iovec[n++], x);
+                }
+
+                if (pe->capeff) {
+                        x = strappenda("_CAP_EFFECTIVE=", pe->capeff);
+                        IOVEC_SET_STRING(iovec[n++], x);
+                }
+
+#ifdef HAVE_AUDIT
+                if (pe->audit_session_valid) {
+                        sprintf(audit_session, "_AUDIT_SESSION=%lu", (unsigned long) pe->audit_session);
+                        IOVEC_SET_STRING(iovec[n++], audit_session);
+                }
+
+                if (pe->audit_loginuid_valid) {
+                        sprintf(audit_loginuid, "_AUDIT_LOGINUID=%lu", (unsigned long) pe->audit_loginuid);
+                        IOVEC_SET_STRING(iovec[n++], audit_loginuid);
+                }
+#endif
+
+                if (pe->cgroup) {
+                        x = strappenda("_SYSTEMD_CGROUP=", pe->cgroup);
                         IOVEC_SET_STRING(iovec[n++], x);
 
-                        r = cg_path_get_session(c, &t);
-                        if (r >= 0) {
-                                session = strappenda("_SYSTEMD_SESSION=", t);
-                                free(t);
-                                IOVEC_SET_STRING(iovec[n++], session);
+                        if (pe->session) {
+                                x = strappenda("_SYSTEMD_SESSION=", pe->session);
+                                IOVEC_SET_STRING(iovec[n++], x);
                         }
 
-                        if (cg_path_get_owner_uid(c, &owner) >= 0) {
+                        if (pe->owner_uid_valid) {
                                 owner_valid = true;
+                                owner = pe->owner_uid;
 
                                 sprintf(owner_uid, "_SYSTEMD_OWNER_UID=%lu", (unsigned long) owner);
                                 IOVEC_SET_STRING(iovec[n++], owner_uid);
                         }
 
-                        if (cg_path_get_unit(c, &t) >= 0) {
-                                x = strappenda("_SYSTEMD_UNIT=", t);
-                                free(t);
-                        } else if (cg_path_get_user_unit(c, &t) >= 0) {
-                                x = strappenda("_SYSTEMD_USER_UNIT=", t);
-                                free(t);
-                        } else if (unit_id) {
-                                if (session)
+                        if (pe->unit)
+                                x = strappenda("_SYSTEMD_UNIT=", pe->unit);
+                        else if (pe->user_unit)
+                                x = strappenda("_SYSTEMD_USER_UNIT=", pe->user_unit);
+                        else if (unit_id) {
+                                if (pe->session)
                                         x = strappenda("_SYSTEMD_USER_UNIT=", unit_id);
                                 else
                                         x = strappenda("_SYSTEMD_UNIT=", unit_id);
@@ -636,11 +1103,11 @@ static void dispatch_message_real(
 
                         if (x)
                                 IOVEC_SET_STRING(iovec[n++], x);
-
-                        free(c);
                 }
+        }
 
 #ifdef HAVE_SELINUX
+        if (ucred) {
                 if (label) {
                         x = alloca(sizeof("_SELINUX_CONTEXT=") + label_len);
 
@@ -656,88 +1123,74 @@ static void dispatch_message_real(
                                 IOVEC_SET_STRING(iovec[n++], x);
                         }
                 }
-#endif
         }
+#endif
         assert(n <= m);
 
-        if (object_pid) {
-                r = get_process_uid(object_pid, &object_uid);
-                if (r >= 0) {
-                        sprintf(o_uid, "OBJECT_UID=%lu", (unsigned long) object_uid);
+        /* Note that this lookup never evicts pe, since that is the
+         * most recently used entry at this point. */
+        oe = object_pid ? pid_cache_get(server_pid_cache(s), object_pid) : NULL;
+        if (oe) {
+                if (oe->uid_valid) {
+                        sprintf(o_uid, "OBJECT_UID=%lu", (unsigned long) oe->uid);
                         IOVEC_SET_STRING(iovec[n++], o_uid);
                 }
 
-                r = get_process_gid(object_pid, &object_gid);
-                if (r >= 0) {
-                        sprintf(o_gid, "OBJECT_GID=%lu", (unsigned long) object_gid);
+                if (oe->gid_valid) {
+                        sprintf(o_gid, "OBJECT_GID=%lu", (unsigned long) oe->gid);
                         IOVEC_SET_STRING(iovec[n++], o_gid);
                 }
 
-                r = get_process_comm(object_pid, &t);
-                if (r >= 0) {
-                        x = strappenda("OBJECT_COMM=", t);
-                        free(t);
+                if (oe->comm) {
+                        x = strappenda("OBJECT_COMM=", oe->comm);
                         IOVEC_SET_STRING(iovec[n++], x);
                 }
 
-                r = get_process_exe(object_pid, &t);
-                if (r >= 0) {
-                        x = strappenda("OBJECT_EXE=", t);
-                        free(t);
+                if (oe->exe) {
+                        x = strappenda("OBJECT_EXE=", oe->exe);
                         IOVEC_SET_STRING(iovec[n++], x);
                 }
 
-                r = get_process_cmdline(object_pid, 0, false, &t);
-                if (r >= 0) {
-                        x = strappenda("OBJECT_CMDLINE=", t);
-                        free(t);
+                if (oe->cmdline) {
+                        x = strappenda("OBJECT_CMDLINE=", oe->cmdline);
                         IOVEC_SET_STRING(iovec[n++], x);
                 }
 
 #ifdef HAVE_AUDIT
-                r = audit_session_from_pid(object_pid, &audit);
-                if (r >= 0) {
-                        sprintf(o_audit_session, "OBJECT_AUDIT_SESSION=%lu", (unsigned long) audit);
+                if (oe->audit_session_valid) {
+                        sprintf(o_audit_session, "OBJECT_AUDIT_SESSION=%lu", (unsigned long) oe->audit_session);
                         IOVEC_SET_STRING(iovec[n++], o_audit_session);
                 }
 
-                r = audit_loginuid_from_pid(object_pid, &loginuid);
-                if (r >= 0) {
-                        sprintf(o_audit_loginuid, "OBJECT_AUDIT_LOGINUID=%lu", (unsigned long) loginuid);
+                if (oe->audit_loginuid_valid) {
+                        sprintf(o_audit_loginuid, "OBJECT_AUDIT_LOGINUID=%lu", (unsigned long) oe->audit_loginuid);
                         IOVEC_SET_STRING(iovec[n++], o_audit_loginuid);
                 }
 #endif
 
-                r = cg_pid_get_path_shifted(object_pid, NULL, &c);
-                if (r >= 0) {
-                        x = strappenda("OBJECT_SYSTEMD_CGROUP=", c);
+                if (oe->cgroup) {
+                        x = strappenda("OBJECT_SYSTEMD_CGROUP=", oe->cgroup);
                         IOVEC_SET_STRING(iovec[n++], x);
 
-                        r = cg_path_get_session(c, &t);
-                        if (r >= 0) {
-                                x = strappenda("OBJECT_SYSTEMD_SESSION=", t);
-                                free(t);
+                        if (oe->session) {
+                                x = strappenda("OBJECT_SYSTEMD_SESSION=", oe->session);
                                 IOVEC_SET_STRING(iovec[n++], x);
                         }
 
-                        if (cg_path_get_owner_uid(c, &owner) >= 0) {
-                                sprintf(o_owner_uid, "OBJECT_SYSTEMD_OWNER_UID=%lu", (unsigned long) owner);
+                        if (oe->owner_uid_valid) {
+                                sprintf(o_owner_uid, "OBJECT_SYSTEMD_OWNER_UID=%lu", (unsigned long) oe->owner_uid);
                                 IOVEC_SET_STRING(iovec[n++], o_owner_uid);
                         }
 
-                        if (cg_path_get_unit(c, &t) >= 0) {
-                                x = strappenda("OBJECT_SYSTEMD_UNIT=", t);
-                                free(t);
-                        } else if (cg_path_get_user_unit(c, &t) >= 0) {
-                                x = strappenda("OBJECT_SYSTEMD_USER_UNIT=", t);
-                                free(t);
-                        } else
+                        if (oe->unit)
+                                x = strappenda("OBJECT_SYSTEMD_UNIT=", oe->unit);
+                        else if (oe->user_unit)
+                                x = strappenda("OBJECT_SYSTEMD_USER_UNIT=", oe->user_unit);
+                        else
                                 x = NULL;
 
                         if (x)
                                 IOVEC_SET_STRING(iovec[n++], x);
-
-                        free(c);
                 }
         }
         assert(n <= m);
@@ -785,27 +1238,66 @@ static void dispatch_message_real(
         else
                 journal_uid = 0;
 
-        write_to_journal(s, journal_uid, iovec, n);
+        /* Everything above only looked at the message and at the
+         * metadata cache of this thread. The lock is only needed to
+         * ask the rate limit and to queue the finished entry. */
+        server_lock_queue(s);
+
+        if (rate_limit_id) {
+                rl = journal_rate_limit_test(s->rate_limit, rate_limit_id, priority, s->available_space,
+                                             &suppressed, &deferred);
+                evicted = journal_rate_limit_evicted(s->rate_limit);
+        }
+
+        if (rl == -EAGAIN) {
+                /* The message will be written later, but let's
+                 * record when we got it */
+                if (!tv) {
+                        sprintf(source_time, "_SOURCE_REALTIME_TIMESTAMP=%llu", (unsigned long long) now(CLOCK_REALTIME));
+                        IOVEC_SET_STRING(iovec[n++], source_time);
+                }
+
+                defer_to_rate_limit(s, rate_limit_id, priority, journal_uid, iovec, n);
+                server_schedule_rate_limit(s);
+        } else if (rl > 0)
+                queue_to_journal(s, journal_uid, iovec, n);
+
+        server_unlock_queue(s);
+
+        /* The reports are messages of their own, hence are only
+         * generated once the lock is released. Our ticket is still
+         * valid, so they follow the message right away. */
+        if (evicted > 0)
+                rate_limit_report(s, NULL, 0, evicted, 0);
+
+        if (rl > 0 && (suppressed > 0 || deferred > 0))
+                rate_limit_report(s, rate_limit_id, ucred ? ucred->pid : 0, suppressed, deferred);
 }
 
-void server_driver_message(Server *s, sd_id128_t message_id, const char *format, ...) {
+static void driver_message_internal(
+                Server *s,
+                sd_id128_t message_id,
+                char **fields,
+                pid_t object_pid,
+                const char *format,
+                va_list ap) {
+
         char mid[11 + 32 + 1];
         char buffer[16 + LINE_MAX + 1];
-        struct iovec iovec[N_IOVEC_META_FIELDS + 4];
+        struct iovec iovec[N_IOVEC_META_FIELDS + N_IOVEC_OBJECT_FIELDS + 4 + DRIVER_FIELDS_MAX];
         int n = 0;
-        va_list ap;
         struct ucred ucred = {};
+        char **f;
 
         assert(s);
         assert(format);
+        assert(strv_length(fields) <= DRIVER_FIELDS_MAX);
 
         IOVEC_SET_STRING(iovec[n++], "PRIORITY=6");
         IOVEC_SET_STRING(iovec[n++], "_TRANSPORT=driver");
 
         memcpy(buffer, "MESSAGE=", 8);
-        va_start(ap, format);
         vsnprintf(buffer + 8, sizeof(buffer) - 8, format, ap);
-        va_end(ap);
         char_array_0(buffer);
         IOVEC_SET_STRING(iovec[n++], buffer);
 
@@ -815,11 +1307,99 @@ void server_driver_message(Server *s, sd_id128_t message_id, const char *format,
                 IOVEC_SET_STRING(iovec[n++], mid);
         }
 
+        STRV_FOREACH(f, fields)
+                IOVEC_SET_STRING(iovec[n++], *f);
+
         ucred.pid = getpid();
         ucred.uid = getuid();
         ucred.gid = getgid();
 
-        dispatch_message_real(s, iovec, n, ELEMENTSOF(iovec), &ucred, NULL, NULL, 0, NULL, 0);
+        dispatch_message_real(s, iovec, n, ELEMENTSOF(iovec), &ucred, pid_cache_get(server_pid_cache(s), ucred.pid), NULL, NULL, 0, NULL, object_pid, NULL, 0);
+}
+
+void server_driver_message(Server *s, sd_id128_t message_id, const char *format, ...) {
+        va_list ap;
+
+        va_start(ap, format);
+        driver_message_internal(s, message_id, NULL, 0, format, ap);
+        va_end(ap);
+}
+
+static void driver_message_fields(Server *s, sd_id128_t message_id, char **fields, pid_t object_pid, const char *format, ...) {
+        va_list ap;
+
+        va_start(ap, format);
+        driver_message_internal(s, message_id, fields, object_pid, format, ap);
+        va_end(ap);
+}
+
+static void rate_limit_report(Server *s, const char *id, pid_t object_pid, unsigned suppressed, unsigned deferred) {
+        char n_dropped[sizeof("N_DROPPED=") + DECIMAL_STR_MAX(unsigned)],
+             n_deferred[sizeof("N_DEFERRED=") + DECIMAL_STR_MAX(unsigned)];
+        char *fields[] = { n_dropped, n_deferred, NULL };
+
+        assert(s);
+
+        /* The counters are attached as fields, and if the sender is
+         * still around, the OBJECT_ fields identify its unit. Without
+         * an id, the messages belonged to groups the rate limit had to
+         * forget. */
+
+        sprintf(n_dropped, "N_DROPPED=%u", suppressed);
+        sprintf(n_deferred, "N_DEFERRED=%u", deferred);
+
+        if (!id)
+                driver_message_fields(s, SD_MESSAGE_JOURNAL_DROPPED, fields, 0,
+                                      "Suppressed %u messages from units the rate limit had to forget", suppressed);
+        else if (suppressed > 0)
+                driver_message_fields(s, SD_MESSAGE_JOURNAL_DROPPED, fields, object_pid,
+                                      "Suppressed %u messages from %s", suppressed, id);
+        else
+                driver_message_fields(s, SD_ID128_NULL, fields, object_pid,
+                                      "Delayed %u messages from %s", deferred, id);
+}
+
+static void server_release_deferred(Server *s, bool force) {
+        assert(s);
+
+        /* Writes the deferred messages that the rate limit lets
+         * through by now, or all of them if forced */
+
+        assert_se(pthread_mutex_lock(&s->lock) == 0);
+        s->rate_limit_timer_usec = 0;
+        assert_se(pthread_mutex_unlock(&s->lock) == 0);
+
+        for (;;) {
+                DeferredEntry *e;
+                const char *id;
+                _cleanup_free_ char *report_id = NULL;
+                unsigned suppressed = 0, deferred = 0;
+
+                server_lock_queue(s);
+
+                e = journal_rate_limit_dequeue(s->rate_limit, s->available_space, force, &id, &suppressed, &deferred);
+                if (e) {
+                        queue_to_journal(s, e->uid, e->iovec, e->n_iovec);
+                        free(e);
+
+                        /* The group may be gone by the time the
+                         * report is written */
+                        if (suppressed > 0 || deferred > 0) {
+                                report_id = strdup(id);
+                                if (!report_id)
+                                        log_oom();
+                        }
+                } else if (!force)
+                        server_schedule_rate_limit(s);
+
+                server_unlock_queue(s);
+
+                if (!e)
+                        break;
+
+                if (report_id)
+                        rate_limit_report(s, report_id, 0, suppressed, deferred);
+        }
 }
 
 void server_dispatch_message(
@@ -832,9 +1412,8 @@ void server_dispatch_message(
                 int priority,
                 pid_t object_pid) {
 
-        int rl, r;
-        _cleanup_free_ char *path = NULL;
-        char *c;
+        PidCacheEntry *pe = NULL;
+        char *path = NULL, *c;
 
         assert(s);
         assert(iovec || n == 0);
@@ -845,42 +1424,31 @@ void server_dispatch_message(
         if (LOG_PRI(priority) > s->max_level_store)
                 return;
 
-        if (!ucred)
-                goto finish;
+        if (ucred)
+                pe = pid_cache_get(server_pid_cache(s), ucred->pid);
 
-        r = cg_pid_get_path_shifted(ucred->pid, NULL, &path);
-        if (r < 0)
-                goto finish;
+        if (pe && pe->cgroup) {
+                path = strdupa(pe->cgroup);
 
-        /* example: /user/lennart/3/foobar
-         *          /system/dbus.service/foobar
-         *
-         * So let's cut of everything past the third /, since that is
-         * where user directories start */
+                /* example: /user/lennart/3/foobar
+                 *          /system/dbus.service/foobar
+                 *
+                 * So let's cut of everything past the third /, since that is
+                 * where user directories start */
 
-        c = strchr(path, '/');
-        if (c) {
-                c = strchr(c+1, '/');
+                c = strchr(path, '/');
                 if (c) {
                         c = strchr(c+1, '/');
-                        if (c)
-                                *c = 0;
+                        if (c) {
+                                c = strchr(c+1, '/');
+                                if (c)
+                                        *c = 0;
+                        }
                 }
         }
 
-        rl = journal_rate_limit_test(s->rate_limit, path,
-                                     priority & LOG_PRIMASK, available_space(s, false));
-
-        if (rl == 0)
-                return;
-
-        /* Write a suppression message if we suppressed something */
-        if (rl > 1)
-                server_driver_message(s, SD_MESSAGE_JOURNAL_DROPPED,
-                                      "Suppressed %u messages from %s", rl - 1, path);
-
-finish:
-        dispatch_message_real(s, iovec, n, m, ucred, tv, label, label_len, unit_id, object_pid);
+        dispatch_message_real(s, iovec, n, m, ucred, pe, tv, label, label_len, unit_id, object_pid,
+                              path, priority & LOG_PRIMASK);
 }
 
 
@@ -915,149 +1483,537 @@ static int system_journal_open(Server *s) {
                 fn = strappenda(fn, "/system.journal");
                 r = journal_file_open_reliably(fn, O_RDWR|O_CREAT, 0640, s->compress, s->seal, &s->system_metrics, s->mmap, NULL, &s->system_journal);
 
-                if (r >= 0)
+                if (r >= 0) {
+                        s->system_journal->defer_post_change = s->notify_interval_usec > 0;
+                        s->system_journal->write_index = s->index_archives;
                         server_fix_perms(s, s->system_journal, 0);
-                else if (r < 0) {
+                } else if (r < 0) {
                         if (r != -ENOENT && r != -EROFS)
                                 log_warning("Failed to open system journal: %s", strerror(-r));
 
-                        r = 0;
-                }
+                        r = 0;
+                }
+        }
+
+        if (!s->runtime_journal &&
+            (s->storage != STORAGE_NONE)) {
+
+                fn = strjoin("/run/log/journal/", ids, "/system.journal", NULL);
+                if (!fn)
+                        return -ENOMEM;
+
+                if (s->system_journal) {
+
+                        /* Try to open the runtime journal, but only
+                         * if it already exists, so that we can flush
+                         * it into the system journal */
+
+                        r = journal_file_open(fn, O_RDWR, 0640, s->compress, false, &s->runtime_metrics, s->mmap, NULL, &s->runtime_journal);
+                        free(fn);
+
+                        if (r < 0) {
+                                if (r != -ENOENT)
+                                        log_warning("Failed to open runtime journal: %s", strerror(-r));
+
+                                r = 0;
+                        }
+
+                } else {
+
+                        /* OK, we really need the runtime journal, so create
+                         * it if necessary. */
+
+                        (void) mkdir_parents(fn, 0755);
+                        r = journal_file_open_reliably(fn, O_RDWR|O_CREAT, 0640, s->compress, false, &s->runtime_metrics, s->mmap, NULL, &s->runtime_journal);
+                        free(fn);
+
+                        if (r < 0) {
+                                log_error("Failed to open runtime journal: %s", strerror(-r));
+                                return r;
+                        }
+                }
+
+                if (s->runtime_journal) {
+                        s->runtime_journal->defer_post_change = s->notify_interval_usec > 0;
+                        s->runtime_journal->write_index = s->index_archives;
+                        server_fix_perms(s, s->runtime_journal, 0);
+                }
+        }
+
+        available_space(s, true);
+
+        return r;
+}
+
+int server_flush_to_var(Server *s) {
+        int r;
+        sd_id128_t machine;
+        sd_journal *j = NULL;
+
+        assert(s);
+
+        if (s->storage != STORAGE_AUTO &&
+            s->storage != STORAGE_PERSISTENT)
+                return 0;
+
+        if (!s->runtime_journal)
+                return 0;
+
+        system_journal_open(s);
+
+        if (!s->system_journal)
+                return 0;
+
+        log_debug("Flushing to /var...");
+
+        /* Make sure nothing is left behind in the runtime journal */
+        server_write_queued(s);
+
+        r = sd_id128_get_machine(&machine);
+        if (r < 0) {
+                log_error("Failed to get machine id: %s", strerror(-r));
+                return r;
+        }
+
+        r = sd_journal_open(&j, SD_JOURNAL_RUNTIME_ONLY);
+        if (r < 0) {
+                log_error("Failed to read runtime journal: %s", strerror(-r));
+                return r;
+        }
+
+        sd_journal_set_data_threshold(j, 0);
+
+        SD_JOURNAL_FOREACH(j) {
+                Object *o = NULL;
+                JournalFile *f;
+
+                f = j->current_file;
+                assert(f && f->current_offset > 0);
+
+                r = journal_file_move_to_object(f, OBJECT_ENTRY, f->current_offset, &o);
+                if (r < 0) {
+                        log_error("Can't read entry: %s", strerror(-r));
+                        goto finish;
+                }
+
+                r = journal_file_copy_entry(f, s->system_journal, o, f->current_offset, NULL, NULL, NULL);
+                if (r >= 0)
+                        continue;
+
+                if (!shall_try_append_again(s->system_journal, r)) {
+                        log_error("Can't write entry: %s", strerror(-r));
+                        goto finish;
+                }
+
+                server_rotate(s);
+                server_vacuum(s);
+
+                if (!s->system_journal) {
+                        log_notice("Didn't flush runtime journal since rotation of system journal wasn't successful.");
+                        r = -EIO;
+                        goto finish;
+                }
+
+                log_debug("Retrying write.");
+                r = journal_file_copy_entry(f, s->system_journal, o, f->current_offset, NULL, NULL, NULL);
+                if (r < 0) {
+                        log_error("Can't write entry: %s", strerror(-r));
+                        goto finish;
+                }
+        }
+
+finish:
+        journal_file_post_change(s->system_journal);
+        server_schedule_notify(s);
+
+        journal_file_close(s->runtime_journal);
+        s->runtime_journal = NULL;
+
+        if (r >= 0)
+                rm_rf("/run/log/journal", false, true, false);
+
+        sd_journal_close(j);
+
+        return r;
+}
+
+static int read_sysctl_u64(const char *path, uint64_t *ret) {
+        _cleanup_free_ char *line = NULL;
+        int r;
+
+        r = read_one_line_file(path, &line);
+        if (r < 0)
+                return r;
+
+        return safe_atou64(line, ret);
+}
+
+static size_t datagram_slot_size(void) {
+        uint64_t wmem_max, wmem_default, l;
+
+        /* Unless they force it, clients cannot send datagrams larger
+         * than their send buffer. That is wmem_default, or twice
+         * what they asked for with SO_SNDBUF, capped by wmem_max.
+         * Returns 0 if we cannot tell, or the slots would not fit
+         * into the address space. */
+
+        if (read_sysctl_u64("/proc/sys/net/core/wmem_max", &wmem_max) < 0 ||
+            read_sysctl_u64("/proc/sys/net/core/wmem_default", &wmem_default) < 0)
+                return 0;
+
+        /* Leave room for a trailing NUL byte */
+        l = MAX(2 * wmem_max, wmem_default);
+        l = MAX(l + 1, (uint64_t) LINE_MAX);
+
+        if (l > (SIZE_MAX - page_size()) / DATAGRAM_BATCH_MAX)
+                return 0;
+
+        return PAGE_ALIGN(l);
+}
+
+static int datagram_batch_init(DatagramBatch *b) {
+        unsigned i, n = DATAGRAM_BATCH_MAX;
+        size_t slot_size;
+        void *p;
+
+        assert(b);
+
+        slot_size = datagram_slot_size();
+
+        /* The pages are only populated when datagrams are received
+         * into them */
+        if (slot_size <= 0) {
+                log_warning("Cannot determine the maximum datagram size, receiving datagrams one by one.");
+                p = NULL;
+                n = 1;
+        } else {
+                p = mmap(NULL, slot_size * DATAGRAM_BATCH_MAX, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+                if (p == MAP_FAILED) {
+                        log_warning("Failed to allocate datagram batch, receiving datagrams one by one: %m");
+                        p = NULL;
+                        n = 1;
+                }
+        }
+
+        b->msgs = new0(struct mmsghdr, n);
+        b->iovecs = new0(struct iovec, n);
+        b->controls = new(DatagramControl, n);
+        if (!b->msgs || !b->iovecs || !b->controls) {
+                if (p)
+                        munmap(p, slot_size * DATAGRAM_BATCH_MAX);
+                datagram_batch_done(b);
+                return log_oom();
+        }
+
+        for (i = 0; i < n; i++) {
+                b->msgs[i].msg_hdr.msg_iov = b->iovecs + i;
+                b->msgs[i].msg_hdr.msg_iovlen = 1;
+                b->msgs[i].msg_hdr.msg_control = b->controls + i;
+        }
+
+        if (p) {
+                b->slots = p;
+                b->slot_size = slot_size;
+                b->n_slots = n;
+        }
+
+        b->initialized = true;
+        return 0;
+}
+
+void datagram_batch_done(DatagramBatch *b) {
+        assert(b);
+
+        if (b->slots)
+                munmap(b->slots, b->slot_size * DATAGRAM_BATCH_MAX);
+
+        free(b->msgs);
+        free(b->iovecs);
+        free(b->controls);
+        free(b->buffer);
+
+        zero(*b);
+}
+
+static void datagram_batch_trim(DatagramBatch *b, unsigned n) {
+        bool truncated = false;
+        unsigned i;
+
+        assert(b);
+
+        /* Give back the memory of slots that just received a large
+         * datagram, so that the occasional one does not pin down
+         * memory for good */
+
+        for (i = 0; i < n; i++) {
+                if (b->msgs[i].msg_len > DATAGRAM_SLOT_RESIDENT_MAX)
+                        madvise(b->slots + i * b->slot_size + DATAGRAM_SLOT_RESIDENT_MAX,
+                                b->slot_size - DATAGRAM_SLOT_RESIDENT_MAX,
+                                MADV_DONTNEED);
+
+                if (b->msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+                        truncated = true;
+        }
+
+        /* Somebody managed to send a datagram larger than the
+         * slots, most likely by forcing its send buffer size, or
+         * because wmem_max was raised since. Only the receive path
+         * that sizes the buffer for each datagram is safe then. */
+        if (truncated) {
+                log_warning("Got datagram larger than %zu bytes, receiving datagrams one by one from now on.", b->slot_size);
+
+                munmap(b->slots, b->slot_size * DATAGRAM_BATCH_MAX);
+                b->slots = NULL;
+                b->slot_size = 0;
+                b->n_slots = 0;
+        }
+}
+
+static int receive_datagram(int fd, DatagramBatch *b) {
+        struct msghdr *msghdr;
+        ssize_t n;
+        int v;
+
+        assert(fd >= 0);
+        assert(b);
+
+        /* Receives a single datagram into the growable buffer, and
+         * returns it in the first message of the batch */
+
+        if (ioctl(fd, SIOCINQ, &v) < 0) {
+                log_error("SIOCINQ failed: %m");
+                return -errno;
+        }
+
+        if (b->buffer_size < (size_t) v) {
+                void *p;
+                size_t l;
+
+                l = MAX(LINE_MAX + (size_t) v, b->buffer_size * 2);
+                p = realloc(b->buffer, l+1);
+
+                if (!p) {
+                        log_error("Couldn't increase buffer.");
+                        return -ENOMEM;
+                }
+
+                b->buffer_size = l;
+                b->buffer = p;
+        }
+
+        msghdr = &b->msgs[0].msg_hdr;
+        msghdr->msg_iov->iov_base = b->buffer;
+        msghdr->msg_iov->iov_len = b->buffer_size;
+        msghdr->msg_controllen = sizeof(DatagramControl);
+        msghdr->msg_flags = 0;
+
+        n = recvmsg(fd, msghdr, MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
+        if (n < 0) {
+                if (errno != EINTR && errno != EAGAIN)
+                        log_error("recvmsg() failed: %m");
+
+                return -errno;
         }
 
-        if (!s->runtime_journal &&
-            (s->storage != STORAGE_NONE)) {
+        b->msgs[0].msg_len = n;
+        return 1;
+}
 
-                fn = strjoin("/run/log/journal/", ids, "/system.journal", NULL);
-                if (!fn)
-                        return -ENOMEM;
+static int receive_datagrams(int fd, DatagramBatch *b) {
+        unsigned i;
+        int n, v;
 
-                if (s->system_journal) {
+        assert(fd >= 0);
+        assert(b);
 
-                        /* Try to open the runtime journal, but only
-                         * if it already exists, so that we can flush
-                         * it into the system journal */
+        /* Returns the number of datagrams received into the batch */
 
-                        r = journal_file_open(fn, O_RDWR, 0640, s->compress, false, &s->runtime_metrics, s->mmap, NULL, &s->runtime_journal);
-                        free(fn);
+        if (!b->initialized) {
+                n = datagram_batch_init(b);
+                if (n < 0)
+                        return n;
+        }
 
-                        if (r < 0) {
-                                if (r != -ENOENT)
-                                        log_warning("Failed to open runtime journal: %s", strerror(-r));
+        if (b->n_slots <= 0)
+                return receive_datagram(fd, b);
 
-                                r = 0;
-                        }
+        /* If the next datagram does not fit into a slot, take the
+         * slow path for it */
+        if (ioctl(fd, SIOCINQ, &v) < 0) {
+                log_error("SIOCINQ failed: %m");
+                return -errno;
+        }
 
-                } else {
+        if ((size_t) v >= b->slot_size)
+                return receive_datagram(fd, b);
 
-                        /* OK, we really need the runtime journal, so create
-                         * it if necessary. */
+        for (i = 0; i < b->n_slots; i++) {
+                /* Leave room for a trailing NUL byte */
+                b->iovecs[i].iov_base = b->slots + i * b->slot_size;
+                b->iovecs[i].iov_len = b->slot_size - 1;
 
-                        (void) mkdir_parents(fn, 0755);
-                        r = journal_file_open_reliably(fn, O_RDWR|O_CREAT, 0640, s->compress, false, &s->runtime_metrics, s->mmap, NULL, &s->runtime_journal);
-                        free(fn);
+                b->msgs[i].msg_hdr.msg_controllen = sizeof(DatagramControl);
+                b->msgs[i].msg_hdr.msg_flags = 0;
+        }
 
-                        if (r < 0) {
-                                log_error("Failed to open runtime journal: %s", strerror(-r));
-                                return r;
-                        }
-                }
+        n = recvmmsg(fd, b->msgs, b->n_slots, MSG_DONTWAIT|MSG_CMSG_CLOEXEC, NULL);
+        if (n < 0) {
+                if (errno != EINTR && errno != EAGAIN)
+                        log_error("recvmmsg() failed: %m");
 
-                if (s->runtime_journal)
-                        server_fix_perms(s, s->runtime_journal, 0);
+                return -errno;
         }
 
-        available_space(s, true);
-
-        return r;
+        return n;
 }
 
-int server_flush_to_var(Server *s) {
-        int r;
-        sd_id128_t machine;
-        sd_journal *j = NULL;
-
+static void finish_ticket(Server *s) {
         assert(s);
+        assert(current_ticket_valid);
 
-        if (s->storage != STORAGE_AUTO &&
-            s->storage != STORAGE_PERSISTENT)
-                return 0;
-
-        if (!s->runtime_journal)
-                return 0;
+        assert_se(pthread_mutex_lock(&s->lock) == 0);
 
-        system_journal_open(s);
+        /* Might be that nothing got dispatched for this ticket */
+        while (s->dispatch_ticket != current_ticket)
+                assert_se(pthread_cond_wait(&s->dispatch_turn, &s->lock) == 0);
 
-        if (!s->system_journal)
-                return 0;
+        s->dispatch_ticket++;
+        current_ticket_valid = false;
 
-        log_debug("Flushing to /var...");
+        assert_se(pthread_cond_broadcast(&s->dispatch_turn) == 0);
+        assert_se(pthread_mutex_unlock(&s->lock) == 0);
+}
 
-        r = sd_id128_get_machine(&machine);
-        if (r < 0) {
-                log_error("Failed to get machine id: %s", strerror(-r));
-                return r;
-        }
+static void process_datagram(Server *s, int fd, char *buffer, size_t n, struct msghdr *msghdr) {
+        struct ucred *ucred = NULL;
+        struct timeval *tv = NULL;
+        struct cmsghdr *cmsg;
+        char *label = NULL;
+        size_t label_len = 0;
+        int *fds = NULL;
+        unsigned n_fds = 0;
 
-        r = sd_journal_open(&j, SD_JOURNAL_RUNTIME_ONLY);
-        if (r < 0) {
-                log_error("Failed to read runtime journal: %s", strerror(-r));
-                return r;
+        assert(s);
+        assert(buffer);
+        assert(msghdr);
+
+        for (cmsg = CMSG_FIRSTHDR(msghdr); cmsg; cmsg = CMSG_NXTHDR(msghdr, cmsg)) {
+
+                if (cmsg->cmsg_level == SOL_SOCKET &&
+                    cmsg->cmsg_type == SCM_CREDENTIALS &&
+                    cmsg->cmsg_len == CMSG_LEN(sizeof(struct ucred)))
+                        ucred = (struct ucred*) CMSG_DATA(cmsg);
+                else if (cmsg->cmsg_level == SOL_SOCKET &&
+                         cmsg->cmsg_type == SCM_SECURITY) {
+                        label = (char*) CMSG_DATA(cmsg);
+                        label_len = cmsg->cmsg_len - CMSG_LEN(0);
+                } else if (cmsg->cmsg_level == SOL_SOCKET &&
+                           cmsg->cmsg_type == SO_TIMESTAMP &&
+                           cmsg->cmsg_len == CMSG_LEN(sizeof(struct timeval)))
+                        tv = (struct timeval*) CMSG_DATA(cmsg);
+                else if (cmsg->cmsg_level == SOL_SOCKET &&
+                         cmsg->cmsg_type == SCM_RIGHTS) {
+                        fds = (int*) CMSG_DATA(cmsg);
+                        n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                }
         }
 
-        sd_journal_set_data_threshold(j, 0);
+        if (msghdr->msg_flags & MSG_TRUNC)
+                log_warning("Dropped datagram that did not fit into the receive buffer.");
+        else if (fd == s->syslog_fd) {
+                char *e;
 
-        SD_JOURNAL_FOREACH(j) {
-                Object *o = NULL;
-                JournalFile *f;
+                if (n > 0 && n_fds == 0) {
+                        e = memchr(buffer, '\n', n);
+                        if (e)
+                                *e = 0;
+                        else
+                                buffer[n] = 0;
 
-                f = j->current_file;
-                assert(f && f->current_offset > 0);
+                        server_process_syslog_message(s, strstrip(buffer), ucred, tv, label, label_len);
+                } else if (n_fds > 0)
+                        log_warning("Got file descriptors via syslog socket. Ignoring.");
 
-                r = journal_file_move_to_object(f, OBJECT_ENTRY, f->current_offset, &o);
-                if (r < 0) {
-                        log_error("Can't read entry: %s", strerror(-r));
-                        goto finish;
-                }
+        } else {
+                if (n > 0 && n_fds == 0)
+                        server_process_native_message(s, buffer, n, ucred, tv, label, label_len);
+                else if (n == 0 && n_fds == 1)
+                        server_process_native_file(s, fds[0], ucred, tv, label, label_len);
+                else if (n_fds > 0)
+                        log_warning("Got too many file descriptors via native socket. Ignoring.");
+        }
 
-                r = journal_file_copy_entry(f, s->system_journal, o, f->current_offset, NULL, NULL, NULL);
-                if (r >= 0)
-                        continue;
+        close_many(fds, n_fds);
+}
 
-                if (!shall_try_append_again(s->system_journal, r)) {
-                        log_error("Can't write entry: %s", strerror(-r));
-                        goto finish;
-                }
+int server_process_datagrams(Server *s, int fd, DatagramBatch *b) {
+        bool receiver;
+        unsigned k;
 
-                server_rotate(s);
-                server_vacuum(s);
+        assert(s);
+        assert(fd >= 0);
+        assert(b);
+
+        /* Reads and processes what is queued on the native or syslog
+         * socket, in batches of up to DATAGRAM_BATCH_MAX datagrams
+         * per system call. A client that keeps the socket busy must
+         * not starve signals, timers and the other sockets, hence
+         * we go back to epoll after a few batches. The socket stays
+         * readable, so we'll be back right away. */
+
+        receiver = s->n_receivers > 0 && !is_main_thread();
+
+        for (k = 0; k < DATAGRAM_BATCHES_PER_WAKEUP; k++) {
+                uint64_t ticket = 0;
+                int n, i;
+
+                /* The main thread writes out the queue itself when
+                 * it runs full, everybody else has to wait for it */
+                if (receiver)
+                        server_wait_for_queue_space(s);
+
+                /* Receiver threads take a ticket with each datagram,
+                 * and dispatch in ticket order, so that messages are
+                 * stored in the order they have been sent, even
+                 * though they are processed in parallel. */
+                if (receiver)
+                        assert_se(pthread_mutex_lock(&s->receive_lock) == 0);
+
+                n = receive_datagrams(fd, b);
+
+                if (receiver) {
+                        if (n > 0) {
+                                ticket = s->next_ticket;
+                                s->next_ticket += n;
+                        }
 
-                if (!s->system_journal) {
-                        log_notice("Didn't flush runtime journal since rotation of system journal wasn't successful.");
-                        r = -EIO;
-                        goto finish;
+                        assert_se(pthread_mutex_unlock(&s->receive_lock) == 0);
                 }
 
-                log_debug("Retrying write.");
-                r = journal_file_copy_entry(f, s->system_journal, o, f->current_offset, NULL, NULL, NULL);
-                if (r < 0) {
-                        log_error("Can't write entry: %s", strerror(-r));
-                        goto finish;
+                if (n < 0) {
+                        if (n == -EINTR || n == -EAGAIN)
+                                return 1;
+
+                        return n;
                 }
-        }
 
-finish:
-        journal_file_post_change(s->system_journal);
+                for (i = 0; i < n; i++) {
+                        if (receiver) {
+                                current_ticket = ticket + i;
+                                current_ticket_valid = true;
+                        }
 
-        journal_file_close(s->runtime_journal);
-        s->runtime_journal = NULL;
+                        process_datagram(s, fd, b->msgs[i].msg_hdr.msg_iov->iov_base, b->msgs[i].msg_len, &b->msgs[i].msg_hdr);
 
-        if (r >= 0)
-                rm_rf("/run/log/journal", false, true, false);
+                        if (receiver)
+                                finish_ticket(s);
+                }
 
-        sd_journal_close(j);
+                if (b->n_slots > 0)
+                        datagram_batch_trim(b, n);
+        }
 
-        return r;
+        return 1;
 }
 
 int process_event(Server *s, struct epoll_event *ev) {
@@ -1094,7 +2050,15 @@ int process_event(Server *s, struct epoll_event *ev) {
 
                 if (sfsi.ssi_signo == SIGUSR2) {
                         server_rotate(s);
-                        server_vacuum(s);
+
+                        /* Pick up files others might have added or
+                         * removed, too */
+                        if (s->system_vacuum)
+                                journal_vacuum_rescan(s->system_vacuum);
+                        if (s->runtime_vacuum)
+                                journal_vacuum_rescan(s->runtime_vacuum);
+
+                        server_schedule_vacuum(s);
                         return 1;
                 }
 
@@ -1115,6 +2079,39 @@ int process_event(Server *s, struct epoll_event *ev) {
                 server_sync(s);
                 return 1;
 
+        } else if (ev->data.fd == s->notify_timer_fd) {
+                int r;
+                uint64_t t;
+
+                r = read(ev->data.fd, (void *)&t, sizeof(t));
+                if (r < 0)
+                        return 0;
+
+                s->notify_scheduled = false;
+                server_post_change(s);
+                return 1;
+
+        } else if (ev->data.fd == s->rate_limit_timer_fd) {
+                int r;
+                uint64_t t;
+
+                r = read(ev->data.fd, (void *)&t, sizeof(t));
+                if (r < 0)
+                        return 0;
+
+                server_release_deferred(s, false);
+                return 1;
+
+        } else if (ev->data.fd == device_cache_get_fd(s->device_cache)) {
+
+                if (ev->events != EPOLLIN) {
+                        log_error("Got invalid event from epoll.");
+                        return -EIO;
+                }
+
+                device_cache_process_monitor(s->device_cache);
+                return 1;
+
         } else if (ev->data.fd == s->dev_kmsg_fd) {
                 int r;
 
@@ -1137,124 +2134,15 @@ int process_event(Server *s, struct epoll_event *ev) {
                         return -EIO;
                 }
 
-                for (;;) {
-                        struct msghdr msghdr;
-                        struct iovec iovec;
-                        struct ucred *ucred = NULL;
-                        struct timeval *tv = NULL;
-                        struct cmsghdr *cmsg;
-                        char *label = NULL;
-                        size_t label_len = 0;
-                        union {
-                                struct cmsghdr cmsghdr;
-
-                                /* We use NAME_MAX space for the
-                                 * SELinux label here. The kernel
-                                 * currently enforces no limit, but
-                                 * according to suggestions from the
-                                 * SELinux people this will change and
-                                 * it will probably be identical to
-                                 * NAME_MAX. For now we use that, but
-                                 * this should be updated one day when
-                                 * the final limit is known.*/
-                                uint8_t buf[CMSG_SPACE(sizeof(struct ucred)) +
-                                            CMSG_SPACE(sizeof(struct timeval)) +
-                                            CMSG_SPACE(sizeof(int)) + /* fd */
-                                            CMSG_SPACE(NAME_MAX)]; /* selinux label */
-                        } control;
-                        ssize_t n;
-                        int v;
-                        int *fds = NULL;
-                        unsigned n_fds = 0;
-
-                        if (ioctl(ev->data.fd, SIOCINQ, &v) < 0) {
-                                log_error("SIOCINQ failed: %m");
-                                return -errno;
-                        }
-
-                        if (s->buffer_size < (size_t) v) {
-                                void *b;
-                                size_t l;
-
-                                l = MAX(LINE_MAX + (size_t) v, s->buffer_size * 2);
-                                b = realloc(s->buffer, l+1);
-
-                                if (!b) {
-                                        log_error("Couldn't increase buffer.");
-                                        return -ENOMEM;
-                                }
-
-                                s->buffer_size = l;
-                                s->buffer = b;
-                        }
-
-                        zero(iovec);
-                        iovec.iov_base = s->buffer;
-                        iovec.iov_len = s->buffer_size;
+                return server_process_datagrams(s, ev->data.fd, &s->batch);
 
-                        zero(control);
-                        zero(msghdr);
-                        msghdr.msg_iov = &iovec;
-                        msghdr.msg_iovlen = 1;
-                        msghdr.msg_control = &control;
-                        msghdr.msg_controllen = sizeof(control);
-
-                        n = recvmsg(ev->data.fd, &msghdr, MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
-                        if (n < 0) {
-
-                                if (errno == EINTR || errno == EAGAIN)
-                                        return 1;
-
-                                log_error("recvmsg() failed: %m");
-                                return -errno;
-                        }
-
-                        for (cmsg = CMSG_FIRSTHDR(&msghdr); cmsg; cmsg = CMSG_NXTHDR(&msghdr, cmsg)) {
-
-                                if (cmsg->cmsg_level == SOL_SOCKET &&
-                                    cmsg->cmsg_type == SCM_CREDENTIALS &&
-                                    cmsg->cmsg_len == CMSG_LEN(sizeof(struct ucred)))
-                                        ucred = (struct ucred*) CMSG_DATA(cmsg);
-                                else if (cmsg->cmsg_level == SOL_SOCKET &&
-                                         cmsg->cmsg_type == SCM_SECURITY) {
-                                        label = (char*) CMSG_DATA(cmsg);
-                                        label_len = cmsg->cmsg_len - CMSG_LEN(0);
-                                } else if (cmsg->cmsg_level == SOL_SOCKET &&
-                                           cmsg->cmsg_type == SO_TIMESTAMP &&
-                                           cmsg->cmsg_len == CMSG_LEN(sizeof(struct timeval)))
-                                        tv = (struct timeval*) CMSG_DATA(cmsg);
-                                else if (cmsg->cmsg_level == SOL_SOCKET &&
-                                         cmsg->cmsg_type == SCM_RIGHTS) {
-                                        fds = (int*) CMSG_DATA(cmsg);
-                                        n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
-                                }
-                        }
-
-                        if (ev->data.fd == s->syslog_fd) {
-                                char *e;
-
-                                if (n > 0 && n_fds == 0) {
-                                        e = memchr(s->buffer, '\n', n);
-                                        if (e)
-                                                *e = 0;
-                                        else
-                                                s->buffer[n] = 0;
-
-                                        server_process_syslog_message(s, strstrip(s->buffer), ucred, tv, label, label_len);
-                                } else if (n_fds > 0)
-                                        log_warning("Got file descriptors via syslog socket. Ignoring.");
-
-                        } else {
-                                if (n > 0 && n_fds == 0)
-                                        server_process_native_message(s, s->buffer, n, ucred, tv, label, label_len);
-                                else if (n == 0 && n_fds == 1)
-                                        server_process_native_file(s, fds[0], ucred, tv, label, label_len);
-                                else if (n_fds > 0)
-                                        log_warning("Got too many file descriptors via native socket. Ignoring.");
-                        }
+        } else if (ev->data.fd == s->queue_fd) {
+                uint64_t t;
 
-                        close_many(fds, n_fds);
-                }
+                /* The receiver threads queued something, which we
+                 * write out in the main loop */
+                if (read(ev->data.fd, &t, sizeof(t)) < 0 && errno != EAGAIN)
+                        return -errno;
 
                 return 1;
 
@@ -1265,7 +2153,7 @@ int process_event(Server *s, struct epoll_event *ev) {
                         return -EIO;
                 }
 
-                stdout_stream_new(s);
+                stdout_stream_new(s, s->epoll_fd);
                 return 1;
 
         } else {
@@ -1440,22 +2328,116 @@ int server_schedule_sync(Server *s) {
         return 0;
 }
 
+static int server_open_notify_timer(Server *s) {
+        int r;
+        struct epoll_event ev;
+
+        assert(s);
+
+        s->notify_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+        if (s->notify_timer_fd < 0)
+                return -errno;
+
+        zero(ev);
+        ev.events = EPOLLIN;
+        ev.data.fd = s->notify_timer_fd;
+
+        r = epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->notify_timer_fd, &ev);
+        if (r < 0) {
+                log_error("Failed to add notify timer fd to epoll object: %m");
+                return -errno;
+        }
+
+        return 0;
+}
+
+static int server_open_rate_limit_timer(Server *s) {
+        int r;
+        struct epoll_event ev;
+
+        assert(s);
+
+        s->rate_limit_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+        if (s->rate_limit_timer_fd < 0)
+                return -errno;
+
+        zero(ev);
+        ev.events = EPOLLIN;
+        ev.data.fd = s->rate_limit_timer_fd;
+
+        r = epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->rate_limit_timer_fd, &ev);
+        if (r < 0) {
+                log_error("Failed to add rate limit timer fd to epoll object: %m");
+                return -errno;
+        }
+
+        return 0;
+}
+
+int server_schedule_notify(Server *s) {
+        struct itimerspec notify_timer_enable = {};
+        int r;
+
+        assert(s);
+
+        /* Readers are woken up at most once per interval, and at
+         * the latest one interval after the first entry written
+         * since they were woken up the last time. */
+
+        if (s->notify_scheduled || s->notify_interval_usec <= 0)
+                return 0;
+
+        timespec_store(&notify_timer_enable.it_value, s->notify_interval_usec);
+
+        r = timerfd_settime(s->notify_timer_fd, 0, &notify_timer_enable, NULL);
+        if (r < 0) {
+                /* Better wake up readers too often than never */
+                server_post_change(s);
+                return -errno;
+        }
+
+        s->notify_scheduled = true;
+
+        return 0;
+}
+
+static void server_init_lock(Server *s) {
+        assert(s);
+
+        /* Driver messages are only generated once the lock is
+         * released again, hence it needn't be recursive */
+        assert_se(pthread_mutex_init(&s->lock, NULL) == 0);
+
+        assert_se(pthread_cond_init(&s->queue_space, NULL) == 0);
+        assert_se(pthread_cond_init(&s->dispatch_turn, NULL) == 0);
+        assert_se(pthread_mutex_init(&s->receive_lock, NULL) == 0);
+}
+
 int server_init(Server *s) {
         int n, r, fd;
 
         assert(s);
 
         zero(*s);
-        s->sync_timer_fd = s->syslog_fd = s->native_fd = s->stdout_fd =
-                s->signal_fd = s->epoll_fd = s->dev_kmsg_fd = -1;
+        s->sync_timer_fd = s->notify_timer_fd = s->rate_limit_timer_fd =
+                s->syslog_fd = s->native_fd =
+                s->stdout_fd = s->signal_fd = s->epoll_fd = s->dev_kmsg_fd =
+                s->queue_fd = s->receivers_exit_fd = -1;
+        server_init_lock(s);
         s->compress = true;
         s->seal = true;
 
         s->sync_interval_usec = DEFAULT_SYNC_INTERVAL_USEC;
         s->sync_scheduled = false;
 
+        s->notify_interval_usec = DEFAULT_NOTIFY_INTERVAL_USEC;
+        s->stdout_streams_max = DEFAULT_STDOUT_STREAMS_MAX;
+        s->line_max = DEFAULT_LINE_MAX;
+        s->notify_scheduled = false;
+
         s->rate_limit_interval = DEFAULT_RATE_LIMIT_INTERVAL;
         s->rate_limit_burst = DEFAULT_RATE_LIMIT_BURST;
+        s->rate_limit_queue = DEFAULT_RATE_LIMIT_QUEUE;
 
         s->forward_to_syslog = true;
 
@@ -1466,6 +2448,9 @@ int server_init(Server *s) {
 
         memset(&s->system_metrics, 0xFF, sizeof(s->system_metrics));
         memset(&s->runtime_metrics, 0xFF, sizeof(s->runtime_metrics));
+        s->system_metrics.usage = &s->system_usage;
+        s->runtime_metrics.usage = &s->runtime_usage;
+        s->system_metrics.vacuum = s->runtime_metrics.vacuum = NULL;
 
         server_parse_config_file(s);
         server_parse_proc_cmdline(s);
@@ -1476,6 +2461,14 @@ int server_init(Server *s) {
                 s->rate_limit_interval = s->rate_limit_burst = 0;
         }
 
+        if (s->line_max < LINE_MAX_MIN) {
+                log_debug("Raising line length limit from %zu to %u", s->line_max, LINE_MAX_MIN);
+                s->line_max = LINE_MAX_MIN;
+        } else if (s->line_max > LINE_MAX_MAX) {
+                log_debug("Lowering line length limit from %zu to %u", s->line_max, LINE_MAX_MAX);
+                s->line_max = LINE_MAX_MAX;
+        }
+
         mkdir_p("/run/systemd/journal", 0755);
 
         s->user_journals = hashmap_new(trivial_hash_func, trivial_compare_func);
@@ -1486,6 +2479,10 @@ int server_init(Server *s) {
         if (!s->mmap)
                 return log_oom();
 
+        s->pid_cache = pid_cache_new();
+        if (!s->pid_cache)
+                return log_oom();
+
         s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
         if (s->epoll_fd < 0) {
                 log_error("Failed to create epoll object: %m");
@@ -1557,6 +2554,10 @@ int server_init(Server *s) {
         if (r < 0)
                 return r;
 
+        r = server_open_notify_timer(s);
+        if (r < 0)
+                return r;
+
         r = open_signalfd(s);
         if (r < 0)
                 return r;
@@ -1565,8 +2566,38 @@ int server_init(Server *s) {
         if (!s->udev)
                 return -ENOMEM;
 
+        s->device_cache = device_cache_new(s->udev, N_IOVEC_UDEV_FIELDS);
+        if (!s->device_cache)
+                return -ENOMEM;
+
+        fd = device_cache_get_fd(s->device_cache);
+        if (fd >= 0) {
+                struct epoll_event ev = {
+                        .events = EPOLLIN,
+                        .data.fd = fd,
+                };
+
+                if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                        log_error("Failed to add udev monitor fd to epoll object: %m");
+                        return -errno;
+                }
+        }
+
+        r = server_init_vacuum(s);
+        if (r < 0)
+                return r;
+
+        if (s->rate_limit_queue > 0 && s->rate_limit_interval > 0) {
+                r = server_open_rate_limit_timer(s);
+                if (r < 0)
+                        return r;
+        } else
+                s->rate_limit_queue = 0;
+
         s->rate_limit = journal_rate_limit_new(s->rate_limit_interval,
-                                               s->rate_limit_burst);
+                                               s->rate_limit_burst,
+                                               s->rate_limit_queue,
+                                               free);
         if (!s->rate_limit)
                 return -ENOMEM;
 
@@ -1574,6 +2605,10 @@ int server_init(Server *s) {
         if (r < 0)
                 return r;
 
+        r = server_start_receivers(s);
+        if (r < 0)
+                return r;
+
         return 0;
 }
 
@@ -1597,9 +2632,18 @@ void server_done(Server *s) {
         JournalFile *f;
         assert(s);
 
+        server_stop_receivers(s);
+
+        if (s->rate_limit)
+                server_release_deferred(s, true);
+
+        server_write_queued(s);
+
         while (s->stdout_streams)
                 stdout_stream_free(s->stdout_streams);
 
+        stdout_buffers_free(s);
+
         if (s->system_journal)
                 journal_file_close(s->system_journal);
 
@@ -1632,18 +2676,45 @@ void server_done(Server *s) {
         if (s->sync_timer_fd >= 0)
                 close_nointr_nofail(s->sync_timer_fd);
 
+        if (s->notify_timer_fd >= 0)
+                close_nointr_nofail(s->notify_timer_fd);
+
+        if (s->rate_limit_timer_fd >= 0)
+                close_nointr_nofail(s->rate_limit_timer_fd);
+
+        if (s->queue_fd >= 0)
+                close_nointr_nofail(s->queue_fd);
+
         if (s->rate_limit)
                 journal_rate_limit_free(s->rate_limit);
 
+        journal_vacuum_free(s->system_vacuum);
+        journal_vacuum_free(s->runtime_vacuum);
+
         if (s->kernel_seqnum)
                 munmap(s->kernel_seqnum, sizeof(uint64_t));
 
-        free(s->buffer);
+        datagram_batch_done(&s->batch);
         free(s->tty_path);
 
+        queue_free(&s->queued);
+        queue_free(&s->writing);
+
         if (s->mmap)
                 mmap_cache_unref(s->mmap);
 
+        if (s->pid_cache) {
+                log_cache_stats(s);
+                pid_cache_free(s->pid_cache);
+        }
+
+        device_cache_free(s->device_cache);
+
         if (s->udev)
                 udev_unref(s->udev);
+
+        pthread_mutex_destroy(&s->receive_lock);
+        pthread_cond_destroy(&s->dispatch_turn);
+        pthread_cond_destroy(&s->queue_space);
+        pthread_mutex_destroy(&s->lock);
 }
@@ -22,16 +22,21 @@
 ***/
 
 #include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
 #include "journal-file.h"
+#include "journal-vacuum.h"
 #include "hashmap.h"
 #include "util.h"
 #include "audit.h"
 #include "journald-rate-limit.h"
+#include "journald-pid-cache.h"
+#include "journald-device-cache.h"
 #include "list.h"
 
 typedef enum Storage {
@@ -52,6 +57,68 @@ typedef enum SplitMode {
 } SplitMode;
 
 typedef struct StdoutStream StdoutStream;
+typedef struct Receiver Receiver;
+
+/* Where the iovecs of a queued entry start, and whom it belongs
+ * to. The iovecs and the data may move while more entries are
+ * queued, hence the pointers in the JournalAppendEntry objects and
+ * the iovecs are only filled in when the queue is written. */
+typedef struct QueuedEntry {
+        uid_t uid;
+        unsigned iovec_offset;
+} QueuedEntry;
+
+/* Entries that have been received but not written yet */
+typedef struct EntryQueue {
+        JournalAppendEntry *entries;
+        QueuedEntry *queued;
+        unsigned n_entries;
+        size_t entries_allocated, queued_allocated;
+
+        struct iovec *iovec;
+        unsigned n_iovec;
+        size_t iovec_allocated;
+
+        char *data;
+        size_t data_size, data_allocated;
+} EntryQueue;
+
+typedef union DatagramControl {
+        struct cmsghdr cmsghdr;
+
+        /* We use NAME_MAX space for the SELinux label here. The
+         * kernel currently enforces no limit, but according to
+         * suggestions from the SELinux people this will change and
+         * it will probably be identical to NAME_MAX. For now we use
+         * that, but this should be updated one day when the final
+         * limit is known.*/
+        uint8_t buf[CMSG_SPACE(sizeof(struct ucred)) +
+                    CMSG_SPACE(sizeof(struct timeval)) +
+                    CMSG_SPACE(sizeof(int)) + /* fd */
+                    CMSG_SPACE(NAME_MAX)]; /* selinux label */
+} DatagramControl;
+
+/* Buffers to receive a batch of datagrams with a single recvmmsg()
+ * call. Each thread reading the native and syslog sockets brings its
+ * own. The slots are large enough for any datagram an unprivileged
+ * client can send, but are only backed by memory as far as they are
+ * used. Should a larger one arrive anyway, the batch goes back to
+ * receiving datagrams one by one. */
+typedef struct DatagramBatch {
+        bool initialized;
+
+        struct mmsghdr *msgs;
+        struct iovec *iovecs;
+        DatagramControl *controls;
+        unsigned n_slots;
+
+        uint8_t *slots;
+        size_t slot_size;
+
+        /* For datagrams that are larger than a slot */
+        char *buffer;
+        size_t buffer_size;
+} DatagramBatch;
 
 typedef struct Server {
         int epoll_fd;
@@ -67,19 +134,21 @@ typedef struct Server {
 
         uint64_t seqnum;
 
-        char *buffer;
-        size_t buffer_size;
+        DatagramBatch batch;
 
         JournalRateLimit *rate_limit;
         usec_t sync_interval_usec;
+        usec_t notify_interval_usec;
         usec_t rate_limit_interval;
         unsigned rate_limit_burst;
+        unsigned rate_limit_queue;
 
         JournalMetrics runtime_metrics;
         JournalMetrics system_metrics;
 
         bool compress;
         bool seal;
+        bool index_archives;
 
         bool forward_to_kmsg;
         bool forward_to_syslog;
@@ -88,8 +157,21 @@ typedef struct Server {
         unsigned n_forward_syslog_missed;
         usec_t last_warn_forward_syslog_missed;
 
+        /* Disk space used by the journal files in /var/log/journal
+         * and /run/log/journal. Determined by looking at all files
+         * when the journal is opened, and kept up-to-date as files
+         * grow, are rotated and vacuumed afterwards. Whenever the
+         * vacuuming reads a directory again, the counter is replaced
+         * by what it found. */
+        uint64_t system_usage;
+        uint64_t runtime_usage;
+
+        /* Only the main thread looks at the journal files, the usage
+         * and the cache above. The receiver threads use the copy in
+         * available_space, which is protected by lock. */
         uint64_t cached_available_space;
         usec_t cached_available_space_timestamp;
+        uint64_t available_space;
 
         uint64_t var_available_timestamp;
 
@@ -97,11 +179,22 @@ typedef struct Server {
         usec_t max_file_usec;
         usec_t oldest_file_usec;
 
+        JournalVacuum *system_vacuum;
+        JournalVacuum *runtime_vacuum;
+        bool vacuum_scheduled;
+        usec_t vacuum_rescan_usec;
+
         gid_t file_gid;
         bool file_gid_valid;
 
         LIST_HEAD(StdoutStream, stdout_streams);
         unsigned n_stdout_streams;
+        unsigned stdout_streams_max;
+        size_t line_max;
+
+        /* Buffers given back by idle stdout streams */
+        char *stdout_buffers;
+        unsigned n_stdout_buffers;
 
         char *tty_path;
 
@@ -121,8 +214,48 @@ typedef struct Server {
 
         struct udev *udev;
 
+        PidCache *pid_cache;
+        DeviceCache *device_cache;
+
+        /* New entries are added to the first queue, while the
+         * second one is being written out */
+        EntryQueue queued;
+        EntryQueue writing;
+        bool writing_queued;
+
+        /* In pipeline mode, messages are received by receiver
+         * threads and written by the main thread. Each thread
+         * looks up the metadata of a message in its own process
+         * cache first. The lock is then only taken to pass the
+         * rate limit and queue the entry, and protects the stdout
+         * streams, too. Nobody writes to disk while holding it. */
+        unsigned n_receiver_threads;
+        Receiver *receivers;
+        unsigned n_receivers;
+        bool receivers_exit;
+        int receivers_exit_fd;
+        int queue_fd;
+
+        pthread_mutex_t lock;
+        pthread_cond_t queue_space;
+
+        /* Datagrams are dispatched in the order they have been
+         * received, see server_process_datagrams() */
+        pthread_mutex_t receive_lock;
+        uint64_t next_ticket;
+        uint64_t dispatch_ticket;
+        pthread_cond_t dispatch_turn;
+
         int sync_timer_fd;
         bool sync_scheduled;
+
+        int notify_timer_fd;
+        bool notify_scheduled;
+
+        /* When the next message held back by the rate limit may be
+         * written */
+        int rate_limit_timer_fd;
+        usec_t rate_limit_timer_usec;
 } Server;
 
 #define N_IOVEC_META_FIELDS 17
@@ -130,6 +263,7 @@ typedef struct Server {
 #define N_IOVEC_UDEV_FIELDS 32
 #define N_IOVEC_OBJECT_FIELDS 11
 
+void server_set_thread_pid_cache(PidCache *c);
 void server_dispatch_message(Server *s, struct iovec *iovec, unsigned n, unsigned m, struct ucred *ucred, struct timeval *tv, const char *label, size_t label_len, const char *unit_id, int priority, pid_t object_pid);
 void server_driver_message(Server *s, sd_id128_t message_id, const char *format, ...) _printf_attr_(3,4);
 
@@ -152,8 +286,16 @@ int server_init(Server *s);
 void server_done(Server *s);
 void server_sync(Server *s);
 void server_vacuum(Server *s);
+void server_schedule_vacuum(Server *s);
+void server_vacuum_step(Server *s);
 void server_rotate(Server *s);
 int server_schedule_sync(Server *s);
+int server_schedule_notify(Server *s);
+void server_post_change(Server *s);
 int server_flush_to_var(Server *s);
+void server_write_queued(Server *s);
+void server_wait_for_queue_space(Server *s);
+int server_process_datagrams(Server *s, int fd, DatagramBatch *b);
+void datagram_batch_done(DatagramBatch *b);
 int process_event(Server *s, struct epoll_event *ev);
 void server_maybe_append_tags(Server *s);
@@ -35,7 +35,13 @@
 #include "journald-kmsg.h"
 #include "journald-console.h"
 
-#define STDOUT_STREAMS_MAX 4096
+/* Streams get a buffer of this size when they have data to process,
+ * and give it back when they are idle again. Longer lines get a
+ * larger buffer, up to the configured LineMax=. */
+#define STDOUT_BUFFER_SIZE LINE_MAX
+
+/* Number of idle buffers kept around for reuse */
+#define STDOUT_BUFFERS_POOL_MAX 64
 
 typedef enum StdoutStreamState {
         STDOUT_STREAM_IDENTIFIER,
@@ -53,6 +59,7 @@ struct StdoutStream {
         StdoutStreamState state;
 
         int fd;
+        int epoll_fd;
 
         struct ucred ucred;
 #ifdef HAVE_SELINUX
@@ -67,8 +74,8 @@ struct StdoutStream {
         bool forward_to_kmsg:1;
         bool forward_to_console:1;
 
-        char buffer[LINE_MAX+1];
-        size_t length;
+        char *buffer;
+        size_t length, allocated;
 
         LIST_FIELDS(StdoutStream, stdout_stream);
 };
@@ -234,13 +241,81 @@ static int stdout_stream_line(StdoutStream *s, char *p) {
         assert_not_reached("Unknown stream state");
 }
 
+static char *stdout_buffer_get(Server *s) {
+        char *b;
+
+        assert(s);
+
+        assert_se(pthread_mutex_lock(&s->lock) == 0);
+
+        b = s->stdout_buffers;
+        if (b) {
+                s->stdout_buffers = *(char**) b;
+                s->n_stdout_buffers--;
+        }
+
+        assert_se(pthread_mutex_unlock(&s->lock) == 0);
+
+        if (!b)
+                b = malloc(STDOUT_BUFFER_SIZE);
+
+        return b;
+}
+
+static void stdout_buffer_put(Server *s, char *b, size_t allocated) {
+        assert(s);
+
+        if (!b)
+                return;
+
+        /* Only buffers of the default size are pooled, the rare
+         * larger ones are freed right-away */
+        if (allocated == STDOUT_BUFFER_SIZE) {
+                assert_se(pthread_mutex_lock(&s->lock) == 0);
+
+                if (s->n_stdout_buffers < STDOUT_BUFFERS_POOL_MAX) {
+                        *(char**) b = s->stdout_buffers;
+                        s->stdout_buffers = b;
+                        s->n_stdout_buffers++;
+                        b = NULL;
+                }
+
+                assert_se(pthread_mutex_unlock(&s->lock) == 0);
+        }
+
+        free(b);
+}
+
+void stdout_buffers_free(Server *s) {
+        assert(s);
+
+        while (s->stdout_buffers) {
+                char *b = s->stdout_buffers;
+
+                s->stdout_buffers = *(char**) b;
+                free(b);
+        }
+
+        s->n_stdout_buffers = 0;
+}
+
+static void stdout_stream_release_buffer(StdoutStream *s) {
+        assert(s);
+
+        stdout_buffer_put(s->server, s->buffer, s->allocated);
+        s->buffer = NULL;
+        s->allocated = 0;
+}
+
 static int stdout_stream_scan(StdoutStream *s, bool force_flush) {
         char *p;
-        size_t remaining;
+        size_t remaining, line_max;
         int r;
 
         assert(s);
 
+        line_max = s->server->line_max;
+
         p = s->buffer;
         remaining = s->length;
         for (;;) {
@@ -250,9 +325,11 @@ static int stdout_stream_scan(StdoutStream *s, bool force_flush) {
                 end = memchr(p, '\n', remaining);
                 if (end)
                         skip = end - p + 1;
-                else if (remaining >= sizeof(s->buffer) - 1) {
-                        end = p + sizeof(s->buffer) - 1;
-                        skip = remaining;
+                else if (remaining >= line_max) {
+                        /* Never read more than a line, so this is
+                         * within the buffer */
+                        end = p + line_max;
+                        skip = line_max;
                 } else
                         break;
 
@@ -281,6 +358,45 @@ static int stdout_stream_scan(StdoutStream *s, bool force_flush) {
                 s->length = remaining;
         }
 
+        /* Nothing pending, give the buffer back until the next
+         * time there is something to read */
+        if (s->length == 0)
+                stdout_stream_release_buffer(s);
+
+        return 0;
+}
+
+static int stdout_stream_make_room(StdoutStream *s) {
+        size_t line_max, n;
+        char *b;
+
+        assert(s);
+
+        if (!s->buffer) {
+                s->buffer = stdout_buffer_get(s->server);
+                if (!s->buffer)
+                        return log_oom();
+
+                s->allocated = STDOUT_BUFFER_SIZE;
+                return 0;
+        }
+
+        /* A line longer than the buffer, reassemble it in a larger
+         * one, as long as it is not longer than LineMax= */
+        line_max = s->server->line_max;
+        if (s->length < s->allocated - 1 || s->length >= line_max)
+                return 0;
+
+        n = MAX(s->allocated * 2, s->length + 1 + LINE_MAX);
+        n = MIN(n, line_max + 1);
+
+        b = realloc(s->buffer, n);
+        if (!b)
+                return log_oom();
+
+        s->buffer = b;
+        s->allocated = n;
+
         return 0;
 }
 
@@ -290,7 +406,11 @@ int stdout_stream_process(StdoutStream *s) {
 
         assert(s);
 
-        l = read(s->fd, s->buffer+s->length, sizeof(s->buffer)-1-s->length);
+        r = stdout_stream_make_room(s);
+        if (r < 0)
+                return r;
+
+        l = read(s->fd, s->buffer+s->length, MIN(s->allocated-1, s->server->line_max) - s->length);
         if (l < 0) {
 
                 if (errno == EAGAIN)
@@ -321,14 +441,16 @@ void stdout_stream_free(StdoutStream *s) {
         assert(s);
 
         if (s->server) {
+                assert_se(pthread_mutex_lock(&s->server->lock) == 0);
                 assert(s->server->n_stdout_streams > 0);
                 s->server->n_stdout_streams --;
                 LIST_REMOVE(StdoutStream, stdout_stream, s->server->stdout_streams, s);
+                assert_se(pthread_mutex_unlock(&s->server->lock) == 0);
         }
 
         if (s->fd >= 0) {
-                if (s->server)
-                        epoll_ctl(s->server->epoll_fd, EPOLL_CTL_DEL, s->fd, NULL);
+                if (s->epoll_fd >= 0)
+                        epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, s->fd, NULL);
 
                 close_nointr_nofail(s->fd);
         }
@@ -338,17 +460,24 @@ void stdout_stream_free(StdoutStream *s) {
                 freecon(s->security_context);
 #endif
 
+        if (s->server)
+                stdout_stream_release_buffer(s);
+        else
+                free(s->buffer);
+
         free(s->identifier);
         free(s);
 }
 
-int stdout_stream_new(Server *s) {
+int stdout_stream_new(Server *s, int epoll_fd) {
         StdoutStream *stream;
         int fd, r;
         socklen_t len;
         struct epoll_event ev;
+        bool too_many;
 
         assert(s);
+        assert(epoll_fd >= 0);
 
         fd = accept4(s->stdout_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
         if (fd < 0) {
@@ -359,7 +488,11 @@ int stdout_stream_new(Server *s) {
                 return -errno;
         }
 
-        if (s->n_stdout_streams >= STDOUT_STREAMS_MAX) {
+        assert_se(pthread_mutex_lock(&s->lock) == 0);
+        too_many = s->n_stdout_streams >= s->stdout_streams_max;
+        assert_se(pthread_mutex_unlock(&s->lock) == 0);
+
+        if (too_many) {
                 log_warning("Too many stdout streams, refusing connection.");
                 close_nointr_nofail(fd);
                 return 0;
@@ -372,6 +505,7 @@ int stdout_stream_new(Server *s) {
         }
 
         stream->fd = fd;
+        stream->epoll_fd = -1;
 
         len = sizeof(stream->ucred);
         if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &stream->ucred, &len) < 0) {
@@ -394,15 +528,19 @@ int stdout_stream_new(Server *s) {
         zero(ev);
         ev.data.ptr = stream;
         ev.events = EPOLLIN;
-        if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
                 log_error("Failed to add stream to event loop: %m");
                 r = -errno;
                 goto fail;
         }
 
+        stream->epoll_fd = epoll_fd;
+
         stream->server = s;
+        assert_se(pthread_mutex_lock(&s->lock) == 0);
         LIST_PREPEND(StdoutStream, stdout_stream, s->stdout_streams, stream);
         s->n_stdout_streams ++;
+        assert_se(pthread_mutex_unlock(&s->lock) == 0);
 
         return 0;
 
@@ -25,6 +25,8 @@
 
 int server_open_stdout_socket(Server *s);
 
-int stdout_stream_new(Server *s);
+int stdout_stream_new(Server *s, int epoll_fd);
 void stdout_stream_free(StdoutStream *s);
 int stdout_stream_process(StdoutStream *s);
+
+void stdout_buffers_free(Server *s);
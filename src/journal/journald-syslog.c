@@ -79,7 +79,7 @@ static void forward_syslog_iovec(Server *s, const struct iovec *iovec, unsigned
         /* The socket is full? I guess the syslog implementation is
          * too slow, and we shouldn't wait for that... */
         if (errno == EAGAIN) {
-                s->n_forward_syslog_missed++;
+                __sync_fetch_and_add(&s->n_forward_syslog_missed, 1);
                 return;
         }
 
@@ -98,7 +98,7 @@ static void forward_syslog_iovec(Server *s, const struct iovec *iovec, unsigned
                         return;
 
                 if (errno == EAGAIN) {
-                        s->n_forward_syslog_missed++;
+                        __sync_fetch_and_add(&s->n_forward_syslog_missed, 1);
                         return;
                 }
         }
@@ -125,7 +125,7 @@ void server_forward_syslog(Server *s, int priority, const char *identifier, cons
         char header_priority[6], header_time[64], header_pid[16];
         int n = 0;
         time_t t;
-        struct tm *tm;
+        struct tm tm;
         char *ident_buf = NULL;
 
         assert(s);
@@ -143,10 +143,9 @@ void server_forward_syslog(Server *s, int priority, const char *identifier, cons
 
         /* Second: timestamp */
         t = tv ? tv->tv_sec : ((time_t) (now(CLOCK_REALTIME) / USEC_PER_SEC));
-        tm = localtime(&t);
-        if (!tm)
+        if (!localtime_r(&t, &tm))
                 return;
-        if (strftime(header_time, sizeof(header_time), "%h %e %T ", tm) <= 0)
+        if (strftime(header_time, sizeof(header_time), "%h %e %T ", &tm) <= 0)
                 return;
         IOVEC_SET_STRING(iovec[n++], header_time);
 
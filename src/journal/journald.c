@@ -58,7 +58,7 @@ int main(int argc, char *argv[]) {
         if (r < 0)
                 goto finish;
 
-        server_vacuum(&server);
+        server_schedule_vacuum(&server);
         server_flush_to_var(&server);
         server_flush_dev_kmsg(&server);
 
@@ -74,15 +74,25 @@ int main(int argc, char *argv[]) {
                 int t = -1;
                 usec_t n;
 
+                /* Write out everything we received in the previous
+                 * iteration, before we go to sleep */
+                server_write_queued(&server);
+
+                /* Vacuum a bit in each iteration, and don't sleep
+                 * while there is more to do */
+                server_vacuum_step(&server);
+                if (server.vacuum_scheduled)
+                        t = 0;
+
                 n = now(CLOCK_REALTIME);
 
-                if (server.max_retention_usec > 0 && server.oldest_file_usec > 0) {
+                if (!server.vacuum_scheduled && server.max_retention_usec > 0 && server.oldest_file_usec > 0) {
 
                         /* The retention time is reached, so let's vacuum! */
                         if (server.oldest_file_usec + server.max_retention_usec < n) {
                                 log_info("Retention time reached.");
                                 server_rotate(&server);
-                                server_vacuum(&server);
+                                server_schedule_vacuum(&server);
                                 continue;
                         }
 
@@ -32,6 +32,7 @@
 #include "mmap-cache.h"
 
 typedef struct Window Window;
+typedef struct WindowChunk WindowChunk;
 typedef struct Context Context;
 typedef struct FileDescriptor FileDescriptor;
 
@@ -40,6 +41,7 @@ struct Window {
 
         bool keep_always;
         bool in_unused;
+        bool sequential;
 
         int prot;
         void *ptr;
@@ -48,12 +50,20 @@ struct Window {
 
         FileDescriptor *fd;
 
+        /* One for each chunk the window covers, see below */
+        WindowChunk *chunks;
+
         LIST_FIELDS(Window, by_fd);
         LIST_FIELDS(Window, unused);
 
         LIST_HEAD(Context, contexts);
 };
 
+struct WindowChunk {
+        Window *window;
+        LIST_FIELDS(WindowChunk, by_chunk);
+};
+
 struct Context {
         MMapCache *cache;
         unsigned id;
@@ -66,21 +76,60 @@ struct FileDescriptor {
         MMapCache *cache;
         int fd;
         LIST_HEAD(Window, windows);
+
+        /* Maps each CHUNK_SIZE sized piece of the file to the list of
+         * windows covering it, most recently mapped first, so that
+         * lookups don't get slower with the number of windows */
+        Hashmap *chunks;
+
+        /* The size of the next window we map for this file, where
+         * the last one was placed, and how many windows in a row
+         * continued where the previous one ended, so that we can
+         * tell sequential from random access */
+        uint64_t window_size;
+        uint64_t last_offset;
+        uint64_t last_size;
+        int last_direction;
+        unsigned n_sequential;
 };
 
 struct MMapCache {
         int n_ref;
         unsigned n_windows;
+        uint64_t mapped_size;
 
         Hashmap *fds;
         Hashmap *contexts;
 
+        /* Windows not referenced by any context. We evict from the
+         * tail. Windows of sequential scans are added at the tail,
+         * since they are unlikely to be needed again, everything
+         * else at the head. */
         LIST_HEAD(Window, unused);
         Window *last_unused;
+
+        MMapCacheStatistics statistics;
 };
 
+/* We always keep at least WINDOWS_MIN windows around. Beyond that
+ * unused windows are only kept as long as the total mapped size stays
+ * below MAPPED_MAX, so that small windows are cached in larger
+ * numbers than large ones. */
 #define WINDOWS_MIN 64
+#define MAPPED_MAX (sizeof(void*) >= 8 ? 512ULL*1024ULL*1024ULL : 128ULL*1024ULL*1024ULL)
+
+/* New files start out with the default window size. It is halved
+ * for every access that looks random (i.e. bisection), and doubled
+ * for every access that continues a scan. Bisection occasionally
+ * continues right after the previous window too, hence we only
+ * consider it a scan after SEQUENTIAL_MIN such windows in a row. */
+#define WINDOW_SIZE_MIN (1ULL*1024ULL*1024ULL)
 #define WINDOW_SIZE (8ULL*1024ULL*1024ULL)
+#define WINDOW_SIZE_MAX (sizeof(void*) >= 8 ? 128ULL*1024ULL*1024ULL : 32ULL*1024ULL*1024ULL)
+#define SEQUENTIAL_MIN 2
+
+#define CHUNK_SIZE WINDOW_SIZE_MIN
+#define CHUNK_TO_PTR(c) ((void*) (uintptr_t) ((c) + 1))
 
 MMapCache* mmap_cache_new(void) {
         MMapCache *m;
@@ -101,16 +150,90 @@ MMapCache* mmap_cache_ref(MMapCache *m) {
         return m;
 }
 
+static uint64_t window_first_chunk(Window *w) {
+        return w->offset / CHUNK_SIZE;
+}
+
+static uint64_t window_n_chunks(Window *w) {
+        return (w->offset + w->size - 1) / CHUNK_SIZE - window_first_chunk(w) + 1;
+}
+
+static void window_index(Window *w) {
+        uint64_t c, i, n;
+
+        assert(w);
+        assert(w->fd);
+        assert(!w->chunks);
+
+        /* The index is only a hint, if we fail to add to it we'll
+         * simply map the same range again later */
+        if (hashmap_ensure_allocated(&w->fd->chunks, trivial_hash_func, trivial_compare_func) < 0)
+                return;
+
+        n = window_n_chunks(w);
+        w->chunks = new0(WindowChunk, n);
+        if (!w->chunks)
+                return;
+
+        for (i = 0, c = window_first_chunk(w); i < n; i++, c++) {
+                WindowChunk *head;
+
+                head = hashmap_get(w->fd->chunks, CHUNK_TO_PTR(c));
+                LIST_PREPEND(WindowChunk, by_chunk, head, &w->chunks[i]);
+
+                /* This can only fail for chunks we had no windows
+                 * for yet, in which case we leave this one out */
+                if (hashmap_replace(w->fd->chunks, CHUNK_TO_PTR(c), head) < 0)
+                        continue;
+
+                w->chunks[i].window = w;
+        }
+}
+
+static void window_unindex(Window *w) {
+        uint64_t c, i, n;
+
+        assert(w);
+        assert(w->fd);
+
+        if (!w->chunks)
+                return;
+
+        n = window_n_chunks(w);
+
+        for (i = 0, c = window_first_chunk(w); i < n; i++, c++) {
+                WindowChunk *head;
+
+                if (!w->chunks[i].window)
+                        continue;
+
+                head = hashmap_get(w->fd->chunks, CHUNK_TO_PTR(c));
+                LIST_REMOVE(WindowChunk, by_chunk, head, &w->chunks[i]);
+
+                if (head)
+                        hashmap_replace(w->fd->chunks, CHUNK_TO_PTR(c), head);
+                else
+                        hashmap_remove(w->fd->chunks, CHUNK_TO_PTR(c));
+        }
+
+        free(w->chunks);
+        w->chunks = NULL;
+}
+
 static void window_unlink(Window *w) {
         Context *c;
 
         assert(w);
 
-        if (w->ptr)
+        if (w->ptr) {
                 munmap(w->ptr, w->size);
+                w->cache->mapped_size -= w->size;
+        }
 
-        if (w->fd)
+        if (w->fd) {
+                window_unindex(w);
                 LIST_REMOVE(Window, by_fd, w->fd->windows, w);
+        }
 
         if (w->in_unused) {
                 if (w->cache->last_unused == w)
@@ -146,12 +269,14 @@ _pure_ static bool window_matches(Window *w, int fd, int prot, uint64_t offset,
                 offset + size <= w->offset + w->size;
 }
 
-static Window *window_add(MMapCache *m) {
+static Window *window_add(MMapCache *m, uint64_t size) {
         Window *w;
 
         assert(m);
 
-        if (!m->last_unused || m->n_windows <= WINDOWS_MIN) {
+        if (!m->last_unused ||
+            m->n_windows <= WINDOWS_MIN ||
+            m->mapped_size + size <= MAPPED_MAX) {
 
                 /* Allocate a new window */
                 w = new0(Window, 1);
@@ -164,6 +289,8 @@ static Window *window_add(MMapCache *m) {
                 w = m->last_unused;
                 window_unlink(w);
                 zero(*w);
+
+                m->statistics.evictions++;
         }
 
         w->cache = m;
@@ -184,9 +311,14 @@ static void context_detach_window(Context *c) {
 
         if (!w->contexts && !w->keep_always) {
                 /* Not used anymore? */
-                LIST_PREPEND(Window, unused, c->cache->unused, w);
-                if (!c->cache->last_unused)
+                if (w->sequential) {
+                        LIST_INSERT_AFTER(Window, unused, c->cache->unused, c->cache->last_unused, w);
                         c->cache->last_unused = w;
+                } else {
+                        LIST_PREPEND(Window, unused, c->cache->unused, w);
+                        if (!c->cache->last_unused)
+                                c->cache->last_unused = w;
+                }
 
                 w->in_unused = true;
         }
@@ -261,6 +393,8 @@ static void fd_free(FileDescriptor *f) {
         while (f->windows)
                 window_free(f->windows);
 
+        hashmap_free(f->chunks);
+
         if (f->cache)
                 assert_se(hashmap_remove(f->cache->fds, INT_TO_PTR(f->fd + 1)));
 
@@ -288,6 +422,7 @@ static FileDescriptor* fd_add(MMapCache *m, int fd) {
 
         f->cache = m;
         f->fd = fd;
+        f->window_size = WINDOW_SIZE;
 
         r = hashmap_put(m->fds, UINT_TO_PTR(fd + 1), f);
         if (r < 0) {
@@ -307,9 +442,13 @@ static void mmap_cache_free(MMapCache *m) {
         while ((c = hashmap_first(m->contexts)))
                 context_free(c);
 
+        hashmap_free(m->contexts);
+
         while ((f = hashmap_first(m->fds)))
                 fd_free(f);
 
+        hashmap_free(m->fds);
+
         while (m->unused)
                 window_free(m->unused);
 
@@ -334,6 +473,7 @@ static int make_room(MMapCache *m) {
                 return 0;
 
         window_free(m->last_unused);
+        m->statistics.evictions++;
         return 1;
 }
 
@@ -373,6 +513,8 @@ static int try_context(
 
         c->window->keep_always = c->window->keep_always || keep_always;
 
+        m->statistics.context_hits++;
+
         *ret = (uint8_t*) c->window->ptr + (offset - c->window->offset);
         return 1;
 }
@@ -388,7 +530,8 @@ static int find_mmap(
                 void **ret) {
 
         FileDescriptor *f;
-        Window *w;
+        WindowChunk *i;
+        Window *w = NULL;
         Context *c;
 
         assert(m);
@@ -403,9 +546,11 @@ static int find_mmap(
 
         assert(f->fd == fd);
 
-        LIST_FOREACH(by_fd, w, f->windows)
-                if (window_matches(w, fd, prot, offset, size))
+        LIST_FOREACH(by_chunk, i, hashmap_get(f->chunks, CHUNK_TO_PTR(offset / CHUNK_SIZE)))
+                if (window_matches(i->window, fd, prot, offset, size)) {
+                        w = i->window;
                         break;
+                }
 
         if (!w)
                 return 0;
@@ -417,6 +562,8 @@ static int find_mmap(
         context_attach_window(c, w);
         w->keep_always = w->keep_always || keep_always;
 
+        m->statistics.window_hits++;
+
         *ret = (uint8_t*) w->ptr + (offset - w->offset);
         return 1;
 }
@@ -437,7 +584,8 @@ static int add_mmap(
         FileDescriptor *f;
         Window *w;
         void *d;
-        int r;
+        int direction = 0, r;
+        bool scan = false;
 
         assert(m);
         assert(m->n_ref > 0);
@@ -445,32 +593,82 @@ static int add_mmap(
         assert(size > 0);
         assert(ret);
 
+        f = fd_add(m, fd);
+        if (!f)
+                return -ENOMEM;
+
+        m->statistics.misses++;
+
         woffset = offset & ~((uint64_t) page_size() - 1ULL);
         wsize = size + (offset - woffset);
         wsize = PAGE_ALIGN(wsize);
 
-        if (wsize < WINDOW_SIZE) {
-                uint64_t delta;
+        /* Does this continue right where the last window we mapped
+         * for this file ended, in either direction? */
+        if (f->last_size > 0) {
+                if (offset >= f->last_offset &&
+                    offset + size > f->last_offset + f->last_size &&
+                    offset <= f->last_offset + f->last_size + WINDOW_SIZE_MIN)
+                        direction = 1;
+                else if (offset < f->last_offset &&
+                         offset + size <= f->last_offset + f->last_size &&
+                         offset + size + WINDOW_SIZE_MIN >= f->last_offset)
+                        direction = -1;
+
+                if (direction != 0 && direction == f->last_direction)
+                        f->n_sequential++;
+                else
+                        f->n_sequential = direction != 0;
 
-                delta = PAGE_ALIGN((WINDOW_SIZE - wsize) / 2);
+                f->last_direction = direction;
 
-                if (delta > offset)
-                        woffset = 0;
-                else
-                        woffset -= delta;
+                scan = f->n_sequential >= SEQUENTIAL_MIN;
+
+                if (scan)
+                        f->window_size = MIN(f->window_size * 2, WINDOW_SIZE_MAX);
+                else if (direction == 0)
+                        f->window_size = MAX(f->window_size / 2, WINDOW_SIZE_MIN);
+        }
+
+        if (wsize < f->window_size) {
+                uint64_t delta;
 
-                wsize = WINDOW_SIZE;
+                /* When scanning, map what comes next in the scan
+                 * direction, otherwise center the window around the
+                 * requested range */
+                delta = f->window_size - wsize;
+                if (!scan)
+                        delta = PAGE_ALIGN(delta / 2);
+
+                if (!scan || direction < 0) {
+                        if (delta > woffset)
+                                woffset = 0;
+                        else
+                                woffset -= delta;
+                }
+
+                wsize = f->window_size;
         }
 
+        /* Align windows to whole chunks, so that each chunk we index
+         * a window under is fully covered by it */
+        wsize = (woffset + wsize + CHUNK_SIZE - 1) / CHUNK_SIZE * CHUNK_SIZE;
+        woffset = woffset / CHUNK_SIZE * CHUNK_SIZE;
+        wsize -= woffset;
+
         if (st) {
                 /* Memory maps that are larger then the files
                    underneath have undefined behavior. Hence, clamp
-                   things to the file size if we know it */
+                   things to the file size if we know it. Files
+                   smaller than the window are mapped in one go. */
 
                 if (woffset >= (uint64_t) st->st_size)
                         return -EADDRNOTAVAIL;
 
-                if (woffset + wsize > (uint64_t) st->st_size)
+                if (!scan && (uint64_t) st->st_size <= wsize) {
+                        woffset = 0;
+                        wsize = PAGE_ALIGN(st->st_size);
+                } else if (woffset + wsize > (uint64_t) st->st_size)
                         wsize = PAGE_ALIGN(st->st_size - woffset);
         }
 
@@ -488,26 +686,42 @@ static int add_mmap(
                         return -ENOMEM;
         }
 
+        /* Tell the kernel what to expect. We leave writable maps
+         * alone, journald appends to those and reads the hash
+         * tables, which doesn't match either pattern well. */
+        if (!(prot & PROT_WRITE) && f->last_size > 0) {
+                if (scan) {
+                        (void) madvise(d, wsize, MADV_SEQUENTIAL);
+                        (void) madvise(d, wsize, MADV_WILLNEED);
+                } else if (direction == 0)
+                        (void) madvise(d, wsize, MADV_RANDOM);
+        }
+
+        m->statistics.mmaps++;
+
         c = context_add(m, context);
         if (!c)
-                return -ENOMEM;
-
-        f = fd_add(m, fd);
-        if (!f)
-                return -ENOMEM;
+                goto fail;
 
-        w = window_add(m);
+        w = window_add(m, wsize);
         if (!w)
-                return -ENOMEM;
+                goto fail;
 
         w->keep_always = keep_always;
+        w->sequential = scan;
         w->ptr = d;
         w->offset = woffset;
         w->prot = prot;
         w->size = wsize;
         w->fd = f;
 
+        m->mapped_size += wsize;
+
+        f->last_offset = woffset;
+        f->last_size = wsize;
+
         LIST_PREPEND(Window, by_fd, f->windows, w);
+        window_index(w);
 
         context_detach_window(c);
         c->window = w;
@@ -515,6 +729,10 @@ static int add_mmap(
 
         *ret = (uint8_t*) w->ptr + (offset - w->offset);
         return 1;
+
+fail:
+        munmap(d, wsize);
+        return -ENOMEM;
 }
 
 int mmap_cache_get(
@@ -574,3 +792,12 @@ void mmap_cache_close_context(MMapCache *m, unsigned context) {
 
         context_free(c);
 }
+
+void mmap_cache_get_statistics(MMapCache *m, MMapCacheStatistics *ret) {
+        assert(m);
+        assert(ret);
+
+        *ret = m->statistics;
+        ret->n_windows = m->n_windows;
+        ret->mapped_size = m->mapped_size;
+}
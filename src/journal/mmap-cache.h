@@ -27,6 +27,24 @@
 
 typedef struct MMapCache MMapCache;
 
+typedef struct MMapCacheStatistics {
+        /* Lookups served by the window the context pointed to
+         * already, or by another window already mapped */
+        uint64_t context_hits;
+        uint64_t window_hits;
+
+        /* Lookups that required a new window, and the resulting
+         * mmap() calls */
+        uint64_t misses;
+        uint64_t mmaps;
+
+        /* Windows unmapped to make room for new ones */
+        uint64_t evictions;
+
+        unsigned n_windows;
+        uint64_t mapped_size;
+} MMapCacheStatistics;
+
 MMapCache* mmap_cache_new(void);
 MMapCache* mmap_cache_ref(MMapCache *m);
 MMapCache* mmap_cache_unref(MMapCache *m);
@@ -34,3 +52,5 @@ MMapCache* mmap_cache_unref(MMapCache *m);
 int mmap_cache_get(MMapCache *m, int fd, int prot, unsigned context, bool keep_always, uint64_t offset, size_t size, struct stat *st, void **ret);
 void mmap_cache_close_fd(MMapCache *m, int fd);
 void mmap_cache_close_context(MMapCache *m, unsigned context);
+
+void mmap_cache_get_statistics(MMapCache *m, MMapCacheStatistics *ret);
@@ -31,6 +31,7 @@
 #include "sd-journal.h"
 #include "journal-def.h"
 #include "journal-file.h"
+#include "journal-index.h"
 #include "hashmap.h"
 #include "list.h"
 #include "strv.h"
@@ -85,6 +86,8 @@ static void detach_location(sd_journal *j) {
 
         HASHMAP_FOREACH(f, j->files, i)
                 f->current_offset = 0;
+
+        j->merge_valid = false;
 }
 
 static void reset_location(sd_journal *j) {
@@ -419,30 +422,20 @@ _public_ void sd_journal_flush_matches(sd_journal *j) {
         detach_location(j);
 }
 
-static int compare_entry_order(JournalFile *af, Object *_ao,
-                               JournalFile *bf, uint64_t bp) {
+static int compare_entry_order(JournalFile *af, Object *ao,
+                               JournalFile *bf, Object *bo) {
 
         uint64_t a, b;
-        Object *ao, *bo;
-        int r;
 
         assert(af);
+        assert(ao);
         assert(bf);
-        assert(_ao);
-
-        /* The mmap cache might invalidate the object from the first
-         * file if we look at the one from the second file. Hence
-         * temporarily copy the header of the first one, and look at
-         * that only. */
-        ao = alloca(offsetof(EntryObject, items));
-        memcpy(ao, _ao, offsetof(EntryObject, items));
+        assert(bo);
 
-        r = journal_file_move_to_object(bf, OBJECT_ENTRY, bp, &bo);
-        if (r < 0)
-                return strcmp(af->path, bf->path);
-
-        /* We operate on two different files here, hence we can access
-         * two objects at the same time, which we normally can't.
+        /* Only the entry headers are looked at, which the caller
+         * copied out of the maps, since the mmap cache might
+         * invalidate the object of one file when we look at the
+         * other.
          *
          * If contents and timestamps match, these entries are
          * identical, even if the seqnum does not match */
@@ -876,53 +869,346 @@ static int next_beyond_location(sd_journal *j, JournalFile *f, direction_t direc
         }
 }
 
-static int real_journal_next(sd_journal *j, direction_t direction) {
-        JournalFile *f, *new_file = NULL;
-        uint64_t new_offset = 0;
+static int compare_merge_down(const void *a, const void *b) {
+        JournalFile *x = (JournalFile*) a, *y = (JournalFile*) b;
+
+        return compare_entry_order(x, (Object*) x->merge_entry, y, (Object*) y->merge_entry);
+}
+
+static int compare_merge_up(const void *a, const void *b) {
+        return compare_merge_down(b, a);
+}
+
+static JournalIndex *file_get_index(JournalFile *f) {
+        _cleanup_free_ char *p = NULL;
+        int r;
+
+        assert(f);
+
+        /* Only archived files get an index written, and only they
+         * are guaranteed not to change anymore. */
+
+        if (f->index_loaded)
+                return f->index;
+
+        f->index_loaded = true;
+
+        if (f->header->state != STATE_ARCHIVED)
+                return NULL;
+
+        p = journal_index_path(f->path);
+        if (!p)
+                return NULL;
+
+        r = journal_index_open(p, f, &f->index);
+        if (r < 0 && r != -ENOENT)
+                log_debug("Failed to open index %s, ignoring: %s", p, strerror(-r));
+
+        return f->index;
+}
+
+static bool index_may_match(JournalIndex *i, Match *m, bool use_realtime, uint64_t realtime, direction_t direction) {
+        Match *c;
+
+        assert(i);
+        assert(m);
+
+        /* Checks whether the file the index belongs to might contain
+         * entries matching m. Returns true if in doubt. */
+
+        if (m->type == MATCH_DISCRETE) {
+                IndexField *field;
+                IndexValue *v;
+                const char *eq;
+                int r;
+
+                eq = memchr(m->data, '=', m->size);
+                if (!eq)
+                        return true;
+
+                r = journal_index_find_field(i, m->data, eq - m->data, &field);
+                if (r == 0)
+                        return false;
+                if (r < 0)
+                        return true;
+
+                r = journal_index_find_data(i, field, m->data, m->size, le64toh(m->le_hash), &v);
+                if (r == 0)
+                        return false;
+                if (r < 0)
+                        return true;
+
+                if (use_realtime) {
+                        if (direction == DIRECTION_DOWN)
+                                return le64toh(v->last_realtime) >= realtime;
+                        else
+                                return le64toh(v->first_realtime) <= realtime;
+                }
+
+                return true;
+
+        } else if (m->type == MATCH_OR_TERM) {
+
+                LIST_FOREACH(matches, c, m->matches)
+                        if (index_may_match(i, c, use_realtime, realtime, direction))
+                                return true;
+
+                return false;
+
+        } else if (m->type == MATCH_AND_TERM) {
+
+                if (!m->matches)
+                        return false;
+
+                LIST_FOREACH(matches, c, m->matches)
+                        if (!index_may_match(i, c, use_realtime, realtime, direction))
+                                return false;
+
+                return true;
+        }
+
+        return true;
+}
+
+static bool location_is_realtime(Location *l) {
+        assert(l);
+
+        return (l->type == LOCATION_DISCRETE || l->type == LOCATION_SEEK) &&
+                l->realtime_set && !l->monotonic_set;
+}
+
+static bool header_may_have_next(sd_journal *j, const Header *h, direction_t direction) {
+        Location *l;
+
+        assert(j);
+        assert(h);
+
+        /* Checks the header of a file to see if it might contain an
+         * entry beyond the current location at all, so that we can
+         * skip the more expensive lookup for the bulk of archived
+         * files when seeking. Entries from the same source are
+         * ordered by seqnum, hence use the seqnum range if we
+         * can. Otherwise only use the wallclock time range if that
+         * is all we have to go by, since entries of the same boot
+         * are ordered by monotonic time. */
+
+        if (h->n_entries == 0)
+                return false;
+
+        l = &j->current_location;
+        if (l->type != LOCATION_DISCRETE && l->type != LOCATION_SEEK)
+                return true;
+
+        if (l->seqnum_set && sd_id128_equal(l->seqnum_id, h->seqnum_id)) {
+                if (direction == DIRECTION_DOWN)
+                        return le64toh(h->tail_entry_seqnum) >= l->seqnum;
+                else
+                        return le64toh(h->head_entry_seqnum) <= l->seqnum;
+        }
+
+        if (location_is_realtime(l)) {
+                if (direction == DIRECTION_DOWN)
+                        return le64toh(h->tail_entry_realtime) >= l->realtime;
+                else
+                        return le64toh(h->head_entry_realtime) <= l->realtime;
+        }
+
+        return true;
+}
+
+static bool file_may_have_next(sd_journal *j, JournalFile *f, direction_t direction) {
+        assert(j);
+        assert(f);
+
+        if (!header_may_have_next(j, f->header, direction))
+                return false;
+
+        /* If the file has an index, check whether it can match at
+         * all, and when seeking by wallclock time whether the
+         * matching values were used late (or early) enough. */
+        if (j->level0) {
+                JournalIndex *i;
+
+                i = file_get_index(f);
+                if (i && !index_may_match(i, j->level0,
+                                          location_is_realtime(&j->current_location),
+                                          j->current_location.realtime,
+                                          direction))
+                        return false;
+        }
+
+        return true;
+}
+
+static void merge_forget(sd_journal *j, JournalFile *f) {
+        assert(j);
+        assert(f);
+
+        if (f->in_merge_queue) {
+                prioq_remove(j->merge, f, &f->merge_idx);
+                f->in_merge_queue = false;
+        }
+
+        if (f->in_merge_waiting) {
+                LIST_REMOVE(JournalFile, merge_waiting, j->merge_waiting, f);
+                f->in_merge_waiting = false;
+        }
+
+        f->merge_offset = 0;
+}
+
+static int merge_update(sd_journal *j, JournalFile *f, direction_t direction) {
         Object *o;
         uint64_t p;
-        Iterator i;
         int r;
 
-        if (!j)
-                return -EINVAL;
-        if (journal_pid_changed(j))
-                return -ECHILD;
+        assert(j);
+        assert(f);
 
-        HASHMAP_FOREACH(f, j->files, i) {
-                bool found;
+        /* Looks for the next entry of this file beyond the current
+         * location, and (re-)queues the file by it */
+
+        f->merge_n_entries = le64toh(f->header->n_entries);
 
+        if (file_may_have_next(j, f, direction)) {
                 r = next_beyond_location(j, f, direction, &o, &p);
-                if (r < 0) {
+                if (r < 0)
                         log_debug("Can't iterate through %s, ignoring: %s", f->path, strerror(-r));
-                        continue;
-                } else if (r == 0)
-                        continue;
+        } else
+                r = 0;
+
+        if (r <= 0) {
+                merge_forget(j, f);
+
+                /* When going forward the file might still get new
+                 * entries later on, unless it is archived */
+                if (r == 0 &&
+                    direction == DIRECTION_DOWN &&
+                    f->header->state != STATE_ARCHIVED) {
+                        LIST_PREPEND(JournalFile, merge_waiting, j->merge_waiting, f);
+                        f->in_merge_waiting = true;
+                }
 
-                if (!new_file)
-                        found = true;
-                else {
-                        int k;
+                return 0;
+        }
 
-                        k = compare_entry_order(f, o, new_file, new_offset);
+        if (f->in_merge_waiting) {
+                LIST_REMOVE(JournalFile, merge_waiting, j->merge_waiting, f);
+                f->in_merge_waiting = false;
+        }
 
-                        found = direction == DIRECTION_DOWN ? k < 0 : k > 0;
-                }
+        f->merge_offset = p;
+        memcpy(f->merge_entry, o, sizeof(f->merge_entry));
 
-                if (found) {
-                        new_file = f;
-                        new_offset = p;
+        if (f->in_merge_queue)
+                prioq_reshuffle(j->merge, f, &f->merge_idx);
+        else {
+                r = prioq_put(j->merge, f, &f->merge_idx);
+                if (r < 0)
+                        return r;
+
+                f->in_merge_queue = true;
+        }
+
+        return 1;
+}
+
+static int open_pending_files_for_next(sd_journal *j, direction_t direction);
+
+static int merge_rebuild(sd_journal *j, direction_t direction) {
+        JournalFile *f;
+        Iterator i;
+        int r;
+
+        assert(j);
+
+        r = open_pending_files_for_next(j, direction);
+        if (r < 0)
+                return r;
+
+        HASHMAP_FOREACH(f, j->files, i)
+                merge_forget(j, f);
+
+        prioq_free(j->merge);
+        j->merge = prioq_new(direction == DIRECTION_DOWN ? compare_merge_down : compare_merge_up);
+        if (!j->merge)
+                return -ENOMEM;
+
+        j->merge_direction = direction;
+
+        HASHMAP_FOREACH(f, j->files, i) {
+                r = merge_update(j, f, direction);
+                if (r < 0)
+                        return r;
+        }
+
+        j->merge_valid = true;
+        return 0;
+}
+
+static int real_journal_next(sd_journal *j, direction_t direction) {
+        JournalFile *f, *n;
+        Object *o;
+        int r;
+
+        if (!j)
+                return -EINVAL;
+        if (journal_pid_changed(j))
+                return -ECHILD;
+
+        /* We keep the files ordered by their next entry beyond the
+         * current location in a priority queue, and only look at the
+         * file we took the last entry from, and at those which have
+         * the same entry, so that a step costs O(log(n_files)),
+         * instead of looking at every file every time. The queue is
+         * rebuilt when the location, the direction, the matches or
+         * the set of files change. */
+
+        if (!j->merge_valid || j->merge_direction != direction) {
+                r = merge_rebuild(j, direction);
+                if (r < 0)
+                        return r;
+        } else {
+                /* Files that had nothing left might have been
+                 * appended to in the meantime */
+                LIST_FOREACH_SAFE(merge_waiting, f, n, j->merge_waiting) {
+                        if (le64toh(f->header->n_entries) == f->merge_n_entries)
+                                continue;
+
+                        r = merge_update(j, f, direction);
+                        if (r < 0)
+                                return r;
                 }
         }
 
-        if (!new_file)
+        f = prioq_peek(j->merge);
+        if (!f)
                 return 0;
 
-        r = journal_file_move_to_object(new_file, OBJECT_ENTRY, new_offset, &o);
+        r = journal_file_move_to_object(f, OBJECT_ENTRY, f->merge_offset, &o);
         if (r < 0)
                 return r;
 
-        set_location(j, LOCATION_DISCRETE, new_file, o, direction, new_offset);
+        set_location(j, LOCATION_DISCRETE, f, o, direction, f->merge_offset);
+
+        /* Advance the file we took the entry from, and then all
+         * files whose next entry is not beyond the new location,
+         * i.e. the same entry stored in multiple files */
+        r = merge_update(j, f, direction);
+        if (r < 0)
+                return r;
+
+        while ((n = prioq_peek(j->merge))) {
+                int k;
+
+                k = compare_with_location(n, (Object*) n->merge_entry, &j->current_location);
+                if (direction == DIRECTION_DOWN ? k > 0 : k < 0)
+                        break;
+
+                r = merge_update(j, n, direction);
+                if (r < 0)
+                        return r;
+        }
 
         return 1;
 }
@@ -1309,7 +1595,7 @@ static bool file_type_wanted(int flags, const char *filename) {
         return false;
 }
 
-static int add_any_file(sd_journal *j, const char *path) {
+static int open_file(sd_journal *j, const char *path) {
         JournalFile *f;
         int r;
 
@@ -1340,11 +1626,213 @@ static int add_any_file(sd_journal *j, const char *path) {
 
         check_network(j, f->fd);
 
+        /* Let the next step look for the location in the new file */
+        j->merge_valid = false;
+
+        return 1;
+}
+
+static int add_any_file(sd_journal *j, const char *path) {
+        int r;
+
+        r = open_file(j, path);
+        if (r <= 0)
+                return r;
+
         j->current_invalidate_counter ++;
 
         return 0;
 }
 
+static void pending_file_free(PendingFile *p) {
+        if (!p)
+                return;
+
+        free(p->path);
+        free(p);
+}
+
+static int read_archived_header(const char *path, Header *h) {
+        _cleanup_close_ int fd = -1;
+        ssize_t n;
+
+        assert(path);
+        assert(h);
+
+        /* Reads the header of the file, and returns 1 if it is an
+         * archived file we can handle, so that we can defer opening
+         * and mapping it. When in doubt we return 0, and the file
+         * is opened right-away, which also reports any errors. */
+
+        fd = open(path, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+        if (fd < 0)
+                return -errno;
+
+        n = pread(fd, h, sizeof(Header), 0);
+        if (n < 0)
+                return -errno;
+
+        if ((size_t) n < sizeof(Header) ||
+            memcmp(h->signature, HEADER_SIGNATURE, 8) != 0 ||
+            h->state != STATE_ARCHIVED ||
+            (le32toh(h->incompatible_flags) & ~HEADER_INCOMPATIBLE_SUPPORTED))
+                return 0;
+
+        return 1;
+}
+
+static int add_pending_file(sd_journal *j, const char *path) {
+        PendingFile *p;
+        Header h;
+        int r;
+
+        assert(j);
+        assert(path);
+
+        if (hashmap_get(j->files, path) || hashmap_get(j->pending_files, path))
+                return 1;
+
+        r = read_archived_header(path, &h);
+        if (r <= 0)
+                return r;
+
+        p = new0(PendingFile, 1);
+        if (!p)
+                return -ENOMEM;
+
+        p->header = h;
+        p->path = strdup(path);
+        if (!p->path) {
+                free(p);
+                return -ENOMEM;
+        }
+
+        r = hashmap_put(j->pending_files, p->path, p);
+        if (r < 0) {
+                pending_file_free(p);
+                return r;
+        }
+
+        log_debug("File %s added, deferring open.", p->path);
+
+        j->pending_by_tail_valid = false;
+        j->merge_valid = false;
+
+        j->current_invalidate_counter ++;
+
+        return 1;
+}
+
+static void open_pending_file(sd_journal *j, PendingFile *p) {
+        int r;
+
+        assert(j);
+        assert(p);
+
+        /* Turns a pending file into a real one. This is not a change
+         * visible to the outside, hence no invalidation. */
+
+        hashmap_remove(j->pending_files, p->path);
+        j->pending_by_tail_valid = false;
+
+        r = open_file(j, p->path);
+        if (r < 0)
+                log_debug("Failed to open %s, ignoring: %s", p->path, strerror(-r));
+
+        pending_file_free(p);
+}
+
+int journal_open_pending_files(sd_journal *j) {
+        PendingFile *p;
+
+        assert(j);
+
+        while ((p = hashmap_first(j->pending_files)))
+                open_pending_file(j, p);
+
+        return 0;
+}
+
+static int pending_compare_tail(const void *_a, const void *_b) {
+        PendingFile *a = *(PendingFile**) _a, *b = *(PendingFile**) _b;
+
+        if (le64toh(a->header.tail_entry_realtime) < le64toh(b->header.tail_entry_realtime))
+                return -1;
+        if (le64toh(a->header.tail_entry_realtime) > le64toh(b->header.tail_entry_realtime))
+                return 1;
+
+        return 0;
+}
+
+static int open_pending_files_for_next(sd_journal *j, direction_t direction) {
+        Location *l;
+        PendingFile *p;
+        Iterator i;
+        unsigned n, a, b, k;
+
+        assert(j);
+
+        /* Opens those pending files that might contain an entry
+         * beyond the current location */
+
+        n = hashmap_size(j->pending_files);
+        if (n <= 0)
+                return 0;
+
+        l = &j->current_location;
+
+        if (direction != DIRECTION_DOWN || !location_is_realtime(l) || l->seqnum_set) {
+                HASHMAP_FOREACH(p, j->pending_files, i)
+                        if (header_may_have_next(j, &p->header, direction))
+                                open_pending_file(j, p);
+
+                return 0;
+        }
+
+        /* The common case of seeking to a wallclock time and
+         * iterating forward: look for the first file that ends
+         * after the time asked for */
+
+        if (!j->pending_by_tail_valid) {
+                PendingFile **t;
+
+                t = realloc(j->pending_by_tail, n * sizeof(PendingFile*));
+                if (!t)
+                        return -ENOMEM;
+
+                j->pending_by_tail = t;
+
+                k = 0;
+                HASHMAP_FOREACH(p, j->pending_files, i)
+                        j->pending_by_tail[k++] = p;
+
+                qsort(j->pending_by_tail, n, sizeof(PendingFile*), pending_compare_tail);
+                j->pending_by_tail_valid = true;
+        }
+
+        a = 0;
+        b = n;
+        while (a < b) {
+                unsigned c = (a + b) / 2;
+
+                if (le64toh(j->pending_by_tail[c]->header.tail_entry_realtime) < l->realtime)
+                        a = c + 1;
+                else
+                        b = c;
+        }
+
+        /* Opening invalidates the array, but does not move the
+         * items we have yet to look at */
+        for (k = a; k < n; k++) {
+                p = j->pending_by_tail[k];
+
+                if (p->header.n_entries != 0)
+                        open_pending_file(j, p);
+        }
+
+        return 0;
+}
+
 static int add_file(sd_journal *j, const char *prefix, const char *filename) {
         _cleanup_free_ char *path = NULL;
         int r;
@@ -1361,7 +1849,9 @@ static int add_file(sd_journal *j, const char *prefix, const char *filename) {
         if (!path)
                 return -ENOMEM;
 
-        r = add_any_file(j, path);
+        r = add_pending_file(j, path);
+        if (r == 0)
+                r = add_any_file(j, path);
         if (r == -ENOENT)
                 return 0;
         return 0;
@@ -1370,6 +1860,7 @@ static int add_file(sd_journal *j, const char *prefix, const char *filename) {
 static int remove_file(sd_journal *j, const char *prefix, const char *filename) {
         char *path;
         JournalFile *f;
+        PendingFile *p;
 
         assert(j);
         assert(prefix);
@@ -1379,6 +1870,18 @@ static int remove_file(sd_journal *j, const char *prefix, const char *filename)
         if (!path)
                 return -ENOMEM;
 
+        p = hashmap_remove(j->pending_files, path);
+        if (p) {
+                free(path);
+
+                log_debug("File %s removed.", p->path);
+
+                pending_file_free(p);
+                j->pending_by_tail_valid = false;
+                j->current_invalidate_counter ++;
+                return 0;
+        }
+
         f = hashmap_get(j->files, path);
         free(path);
         if (!f)
@@ -1388,6 +1891,8 @@ static int remove_file(sd_journal *j, const char *prefix, const char *filename)
 
         log_debug("File %s removed.", f->path);
 
+        merge_forget(j, f);
+
         if (j->current_file == f) {
                 j->current_file = NULL;
                 j->current_field = 0;
@@ -1697,9 +2202,10 @@ static sd_journal *journal_new(int flags, const char *path) {
         }
 
         j->files = hashmap_new(string_hash_func, string_compare_func);
+        j->pending_files = hashmap_new(string_hash_func, string_compare_func);
         j->directories_by_path = hashmap_new(string_hash_func, string_compare_func);
         j->mmap = mmap_cache_new();
-        if (!j->files || !j->directories_by_path || !j->mmap)
+        if (!j->files || !j->pending_files || !j->directories_by_path || !j->mmap)
                 goto fail;
 
         return j;
@@ -1808,6 +2314,7 @@ fail:
 _public_ void sd_journal_close(sd_journal *j) {
         Directory *d;
         JournalFile *f;
+        PendingFile *p;
 
         if (!j)
                 return;
@@ -1819,6 +2326,12 @@ _public_ void sd_journal_close(sd_journal *j) {
 
         hashmap_free(j->files);
 
+        while ((p = hashmap_steal_first(j->pending_files)))
+                pending_file_free(p);
+
+        hashmap_free(j->pending_files);
+        free(j->pending_by_tail);
+
         while ((d = hashmap_first(j->directories_by_path)))
                 remove_directory(j, d);
 
@@ -1831,8 +2344,18 @@ _public_ void sd_journal_close(sd_journal *j) {
         if (j->inotify_fd >= 0)
                 close_nointr_nofail(j->inotify_fd);
 
-        if (j->mmap)
+        prioq_free(j->merge);
+
+        if (j->mmap) {
+                MMapCacheStatistics st;
+
+                mmap_cache_get_statistics(j->mmap, &st);
+                log_debug("mmap cache statistics: %"PRIu64" context hits, %"PRIu64" window hits, "
+                          "%"PRIu64" misses, %"PRIu64" mmaps, %"PRIu64" evictions",
+                          st.context_hits, st.window_hits, st.misses, st.mmaps, st.evictions);
+
                 mmap_cache_unref(j->mmap);
+        }
 
         free(j->path);
         free(j->unique_field);
@@ -1985,28 +2508,30 @@ _public_ int sd_journal_get_data(sd_journal *j, const char *field, const void **
 
                 l = le64toh(o->object.size) - offsetof(Object, data.payload);
 
-                if (o->object.flags & OBJECT_COMPRESSED) {
+                if (o->object.flags & OBJECT_COMPRESSION_MASK) {
+                        int compression = o->object.flags & OBJECT_COMPRESSION_MASK;
 
-#ifdef HAVE_XZ
-                        if (uncompress_startswith(o->data.payload, l,
+                        r = uncompress_startswith(compression,
+                                                  o->data.payload, l,
                                                   &f->compress_buffer, &f->compress_buffer_size,
-                                                  field, field_length, '=')) {
-
+                                                  field, field_length, '=');
+                        if (r < 0)
+                                return r;
+                        if (r > 0) {
                                 uint64_t rsize;
 
-                                if (!uncompress_blob(o->data.payload, l,
-                                                     &f->compress_buffer, &f->compress_buffer_size, &rsize,
-                                                     j->data_threshold))
-                                        return -EBADMSG;
+                                r = uncompress_blob(compression,
+                                                    o->data.payload, l,
+                                                    &f->compress_buffer, &f->compress_buffer_size, &rsize,
+                                                    j->data_threshold);
+                                if (r < 0)
+                                        return r;
 
                                 *data = f->compress_buffer;
                                 *size = (size_t) rsize;
 
                                 return 0;
                         }
-#else
-                        return -EPROTONOSUPPORT;
-#endif
 
                 } else if (l >= field_length+1 &&
                            memcmp(o->data.payload, field, field_length) == 0 &&
@@ -2034,6 +2559,7 @@ _public_ int sd_journal_get_data(sd_journal *j, const char *field, const void **
 static int return_data(sd_journal *j, JournalFile *f, Object *o, const void **data, size_t *size) {
         size_t t;
         uint64_t l;
+        int r;
 
         l = le64toh(o->object.size) - offsetof(Object, data.payload);
         t = (size_t) l;
@@ -2042,18 +2568,16 @@ static int return_data(sd_journal *j, JournalFile *f, Object *o, const void **da
         if ((uint64_t) t != l)
                 return -E2BIG;
 
-        if (o->object.flags & OBJECT_COMPRESSED) {
-#ifdef HAVE_XZ
+        if (o->object.flags & OBJECT_COMPRESSION_MASK) {
                 uint64_t rsize;
 
-                if (!uncompress_blob(o->data.payload, l, &f->compress_buffer, &f->compress_buffer_size, &rsize, j->data_threshold))
-                        return -EBADMSG;
+                r = uncompress_blob(o->object.flags & OBJECT_COMPRESSION_MASK,
+                                    o->data.payload, l, &f->compress_buffer, &f->compress_buffer_size, &rsize, j->data_threshold);
+                if (r < 0)
+                        return r;
 
                 *data = f->compress_buffer;
                 *size = (size_t) rsize;
-#else
-                return -EPROTONOSUPPORT;
-#endif
         } else {
                 *data = o->data.payload;
                 *size = t;
@@ -2356,6 +2880,7 @@ _public_ int sd_journal_wait(sd_journal *j, uint64_t timeout_usec) {
 _public_ int sd_journal_get_cutoff_realtime_usec(sd_journal *j, uint64_t *from, uint64_t *to) {
         Iterator i;
         JournalFile *f;
+        PendingFile *p;
         bool first = true;
         int r;
 
@@ -2393,6 +2918,31 @@ _public_ int sd_journal_get_cutoff_realtime_usec(sd_journal *j, uint64_t *from,
                 }
         }
 
+        /* The header is all we need here, no need to open pending
+         * files for this */
+        HASHMAP_FOREACH(p, j->pending_files, i) {
+                usec_t fr, t;
+
+                fr = le64toh(p->header.head_entry_realtime);
+                t = le64toh(p->header.tail_entry_realtime);
+
+                if ((from && fr == 0) || (to && t == 0))
+                        continue;
+
+                if (first) {
+                        if (from)
+                                *from = fr;
+                        if (to)
+                                *to = t;
+                        first = false;
+                } else {
+                        if (from)
+                                *from = MIN(fr, *from);
+                        if (to)
+                                *to = MAX(t, *to);
+                }
+        }
+
         return first ? 0 : 1;
 }
 
@@ -2411,6 +2961,8 @@ _public_ int sd_journal_get_cutoff_monotonic_usec(sd_journal *j, sd_id128_t boot
         if (from == to)
                 return -EINVAL;
 
+        journal_open_pending_files(j);
+
         HASHMAP_FOREACH(f, j->files, i) {
                 usec_t fr, t;
 
@@ -2446,6 +2998,8 @@ void journal_print_header(sd_journal *j) {
 
         assert(j);
 
+        journal_open_pending_files(j);
+
         HASHMAP_FOREACH(f, j->files, i) {
                 if (newline)
                         putchar('\n');
@@ -2454,11 +3008,47 @@ void journal_print_header(sd_journal *j) {
 
                 journal_file_print_header(f);
         }
+
+        if (j->mmap) {
+                MMapCacheStatistics st;
+                char bytes[FORMAT_BYTES_MAX];
+
+                journal_get_mmap_statistics(j, &st);
+
+                if (newline)
+                        putchar('\n');
+
+                printf("MMap Cache Windows: %u\n"
+                       "MMap Cache Mapped: %s\n"
+                       "MMap Cache Context Hits: %"PRIu64"\n"
+                       "MMap Cache Window Hits: %"PRIu64"\n"
+                       "MMap Cache Misses: %"PRIu64"\n"
+                       "MMap Cache Mmaps: %"PRIu64"\n"
+                       "MMap Cache Evictions: %"PRIu64"\n",
+                       st.n_windows,
+                       format_bytes(bytes, sizeof(bytes), st.mapped_size),
+                       st.context_hits,
+                       st.window_hits,
+                       st.misses,
+                       st.mmaps,
+                       st.evictions);
+        }
+}
+
+void journal_get_mmap_statistics(sd_journal *j, MMapCacheStatistics *ret) {
+        assert(j);
+        assert(ret);
+
+        if (j->mmap)
+                mmap_cache_get_statistics(j->mmap, ret);
+        else
+                zero(*ret);
 }
 
 _public_ int sd_journal_get_usage(sd_journal *j, uint64_t *bytes) {
         Iterator i;
         JournalFile *f;
+        PendingFile *p;
         uint64_t sum = 0;
 
         if (!j)
@@ -2477,6 +3067,19 @@ _public_ int sd_journal_get_usage(sd_journal *j, uint64_t *bytes) {
                 sum += (uint64_t) st.st_blocks * 512ULL;
         }
 
+        HASHMAP_FOREACH(p, j->pending_files, i) {
+                struct stat st;
+
+                if (stat(p->path, &st) < 0) {
+                        if (errno == ENOENT)
+                                continue;
+
+                        return -errno;
+                }
+
+                sum += (uint64_t) st.st_blocks * 512ULL;
+        }
+
         *bytes = sum;
         return 0;
 }
@@ -2505,6 +3108,21 @@ _public_ int sd_journal_query_unique(sd_journal *j, const char *field) {
         return 0;
 }
 
+static int unique_next_file(sd_journal *j) {
+        JournalFile *n;
+
+        assert(j);
+        assert(j->unique_file);
+
+        n = hashmap_next(j->files, j->unique_file->path);
+        if (!n)
+                return 0;
+
+        j->unique_file = n;
+        j->unique_offset = 0;
+        return 1;
+}
+
 _public_ int sd_journal_enumerate_unique(sd_journal *j, const void **data, size_t *l) {
         Object *o;
         size_t k;
@@ -2524,6 +3142,8 @@ _public_ int sd_journal_enumerate_unique(sd_journal *j, const void **data, size_
         k = strlen(j->unique_field);
 
         if (!j->unique_file) {
+                journal_open_pending_files(j);
+
                 j->unique_file = hashmap_first(j->files);
                 if (!j->unique_file)
                         return 0;
@@ -2532,52 +3152,96 @@ _public_ int sd_journal_enumerate_unique(sd_journal *j, const void **data, size_
 
         for (;;) {
                 JournalFile *of;
+                JournalIndex *index;
+                IndexField *field = NULL;
                 Iterator i;
                 const void *odata;
                 size_t ol;
+                uint64_t hash;
                 bool found;
 
-                /* Proceed to next data object in the field's linked list */
-                if (j->unique_offset == 0) {
-                        r = journal_file_find_field_object(j->unique_file, j->unique_field, k, &o, NULL);
+                /* If the file has an index that lists the values of
+                 * the field we can take them from there, and
+                 * unique_offset counts the values already
+                 * returned. */
+                index = file_get_index(j->unique_file);
+                if (index) {
+                        r = journal_index_find_field(index, j->unique_field, k, &field);
                         if (r < 0)
                                 return r;
+                        if (r == 0) {
+                                if (unique_next_file(j) == 0)
+                                        return 0;
 
-                        j->unique_offset = r > 0 ? le64toh(o->field.head_data_offset) : 0;
-                } else {
-                        r = journal_file_move_to_object(j->unique_file, OBJECT_DATA, j->unique_offset, &o);
+                                continue;
+                        }
+
+                        if (!(le64toh(field->flags) & INDEX_FIELD_HAS_VALUES))
+                                field = NULL;
+                }
+
+                if (field) {
+                        IndexValue *v;
+
+                        r = journal_index_get_value(index, field, j->unique_offset, &v);
                         if (r < 0)
                                 return r;
+                        if (r == 0) {
+                                if (unique_next_file(j) == 0)
+                                        return 0;
 
-                        j->unique_offset = le64toh(o->data.next_field_offset);
-                }
+                                continue;
+                        }
 
-                /* We reached the end of the list? Then start again, with the next file */
-                if (j->unique_offset == 0) {
-                        JournalFile *n;
+                        j->unique_offset++;
 
-                        n = hashmap_next(j->files, j->unique_file->path);
-                        if (!n)
-                                return 0;
+                        r = journal_index_get_payload(index, v, &odata, &ol);
+                        if (r < 0)
+                                return r;
 
-                        j->unique_file = n;
-                        continue;
-                }
+                        hash = le64toh(v->hash);
+                        o = NULL;
+                } else {
+                        /* Proceed to next data object in the field's linked list */
+                        if (j->unique_offset == 0) {
+                                r = journal_file_find_field_object(j->unique_file, j->unique_field, k, &o, NULL);
+                                if (r < 0)
+                                        return r;
 
-                /* We do not use the type context here, but 0 instead,
-                 * so that we can look at this data object at the same
-                 * time as one on another file */
-                r = journal_file_move_to_object(j->unique_file, 0, j->unique_offset, &o);
-                if (r < 0)
-                        return r;
+                                j->unique_offset = r > 0 ? le64toh(o->field.head_data_offset) : 0;
+                        } else {
+                                r = journal_file_move_to_object(j->unique_file, OBJECT_DATA, j->unique_offset, &o);
+                                if (r < 0)
+                                        return r;
 
-                /* Let's do the type check by hand, since we used 0 context above. */
-                if (o->object.type != OBJECT_DATA)
-                        return -EBADMSG;
+                                j->unique_offset = le64toh(o->data.next_field_offset);
+                        }
 
-                r = return_data(j, j->unique_file, o, &odata, &ol);
-                if (r < 0)
-                        return r;
+                        /* We reached the end of the list? Then start again, with the next file */
+                        if (j->unique_offset == 0) {
+                                if (unique_next_file(j) == 0)
+                                        return 0;
+
+                                continue;
+                        }
+
+                        /* We do not use the type context here, but 0 instead,
+                         * so that we can look at this data object at the same
+                         * time as one on another file */
+                        r = journal_file_move_to_object(j->unique_file, 0, j->unique_offset, &o);
+                        if (r < 0)
+                                return r;
+
+                        /* Let's do the type check by hand, since we used 0 context above. */
+                        if (o->object.type != OBJECT_DATA)
+                                return -EBADMSG;
+
+                        r = return_data(j, j->unique_file, o, &odata, &ol);
+                        if (r < 0)
+                                return r;
+
+                        hash = le64toh(o->data.hash);
+                }
 
                 /* OK, now let's see if we already returned this data
                  * object by checking if it exists in the earlier
@@ -2596,7 +3260,26 @@ _public_ int sd_journal_enumerate_unique(sd_journal *j, const void **data, size_
                             le64toh(of->header->n_fields) <= 0)
                                 continue;
 
-                        r = journal_file_find_data_object_with_hash(of, odata, ol, le64toh(o->data.hash), &oo, &op);
+                        index = file_get_index(of);
+                        if (index) {
+                                IndexField *ofield;
+
+                                r = journal_index_find_field(index, j->unique_field, k, &ofield);
+                                if (r < 0)
+                                        return r;
+                                if (r == 0)
+                                        continue;
+
+                                r = journal_index_find_data(index, ofield, odata, ol, hash, NULL);
+                                if (r < 0 && r != -ENOENT)
+                                        return r;
+                                if (r > 0)
+                                        found = true;
+                                if (r >= 0)
+                                        continue;
+                        }
+
+                        r = journal_file_find_data_object_with_hash(of, odata, ol, hash, &oo, &op);
                         if (r < 0)
                                 return r;
 
@@ -2607,9 +3290,14 @@ _public_ int sd_journal_enumerate_unique(sd_journal *j, const void **data, size_
                 if (found)
                         continue;
 
-                r = return_data(j, j->unique_file, o, data, l);
-                if (r < 0)
-                        return r;
+                if (o) {
+                        r = return_data(j, j->unique_file, o, data, l);
+                        if (r < 0)
+                                return r;
+                } else {
+                        *data = odata;
+                        *l = ol;
+                }
 
                 return 1;
         }
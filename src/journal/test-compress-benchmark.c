@@ -0,0 +1,232 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  Copyright 2013 Lennart Poettering
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <systemd/sd-journal.h>
+
+#include "log.h"
+#include "macro.h"
+#include "util.h"
+#include "time-util.h"
+#include "journal-def.h"
+#include "compress.h"
+
+/* Compares the compression algorithms on the data objects of the
+ * local journal, or of the journal directory specified on the
+ * command line. Only payloads above the threshold journald compresses
+ * at are considered. */
+
+#define PAYLOAD_MIN 512
+#define PAYLOAD_TOTAL_MAX (64ULL*1024ULL*1024ULL)
+#define ITERATIONS 5
+
+typedef struct Payload {
+        void *data;
+        size_t size;
+} Payload;
+
+static Payload *payloads = NULL;
+static size_t n_payloads = 0, payloads_allocated = 0;
+static uint64_t payloads_total = 0;
+
+static int add_payload(const void *data, size_t size) {
+        void *p;
+
+        if (!GREEDY_REALLOC(payloads, payloads_allocated, n_payloads + 1))
+                return log_oom();
+
+        p = memdup(data, size);
+        if (!p)
+                return log_oom();
+
+        payloads[n_payloads].data = p;
+        payloads[n_payloads].size = size;
+        n_payloads++;
+        payloads_total += size;
+
+        return 0;
+}
+
+static int load_payloads(const char *directory) {
+        static const char * const fields[] = { "MESSAGE", "COREDUMP", "_CMDLINE" };
+        sd_journal *j;
+        const void *data;
+        size_t size;
+        unsigned i;
+        int r;
+
+        if (directory)
+                r = sd_journal_open_directory(&j, directory, 0);
+        else
+                r = sd_journal_open(&j, SD_JOURNAL_LOCAL_ONLY);
+        if (r < 0) {
+                log_error("Failed to open journal: %s", strerror(-r));
+                return r;
+        }
+
+        r = sd_journal_set_data_threshold(j, 0);
+        if (r < 0)
+                goto finish;
+
+        /* Every distinct data object is stored only once in the
+         * journal, hence we only look at the unique values of a few
+         * fields which typically carry long payloads */
+        for (i = 0; i < ELEMENTSOF(fields) && payloads_total < PAYLOAD_TOTAL_MAX; i++) {
+                r = sd_journal_query_unique(j, fields[i]);
+                if (r < 0)
+                        goto finish;
+
+                SD_JOURNAL_FOREACH_UNIQUE(j, data, size) {
+                        if (size < PAYLOAD_MIN)
+                                continue;
+
+                        r = add_payload(data, size);
+                        if (r < 0)
+                                goto finish;
+
+                        if (payloads_total >= PAYLOAD_TOTAL_MAX)
+                                break;
+                }
+        }
+
+        r = 0;
+
+finish:
+        sd_journal_close(j);
+        return r;
+}
+
+static void make_payloads(void) {
+        char buf[PAYLOAD_MIN * 4];
+        unsigned i;
+
+        /* Fallback if the journal has no large payloads: synthesize
+         * log-like text of varying length */
+        for (i = 0; i < 4096; i++) {
+                size_t l = 0;
+
+                l += snprintf(buf, sizeof(buf), "MESSAGE=");
+                while (l < PAYLOAD_MIN + (i % 4) * PAYLOAD_MIN - 64)
+                        l += snprintf(buf + l, sizeof(buf) - l,
+                                      "worker %u: processed request %u in %u us; ",
+                                      i % 7, (unsigned) random() % 100000, (unsigned) random() % 5000);
+
+                assert_se(add_payload(buf, l) >= 0);
+        }
+}
+
+static void benchmark(int compression) {
+        _cleanup_free_ Payload *compressed = NULL;
+        _cleanup_free_ void *decompressed = NULL;
+        uint64_t decompressed_allocated = 0, compressed_total = 0, n_compressed = 0;
+        usec_t t, compress_usec, uncompress_usec;
+        unsigned k;
+        size_t i;
+
+        compressed = new0(Payload, n_payloads);
+        assert_se(compressed);
+
+        t = now(CLOCK_MONOTONIC);
+        for (k = 0; k < ITERATIONS; k++) {
+                compressed_total = n_compressed = 0;
+
+                for (i = 0; i < n_payloads; i++) {
+                        uint64_t csize;
+
+                        if (!compressed[i].data)
+                                assert_se(compressed[i].data = malloc(payloads[i].size));
+
+                        if (compress_blob(compression, payloads[i].data, payloads[i].size, compressed[i].data, &csize)) {
+                                compressed[i].size = csize;
+                                compressed_total += csize;
+                                n_compressed++;
+                        } else {
+                                compressed[i].size = 0;
+                                compressed_total += payloads[i].size;
+                        }
+                }
+        }
+        compress_usec = (now(CLOCK_MONOTONIC) - t) / ITERATIONS;
+
+        t = now(CLOCK_MONOTONIC);
+        for (k = 0; k < ITERATIONS; k++)
+                for (i = 0; i < n_payloads; i++) {
+                        uint64_t usize;
+
+                        if (compressed[i].size == 0)
+                                continue;
+
+                        assert_se(uncompress_blob(compression, compressed[i].data, compressed[i].size,
+                                                  &decompressed, &decompressed_allocated, &usize, 0) == 0);
+                        assert_se(usize == payloads[i].size);
+                }
+        uncompress_usec = (now(CLOCK_MONOTONIC) - t) / ITERATIONS;
+
+        /* Make sure we actually measured something sensible */
+        for (i = 0; i < n_payloads; i++) {
+                uint64_t usize;
+
+                if (compressed[i].size > 0) {
+                        assert_se(uncompress_blob(compression, compressed[i].data, compressed[i].size,
+                                                  &decompressed, &decompressed_allocated, &usize, 0) == 0);
+                        assert_se(memcmp(decompressed, payloads[i].data, usize) == 0);
+                }
+
+                free(compressed[i].data);
+        }
+
+        printf("%-4s  compressed %"PRIu64"/%zu objects, ratio %5.1f%%, "
+               "compress %7.1f MiB/s, uncompress %7.1f MiB/s\n",
+               object_compressed_to_string(compression),
+               n_compressed, n_payloads,
+               100.0 * compressed_total / payloads_total,
+               compress_usec > 0 ? (double) payloads_total / compress_usec * USEC_PER_SEC / 1024 / 1024 : 0.0,
+               uncompress_usec > 0 ? (double) payloads_total / uncompress_usec * USEC_PER_SEC / 1024 / 1024 : 0.0);
+}
+
+int main(int argc, char *argv[]) {
+        size_t i;
+
+        log_set_max_level(LOG_INFO);
+
+        if (load_payloads(argc > 1 ? argv[1] : NULL) < 0 || n_payloads == 0) {
+                log_info("No suitable journal payloads found, using synthetic data.");
+                make_payloads();
+        }
+
+        printf("%zu payloads, %"PRIu64" bytes\n", n_payloads, payloads_total);
+
+#ifdef HAVE_XZ
+        benchmark(OBJECT_COMPRESSED_XZ);
+#endif
+#ifdef HAVE_LZ4
+        benchmark(OBJECT_COMPRESSED_LZ4);
+#endif
+
+        for (i = 0; i < n_payloads; i++)
+                free(payloads[i].data);
+        free(payloads);
+
+        return 0;
+}
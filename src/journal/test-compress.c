@@ -0,0 +1,145 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  Copyright 2013 Lennart Poettering
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include "log.h"
+#include "macro.h"
+#include "util.h"
+#include "journal-def.h"
+#include "compress.h"
+
+static const char text[] =
+        "MESSAGE=text, text, text, text, text, text, text, text, text, "
+        "text, text, text, text, text, text, text, text, text, text, "
+        "text, text, text, text, text, text, text, text, text, text, "
+        "text, text, text, text, text, text, text, text, text, text";
+
+static void test_compress_uncompress(int compression) {
+        char compressed[sizeof(text)];
+        uint64_t csize = 0, usize = 0, alloc = 0;
+        _cleanup_free_ char *decompressed = NULL;
+
+        log_info("/* testing %s roundtrip */", object_compressed_to_string(compression));
+
+        assert_se(compress_blob(compression, text, sizeof(text), compressed, &csize));
+        assert_se(csize > 0 && csize < sizeof(text));
+
+        assert_se(uncompress_blob(compression, compressed, csize,
+                                  (void**) &decompressed, &alloc, &usize, 0) == 0);
+        assert_se(usize == sizeof(text));
+        assert_se(memcmp(decompressed, text, sizeof(text)) == 0);
+
+        /* Garbage must be refused, not crash */
+        memset(compressed, 'x', csize);
+        assert_se(uncompress_blob(compression, compressed, csize,
+                                  (void**) &decompressed, &alloc, &usize, 0) == -EBADMSG);
+}
+
+static void test_uncompress_max(int compression) {
+        char compressed[sizeof(text)];
+        uint64_t csize = 0, usize = 0, alloc = 0;
+        _cleanup_free_ char *decompressed = NULL;
+
+        log_info("/* testing %s with size limit */", object_compressed_to_string(compression));
+
+        assert_se(compress_blob(compression, text, sizeof(text), compressed, &csize));
+
+        assert_se(uncompress_blob(compression, compressed, csize,
+                                  (void**) &decompressed, &alloc, &usize, 32) == 0);
+        assert_se(usize >= 32);
+        assert_se(memcmp(decompressed, text, 32) == 0);
+}
+
+static void test_uncompress_startswith(int compression) {
+        char compressed[sizeof(text)];
+        uint64_t csize = 0, alloc = 0;
+        _cleanup_free_ char *decompressed = NULL;
+
+        log_info("/* testing %s prefix match */", object_compressed_to_string(compression));
+
+        assert_se(compress_blob(compression, text, sizeof(text), compressed, &csize));
+
+        assert_se(uncompress_startswith(compression, compressed, csize,
+                                        (void**) &decompressed, &alloc,
+                                        "MESSAGE", strlen("MESSAGE"), '=') > 0);
+        assert_se(uncompress_startswith(compression, compressed, csize,
+                                        (void**) &decompressed, &alloc,
+                                        "MESSAGE", strlen("MESSAGE"), 'x') == 0);
+        assert_se(uncompress_startswith(compression, compressed, csize,
+                                        (void**) &decompressed, &alloc,
+                                        "MESSAGF", strlen("MESSAGF"), '=') == 0);
+}
+
+static void test_incompressible(int compression) {
+        char data[1024], compressed[sizeof(data)];
+        uint64_t csize = 0;
+        unsigned i;
+
+        log_info("/* testing %s with random data */", object_compressed_to_string(compression));
+
+        for (i = 0; i < sizeof(data); i++)
+                data[i] = random() & 0xff;
+
+        assert_se(!compress_blob(compression, data, sizeof(data), compressed, &csize));
+}
+
+static void test_unsupported(int compression) {
+        char data[] = "foobar";
+        uint64_t usize = 0, alloc = 0;
+        _cleanup_free_ char *decompressed = NULL;
+
+        log_info("/* testing %s without support */", object_compressed_to_string(compression));
+
+        assert_se(uncompress_blob(compression, data, sizeof(data),
+                                  (void**) &decompressed, &alloc, &usize, 0) == -EPROTONOSUPPORT);
+        assert_se(uncompress_startswith(compression, data, sizeof(data),
+                                        (void**) &decompressed, &alloc,
+                                        "foo", strlen("foo"), 'b') == -EPROTONOSUPPORT);
+}
+
+static void test_compression(int compression) {
+        test_compress_uncompress(compression);
+        test_uncompress_max(compression);
+        test_uncompress_startswith(compression);
+        test_incompressible(compression);
+}
+
+int main(int argc, char *argv[]) {
+        log_set_max_level(LOG_DEBUG);
+
+#ifdef HAVE_XZ
+        test_compression(OBJECT_COMPRESSED_XZ);
+#endif
+#ifdef HAVE_LZ4
+        test_compression(OBJECT_COMPRESSED_LZ4);
+#else
+        test_unsupported(OBJECT_COMPRESSED_LZ4);
+#endif
+
+        assert_se(!object_compressed_to_string(0));
+        assert_se(streq(object_compressed_to_string(OBJECT_COMPRESSED_XZ), "XZ"));
+        assert_se(streq(object_compressed_to_string(OBJECT_COMPRESSED_LZ4), "LZ4"));
+
+        return 0;
+}
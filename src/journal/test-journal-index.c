@@ -0,0 +1,293 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  Copyright 2013 Lennart Poettering
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include <systemd/sd-journal.h>
+
+#include "journal-file.h"
+#include "journal-index.h"
+#include "journal-internal.h"
+#include "lookup3.h"
+#include "set.h"
+#include "util.h"
+#include "log.h"
+
+/* Two archived files with 2000 entries each and a live one with
+ * 100. The archived ones use units 0-2 and 2-4, the live one only
+ * unit 5. */
+#define N_ARCHIVED 2000U
+#define N_LIVE 100U
+#define N_ENTRIES (2 * N_ARCHIVED + N_LIVE)
+
+#define REALTIME(i) (1000000000ULL + (uint64_t) (i) * 1000ULL)
+
+static unsigned unit_of(unsigned i) {
+        if (i < N_ARCHIVED)
+                return i % 3;
+        if (i < 2 * N_ARCHIVED)
+                return 2 + i % 3;
+        return 5;
+}
+
+static void append(JournalFile *f, unsigned i) {
+        char message[DECIMAL_STR_MAX(unsigned) + 9], unit[DECIMAL_STR_MAX(unsigned) + 20];
+        struct iovec iovec[2];
+        dual_timestamp ts;
+
+        ts.realtime = REALTIME(i);
+        ts.monotonic = i + 1;
+
+        snprintf(message, sizeof(message), "MESSAGE=%u", i);
+        snprintf(unit, sizeof(unit), "_SYSTEMD_UNIT=unit-%u", unit_of(i));
+
+        IOVEC_SET_STRING(iovec[0], message);
+        IOVEC_SET_STRING(iovec[1], unit);
+
+        assert_se(journal_file_append_entry(f, &ts, iovec, 2, NULL, NULL, NULL) == 0);
+}
+
+static void test_index_file(JournalFile *f) {
+        JournalIndex *i;
+        IndexField *field;
+        IndexValue *v;
+        const void *data;
+        size_t l;
+        const char *s = "_SYSTEMD_UNIT=unit-1";
+
+        assert_se(journal_index_write(f, "direct.index") == 0);
+        assert_se(journal_index_open("direct.index", f, &i) == 0);
+
+        assert_se(journal_index_find_field(i, "NOTTHERE", 8, NULL) == 0);
+
+        assert_se(journal_index_find_field(i, "MESSAGE", 7, &field) == 1);
+        assert_se(!(le64toh(field->flags) & INDEX_FIELD_HAS_VALUES));
+        assert_se(journal_index_find_data(i, field, "MESSAGE=1", 9, hash64("MESSAGE=1", 9), NULL) == -ENOENT);
+
+        assert_se(journal_index_find_field(i, "_SYSTEMD_UNIT", 13, &field) == 1);
+        assert_se(le64toh(field->flags) & INDEX_FIELD_HAS_VALUES);
+        assert_se(le64toh(field->n_values) == 3);
+
+        assert_se(journal_index_find_data(i, field, s, strlen(s), hash64(s, strlen(s)), &v) == 1);
+        assert_se(le64toh(v->first_realtime) == REALTIME(1));
+        assert_se(le64toh(v->last_realtime) == REALTIME(N_ARCHIVED - 4));
+        assert_se(le64toh(v->n_entries) == (N_ARCHIVED - 1) / 3);
+        assert_se(journal_index_get_payload(i, v, &data, &l) == 0);
+        assert_se(l == strlen(s) && memcmp(data, s, l) == 0);
+
+        s = "_SYSTEMD_UNIT=unit-4";
+        assert_se(journal_index_find_data(i, field, s, strlen(s), hash64(s, strlen(s)), NULL) == 0);
+
+        journal_index_close(i);
+
+        /* Once the file changes the index must not be used anymore */
+        append(f, N_ARCHIVED - 1);
+        assert_se(journal_index_open("direct.index", f, &i) == -ESTALE);
+
+        assert_se(unlink("direct.index") >= 0);
+}
+
+static unsigned count_indexes(const char *path) {
+        _cleanup_closedir_ DIR *d = NULL;
+        struct dirent *de;
+        unsigned n = 0;
+
+        d = opendir(path);
+        assert_se(d);
+
+        while ((de = readdir(d)))
+                if (endswith(de->d_name, ".journal" INDEX_SUFFIX))
+                        n++;
+
+        return n;
+}
+
+static void test_unique(sd_journal *j, const char *field, unsigned n) {
+        _cleanup_set_free_free_ Set *s = NULL;
+        const void *data;
+        size_t l;
+        int r;
+
+        s = set_new(string_hash_func, string_compare_func);
+        assert_se(s);
+
+        assert_se(sd_journal_query_unique(j, field) >= 0);
+        while ((r = sd_journal_enumerate_unique(j, &data, &l)) > 0) {
+                char *v;
+
+                v = strndup(data, l);
+                assert_se(v);
+                assert_se(set_put(s, v) > 0);
+        }
+
+        assert_se(r == 0);
+        assert_se(set_size(s) == n);
+}
+
+static void test_match(sd_journal *j, unsigned unit, unsigned since) {
+        char match[DECIMAL_STR_MAX(unsigned) + 20];
+        unsigned i, expected = 0, n = 0;
+        int r;
+
+        for (i = since; i < N_ENTRIES; i++)
+                if (unit_of(i) == unit)
+                        expected++;
+
+        snprintf(match, sizeof(match), "_SYSTEMD_UNIT=unit-%u", unit);
+
+        sd_journal_flush_matches(j);
+        assert_se(sd_journal_add_match(j, match, 0) >= 0);
+
+        if (since > 0)
+                assert_se(sd_journal_seek_realtime_usec(j, REALTIME(since)) >= 0);
+        else
+                assert_se(sd_journal_seek_head(j) >= 0);
+
+        while ((r = sd_journal_next(j)) > 0) {
+                const void *data;
+                size_t l;
+
+                assert_se(sd_journal_get_data(j, "_SYSTEMD_UNIT", &data, &l) >= 0);
+                assert_se(l == strlen(match) && memcmp(data, match, l) == 0);
+                n++;
+        }
+
+        assert_se(r == 0);
+        assert_se(n == expected);
+}
+
+static void test_reader(const char *path, unsigned n_indexes) {
+        sd_journal *j;
+        JournalFile *f;
+        Iterator i;
+        unsigned unit, n = 0;
+
+        assert_se(sd_journal_open_directory(&j, path, 0) >= 0);
+
+        test_unique(j, "_SYSTEMD_UNIT", 6);
+        test_unique(j, "MESSAGE", N_ENTRIES);
+
+        for (unit = 0; unit < 6; unit++) {
+                test_match(j, unit, 0);
+                test_match(j, unit, N_ARCHIVED);
+                test_match(j, unit, 2 * N_ARCHIVED + 1);
+        }
+
+        HASHMAP_FOREACH(f, j->files, i)
+                if (f->index)
+                        n++;
+        assert_se(n == n_indexes);
+
+        sd_journal_close(j);
+}
+
+static void test_lazy(const char *path) {
+        sd_journal *j;
+        uint64_t from, to;
+
+        assert_se(sd_journal_open_directory(&j, path, 0) >= 0);
+
+        /* Only the live file is opened right-away */
+        assert_se(hashmap_size(j->files) == 1);
+        assert_se(hashmap_size(j->pending_files) == 2);
+
+        assert_se(sd_journal_get_cutoff_realtime_usec(j, &from, &to) > 0);
+        assert_se(from == REALTIME(0));
+        assert_se(to == REALTIME(N_ENTRIES - 1));
+
+        /* Seeking past the end of the first archived file does not
+         * open it */
+        assert_se(sd_journal_seek_realtime_usec(j, REALTIME(N_ARCHIVED + 1)) >= 0);
+        assert_se(sd_journal_next(j) > 0);
+        assert_se(sd_journal_get_realtime_usec(j, &to) >= 0);
+        assert_se(to == REALTIME(N_ARCHIVED + 1));
+
+        assert_se(hashmap_size(j->files) == 2);
+        assert_se(hashmap_size(j->pending_files) == 1);
+
+        /* Going backwards from there needs it */
+        assert_se(sd_journal_previous_skip(j, 2) == 2);
+        assert_se(sd_journal_get_realtime_usec(j, &to) >= 0);
+        assert_se(to == REALTIME(N_ARCHIVED - 1));
+
+        assert_se(hashmap_size(j->files) == 3);
+        assert_se(hashmap_size(j->pending_files) == 0);
+
+        sd_journal_close(j);
+}
+
+int main(int argc, char *argv[]) {
+        char t[] = "/tmp/journal-index-XXXXXX";
+        _cleanup_closedir_ DIR *d = NULL;
+        struct dirent *de;
+        JournalFile *f;
+        unsigned i;
+
+        log_set_max_level(LOG_DEBUG);
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        assert_se(journal_file_open("test.journal", O_RDWR|O_CREAT, 0644, true, false, NULL, NULL, NULL, &f) == 0);
+        f->write_index = true;
+
+        for (i = 0; i < N_ARCHIVED - 1; i++)
+                append(f, i);
+
+        test_index_file(f);
+
+        assert_se(journal_file_rotate(&f, true, false) == 0);
+        assert_se(f->write_index);
+
+        for (i = N_ARCHIVED; i < 2 * N_ARCHIVED; i++)
+                append(f, i);
+
+        assert_se(journal_file_rotate(&f, true, false) == 0);
+
+        for (i = 2 * N_ARCHIVED; i < N_ENTRIES; i++)
+                append(f, i);
+
+        journal_file_close(f);
+
+        assert_se(count_indexes(t) == 2);
+
+        test_lazy(t);
+
+        /* The results have to be the same with and without the
+         * indexes */
+        test_reader(t, 2);
+
+        d = opendir(t);
+        assert_se(d);
+        while ((de = readdir(d)))
+                if (endswith(de->d_name, ".journal" INDEX_SUFFIX))
+                        assert_se(unlink(de->d_name) >= 0);
+
+        assert_se(count_indexes(t) == 0);
+
+        test_reader(t, 0);
+
+        assert_se(rm_rf_dangerous(t, false, true, false) >= 0);
+
+        return 0;
+}
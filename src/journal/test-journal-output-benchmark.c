@@ -0,0 +1,132 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  Copyright 2013 Lennart Poettering
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <systemd/sd-journal.h>
+
+#include "journal-file.h"
+#include "logs-show.h"
+#include "log.h"
+#include "macro.h"
+#include "util.h"
+#include "time-util.h"
+
+/* Writes a journal file with entries resembling what services
+ * usually log, and measures how fast it is formatted by
+ * output_journal(), the way "journalctl -o json" does it. */
+
+#define ENTRIES_DEFAULT 200000
+
+static void fill(const char *fn, unsigned n_entries) {
+        JournalFile *f;
+        unsigned i;
+
+        assert_se(journal_file_open(fn, O_RDWR|O_CREAT, 0644, false, false, NULL, NULL, NULL, &f) == 0);
+
+        for (i = 0; i < n_entries; i++) {
+                char message[sizeof("MESSAGE=Accepted connection \"\" from 10.0.0.1:, handled in \tms") + 3 * DECIMAL_STR_MAX(unsigned)];
+                char pid[sizeof("_PID=") + DECIMAL_STR_MAX(unsigned)];
+                struct iovec iovec[9];
+                dual_timestamp ts;
+
+                dual_timestamp_get(&ts);
+
+                snprintf(message, sizeof(message),
+                         "MESSAGE=Accepted connection \"%u\" from 10.0.0.1:%u, handled in \t%ums",
+                         i, 1024 + i % 60000, i % 97);
+                snprintf(pid, sizeof(pid), "_PID=%u", 100 + i % 50);
+
+                IOVEC_SET_STRING(iovec[0], message);
+                IOVEC_SET_STRING(iovec[1], pid);
+                IOVEC_SET_STRING(iovec[2], "PRIORITY=6");
+                IOVEC_SET_STRING(iovec[3], "SYSLOG_FACILITY=3");
+                IOVEC_SET_STRING(iovec[4], "SYSLOG_IDENTIFIER=test-journal-output-benchmark");
+                IOVEC_SET_STRING(iovec[5], "_COMM=test-journal-ou");
+                IOVEC_SET_STRING(iovec[6], "_SYSTEMD_UNIT=benchmark.service");
+                IOVEC_SET_STRING(iovec[7], "TAG=first");
+                IOVEC_SET_STRING(iovec[8], "TAG=second");
+
+                assert_se(journal_file_append_entry(f, &ts, iovec, ELEMENTSOF(iovec), NULL, NULL, NULL) == 0);
+        }
+
+        journal_file_close(f);
+}
+
+int main(int argc, char *argv[]) {
+        char t[] = "/var/tmp/journal-output-XXXXXX";
+        unsigned n_entries = ENTRIES_DEFAULT, n = 0;
+        OutputMode mode = OUTPUT_JSON;
+        sd_journal *j;
+        FILE *f;
+        struct stat st;
+        usec_t start, elapsed;
+
+        log_set_max_level(LOG_INFO);
+
+        if ((argc > 1 && (safe_atou(argv[1], &n_entries) < 0 || n_entries <= 0)) ||
+            (argc > 2 && (mode = output_mode_from_string(argv[2])) < 0)) {
+                log_error("Usage: %s [ENTRIES] [MODE]", program_invocation_short_name);
+                return EXIT_FAILURE;
+        }
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        log_info("Generating %u entries...", n_entries);
+        fill("test.journal", n_entries);
+
+        assert_se(sd_journal_open_directory(&j, t, 0) >= 0);
+
+        f = fopen("output", "we");
+        assert_se(f);
+
+        log_info("Formatting as %s...", output_mode_to_string(mode));
+
+        start = now(CLOCK_MONOTONIC);
+
+        SD_JOURNAL_FOREACH(j) {
+                assert_se(output_journal(f, j, mode, 0, OUTPUT_FULL_WIDTH) >= 0);
+                n++;
+        }
+
+        assert_se(fflush(f) == 0);
+        elapsed = MAX(now(CLOCK_MONOTONIC) - start, (usec_t) 1);
+
+        assert_se(n == n_entries);
+        assert_se(fstat(fileno(f), &st) >= 0);
+
+        printf("%u entries, %"PRIu64" MB: %.0f entries/s, %.1f MB/s\n",
+               n, (uint64_t) st.st_size / 1024 / 1024,
+               (double) n * USEC_PER_SEC / elapsed,
+               (double) st.st_size / 1024 / 1024 * USEC_PER_SEC / elapsed);
+
+        fclose(f);
+        sd_journal_close(j);
+
+        assert_se(rm_rf_dangerous(t, false, true, false) >= 0);
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,81 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  Copyright 2013 Lennart Poettering
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "journald-rate-limit.h"
+#include "macro.h"
+#include "util.h"
+
+#define INTERVAL_USEC (50*USEC_PER_MSEC)
+
+static void test_tiny_burst(uint64_t available) {
+        JournalRateLimit *r;
+        unsigned suppressed, deferred;
+        const char *id;
+        char *e;
+        usec_t next;
+
+        /* A burst of 1 is modulated down to nothing when there is
+         * little disk space left. The buckets still need to
+         * refill. */
+
+        r = journal_rate_limit_new(INTERVAL_USEC, 1, 2, free);
+        assert_se(r);
+
+        assert_se(journal_rate_limit_test(r, "/system/foo.service", LOG_INFO, available, &suppressed, &deferred) > 0);
+        assert_se(suppressed == 0 && deferred == 0);
+
+        assert_se(journal_rate_limit_test(r, "/system/foo.service", LOG_INFO, available, NULL, NULL) == -EAGAIN);
+        assert_se(e = strdup("first"));
+        assert_se(journal_rate_limit_defer(r, "/system/foo.service", LOG_INFO, e, 6) == 0);
+
+        assert_se(!journal_rate_limit_dequeue(r, available, false, &id, NULL, NULL));
+
+        next = journal_rate_limit_next(r, available);
+        assert_se(next > 0);
+        assert_se(next <= now(CLOCK_MONOTONIC) + INTERVAL_USEC);
+
+        usleep(INTERVAL_USEC + 10*USEC_PER_MSEC);
+
+        e = journal_rate_limit_dequeue(r, available, false, &id, &suppressed, &deferred);
+        assert_se(e);
+        assert_se(streq(e, "first"));
+        assert_se(streq(id, "/system/foo.service"));
+        assert_se(suppressed == 0 && deferred == 1);
+        free(e);
+
+        assert_se(journal_rate_limit_next(r, available) == 0);
+
+        journal_rate_limit_free(r);
+}
+
+int main(int argc, char *argv[]) {
+        test_tiny_burst(0);
+        test_tiny_burst(2*1024*1024);
+        test_tiny_burst(8*1024*1024);
+        test_tiny_burst(16*1024*1024);
+
+        return 0;
+}
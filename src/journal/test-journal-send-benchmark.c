@@ -0,0 +1,204 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  Copyright 2013 Lennart Poettering
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/wait.h>
+
+#include <systemd/sd-journal.h>
+#include <systemd/sd-id128.h>
+
+#include "log.h"
+#include "macro.h"
+#include "util.h"
+#include "time-util.h"
+
+/* Sends small messages to the running journald from a number of
+ * processes as fast as it takes them, via the native or the syslog
+ * socket, and measures how many messages per second are received,
+ * and how many are stored. Since the socket queues are short, the
+ * former is bounded by how fast journald drains the sockets.
+ *
+ * Rate limiting has to be turned off in journald.conf
+ * (RateLimitInterval=0) to get meaningful results. */
+
+#define IDENTIFIER "test-journal-send-benchmark"
+#define PROCESSES_DEFAULT 8
+#define MESSAGES_DEFAULT 20000
+#define WAIT_USEC (60*USEC_PER_SEC)
+
+static void send_messages(bool syslog_socket, const char *id, unsigned n) {
+        unsigned i;
+
+        /* Errors are not checked here, lost messages show up in the
+         * number of stored ones */
+
+        if (syslog_socket)
+                openlog(IDENTIFIER, LOG_NDELAY, LOG_USER);
+
+        for (i = 0; i < n; i++)
+                if (syslog_socket)
+                        syslog(LOG_INFO, "benchmark %s %u", id, i);
+                else
+                        sd_journal_send("MESSAGE=benchmark %s %u", id, i,
+                                        "SYSLOG_IDENTIFIER=" IDENTIFIER,
+                                        NULL);
+}
+
+static int wait_for_marker(sd_journal *j, const char *id) {
+        char match[sizeof("MESSAGE=benchmark done ") + 32];
+        usec_t until;
+        int r;
+
+        snprintf(match, sizeof(match), "MESSAGE=benchmark done %s", id);
+        assert_se(sd_journal_add_match(j, match, 0) >= 0);
+
+        until = now(CLOCK_MONOTONIC) + WAIT_USEC;
+
+        for (;;) {
+                usec_t n;
+
+                r = sd_journal_next(j);
+                if (r != 0)
+                        return r;
+
+                n = now(CLOCK_MONOTONIC);
+                if (n >= until)
+                        return -ETIMEDOUT;
+
+                r = sd_journal_wait(j, until - n);
+                if (r < 0)
+                        return r;
+        }
+}
+
+static unsigned count_stored(sd_journal *j, const char *id) {
+        char prefix[sizeof("MESSAGE=benchmark ") + 32];
+        unsigned n = 0;
+
+        snprintf(prefix, sizeof(prefix), "MESSAGE=benchmark %s", id);
+
+        sd_journal_flush_matches(j);
+        assert_se(sd_journal_add_match(j, "SYSLOG_IDENTIFIER=" IDENTIFIER, 0) >= 0);
+        assert_se(sd_journal_seek_head(j) >= 0);
+
+        while (sd_journal_next(j) > 0) {
+                const void *data;
+                size_t l;
+
+                if (sd_journal_get_data(j, "MESSAGE", &data, &l) >= 0 &&
+                    l > strlen(prefix) &&
+                    memcmp(data, prefix, strlen(prefix)) == 0 &&
+                    ((const char*) data)[strlen(prefix)] == ' ')
+                        n++;
+        }
+
+        return n;
+}
+
+int main(int argc, char *argv[]) {
+        unsigned n_processes = PROCESSES_DEFAULT, n_messages = MESSAGES_DEFAULT, i, total, stored;
+        bool syslog_socket = false;
+        char id[33];
+        sd_id128_t rnd;
+        sd_journal *j;
+        usec_t start, sent, done;
+        int r;
+
+        log_set_max_level(LOG_INFO);
+
+        if (argc > 1) {
+                if (streq(argv[1], "syslog"))
+                        syslog_socket = true;
+                else if (!streq(argv[1], "native")) {
+                        log_error("Usage: %s [native|syslog] [PROCESSES] [MESSAGES]", program_invocation_short_name);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        if ((argc > 2 && (safe_atou(argv[2], &n_processes) < 0 || n_processes <= 0)) ||
+            (argc > 3 && (safe_atou(argv[3], &n_messages) < 0 || n_messages <= 0))) {
+                log_error("Failed to parse arguments.");
+                return EXIT_FAILURE;
+        }
+
+        assert_se(sd_id128_randomize(&rnd) >= 0);
+        sd_id128_to_string(rnd, id);
+
+        /* Open the journal first, so that we get notified about the
+         * marker even if the files are rotated meanwhile */
+        r = sd_journal_open(&j, SD_JOURNAL_LOCAL_ONLY);
+        if (r < 0) {
+                log_error("Failed to open journal: %s", strerror(-r));
+                return EXIT_FAILURE;
+        }
+
+        start = now(CLOCK_MONOTONIC);
+
+        for (i = 0; i < n_processes; i++) {
+                pid_t pid;
+
+                pid = fork();
+                assert_se(pid >= 0);
+
+                if (pid == 0) {
+                        send_messages(syslog_socket, id, n_messages);
+                        _exit(EXIT_SUCCESS);
+                }
+        }
+
+        while (wait(NULL) > 0)
+                ;
+
+        sent = now(CLOCK_MONOTONIC);
+
+        /* Datagrams from one socket are stored in the order they
+         * are received, hence once the marker is stored everything
+         * sent before it on the same socket is too */
+        if (syslog_socket)
+                syslog(LOG_INFO, "benchmark done %s", id);
+        else
+                assert_se(sd_journal_send("MESSAGE=benchmark done %s", id, NULL) >= 0);
+
+        r = wait_for_marker(j, id);
+        if (r <= 0) {
+                log_error("Marker message did not show up in the journal: %s", r < 0 ? strerror(-r) : "not found");
+                sd_journal_close(j);
+                return EXIT_FAILURE;
+        }
+
+        done = now(CLOCK_MONOTONIC);
+
+        total = n_processes * n_messages;
+        stored = count_stored(j, id);
+
+        printf("%s socket, %u processes: sent %u messages at %.0f msg/s, stored %u at %.0f msg/s\n",
+               syslog_socket ? "syslog" : "native",
+               n_processes,
+               total, (double) total * USEC_PER_SEC / MAX(sent - start, (usec_t) 1),
+               stored, (double) stored * USEC_PER_SEC / MAX(done - start, (usec_t) 1));
+
+        sd_journal_close(j);
+
+        return stored == total ? EXIT_SUCCESS : EXIT_FAILURE;
+}
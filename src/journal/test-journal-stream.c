@@ -21,6 +21,7 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/wait.h>
 
 #include <systemd/sd-journal.h>
 
@@ -31,6 +32,13 @@
 
 #define N_ENTRIES 200
 
+#define N_FOLLOW_ENTRIES 200
+
+#define N_INGEST_ENTRIES 10000
+#define N_INGEST_UNITS 8
+#define NOTIFY_INTERVAL_USEC (50*USEC_PER_MSEC)
+#define LATENCY_SLACK_USEC (1*USEC_PER_SEC)
+
 static void verify_contents(sd_journal *j, unsigned skip) {
         unsigned i;
 
@@ -71,6 +79,186 @@ static void verify_contents(sd_journal *j, unsigned skip) {
                 assert_se(i == N_ENTRIES);
 }
 
+static void write_deferred(JournalFile *f) {
+        usec_t last;
+        unsigned i;
+
+        last = now(CLOCK_MONOTONIC);
+
+        for (i = 0; i < N_FOLLOW_ENTRIES; i++) {
+                char *p;
+                struct iovec iovec;
+
+                assert_se(asprintf(&p, "NUMBER=%u", i) >= 0);
+                IOVEC_SET_STRING(iovec, p);
+
+                assert_se(journal_file_append_entry(f, NULL, &iovec, 1, NULL, NULL, NULL) == 0);
+                free(p);
+
+                /* This is what journald's notify timer does */
+                if (now(CLOCK_MONOTONIC) >= last + NOTIFY_INTERVAL_USEC) {
+                        journal_file_flush_post_change(f);
+                        last = now(CLOCK_MONOTONIC);
+                }
+
+                usleep(USEC_PER_MSEC);
+        }
+
+        /* Notifies the reader about the remaining entries */
+        journal_file_close(f);
+}
+
+static void test_deferred_post_change(void) {
+        char t[] = "/tmp/journal-follow-XXXXXX";
+        _cleanup_journal_close_ sd_journal *j = NULL;
+        JournalFile *f;
+        unsigned n = 0, wakeups = 0;
+        usec_t max_latency = 0;
+        pid_t pid;
+        siginfo_t si;
+
+        /* Checks that a following reader sees entries written with
+         * deferred change notification at most one notify interval
+         * late, while being woken up less than once per entry. */
+
+        assert_se(mkdtemp(t));
+
+        assert_se(journal_file_open(strappenda(t, "/follow.journal"), O_RDWR|O_CREAT, 0666, true, false, NULL, NULL, NULL, &f) == 0);
+        f->defer_post_change = true;
+
+        assert_se(sd_journal_open_directory(&j, t, 0) >= 0);
+        assert_se(sd_journal_get_fd(j) >= 0);
+        assert_se(sd_journal_seek_head(j) >= 0);
+
+        pid = fork();
+        assert_se(pid >= 0);
+
+        if (pid == 0) {
+                write_deferred(f);
+                _exit(EXIT_SUCCESS);
+        }
+
+        while (n < N_FOLLOW_ENTRIES) {
+                int r;
+
+                r = sd_journal_wait(j, NOTIFY_INTERVAL_USEC + LATENCY_SLACK_USEC);
+                assert_se(r >= 0);
+
+                /* Timing out here means a notification got lost */
+                assert_se(r != SD_JOURNAL_NOP);
+                wakeups++;
+
+                while ((r = sd_journal_next(j)) > 0) {
+                        uint64_t realtime;
+                        usec_t l;
+
+                        assert_se(sd_journal_get_realtime_usec(j, &realtime) >= 0);
+
+                        l = now(CLOCK_REALTIME) - realtime;
+                        if (l > max_latency)
+                                max_latency = l;
+
+                        n++;
+                }
+                assert_se(r >= 0);
+        }
+
+        assert_se(wait_for_terminate(pid, &si) >= 0);
+        assert_se(si.si_code == CLD_EXITED && si.si_status == EXIT_SUCCESS);
+
+        /* The child wrote and closed the file already */
+        journal_file_close(f);
+
+        printf("%u entries, %u wakeups, maximum latency %llu us\n",
+               n, wakeups, (unsigned long long) max_latency);
+
+        assert_se(n == N_FOLLOW_ENTRIES);
+        assert_se(wakeups < N_FOLLOW_ENTRIES);
+        assert_se(max_latency < NOTIFY_INTERVAL_USEC + LATENCY_SLACK_USEC);
+
+        assert_se(rm_rf_dangerous(t, false, true, false) >= 0);
+}
+
+static usec_t ingest(const char *fn, bool data_cache, uint64_t *n_data, uint64_t *arena_size) {
+        JournalFile *f;
+        usec_t start, elapsed;
+        unsigned i;
+
+        assert_se(journal_file_open(fn, O_RDWR|O_CREAT, 0666, true, false, NULL, NULL, NULL, &f) == 0);
+
+        if (!data_cache) {
+                hashmap_free_free(f->data_cache);
+                f->data_cache = NULL;
+        }
+
+        start = now(CLOCK_MONOTONIC);
+
+        for (i = 0; i < N_INGEST_ENTRIES; i++) {
+                char message[sizeof("MESSAGE=ingest message ") + DECIMAL_STR_MAX(unsigned)];
+                char pid[sizeof("_PID=") + DECIMAL_STR_MAX(unsigned)];
+                char unit[sizeof("_SYSTEMD_UNIT=ingest-.service") + DECIMAL_STR_MAX(unsigned)];
+                struct iovec iovec[13];
+                unsigned n = 0;
+
+                snprintf(message, sizeof(message), "MESSAGE=ingest message %u", i);
+                snprintf(pid, sizeof(pid), "_PID=%u", 100 + i % N_INGEST_UNITS);
+                snprintf(unit, sizeof(unit), "_SYSTEMD_UNIT=ingest-%u.service", i % N_INGEST_UNITS);
+
+                /* Like what journald writes for a service that
+                 * logs to stdout: everything but the message
+                 * repeats */
+                IOVEC_SET_STRING(iovec[n++], message);
+                IOVEC_SET_STRING(iovec[n++], "PRIORITY=6");
+                IOVEC_SET_STRING(iovec[n++], "SYSLOG_FACILITY=3");
+                IOVEC_SET_STRING(iovec[n++], "SYSLOG_IDENTIFIER=ingest");
+                IOVEC_SET_STRING(iovec[n++], "_TRANSPORT=stdout");
+                IOVEC_SET_STRING(iovec[n++], pid);
+                IOVEC_SET_STRING(iovec[n++], "_UID=0");
+                IOVEC_SET_STRING(iovec[n++], "_GID=0");
+                IOVEC_SET_STRING(iovec[n++], "_COMM=ingest");
+                IOVEC_SET_STRING(iovec[n++], "_EXE=/usr/bin/ingest");
+                IOVEC_SET_STRING(iovec[n++], unit);
+                IOVEC_SET_STRING(iovec[n++], "_BOOT_ID=0123456789abcdef0123456789abcdef");
+                IOVEC_SET_STRING(iovec[n++], "_HOSTNAME=localhost");
+
+                assert_se(journal_file_append_entry(f, NULL, iovec, n, NULL, NULL, NULL) == 0);
+        }
+
+        elapsed = now(CLOCK_MONOTONIC) - start;
+
+        *n_data = le64toh(f->header->n_data);
+        *arena_size = le64toh(f->header->arena_size);
+
+        journal_file_close(f);
+
+        return elapsed;
+}
+
+static void test_data_cache(void) {
+        char t[] = "/tmp/journal-ingest-XXXXXX";
+        uint64_t n_data_cached, n_data_uncached, arena_size_cached, arena_size_uncached;
+        usec_t cached, uncached;
+
+        /* Appends the same entries with and without the data object
+         * cache, which must result in the very same objects */
+
+        assert_se(mkdtemp(t));
+
+        uncached = ingest(strappenda(t, "/uncached.journal"), false, &n_data_uncached, &arena_size_uncached);
+        cached = ingest(strappenda(t, "/cached.journal"), true, &n_data_cached, &arena_size_cached);
+
+        printf("%u entries: %.0f entries/s without data cache, %.0f entries/s with data cache\n",
+               N_INGEST_ENTRIES,
+               (double) N_INGEST_ENTRIES * USEC_PER_SEC / MAX(uncached, (usec_t) 1),
+               (double) N_INGEST_ENTRIES * USEC_PER_SEC / MAX(cached, (usec_t) 1));
+
+        assert_se(n_data_cached == n_data_uncached);
+        assert_se(n_data_cached == N_INGEST_ENTRIES + 10 + 2 * N_INGEST_UNITS);
+        assert_se(arena_size_cached == arena_size_uncached);
+
+        assert_se(rm_rf_dangerous(t, false, true, false) >= 0);
+}
+
 int main(int argc, char *argv[]) {
         JournalFile *one, *two, *three;
         char t[] = "/tmp/journal-stream-XXXXXX";
@@ -177,5 +365,9 @@ int main(int argc, char *argv[]) {
 
         assert_se(rm_rf_dangerous(t, false, true, false) >= 0);
 
+        test_deferred_post_change();
+
+        test_data_cache();
+
         return 0;
 }
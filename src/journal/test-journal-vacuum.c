@@ -0,0 +1,245 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  Copyright 2013 Lennart Poettering
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include "journal-file.h"
+#include "journal-index.h"
+#include "journal-vacuum.h"
+#include "util.h"
+#include "log.h"
+
+#define N_ARCHIVED 8U
+
+static char archived[N_ARCHIVED][NAME_MAX+1];
+
+static void append(JournalFile *f, unsigned i) {
+        char message[DECIMAL_STR_MAX(unsigned) + 9];
+        struct iovec iovec;
+        dual_timestamp ts;
+
+        dual_timestamp_get(&ts);
+
+        snprintf(message, sizeof(message), "MESSAGE=%u", i);
+        IOVEC_SET_STRING(iovec, message);
+
+        assert_se(journal_file_append_entry(f, &ts, &iovec, 1, NULL, NULL, NULL) == 0);
+}
+
+static unsigned count_archived(void) {
+        _cleanup_closedir_ DIR *d = NULL;
+        struct dirent *de;
+        unsigned n = 0;
+
+        d = opendir(".");
+        assert_se(d);
+
+        while ((de = readdir(d)))
+                if (strchr(de->d_name, '@') && endswith(de->d_name, ".journal"))
+                        n++;
+
+        return n;
+}
+
+static uint64_t directory_usage(void) {
+        _cleanup_closedir_ DIR *d = NULL;
+        struct dirent *de;
+        uint64_t sum = 0;
+
+        d = opendir(".");
+        assert_se(d);
+
+        while ((de = readdir(d))) {
+                struct stat st;
+
+                if (!endswith(de->d_name, ".journal") &&
+                    !endswith(de->d_name, ".journal~") &&
+                    !endswith(de->d_name, ".journal" INDEX_SUFFIX))
+                        continue;
+
+                assert_se(stat(de->d_name, &st) >= 0);
+                sum += 512UL * (uint64_t) st.st_blocks;
+        }
+
+        return sum;
+}
+
+static void find_archived(void) {
+        _cleanup_closedir_ DIR *d = NULL;
+        struct dirent *de;
+
+        d = opendir(".");
+        assert_se(d);
+
+        /* The files share the sequence number ID, and the first
+         * sequence number of each is what tells their age */
+        while ((de = readdir(d))) {
+                unsigned long long seqnum, realtime;
+                size_t l;
+
+                if (!strchr(de->d_name, '@') || !endswith(de->d_name, ".journal"))
+                        continue;
+
+                l = strlen(de->d_name);
+                assert_se(sscanf(de->d_name + l - 8 - 16 - 1 - 16, "%16llx-%16llx.journal", &seqnum, &realtime) == 2);
+                assert_se(seqnum >= 1 && (seqnum - 1) % 2 == 0 && (seqnum - 1) / 2 < N_ARCHIVED);
+
+                strcpy(archived[(seqnum - 1) / 2], de->d_name);
+        }
+}
+
+static void test_incremental(unsigned first) {
+        JournalVacuum *v;
+        uint64_t usage = 0, before;
+        unsigned steps = 0, n, i;
+        int r;
+
+        /* A fresh index has to read the directory first, one entry
+         * per step, before it deletes anything */
+
+        v = journal_vacuum_new(".");
+        assert_se(v);
+
+        n = count_archived();
+
+        do {
+                r = journal_vacuum_step(v, 1, 0, 0, 1, &usage);
+                assert_se(r >= 0);
+
+                steps++;
+        } while (r == 0 && count_archived() == n);
+
+        /* Each archived file and index takes a step to find */
+        assert_se(steps > 2 * n);
+
+        /* The oldest file goes first, together with its index. The
+         * usage is what was left over of what the scan found. */
+        assert_se(count_archived() == n - 1);
+        assert_se(usage > 0);
+        assert_se(usage == directory_usage());
+        assert_se(access(archived[first], F_OK) < 0 && errno == ENOENT);
+        assert_se(access(strappenda(archived[first], INDEX_SUFFIX), F_OK) < 0 && errno == ENOENT);
+        assert_se(access(archived[first + 1], F_OK) >= 0);
+
+        /* Without a limit on the number of steps, it vacuums
+         * everything that is too much in one go */
+        before = usage;
+        assert_se(journal_vacuum_step(v, 1, 0, 0, (unsigned) -1, &usage) > 0);
+        assert_se(usage < before);
+        assert_se(usage == directory_usage());
+        assert_se(count_archived() == 0);
+        assert_se(journal_vacuum_oldest(v) == 0);
+
+        for (i = 0; i < N_ARCHIVED; i++)
+                assert_se(access(strappenda(archived[i], INDEX_SUFFIX), F_OK) < 0 && errno == ENOENT);
+
+        journal_vacuum_free(v);
+}
+
+int main(int argc, char *argv[]) {
+        char t[] = "/tmp/journal-vacuum-XXXXXX";
+        JournalMetrics metrics;
+        JournalVacuum *v;
+        JournalFile *f;
+        uint64_t usage = 0, before;
+        usec_t oldest;
+        unsigned i;
+
+        log_set_max_level(LOG_DEBUG);
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        v = journal_vacuum_new(".");
+        assert_se(v);
+
+        memset(&metrics, 0xFF, sizeof(metrics));
+        metrics.usage = &usage;
+        metrics.vacuum = v;
+
+        assert_se(journal_file_open("test.journal", O_RDWR|O_CREAT, 0644, true, false, &metrics, NULL, NULL, &f) == 0);
+        f->write_index = true;
+
+        /* Files archived by rotation are registered as they are
+         * created */
+        for (i = 0; i < N_ARCHIVED; i++) {
+                append(f, 2*i);
+                append(f, 2*i+1);
+                assert_se(journal_file_rotate(&f, true, false) == 0);
+        }
+
+        journal_file_close(f);
+
+        assert_se(count_archived() == N_ARCHIVED);
+        find_archived();
+
+        oldest = journal_vacuum_oldest(v);
+        assert_se(oldest > 0);
+
+        /* Nothing to do, once the directory has been read. That
+         * finds the registered files again, but must not count them
+         * twice. Whatever the usage was, it is what the directory
+         * holds afterwards. */
+        usage = 0;
+        assert_se(journal_vacuum_step(v, (uint64_t) -1 / 2, 0, 0, 0, &usage) == 0);
+        assert_se(usage == 0);
+        assert_se(journal_vacuum_step(v, (uint64_t) -1 / 2, 0, 0, (unsigned) -1, &usage) > 0);
+        assert_se(usage == directory_usage());
+        assert_se(journal_vacuum_oldest(v) == oldest);
+
+        /* Deleting one file at a time */
+        before = usage;
+        assert_se(journal_vacuum_step(v, 1, 0, 0, 1, &usage) == 0);
+        assert_se(usage < before);
+        assert_se(usage == directory_usage());
+        assert_se(count_archived() == N_ARCHIVED - 1);
+        assert_se(access(archived[0], F_OK) < 0 && errno == ENOENT);
+        assert_se(journal_vacuum_oldest(v) >= oldest);
+
+        assert_se(journal_vacuum_step(v, 1, 0, 0, 1, &usage) == 0);
+        assert_se(count_archived() == N_ARCHIVED - 2);
+        assert_se(access(archived[1], F_OK) < 0 && errno == ENOENT);
+        assert_se(access(archived[2], F_OK) >= 0);
+
+        /* Files deleted by somebody else are skipped, and only
+         * accounted for once the directory is read again */
+        assert_se(unlink(archived[2]) >= 0);
+        before = usage;
+        assert_se(journal_vacuum_step(v, 1, 0, 0, 1, &usage) == 0);
+        assert_se(usage == before);
+        assert_se(usage > directory_usage());
+        assert_se(access(archived[3], F_OK) >= 0);
+
+        journal_vacuum_rescan(v);
+        assert_se(journal_vacuum_step(v, (uint64_t) -1 / 2, 0, 0, (unsigned) -1, &usage) > 0);
+        assert_se(usage == directory_usage());
+
+        journal_vacuum_free(v);
+
+        /* Start over with what's left, reading the directory */
+        test_incremental(3);
+
+        assert_se(rm_rf_dangerous(t, false, true, false) >= 0);
+
+        return 0;
+}
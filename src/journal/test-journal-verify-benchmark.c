@@ -0,0 +1,143 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  Copyright 2013 Lennart Poettering
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "journal-file.h"
+#include "journal-verify.h"
+#include "log.h"
+#include "macro.h"
+#include "util.h"
+#include "time-util.h"
+
+/* Fills a number of journal files up to their maximum size and
+ * measures how fast they are verified, first one after the other,
+ * and then all at once, the way journalctl --verify does it. */
+
+#define SIZE_MB_DEFAULT 64
+#define FILES_DEFAULT 4
+#define RANDOM_RANGE 10000
+
+static void fill(const char *fn, uint64_t size) {
+        JournalMetrics metrics = {
+                .max_use = (uint64_t) -1,
+                .max_size = size,
+                .min_size = (uint64_t) -1,
+                .keep_free = 0,
+        };
+        JournalFile *f;
+        unsigned i;
+
+        assert_se(journal_file_open(fn, O_RDWR|O_CREAT, 0644, false, false, &metrics, NULL, NULL, &f) == 0);
+
+        for (i = 0;; i++) {
+                char message[sizeof("MESSAGE=benchmark message ") + DECIMAL_STR_MAX(unsigned)];
+                char rnd[sizeof("RANDOM=") + DECIMAL_STR_MAX(long)];
+                struct iovec iovec[3];
+                dual_timestamp ts;
+                int r;
+
+                dual_timestamp_get(&ts);
+
+                snprintf(message, sizeof(message), "MESSAGE=benchmark message %u", i);
+                snprintf(rnd, sizeof(rnd), "RANDOM=%li", random() % RANDOM_RANGE);
+
+                IOVEC_SET_STRING(iovec[0], message);
+                IOVEC_SET_STRING(iovec[1], rnd);
+                IOVEC_SET_STRING(iovec[2], "SYSLOG_IDENTIFIER=test-journal-verify-benchmark");
+
+                r = journal_file_append_entry(f, &ts, iovec, ELEMENTSOF(iovec), NULL, NULL, NULL);
+                if (r == -E2BIG)
+                        break;
+
+                assert_se(r == 0);
+        }
+
+        journal_file_close(f);
+}
+
+static int report(JournalFile *f, int r, usec_t first, usec_t validated, usec_t last, void *userdata) {
+        assert_se(r >= 0);
+        return 0;
+}
+
+int main(int argc, char *argv[]) {
+        char t[] = "/var/tmp/journal-verify-XXXXXX";
+        unsigned size_mb = SIZE_MB_DEFAULT, n_files = FILES_DEFAULT, i;
+        _cleanup_free_ JournalFile **files = NULL;
+        uint64_t total = 0;
+        usec_t start, serial, parallel;
+
+        log_set_max_level(LOG_INFO);
+
+        if ((argc > 1 && (safe_atou(argv[1], &size_mb) < 0 || size_mb <= 0)) ||
+            (argc > 2 && (safe_atou(argv[2], &n_files) < 0 || n_files <= 0))) {
+                log_error("Usage: %s [SIZE_MB] [FILES]", program_invocation_short_name);
+                return EXIT_FAILURE;
+        }
+
+        files = new(JournalFile*, n_files);
+        assert_se(files);
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        log_info("Generating %u files of %u MB...", n_files, size_mb);
+
+        for (i = 0; i < n_files; i++) {
+                char fn[sizeof("test-.journal") + DECIMAL_STR_MAX(unsigned)];
+
+                snprintf(fn, sizeof(fn), "test-%u.journal", i);
+                fill(fn, (uint64_t) size_mb * 1024ULL * 1024ULL);
+
+                assert_se(journal_file_open(fn, O_RDONLY, 0, false, false, NULL, NULL, NULL, files + i) == 0);
+                total += files[i]->last_stat.st_size;
+        }
+
+        log_info("Verifying...");
+
+        start = now(CLOCK_MONOTONIC);
+
+        for (i = 0; i < n_files; i++)
+                assert_se(journal_file_verify(files[i], NULL, NULL, NULL, NULL, false) >= 0);
+
+        serial = now(CLOCK_MONOTONIC) - start;
+        start = now(CLOCK_MONOTONIC);
+
+        assert_se(journal_files_verify(files, n_files, NULL, false, report, NULL) >= 0);
+
+        parallel = now(CLOCK_MONOTONIC) - start;
+
+        printf("%u files, %"PRIu64" MB: one by one %.1f MB/s, all at once %.1f MB/s\n",
+               n_files, total / 1024 / 1024,
+               (double) total / 1024 / 1024 * USEC_PER_SEC / MAX(serial, (usec_t) 1),
+               (double) total / 1024 / 1024 * USEC_PER_SEC / MAX(parallel, (usec_t) 1));
+
+        for (i = 0; i < n_files; i++)
+                journal_file_close(files[i]);
+
+        assert_se(rm_rf_dangerous(t, false, true, false) >= 0);
+
+        return EXIT_SUCCESS;
+}
@@ -28,6 +28,7 @@
 #include "journal-file.h"
 #include "journal-authenticate.h"
 #include "journal-vacuum.h"
+#include "journal-verify.h"
 
 static bool arg_keep = false;
 
@@ -126,7 +127,7 @@ static void test_non_empty(void) {
         if (arg_keep)
                 log_info("Not removing %s", t);
         else {
-                journal_directory_vacuum(".", 3000000, 0, 0, NULL);
+                journal_directory_vacuum(".", 3000000, 0, 0, NULL, NULL);
 
                 assert_se(rm_rf_dangerous(t, false, true, false) >= 0);
         }
@@ -134,6 +135,348 @@ static void test_non_empty(void) {
         puts("------------------------------------------------------------");
 }
 
+static void test_append_entries(void) {
+        JournalFile *f;
+        JournalAppendEntry e[3];
+        struct iovec iovec[3];
+        static const char test[] = "TEST1=1", test2[] = "TEST2=2", test3[] = "TEST3=3";
+        Object *o;
+        uint64_t p, seqnum = 0;
+        unsigned n;
+        char t[] = "/tmp/journal-XXXXXX";
+
+        log_set_max_level(LOG_DEBUG);
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        assert_se(journal_file_open("test.journal", O_RDWR|O_CREAT, 0666, true, false, NULL, NULL, NULL, &f) == 0);
+
+        IOVEC_SET_STRING(iovec[0], test);
+        IOVEC_SET_STRING(iovec[1], test2);
+        IOVEC_SET_STRING(iovec[2], test3);
+
+        zero(e);
+        for (n = 0; n < 3; n++) {
+                dual_timestamp_get(&e[n].ts);
+                e[n].iovec = iovec + n;
+                e[n].n_iovec = 1;
+        }
+
+        assert_se(journal_file_append_entries(f, e, 3, &seqnum, &n) == 0);
+        assert_se(n == 3);
+        assert_se(seqnum == 3);
+        assert_se(le64toh(f->header->n_entries) == 3);
+
+        /* The second entry goes back in time and is refused, the
+         * first one must have been written nonetheless */
+        dual_timestamp_get(&e[0].ts);
+        e[1].ts.monotonic = 0;
+        assert_se(journal_file_append_entries(f, e, 3, &seqnum, &n) == -EINVAL);
+        assert_se(n == 1);
+        assert_se(seqnum == 4);
+
+        assert_se(journal_file_move_to_entry_by_seqnum(f, 2, DIRECTION_DOWN, &o, &p) == 1);
+        assert_se(le64toh(o->entry.seqnum) == 2);
+        assert_se(journal_file_find_data_object(f, test2, strlen(test2), NULL, &p) == 1);
+
+        journal_file_close(f);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf_dangerous(t, false, true, false) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
+static void test_append_imported(void) {
+        JournalFile *f;
+        JournalAppendEntry e[3];
+        struct iovec iovec;
+        static const char test[] = "TEST=1";
+        sd_id128_t boot1, boot2;
+        Object *o;
+        uint64_t p;
+        unsigned n;
+        char t[] = "/tmp/journal-XXXXXX";
+
+        log_set_max_level(LOG_DEBUG);
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        assert_se(journal_file_open("test.journal", O_RDWR|O_CREAT, 0666, true, false, NULL, NULL, NULL, &f) == 0);
+
+        assert_se(sd_id128_randomize(&boot1) >= 0);
+        assert_se(sd_id128_randomize(&boot2) >= 0);
+
+        IOVEC_SET_STRING(iovec, test);
+
+        /* Entries of different boots may go back in the monotonic
+         * clock, and keep their seqnums as long as these increase */
+        zero(e);
+        for (n = 0; n < 3; n++) {
+                e[n].iovec = &iovec;
+                e[n].n_iovec = 1;
+                e[n].ts.realtime = 1000 + n;
+        }
+
+        e[0].ts.monotonic = 500;
+        e[0].boot_id = &boot1;
+        e[0].seqnum = 10;
+        e[1].ts.monotonic = 100;
+        e[1].boot_id = &boot2;
+        e[1].seqnum = 20;
+        e[2].ts.monotonic = 200;
+        e[2].boot_id = &boot2;
+        e[2].seqnum = 5;
+
+        assert_se(journal_file_append_entries(f, e, 3, NULL, &n) == 0);
+        assert_se(n == 3);
+
+        assert_se(journal_file_next_entry(f, NULL, 0, DIRECTION_DOWN, &o, &p) == 1);
+        assert_se(le64toh(o->entry.seqnum) == 10);
+        assert_se(sd_id128_equal(o->entry.boot_id, boot1));
+
+        assert_se(journal_file_next_entry(f, o, p, DIRECTION_DOWN, &o, &p) == 1);
+        assert_se(le64toh(o->entry.seqnum) == 20);
+        assert_se(sd_id128_equal(o->entry.boot_id, boot2));
+
+        assert_se(journal_file_next_entry(f, o, p, DIRECTION_DOWN, &o, &p) == 1);
+        assert_se(le64toh(o->entry.seqnum) == 21);
+        assert_se(sd_id128_equal(o->entry.boot_id, boot2));
+
+        /* Within the same boot time still may not go backwards */
+        e[0].ts.monotonic = 100;
+        e[0].boot_id = &boot2;
+        e[0].seqnum = 0;
+        assert_se(journal_file_append_entries(f, e, 1, NULL, &n) == -EINVAL);
+        assert_se(n == 0);
+
+        journal_file_close(f);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf_dangerous(t, false, true, false) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
+static void test_compressed(void) {
+        JournalFile *f;
+        sd_journal *j;
+        struct iovec iovec;
+        dual_timestamp ts;
+        char t[] = "/tmp/journal-XXXXXX";
+        char payload[4096];
+        const void *data;
+        size_t l;
+        Object *o;
+        uint64_t p;
+
+        log_set_max_level(LOG_DEBUG);
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        memcpy(payload, "LARGE=", 6);
+        memset(payload + 6, 'x', sizeof(payload) - 6);
+
+        assert_se(journal_file_open("test-compress.journal", O_RDWR|O_CREAT, 0666, true, false, NULL, NULL, NULL, &f) == 0);
+
+        dual_timestamp_get(&ts);
+        iovec.iov_base = payload;
+        iovec.iov_len = sizeof(payload);
+        assert_se(journal_file_append_entry(f, &ts, &iovec, 1, NULL, NULL, NULL) == 0);
+
+        assert_se(journal_file_find_data_object(f, payload, sizeof(payload), &o, &p) == 1);
+
+#if defined(HAVE_LZ4)
+        assert_se((o->object.flags & OBJECT_COMPRESSION_MASK) == OBJECT_COMPRESSED_LZ4);
+#elif defined(HAVE_XZ)
+        assert_se((o->object.flags & OBJECT_COMPRESSION_MASK) == OBJECT_COMPRESSED_XZ);
+#else
+        assert_se((o->object.flags & OBJECT_COMPRESSION_MASK) == 0);
+#endif
+
+        journal_file_print_header(f);
+        journal_file_close(f);
+
+        assert_se(sd_journal_open_directory(&j, t, 0) >= 0);
+        assert_se(sd_journal_next(j) == 1);
+        assert_se(sd_journal_get_data(j, "LARGE", &data, &l) >= 0);
+        assert_se(l == sizeof(payload));
+        assert_se(memcmp(data, payload, l) == 0);
+        sd_journal_close(j);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf_dangerous(t, false, true, false) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
+#define N_COMPACT_ENTRIES 2000
+
+static uint64_t write_compact(const char *fn, bool compact) {
+        JournalFile *f;
+        dual_timestamp ts;
+        Object *o;
+        uint64_t p, seqnum, size;
+
+        assert_se(setenv("SYSTEMD_JOURNAL_COMPACT", compact ? "1" : "0", 1) >= 0);
+        assert_se(journal_file_open(fn, O_RDWR|O_CREAT, 0666, false, false, NULL, NULL, NULL, &f) == 0);
+        assert_se(f->compact == compact);
+        assert_se(JOURNAL_HEADER_COMPACT(f->header) == compact);
+
+        for (seqnum = 1; seqnum <= N_COMPACT_ENTRIES; seqnum++) {
+                struct iovec iovec[2];
+                char parity[] = "PARITY=?";
+
+                parity[7] = seqnum % 2 ? '1' : '0';
+                IOVEC_SET_STRING(iovec[0], "COMMON=1");
+                IOVEC_SET_STRING(iovec[1], parity);
+
+                dual_timestamp_get(&ts);
+                assert_se(journal_file_append_entry(f, &ts, iovec, 2, NULL, NULL, NULL) == 0);
+        }
+
+        journal_file_close(f);
+        assert_se(unsetenv("SYSTEMD_JOURNAL_COMPACT") >= 0);
+
+        /* The header decides, not the default for new files */
+        assert_se(setenv("SYSTEMD_JOURNAL_COMPACT", compact ? "0" : "1", 1) >= 0);
+        assert_se(journal_file_open(fn, O_RDONLY, 0, false, false, NULL, NULL, NULL, &f) == 0);
+        assert_se(unsetenv("SYSTEMD_JOURNAL_COMPACT") >= 0);
+        assert_se(f->compact == compact);
+
+        assert_se(journal_file_verify(f, NULL, NULL, NULL, NULL, false) >= 0);
+
+        for (seqnum = 1; seqnum <= N_COMPACT_ENTRIES; seqnum += 97) {
+                assert_se(journal_file_move_to_entry_by_seqnum(f, seqnum, DIRECTION_DOWN, &o, NULL) == 1);
+                assert_se(le64toh(o->entry.seqnum) == seqnum);
+        }
+
+        assert_se(journal_file_find_data_object(f, "PARITY=0", 8, NULL, &p) == 1);
+        assert_se(journal_file_next_entry_for_data(f, NULL, 0, p, DIRECTION_DOWN, &o, NULL) == 1);
+        assert_se(le64toh(o->entry.seqnum) == 2);
+        assert_se(journal_file_next_entry_for_data(f, NULL, 0, p, DIRECTION_UP, &o, NULL) == 1);
+        assert_se(le64toh(o->entry.seqnum) == N_COMPACT_ENTRIES);
+        assert_se(journal_file_move_to_entry_by_seqnum_for_data(f, p, 1001, DIRECTION_DOWN, &o, NULL) == 1);
+        assert_se(le64toh(o->entry.seqnum) == 1002);
+        assert_se(journal_file_move_to_entry_by_seqnum_for_data(f, p, 1001, DIRECTION_UP, &o, NULL) == 1);
+        assert_se(le64toh(o->entry.seqnum) == 1000);
+
+        size = le64toh(f->header->arena_size);
+        journal_file_print_header(f);
+        journal_file_close(f);
+
+        return size;
+}
+
+static void test_compact(void) {
+        char t[] = "/tmp/journal-XXXXXX";
+        uint64_t regular, compact;
+
+        log_set_max_level(LOG_DEBUG);
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        regular = write_compact("test-regular.journal", false);
+        compact = write_compact("test-compact.journal", true);
+
+        log_info("Arena size: regular %"PRIu64", compact %"PRIu64, regular, compact);
+        assert_se(compact < regular);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf_dangerous(t, false, true, false) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
+static void test_overflow_tables(void) {
+        JournalFile *f;
+        dual_timestamp ts;
+        struct iovec iovec[2];
+        Object *o;
+        uint64_t n, n_data;
+        unsigned i;
+        char m[32], field[32];
+        char t[] = "/tmp/journal-XXXXXX";
+
+        log_set_max_level(LOG_DEBUG);
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        assert_se(journal_file_open("test.journal", O_RDWR|O_CREAT, 0666, true, false, NULL, NULL, NULL, &f) == 0);
+
+        /* Enough unique values and field names to take both hash
+         * tables beyond 75% fill level, and to grow the data
+         * overflow table twice */
+        for (i = 0; i < 10000; i++) {
+                unsigned k = 0;
+
+                snprintf(m, sizeof(m), "MESSAGE=%u", i);
+                IOVEC_SET_STRING(iovec[k++], m);
+
+                if (i < 400) {
+                        snprintf(field, sizeof(field), "FIELD_%u=1", i);
+                        IOVEC_SET_STRING(iovec[k++], field);
+                }
+
+                dual_timestamp_get(&ts);
+                assert_se(journal_file_append_entry(f, &ts, iovec, k, NULL, NULL, NULL) == 0);
+        }
+
+        assert_se(JOURNAL_HEADER_OVERFLOW_TABLES(f->header));
+        assert_se(journal_file_move_to_overflow_table(f, OBJECT_DATA, &o, &n) > 0);
+        assert_se(n == 16384);
+        assert_se(journal_file_move_to_overflow_table(f, OBJECT_FIELD, &o, &n) > 0);
+
+        for (i = 0; i < 10000; i++) {
+                snprintf(m, sizeof(m), "MESSAGE=%u", i);
+                assert_se(journal_file_find_data_object(f, m, strlen(m), NULL, NULL) == 1);
+        }
+
+        for (i = 0; i < 400; i++) {
+                snprintf(m, sizeof(m), "FIELD_%u", i);
+                assert_se(journal_file_find_field_object(f, m, strlen(m), NULL, NULL) == 1);
+        }
+
+        assert_se(journal_file_find_data_object(f, "MESSAGE=x", 9, NULL, NULL) == 0);
+        assert_se(journal_file_find_field_object(f, "FIELD_x", 7, NULL, NULL) == 0);
+
+        assert_se(journal_file_verify(f, NULL, NULL, NULL, NULL, false) >= 0);
+
+        journal_file_close(f);
+
+        /* The tables are picked up again when appending */
+        assert_se(journal_file_open("test.journal", O_RDWR, 0, true, false, NULL, NULL, NULL, &f) == 0);
+
+        n_data = le64toh(f->header->n_data);
+        snprintf(m, sizeof(m), "MESSAGE=%u", 42);
+        IOVEC_SET_STRING(iovec[0], m);
+        dual_timestamp_get(&ts);
+        assert_se(journal_file_append_entry(f, &ts, iovec, 1, NULL, NULL, NULL) == 0);
+        assert_se(le64toh(f->header->n_data) == n_data);
+
+        journal_file_close(f);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf_dangerous(t, false, true, false) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
 static void test_empty(void) {
         JournalFile *f1, *f2, *f3, *f4;
         char t[] = "/tmp/journal-XXXXXX";
@@ -165,7 +508,7 @@ static void test_empty(void) {
         if (arg_keep)
                 log_info("Not removing %s", t);
         else {
-                journal_directory_vacuum(".", 3000000, 0, 0, NULL);
+                journal_directory_vacuum(".", 3000000, 0, 0, NULL, NULL);
 
                 assert_se(rm_rf_dangerous(t, false, true, false) >= 0);
         }
@@ -175,6 +518,11 @@ int main(int argc, char *argv[]) {
         arg_keep = argc > 1;
 
         test_non_empty();
+        test_append_entries();
+        test_append_imported();
+        test_compressed();
+        test_compact();
+        test_overflow_tables();
         test_empty();
 
         return 0;
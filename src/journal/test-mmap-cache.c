@@ -20,14 +20,94 @@
 ***/
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
 #include "log.h"
 #include "macro.h"
 #include "util.h"
+#include "time-util.h"
 #include "mmap-cache.h"
 
+#define OBJECT_SIZE 64
+
+static void print_statistics(const char *what, MMapCache *m, usec_t t) {
+        MMapCacheStatistics st;
+        char bytes[FORMAT_BYTES_MAX], span[FORMAT_TIMESPAN_MAX];
+
+        mmap_cache_get_statistics(m, &st);
+
+        printf("%-10s %10s, %"PRIu64" context hits, %"PRIu64" window hits, %"PRIu64" misses, "
+               "%"PRIu64" mmaps, %"PRIu64" evictions, %u windows, %s mapped\n",
+               what, format_timespan(span, sizeof(span), t, 0),
+               st.context_hits, st.window_hits, st.misses, st.mmaps, st.evictions,
+               st.n_windows, format_bytes(bytes, sizeof(bytes), st.mapped_size));
+}
+
+/* Reads a file of the given size the way journalctl does: first front
+ * to back, then by bisecting for random offsets. */
+static void benchmark(uint64_t size) {
+        char path[] = "/tmp/testmmapBXXXXXX";
+        MMapCacheStatistics st;
+        struct stat stat;
+        MMapCache *m;
+        uint64_t offset, sum = 0;
+        unsigned i;
+        usec_t t;
+        void *p;
+        int fd;
+
+        fd = mkstemp(path);
+        assert_se(fd >= 0);
+        unlink(path);
+
+        assert_se(ftruncate(fd, size) >= 0);
+        assert_se(fstat(fd, &stat) >= 0);
+
+        assert_se(m = mmap_cache_new());
+
+        t = now(CLOCK_MONOTONIC);
+        for (offset = 0; offset + OBJECT_SIZE <= size; offset += OBJECT_SIZE) {
+                assert_se(mmap_cache_get(m, fd, PROT_READ, 0, false, offset, OBJECT_SIZE, &stat, &p) > 0);
+                sum += *(uint8_t*) p;
+        }
+        print_statistics("sequential", m, now(CLOCK_MONOTONIC) - t);
+
+        /* Growing the windows while scanning must get us away with
+         * fewer maps than the fixed default window size did */
+        mmap_cache_get_statistics(m, &st);
+        assert_se(st.mmaps <= 1 + size / (8ULL*1024ULL*1024ULL));
+
+        mmap_cache_unref(m);
+        assert_se(m = mmap_cache_new());
+
+        t = now(CLOCK_MONOTONIC);
+        for (i = 0; i < 10000; i++) {
+                uint64_t left = 0, right = size / OBJECT_SIZE, target;
+
+                target = (uint64_t) random() % right;
+
+                while (left < right) {
+                        uint64_t middle = left + (right - left) / 2;
+
+                        assert_se(mmap_cache_get(m, fd, PROT_READ, 1, false, middle * OBJECT_SIZE, OBJECT_SIZE, &stat, &p) > 0);
+                        sum += *(uint8_t*) p;
+
+                        if (middle < target)
+                                left = middle + 1;
+                        else
+                                right = middle;
+                }
+        }
+        print_statistics("bisection", m, now(CLOCK_MONOTONIC) - t);
+
+        mmap_cache_unref(m);
+        close_nointr_nofail(fd);
+
+        assert_se(sum == 0);
+}
+
 int main(int argc, char *argv[]) {
         int x, y, z, r;
         char px[] = "/tmp/testmmapXXXXXXX", py[] = "/tmp/testmmapYXXXXXX", pz[] = "/tmp/testmmapZXXXXXX";
@@ -75,5 +155,13 @@ int main(int argc, char *argv[]) {
         close_nointr_nofail(y);
         close_nointr_nofail(z);
 
+        if (argc > 1) {
+                off_t size;
+
+                assert_se(parse_bytes(argv[1], &size) >= 0);
+                benchmark(size);
+        } else
+                benchmark(64ULL*1024ULL*1024ULL);
+
         return 0;
 }
@@ -30,11 +30,18 @@
 #include "pyutil.h"
 #include "macro.h"
 #include "util.h"
+#include "hashmap.h"
 #include "build.h"
 
+/* Longest field name that is looked up without a heap copy, and the
+ * upper bound on the number of field names kept in the key cache. */
+#define FIELD_NAME_MAX 64
+#define FIELD_KEYS_MAX 4096
+
 typedef struct {
     PyObject_HEAD
     sd_journal *j;
+    Hashmap *keys;
 } Reader;
 static PyTypeObject ReaderType;
 
@@ -66,6 +73,16 @@ static PyStructSequence_Desc Monotonic_desc = {
 
 static void Reader_dealloc(Reader* self)
 {
+    PyObject *key;
+    char *name;
+    Iterator i;
+
+    HASHMAP_FOREACH_KEY(key, name, self->keys, i) {
+        Py_DECREF(key);
+        free(name);
+    }
+    hashmap_free(self->keys);
+
     sd_journal_close(self->j);
     Py_TYPE(self)->tp_free((PyObject*)self);
 }
@@ -385,6 +402,32 @@ static PyObject* Reader_get(Reader *self, PyObject *args)
 }
 
 
+/* Add value to dict under key. Fields which appear more than once in
+ * an entry are collected in a list. */
+static int dict_add_value(PyObject *dict, PyObject *key, PyObject *value)
+{
+    PyObject *cur_value;
+    _cleanup_Py_DECREF_ PyObject *tmp_list = NULL;
+
+    cur_value = PyDict_GetItem(dict, key);
+    if (!cur_value)
+        return PyDict_SetItem(dict, key, value);
+
+    if (PyList_CheckExact(cur_value))
+        return PyList_Append(cur_value, value);
+
+    tmp_list = PyList_New(2);
+    if (!tmp_list)
+        return -1;
+
+    Py_INCREF(cur_value);
+    PyList_SET_ITEM(tmp_list, 0, cur_value);
+    Py_INCREF(value);
+    PyList_SET_ITEM(tmp_list, 1, value);
+
+    return PyDict_SetItem(dict, key, tmp_list);
+}
+
 PyDoc_STRVAR(Reader_get_all__doc__,
              "_get_all() -> dict\n\n"
              "Return dictionary of the current log entry.");
@@ -406,35 +449,9 @@ static PyObject* Reader_get_all(Reader *self, PyObject *args)
         if (r < 0)
             goto error;
 
-        if (PyDict_Contains(dict, key)) {
-            PyObject *cur_value = PyDict_GetItem(dict, key);
-
-            if (PyList_CheckExact(cur_value)) {
-                r = PyList_Append(cur_value, value);
-                if (r < 0)
-                    goto error;
-            } else {
-                _cleanup_Py_DECREF_ PyObject *tmp_list = PyList_New(0);
-                if (!tmp_list)
-                    goto error;
-
-                r = PyList_Append(tmp_list, cur_value);
-                if (r < 0)
-                    goto error;
-
-                r = PyList_Append(tmp_list, value);
-                if (r < 0)
-                    goto error;
-
-                r = PyDict_SetItem(dict, key, tmp_list);
-                if (r < 0)
-                    goto error;
-            }
-        } else {
-            r = PyDict_SetItem(dict, key, value);
-            if (r < 0)
-                goto error;
-        }
+        r = dict_add_value(dict, key, value);
+        if (r < 0)
+            goto error;
     }
 
     return dict;
@@ -468,25 +485,9 @@ static PyObject* Reader_get_realtime(Reader *self, PyObject *args)
 }
 
 
-PyDoc_STRVAR(Reader_get_monotonic__doc__,
-             "get_monotonic() -> (timestamp, bootid)\n\n"
-             "Return the monotonic timestamp for the current journal entry\n"
-             "as a tuple of time in microseconds and bootid.\n\n"
-             "Wraps sd_journal_get_monotonic_usec().\n"
-             "See man:sd_journal_get_monotonic_usec(3).");
-static PyObject* Reader_get_monotonic(Reader *self, PyObject *args)
+static PyObject* monotonic_tuple(uint64_t timestamp, sd_id128_t id)
 {
-    uint64_t timestamp;
-    sd_id128_t id;
     PyObject *monotonic, *bootid, *tuple;
-    int r;
-
-    assert(self);
-    assert(!args);
-
-    r = sd_journal_get_monotonic_usec(self->j, &timestamp, &id);
-    if (set_error(r, NULL, NULL))
-        return NULL;
 
     assert_cc(sizeof(unsigned long long) == sizeof(timestamp));
     monotonic = PyLong_FromUnsignedLongLong(timestamp);
@@ -514,6 +515,300 @@ static PyObject* Reader_get_monotonic(Reader *self, PyObject *args)
     return tuple;
 }
 
+PyDoc_STRVAR(Reader_get_monotonic__doc__,
+             "get_monotonic() -> (timestamp, bootid)\n\n"
+             "Return the monotonic timestamp for the current journal entry\n"
+             "as a tuple of time in microseconds and bootid.\n\n"
+             "Wraps sd_journal_get_monotonic_usec().\n"
+             "See man:sd_journal_get_monotonic_usec(3).");
+static PyObject* Reader_get_monotonic(Reader *self, PyObject *args)
+{
+    uint64_t timestamp;
+    sd_id128_t id;
+    int r;
+
+    assert(self);
+    assert(!args);
+
+    r = sd_journal_get_monotonic_usec(self->j, &timestamp, &id);
+    if (set_error(r, NULL, NULL))
+        return NULL;
+
+    return monotonic_tuple(timestamp, id);
+}
+
+/* Selection of the fields put into the dictionaries returned by
+ * _get_entries(). When fields is NULL, all fields of the entry are
+ * returned. The address fields are added under the given keys, if set. */
+typedef struct EntryFilter {
+    Hashmap *fields;
+    PyObject *realtime;
+    PyObject *monotonic;
+    PyObject *cursor;
+} EntryFilter;
+
+static void* hashmap_get_field(Hashmap *h, const char *name, size_t len)
+{
+    char buf[FIELD_NAME_MAX + 1];
+    _cleanup_free_ char *p = NULL;
+
+    if (len < sizeof(buf)) {
+        memcpy(buf, name, len);
+        buf[len] = 0;
+        return hashmap_get(h, buf);
+    }
+
+    p = strndup(name, len);
+    if (!p)
+        return NULL;
+    return hashmap_get(h, p);
+}
+
+/* Return a new reference to the key object for the given field name.
+ * Key objects are cached in the Reader, so that each field name is
+ * converted to a Python string only once. */
+static PyObject* get_field_key(Reader *self, const char *name, size_t len)
+{
+    PyObject *key;
+    char *n;
+    int r;
+
+    key = hashmap_get_field(self->keys, name, len);
+    if (key) {
+        Py_INCREF(key);
+        return key;
+    }
+
+    key = unicode_FromStringAndSize(name, len);
+    if (!key)
+        return NULL;
+
+    if (len > FIELD_NAME_MAX || hashmap_size(self->keys) >= FIELD_KEYS_MAX)
+        return key;
+
+    if (!self->keys) {
+        self->keys = hashmap_new(string_hash_func, string_compare_func);
+        if (!self->keys)
+            return key;
+    }
+
+    n = strndup(name, len);
+    if (!n)
+        return key;
+
+    r = hashmap_put(self->keys, n, key);
+    if (r < 0) {
+        free(n);
+        return key;
+    }
+
+    Py_INCREF(key);
+    return key;
+}
+
+static PyObject* get_entry(Reader *self, const EntryFilter *filter)
+{
+    _cleanup_Py_DECREF_ PyObject *dict = NULL;
+    const void *msg;
+    size_t msg_len;
+    int r;
+
+    dict = PyDict_New();
+    if (!dict)
+        return NULL;
+
+    sd_journal_restart_data(self->j);
+    while ((r = sd_journal_enumerate_data(self->j, &msg, &msg_len)) > 0) {
+        _cleanup_Py_DECREF_ PyObject *key = NULL, *value = NULL;
+        const char *delim_ptr;
+        size_t len;
+
+        delim_ptr = memchr(msg, '=', msg_len);
+        if (!delim_ptr) {
+            PyErr_SetString(PyExc_OSError,
+                            "journal gave us a field without '='");
+            return NULL;
+        }
+        len = delim_ptr - (const char*) msg;
+
+        if (filter->fields) {
+            key = hashmap_get_field(filter->fields, msg, len);
+            if (!key)
+                continue;
+            Py_INCREF(key);
+        } else {
+            key = get_field_key(self, msg, len);
+            if (!key)
+                return NULL;
+        }
+
+        value = PyBytes_FromStringAndSize(delim_ptr + 1,
+                             (const char*) msg + msg_len - (delim_ptr + 1));
+        if (!value)
+            return NULL;
+
+        r = dict_add_value(dict, key, value);
+        if (r < 0)
+            return NULL;
+    }
+    if (set_error(r, NULL, NULL))
+        return NULL;
+
+    if (filter->realtime) {
+        _cleanup_Py_DECREF_ PyObject *value = NULL;
+        uint64_t timestamp;
+
+        r = sd_journal_get_realtime_usec(self->j, &timestamp);
+        if (set_error(r, NULL, NULL))
+            return NULL;
+
+        value = PyLong_FromUnsignedLongLong(timestamp);
+        if (!value || PyDict_SetItem(dict, filter->realtime, value) < 0)
+            return NULL;
+    }
+
+    if (filter->monotonic) {
+        _cleanup_Py_DECREF_ PyObject *value = NULL;
+        uint64_t timestamp;
+        sd_id128_t id;
+
+        r = sd_journal_get_monotonic_usec(self->j, &timestamp, &id);
+        if (set_error(r, NULL, NULL))
+            return NULL;
+
+        value = monotonic_tuple(timestamp, id);
+        if (!value || PyDict_SetItem(dict, filter->monotonic, value) < 0)
+            return NULL;
+    }
+
+    if (filter->cursor) {
+        _cleanup_Py_DECREF_ PyObject *value = NULL;
+        _cleanup_free_ char *cursor = NULL;
+
+        r = sd_journal_get_cursor(self->j, &cursor);
+        if (set_error(r, NULL, NULL))
+            return NULL;
+
+        value = unicode_FromString(cursor);
+        if (!value || PyDict_SetItem(dict, filter->cursor, value) < 0)
+            return NULL;
+    }
+
+    Py_INCREF(dict);
+    return dict;
+}
+
+PyDoc_STRVAR(Reader_get_entries__doc__,
+             "_get_entries(count[, fields]) -> list\n\n"
+             "Advance by up to `count` entries and return them as a list of\n"
+             "dictionaries. The list is shorter than `count` if the end of\n"
+             "the journal is reached. Values are bytes and are not passed\n"
+             "through any converters; fields appearing more than once in an\n"
+             "entry are returned as lists.\n\n"
+             "If `fields` is given, it is a sequence of field names, and only\n"
+             "those fields are returned. Otherwise all fields of the entry are\n"
+             "returned, together with __REALTIME_TIMESTAMP and\n"
+             "__MONOTONIC_TIMESTAMP. __CURSOR is only computed when listed\n"
+             "in `fields`; after the call, _get_cursor() returns the cursor\n"
+             "of the last entry.");
+static PyObject* Reader_get_entries(Reader *self, PyObject *args, PyObject *keywds)
+{
+    long count, i;
+    PyObject *fields = Py_None;
+    _cleanup_Py_DECREF_ PyObject *seq = NULL, *list = NULL,
+        *realtime = NULL, *monotonic = NULL;
+    EntryFilter filter = {};
+    int r;
+
+    static const char* const kwlist[] = {"count", "fields", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "l|O:_get_entries", (char**) kwlist,
+                                     &count, &fields))
+        return NULL;
+
+    if (count <= 0) {
+        PyErr_SetString(PyExc_ValueError, "count must be positive");
+        return NULL;
+    }
+
+    if (fields == Py_None) {
+        realtime = unicode_FromString("__REALTIME_TIMESTAMP");
+        monotonic = unicode_FromString("__MONOTONIC_TIMESTAMP");
+        if (!realtime || !monotonic)
+            return NULL;
+
+        filter.realtime = realtime;
+        filter.monotonic = monotonic;
+    } else {
+        PyObject **items;
+        Py_ssize_t n;
+
+        seq = PySequence_Fast(fields, "fields must be a sequence of strings");
+        if (!seq)
+            return NULL;
+        items = PySequence_Fast_ITEMS(seq);
+
+        filter.fields = hashmap_new(string_hash_func, string_compare_func);
+        if (!filter.fields)
+            return PyErr_NoMemory();
+
+        /* The names are borrowed from the items of seq, which is kept
+         * alive until the end of the call. */
+        for (n = 0; n < PySequence_Fast_GET_SIZE(seq); n++) {
+            PyObject *item = items[n];
+            char *name;
+
+            if (!PyArg_Parse(item, "s;fields must be a sequence of strings", &name))
+                goto error;
+
+            if (streq(name, "__REALTIME_TIMESTAMP"))
+                filter.realtime = item;
+            else if (streq(name, "__MONOTONIC_TIMESTAMP"))
+                filter.monotonic = item;
+            else if (streq(name, "__CURSOR"))
+                filter.cursor = item;
+            else {
+                r = hashmap_put(filter.fields, name, item);
+                if (r < 0 && r != -EEXIST) {
+                    set_error(r, NULL, NULL);
+                    goto error;
+                }
+            }
+        }
+    }
+
+    list = PyList_New(0);
+    if (!list)
+        goto error;
+
+    for (i = 0; i < count; i++) {
+        _cleanup_Py_DECREF_ PyObject *entry = NULL;
+
+        Py_BEGIN_ALLOW_THREADS
+        r = sd_journal_next(self->j);
+        Py_END_ALLOW_THREADS
+        if (set_error(r, NULL, NULL) < 0)
+            goto error;
+        if (r == 0)
+            break;
+
+        entry = get_entry(self, &filter);
+        if (!entry)
+            goto error;
+
+        r = PyList_Append(list, entry);
+        if (r < 0)
+            goto error;
+    }
+
+    hashmap_free(filter.fields);
+    Py_INCREF(list);
+    return list;
+
+error:
+    hashmap_free(filter.fields);
+    return NULL;
+}
+
 PyDoc_STRVAR(Reader_add_match__doc__,
              "add_match(match) -> None\n\n"
              "Add a match to filter journal log entries. All matches of different\n"
@@ -969,6 +1264,7 @@ static PyMethodDef Reader_methods[] = {
     {"_get_all",        (PyCFunction) Reader_get_all, METH_NOARGS, Reader_get_all__doc__},
     {"_get_realtime",   (PyCFunction) Reader_get_realtime, METH_NOARGS, Reader_get_realtime__doc__},
     {"_get_monotonic",  (PyCFunction) Reader_get_monotonic, METH_NOARGS, Reader_get_monotonic__doc__},
+    {"_get_entries",    (PyCFunction) Reader_get_entries, METH_VARARGS|METH_KEYWORDS, Reader_get_entries__doc__},
     {"add_match",       (PyCFunction) Reader_add_match, METH_VARARGS|METH_KEYWORDS, Reader_add_match__doc__},
     {"add_disjunction", (PyCFunction) Reader_add_disjunction, METH_NOARGS, Reader_add_disjunction__doc__},
     {"add_conjunction", (PyCFunction) Reader_add_conjunction, METH_NOARGS, Reader_add_conjunction__doc__},
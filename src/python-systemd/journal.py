@@ -248,6 +248,23 @@ class Reader(_Reader):
         """
         return self.get_next(-skip)
 
+    def get_entries(self, count, fields=None):
+        """Return a list of up to `count` following log entries.
+
+        The list is shorter than `count` if the end of the journal
+        is reached.
+
+        Optional `fields` is a sequence of field names to return,
+        including __REALTIME_TIMESTAMP, __MONOTONIC_TIMESTAMP and
+        __CURSOR. By default all fields and both timestamps are
+        returned, but not the cursor, which can be retrieved for the
+        last entry with _get_cursor().
+
+        Unlike get_next(), values are returned as bytes and are not
+        processed with converters.
+        """
+        return super(Reader, self)._get_entries(count, fields)
+
     def query_unique(self, field):
         """Return unique values appearing in the journal for given `field`.
 
@@ -28,12 +28,22 @@
 #include "hashmap.h"
 #include "macro.h"
 
-#define NBUCKETS 127
+/* The hash table is an open-addressing table of pointers to the
+ * entries, using Robin Hood insertion and backward shift deletion.
+ * The entries themselves are allocated individually and linked into
+ * the iteration list, so that iterators stay valid and iteration
+ * order follows insertion order regardless of table resizes. */
+
+#define INITIAL_N_BUCKETS 8U
+
+/* Grow when more than 3/4 of the buckets are in use */
+#define LOAD_FACTOR_NUM 3U
+#define LOAD_FACTOR_DEN 4U
 
 struct hashmap_entry {
         const void *key;
         void *value;
-        struct hashmap_entry *bucket_next, *bucket_previous;
+        unsigned hash;
         struct hashmap_entry *iterate_next, *iterate_previous;
 };
 
@@ -44,10 +54,16 @@ struct Hashmap {
         struct hashmap_entry *iterate_list_head, *iterate_list_tail;
         unsigned n_entries;
 
+        struct hashmap_entry **buckets;
+        unsigned n_buckets;
+        unsigned shift;
+
         bool from_pool;
-};
 
-#define BY_HASH(h) ((struct hashmap_entry**) ((uint8_t*) (h) + ALIGN(sizeof(Hashmap))))
+        /* Small hashmaps never need an extra allocation for the
+         * table */
+        struct hashmap_entry *initial_buckets[INITIAL_N_BUCKETS];
+};
 
 struct pool {
         struct pool *next;
@@ -166,14 +182,38 @@ int uint64_compare_func(const void *_a, const void *_b) {
         return a < b ? -1 : (a > b ? 1 : 0);
 }
 
-Hashmap *hashmap_new(hash_func_t hash_func, compare_func_t compare_func) {
-        bool b;
+static unsigned bucket_of(Hashmap *h, unsigned hash) {
+
+        /* Fibonacci hashing: spread the bits of the hash, so that
+         * pointers and other values whose lower bits are mostly
+         * zero are distributed evenly, too. */
+
+        return (unsigned) (((uint32_t) hash * UINT32_C(2654435769)) >> h->shift);
+}
+
+static unsigned distance_of(Hashmap *h, struct hashmap_entry *e, unsigned idx) {
+        return (idx - bucket_of(h, e->hash)) & (h->n_buckets - 1);
+}
+
+static void reset_buckets(Hashmap *h) {
+        assert(h);
+
+        if (h->buckets != h->initial_buckets)
+                free(h->buckets);
+
+        memset(h->initial_buckets, 0, sizeof(h->initial_buckets));
+        h->buckets = h->initial_buckets;
+        h->n_buckets = INITIAL_N_BUCKETS;
+        h->shift = 32 - u64log2(INITIAL_N_BUCKETS);
+}
+
+static Hashmap *hashmap_new_internal(hash_func_t hash_func, compare_func_t compare_func, bool b) {
         Hashmap *h;
         size_t size;
 
-        b = is_main_thread();
+        assert_cc(sizeof(unsigned) == sizeof(uint32_t));
 
-        size = ALIGN(sizeof(Hashmap)) + NBUCKETS * sizeof(struct hashmap_entry*);
+        size = sizeof(Hashmap);
 
         if (b) {
                 h = allocate_tile(&first_hashmap_pool, &first_hashmap_tile, size);
@@ -194,11 +234,28 @@ Hashmap *hashmap_new(hash_func_t hash_func, compare_func_t compare_func) {
         h->n_entries = 0;
         h->iterate_list_head = h->iterate_list_tail = NULL;
 
+        h->buckets = NULL;
+        reset_buckets(h);
+
         h->from_pool = b;
 
         return h;
 }
 
+Hashmap *hashmap_new(hash_func_t hash_func, compare_func_t compare_func) {
+        return hashmap_new_internal(hash_func, compare_func, is_main_thread());
+}
+
+Hashmap *hashmap_new_unpooled(hash_func_t hash_func, compare_func_t compare_func) {
+
+        /* The memory pools are not thread-safe, hence hashmaps
+         * allocated from them may only be used from the main
+         * thread. This one may be used from any thread, as long as
+         * the accesses are serialized. */
+
+        return hashmap_new_internal(hash_func, compare_func, false);
+}
+
 int hashmap_ensure_allocated(Hashmap **h, hash_func_t hash_func, compare_func_t compare_func) {
         assert(h);
 
@@ -211,16 +268,127 @@ int hashmap_ensure_allocated(Hashmap **h, hash_func_t hash_func, compare_func_t
         return 0;
 }
 
-static void link_entry(Hashmap *h, struct hashmap_entry *e, unsigned hash) {
+static void bucket_insert(Hashmap *h, struct hashmap_entry *e) {
+        unsigned idx, dist = 0;
+
+        assert(h);
+        assert(e);
+        assert(h->n_entries < h->n_buckets);
+
+        /* Robin Hood: whoever is further away from its home bucket
+         * gets to stay, the other one moves on. */
+
+        idx = bucket_of(h, e->hash);
+
+        for (;;) {
+                struct hashmap_entry *t;
+                unsigned d;
+
+                t = h->buckets[idx];
+                if (!t) {
+                        h->buckets[idx] = e;
+                        return;
+                }
+
+                d = distance_of(h, t, idx);
+                if (d < dist) {
+                        h->buckets[idx] = e;
+                        e = t;
+                        dist = d;
+                }
+
+                idx = (idx + 1) & (h->n_buckets - 1);
+                dist++;
+        }
+}
+
+static void bucket_remove(Hashmap *h, struct hashmap_entry *e) {
+        unsigned idx;
+
+        assert(h);
+        assert(e);
+
+        idx = bucket_of(h, e->hash);
+        while (h->buckets[idx] != e) {
+                assert(h->buckets[idx]);
+                idx = (idx + 1) & (h->n_buckets - 1);
+        }
+
+        /* Shift the following entries back by one, until we find
+         * one that is already in its home bucket, or a hole. */
+        for (;;) {
+                unsigned next;
+                struct hashmap_entry *t;
+
+                next = (idx + 1) & (h->n_buckets - 1);
+                t = h->buckets[next];
+
+                if (!t || distance_of(h, t, next) == 0) {
+                        h->buckets[idx] = NULL;
+                        return;
+                }
+
+                h->buckets[idx] = t;
+                idx = next;
+        }
+}
+
+static int resize_buckets(Hashmap *h, unsigned n_buckets) {
+        struct hashmap_entry **b, *e;
+
+        assert(h);
+        assert(n_buckets >= h->n_buckets);
+        assert((n_buckets & (n_buckets - 1)) == 0);
+
+        b = new0(struct hashmap_entry*, n_buckets);
+        if (!b)
+                return -ENOMEM;
+
+        if (h->buckets != h->initial_buckets)
+                free(h->buckets);
+
+        h->buckets = b;
+        h->n_buckets = n_buckets;
+        h->shift = 32 - u64log2(n_buckets);
+
+        for (e = h->iterate_list_head; e; e = e->iterate_next)
+                bucket_insert(h, e);
+
+        return 0;
+}
+
+static int reserve_entries(Hashmap *h, unsigned n) {
+        unsigned n_buckets;
+
+        assert(h);
+
+        /* Makes sure there is room for n more entries. If we cannot
+         * grow we still continue with a fuller table, and only fail
+         * if it is entirely full. */
+
+        n_buckets = h->n_buckets;
+        while ((uint64_t) (h->n_entries + n) * LOAD_FACTOR_DEN > (uint64_t) n_buckets * LOAD_FACTOR_NUM) {
+                if (n_buckets >= (1U << 31))
+                        break;
+
+                n_buckets *= 2;
+        }
+
+        if (n_buckets == h->n_buckets)
+                return 0;
+
+        if (resize_buckets(h, n_buckets) < 0 && h->n_entries + n > h->n_buckets)
+                return -ENOMEM;
+
+        return 0;
+}
+
+static void link_entry(Hashmap *h, struct hashmap_entry *e) {
         assert(h);
         assert(e);
 
         /* Insert into hash table */
-        e->bucket_next = BY_HASH(h)[hash];
-        e->bucket_previous = NULL;
-        if (BY_HASH(h)[hash])
-                BY_HASH(h)[hash]->bucket_previous = e;
-        BY_HASH(h)[hash] = e;
+        bucket_insert(h, e);
 
         /* Insert into iteration list */
         e->iterate_previous = h->iterate_list_tail;
@@ -238,7 +406,7 @@ static void link_entry(Hashmap *h, struct hashmap_entry *e, unsigned hash) {
         assert(h->n_entries >= 1);
 }
 
-static void unlink_entry(Hashmap *h, struct hashmap_entry *e, unsigned hash) {
+static void unlink_entry(Hashmap *h, struct hashmap_entry *e) {
         assert(h);
         assert(e);
 
@@ -253,28 +421,18 @@ static void unlink_entry(Hashmap *h, struct hashmap_entry *e, unsigned hash) {
         else
                 h->iterate_list_head = e->iterate_next;
 
-        /* Remove from hash table bucket list */
-        if (e->bucket_next)
-                e->bucket_next->bucket_previous = e->bucket_previous;
-
-        if (e->bucket_previous)
-                e->bucket_previous->bucket_next = e->bucket_next;
-        else
-                BY_HASH(h)[hash] = e->bucket_next;
+        /* Remove from hash table */
+        bucket_remove(h, e);
 
         assert(h->n_entries >= 1);
         h->n_entries--;
 }
 
 static void remove_entry(Hashmap *h, struct hashmap_entry *e) {
-        unsigned hash;
-
         assert(h);
         assert(e);
 
-        hash = h->hash_func(e->key) % NBUCKETS;
-
-        unlink_entry(h, e, hash);
+        unlink_entry(h, e);
 
         if (h->from_pool)
                 deallocate_tile(&first_entry_tile, e);
@@ -291,6 +449,9 @@ void hashmap_free(Hashmap*h) {
 
         hashmap_clear(h);
 
+        if (h->buckets != h->initial_buckets)
+                free(h->buckets);
+
         if (h->from_pool)
                 deallocate_tile(&first_hashmap_tile, h);
         else
@@ -326,6 +487,8 @@ void hashmap_clear(Hashmap *h) {
 
         while (h->iterate_list_head)
                 remove_entry(h, h->iterate_list_head);
+
+        reset_buckets(h);
 }
 
 void hashmap_clear_free(Hashmap *h) {
@@ -336,6 +499,8 @@ void hashmap_clear_free(Hashmap *h) {
 
         while ((p = hashmap_steal_first(h)))
                 free(p);
+
+        reset_buckets(h);
 }
 
 void hashmap_clear_free_free(Hashmap *h) {
@@ -351,19 +516,35 @@ void hashmap_clear_free_free(Hashmap *h) {
                 free(a);
                 free(b);
         }
+
+        reset_buckets(h);
 }
 
 
 static struct hashmap_entry *hash_scan(Hashmap *h, unsigned hash, const void *key) {
-        struct hashmap_entry *e;
+        unsigned idx, dist = 0;
+
         assert(h);
-        assert(hash < NBUCKETS);
 
-        for (e = BY_HASH(h)[hash]; e; e = e->bucket_next)
-                if (h->compare_func(e->key, key) == 0)
+        idx = bucket_of(h, hash);
+
+        for (;;) {
+                struct hashmap_entry *e;
+
+                e = h->buckets[idx];
+
+                /* If we hit a hole, or an entry that is closer to
+                 * its home bucket than we'd be, the key is not in
+                 * the table. */
+                if (!e || distance_of(h, e, idx) < dist)
+                        return NULL;
+
+                if (e->hash == hash && h->compare_func(e->key, key) == 0)
                         return e;
 
-        return NULL;
+                idx = (idx + 1) & (h->n_buckets - 1);
+                dist++;
+        }
 }
 
 int hashmap_put(Hashmap *h, const void *key, void *value) {
@@ -372,7 +553,7 @@ int hashmap_put(Hashmap *h, const void *key, void *value) {
 
         assert(h);
 
-        hash = h->hash_func(key) % NBUCKETS;
+        hash = h->hash_func(key);
 
         e = hash_scan(h, hash, key);
         if (e) {
@@ -383,6 +564,9 @@ int hashmap_put(Hashmap *h, const void *key, void *value) {
                 return -EEXIST;
         }
 
+        if (reserve_entries(h, 1) < 0)
+                return -ENOMEM;
+
         if (h->from_pool)
                 e = allocate_tile(&first_entry_pool, &first_entry_tile, sizeof(struct hashmap_entry));
         else
@@ -393,8 +577,9 @@ int hashmap_put(Hashmap *h, const void *key, void *value) {
 
         e->key = key;
         e->value = value;
+        e->hash = hash;
 
-        link_entry(h, e, hash);
+        link_entry(h, e);
 
         return 1;
 }
@@ -405,7 +590,7 @@ int hashmap_replace(Hashmap *h, const void *key, void *value) {
 
         assert(h);
 
-        hash = h->hash_func(key) % NBUCKETS;
+        hash = h->hash_func(key);
         e = hash_scan(h, hash, key);
         if (e) {
                 e->key = key;
@@ -422,7 +607,7 @@ int hashmap_update(Hashmap *h, const void *key, void *value) {
 
         assert(h);
 
-        hash = h->hash_func(key) % NBUCKETS;
+        hash = h->hash_func(key);
         e = hash_scan(h, hash, key);
         if (!e)
                 return -ENOENT;
@@ -438,7 +623,7 @@ void* hashmap_get(Hashmap *h, const void *key) {
         if (!h)
                 return NULL;
 
-        hash = h->hash_func(key) % NBUCKETS;
+        hash = h->hash_func(key);
         e = hash_scan(h, hash, key);
         if (!e)
                 return NULL;
@@ -453,7 +638,7 @@ void* hashmap_get2(Hashmap *h, const void *key, void **key2) {
         if (!h)
                 return NULL;
 
-        hash = h->hash_func(key) % NBUCKETS;
+        hash = h->hash_func(key);
         e = hash_scan(h, hash, key);
         if (!e)
                 return NULL;
@@ -470,7 +655,7 @@ bool hashmap_contains(Hashmap *h, const void *key) {
         if (!h)
                 return false;
 
-        hash = h->hash_func(key) % NBUCKETS;
+        hash = h->hash_func(key);
 
         if (!hash_scan(h, hash, key))
                 return false;
@@ -486,7 +671,7 @@ void* hashmap_remove(Hashmap *h, const void *key) {
         if (!h)
                 return NULL;
 
-        hash = h->hash_func(key) % NBUCKETS;
+        hash = h->hash_func(key);
 
         if (!(e = hash_scan(h, hash, key)))
                 return NULL;
@@ -504,20 +689,21 @@ int hashmap_remove_and_put(Hashmap *h, const void *old_key, const void *new_key,
         if (!h)
                 return -ENOENT;
 
-        old_hash = h->hash_func(old_key) % NBUCKETS;
+        old_hash = h->hash_func(old_key);
         if (!(e = hash_scan(h, old_hash, old_key)))
                 return -ENOENT;
 
-        new_hash = h->hash_func(new_key) % NBUCKETS;
+        new_hash = h->hash_func(new_key);
         if (hash_scan(h, new_hash, new_key))
                 return -EEXIST;
 
-        unlink_entry(h, e, old_hash);
+        unlink_entry(h, e);
 
         e->key = new_key;
         e->value = value;
+        e->hash = new_hash;
 
-        link_entry(h, e, new_hash);
+        link_entry(h, e);
 
         return 0;
 }
@@ -529,22 +715,23 @@ int hashmap_remove_and_replace(Hashmap *h, const void *old_key, const void *new_
         if (!h)
                 return -ENOENT;
 
-        old_hash = h->hash_func(old_key) % NBUCKETS;
+        old_hash = h->hash_func(old_key);
         if (!(e = hash_scan(h, old_hash, old_key)))
                 return -ENOENT;
 
-        new_hash = h->hash_func(new_key) % NBUCKETS;
+        new_hash = h->hash_func(new_key);
 
         if ((k = hash_scan(h, new_hash, new_key)))
                 if (e != k)
                         remove_entry(h, k);
 
-        unlink_entry(h, e, old_hash);
+        unlink_entry(h, e);
 
         e->key = new_key;
         e->value = value;
+        e->hash = new_hash;
 
-        link_entry(h, e, new_hash);
+        link_entry(h, e);
 
         return 0;
 }
@@ -556,7 +743,7 @@ void* hashmap_remove_value(Hashmap *h, const void *key, void *value) {
         if (!h)
                 return NULL;
 
-        hash = h->hash_func(key) % NBUCKETS;
+        hash = h->hash_func(key);
 
         if (!(e = hash_scan(h, hash, key)))
                 return NULL;
@@ -646,7 +833,7 @@ void *hashmap_iterate_skip(Hashmap *h, const void *key, Iterator *i) {
         if (!h)
                 return NULL;
 
-        hash = h->hash_func(key) % NBUCKETS;
+        hash = h->hash_func(key);
 
         if (!(e = hash_scan(h, hash, key)))
                 return NULL;
@@ -743,6 +930,11 @@ int hashmap_merge(Hashmap *h, Hashmap *other) {
         if (!other)
                 return 0;
 
+        /* Size the table in one go, rather than growing it step by
+         * step. The individual puts below will notice if this
+         * failed. */
+        reserve_entries(h, other->n_entries);
+
         for (e = other->iterate_list_head; e; e = e->iterate_next) {
                 int r;
 
@@ -766,19 +958,24 @@ void hashmap_move(Hashmap *h, Hashmap *other) {
                 return;
 
         for (e = other->iterate_list_head; e; e = n) {
-                unsigned h_hash, other_hash;
+                unsigned h_hash;
 
                 n = e->iterate_next;
 
-                h_hash = h->hash_func(e->key) % NBUCKETS;
+                h_hash = h->hash_func(e->key);
 
                 if (hash_scan(h, h_hash, e->key))
                         continue;
 
-                other_hash = other->hash_func(e->key) % NBUCKETS;
+                /* This can only fail if we are out of memory and
+                 * the table is entirely full. In that case leave
+                 * the remaining items in other. */
+                if (reserve_entries(h, 1) < 0)
+                        return;
 
-                unlink_entry(other, e, other_hash);
-                link_entry(h, e, h_hash);
+                unlink_entry(other, e);
+                e->hash = h_hash;
+                link_entry(h, e);
         }
 }
 
@@ -791,16 +988,20 @@ int hashmap_move_one(Hashmap *h, Hashmap *other, const void *key) {
 
         assert(h);
 
-        h_hash = h->hash_func(key) % NBUCKETS;
+        h_hash = h->hash_func(key);
         if (hash_scan(h, h_hash, key))
                 return -EEXIST;
 
-        other_hash = other->hash_func(key) % NBUCKETS;
+        other_hash = other->hash_func(key);
         if (!(e = hash_scan(other, other_hash, key)))
                 return -ENOENT;
 
-        unlink_entry(other, e, other_hash);
-        link_entry(h, e, h_hash);
+        if (reserve_entries(h, 1) < 0)
+                return -ENOMEM;
+
+        unlink_entry(other, e);
+        e->hash = h_hash;
+        link_entry(h, e);
 
         return 0;
 }
@@ -849,7 +1050,7 @@ void *hashmap_next(Hashmap *h, const void *key) {
         if (!h)
                 return NULL;
 
-        hash = h->hash_func(key) % NBUCKETS;
+        hash = h->hash_func(key);
         e = hash_scan(h, hash, key);
         if (!e)
                 return NULL;
@@ -24,18 +24,126 @@
 #include <errno.h>
 #include <sys/poll.h>
 #include <string.h>
+#include <stdarg.h>
 
 #include "logs-show.h"
 #include "log.h"
 #include "util.h"
 #include "utf8.h"
-#include "hashmap.h"
 #include "journal-internal.h"
 
 #define PRINT_THRESHOLD 128
 #define JSON_THRESHOLD 4096
 
-static int print_catalog(FILE *f, sd_journal *j) {
+/* Entries are formatted into this buffer first, and handed to stdio
+ * with a single write. It is kept around between calls, so that in the
+ * common case formatting an entry does not allocate anything. */
+typedef struct OutputBuffer {
+        char *data;
+        size_t size;
+        size_t allocated;
+        bool oom;
+} OutputBuffer;
+
+static __thread OutputBuffer output_buffer = {};
+
+static char *buffer_extend(OutputBuffer *b, size_t l) {
+        char *p;
+
+        assert(b);
+
+        if (b->oom)
+                return NULL;
+
+        if (!GREEDY_REALLOC(b->data, b->allocated, b->size + l)) {
+                b->oom = true;
+                return NULL;
+        }
+
+        p = b->data + b->size;
+        b->size += l;
+
+        return p;
+}
+
+static void buffer_put(OutputBuffer *b, const void *p, size_t l) {
+        char *d;
+
+        d = buffer_extend(b, l);
+        if (d)
+                memcpy(d, p, l);
+}
+
+static void buffer_putc(OutputBuffer *b, char c) {
+        buffer_put(b, &c, 1);
+}
+
+static void buffer_puts(OutputBuffer *b, const char *s) {
+        buffer_put(b, s, strlen(s));
+}
+
+static void buffer_put_unsigned(OutputBuffer *b, unsigned long long u) {
+        char buf[DECIMAL_STR_MAX(unsigned long long)], *p = buf + sizeof(buf);
+
+        do {
+                *(--p) = '0' + u % 10;
+                u /= 10;
+        } while (u > 0);
+
+        buffer_put(b, p, buf + sizeof(buf) - p);
+}
+
+_printf_attr_(2, 3) static void buffer_printf(OutputBuffer *b, const char *format, ...) {
+        va_list ap;
+        int n;
+
+        assert(b);
+
+        if (b->oom)
+                return;
+
+        va_start(ap, format);
+        n = vsnprintf(b->data + b->size, b->allocated - b->size, format, ap);
+        va_end(ap);
+
+        if (n < 0) {
+                b->oom = true;
+                return;
+        }
+
+        if ((size_t) n >= b->allocated - b->size) {
+                /* Make room for the trailing NUL too, which we drop again */
+                if (!buffer_extend(b, n + 1))
+                        return;
+                b->size -= n + 1;
+
+                va_start(ap, format);
+                vsnprintf(b->data + b->size, n + 1, format, ap);
+                va_end(ap);
+        }
+
+        b->size += n;
+}
+
+static int buffer_flush(OutputBuffer *b, FILE *f) {
+        assert(b);
+        assert(f);
+
+        if (b->oom) {
+                b->oom = false;
+                b->size = 0;
+                return log_oom();
+        }
+
+        if (b->size > 0)
+                fwrite(b->data, 1, b->size, f);
+
+        b->size = 0;
+
+        return 0;
+}
+
+static int print_catalog(OutputBuffer *b, sd_journal *j) {
         int r;
         _cleanup_free_ char *t = NULL, *z = NULL;
 
@@ -48,9 +156,9 @@ static int print_catalog(FILE *f, sd_journal *j) {
         if (!z)
                 return log_oom();
 
-        fputs("-- ", f);
-        fputs(z, f);
-        fputc('\n', f);
+        buffer_puts(b, "-- ");
+        buffer_puts(b, z);
+        buffer_putc(b, '\n');
 
         return 0;
 }
@@ -61,37 +169,6 @@ static int is_field(const void *data, size_t length, const char *field) {
         return length >= fl+1 && !memcmp(data, field, fl) && ((const char *)data)[fl] == '=';
 }
 
-static int parse_field(const void *data, size_t length, const char *field, char **target, size_t *target_size) {
-        size_t fl, nl;
-        void *buf;
-
-        assert(data);
-        assert(field);
-        assert(target);
-        assert(target_size);
-
-        fl = strlen(field);
-        if (length < fl)
-                return 0;
-
-        if (memcmp(data, field, fl))
-                return 0;
-
-        nl = length - fl;
-        buf = malloc(nl+1);
-        if (!buf)
-                return log_oom();
-
-        memcpy(buf, (const char*) data + fl, nl);
-        ((char*)buf)[nl] = 0;
-
-        free(*target);
-        *target = buf;
-        *target_size = nl;
-
-        return 1;
-}
-
 static bool shall_print(const char *p, size_t l, OutputFlags flags) {
         assert(p);
 
@@ -107,7 +184,7 @@ static bool shall_print(const char *p, size_t l, OutputFlags flags) {
         return true;
 }
 
-static void print_multiline(FILE *f, unsigned prefix, unsigned n_columns, OutputMode flags, int priority, const char* message, size_t message_len) {
+static void print_multiline(OutputBuffer *b, unsigned prefix, unsigned n_columns, OutputMode flags, int priority, const char* message, size_t message_len) {
         const char *color_on = "", *color_off = "";
         const char *pos, *end;
         bool continuation = false;
@@ -124,42 +201,50 @@ static void print_multiline(FILE *f, unsigned prefix, unsigned n_columns, Output
 
         for (pos = message; pos < message + message_len; pos = end + 1) {
                 int len;
-                for (end = pos; end < message + message_len && *end != '\n'; end++)
-                        ;
+
+                end = memchr(pos, '\n', message + message_len - pos);
+                if (!end)
+                        end = message + message_len;
                 len = end - pos;
                 assert(len >= 0);
 
-                if (flags & (OUTPUT_FULL_WIDTH | OUTPUT_SHOW_ALL) || prefix + len + 1 < n_columns)
-                        fprintf(f, "%*s%s%.*s%s\n",
-                                continuation * prefix, "",
-                                color_on, len, pos, color_off);
-                else if (prefix < n_columns && n_columns - prefix >= 3) {
+                if (flags & (OUTPUT_FULL_WIDTH | OUTPUT_SHOW_ALL) || prefix + len + 1 < n_columns) {
+                        if (continuation)
+                                buffer_printf(b, "%*s", (int) prefix, "");
+                        buffer_puts(b, color_on);
+                        buffer_put(b, pos, len);
+                        buffer_puts(b, color_off);
+                        buffer_putc(b, '\n');
+                } else if (prefix < n_columns && n_columns - prefix >= 3) {
                         _cleanup_free_ char *e;
 
                         e = ellipsize_mem(pos, len, n_columns - prefix, 90);
 
+                        buffer_puts(b, color_on);
                         if (!e)
-                                fprintf(f, "%s%.*s%s\n", color_on, len, pos, color_off);
+                                buffer_put(b, pos, len);
                         else
-                                fprintf(f, "%s%s%s\n", color_on, e, color_off);
+                                buffer_puts(b, e);
+                        buffer_puts(b, color_off);
+                        buffer_putc(b, '\n');
                 } else
-                        fputs("...\n", f);
+                        buffer_puts(b, "...\n");
 
                 continuation = true;
         }
 }
 
 static int output_short(
-                FILE *f,
+                OutputBuffer *b,
                 sd_journal *j,
                 OutputMode mode,
                 unsigned n_columns,
                 OutputFlags flags) {
 
         int r;
-        _cleanup_free_ char *realtime = NULL, *cursor = NULL;
+        _cleanup_free_ char *cursor = NULL;
 
-        assert(f);
+        assert(b);
         assert(j);
 
 	r = sd_journal_get_cursor(j, &cursor);
@@ -174,14 +259,7 @@ static int output_short(
                 time_t t;
                 struct tm tm;
 
-                r = -ENOENT;
-
-                if (realtime)
-                        r = safe_atou64(realtime, &x);
-
-                if (r < 0)
-                        r = sd_journal_get_realtime_usec(j, &x);
-
+                r = sd_journal_get_realtime_usec(j, &x);
                 if (r < 0) {
                         log_error("Failed to get realtime timestamp: %s", strerror(-r));
                         return r;
@@ -193,17 +271,20 @@ static int output_short(
                         return r;
                 }
 
-                fputs(buf, f);
+                buffer_puts(b, buf);
         }
 
-	fprintf(f, " %s\n", j->current_file->path);
-	fprintf(f, "[%s]\n", cursor);
+	buffer_putc(b, ' ');
+	buffer_puts(b, j->current_file->path);
+	buffer_puts(b, "\n[");
+	buffer_puts(b, cursor);
+	buffer_puts(b, "]\n");
 
         return 0;
 }
 
 static int output_verbose(
-                FILE *f,
+                OutputBuffer *b,
                 sd_journal *j,
                 OutputMode mode,
                 unsigned n_columns,
@@ -216,7 +297,7 @@ static int output_verbose(
         char ts[FORMAT_TIMESTAMP_MAX];
         int r;
 
-        assert(f);
+        assert(b);
         assert(j);
 
         sd_journal_set_data_threshold(j, 0);
@@ -234,9 +315,9 @@ static int output_verbose(
                 return r;
         }
 
-        fprintf(f, "%s [%s]\n",
-                format_timestamp(ts, sizeof(ts), realtime),
-                cursor);
+        buffer_printf(b, "%s [%s]\n",
+                      format_timestamp(ts, sizeof(ts), realtime),
+                      cursor);
 
         JOURNAL_FOREACH_DATA_RETVAL(j, data, length, r) {
                 const char *c;
@@ -255,20 +336,21 @@ static int output_verbose(
                         off = ANSI_HIGHLIGHT_OFF;
                 }
 
+                buffer_puts(b, "    ");
+                buffer_puts(b, on);
+                buffer_put(b, data, fieldlen);
+                buffer_putc(b, '=');
+
                 if (flags & OUTPUT_SHOW_ALL ||
                     (((length < PRINT_THRESHOLD) || flags & OUTPUT_FULL_WIDTH) && utf8_is_printable(data, length))) {
-                        fprintf(f, "    %s%.*s=", on, fieldlen, (const char*)data);
-                        print_multiline(f, 4 + fieldlen + 1, 0, OUTPUT_FULL_WIDTH, 0, c + 1, length - fieldlen - 1);
-                        fputs(off, f);
+                        print_multiline(b, 4 + fieldlen + 1, 0, OUTPUT_FULL_WIDTH, 0, c + 1, length - fieldlen - 1);
+                        buffer_puts(b, off);
                 } else {
                         char bytes[FORMAT_BYTES_MAX];
 
-                        fprintf(f, "    %s%.*s=[%s blob data]%s\n",
-                                on,
-                                (int) (c - (const char*) data),
-                                (const char*) data,
-                                format_bytes(bytes, sizeof(bytes), length - (c - (const char *) data) - 1),
-                                off);
+                        buffer_printf(b, "[%s blob data]%s\n",
+                                      format_bytes(bytes, sizeof(bytes), length - fieldlen - 1),
+                                      off);
                 }
         }
 
@@ -276,13 +358,13 @@ static int output_verbose(
                 return r;
 
         if (flags & OUTPUT_CATALOG)
-                print_catalog(f, j);
+                print_catalog(b, j);
 
         return 0;
 }
 
 static int output_export(
-                FILE *f,
+                OutputBuffer *b,
                 sd_journal *j,
                 OutputMode mode,
                 unsigned n_columns,
@@ -318,15 +400,15 @@ static int output_export(
                 return r;
         }
 
-        fprintf(f,
-                "__CURSOR=%s\n"
-                "__REALTIME_TIMESTAMP=%llu\n"
-                "__MONOTONIC_TIMESTAMP=%llu\n"
-                "_BOOT_ID=%s\n",
-                cursor,
-                (unsigned long long) realtime,
-                (unsigned long long) monotonic,
-                sd_id128_to_string(boot_id, sid));
+        buffer_puts(b, "__CURSOR=");
+        buffer_puts(b, cursor);
+        buffer_puts(b, "\n__REALTIME_TIMESTAMP=");
+        buffer_put_unsigned(b, realtime);
+        buffer_puts(b, "\n__MONOTONIC_TIMESTAMP=");
+        buffer_put_unsigned(b, monotonic);
+        buffer_puts(b, "\n_BOOT_ID=");
+        buffer_puts(b, sd_id128_to_string(boot_id, sid));
+        buffer_putc(b, '\n');
 
         JOURNAL_FOREACH_DATA_RETVAL(j, data, length, r) {
 
@@ -356,80 +438,199 @@ static int output_export(
                                 return -EINVAL;
                         }
 
-                        fwrite(data, c - (const char*) data, 1, f);
-                        fputc('\n', f);
+                        buffer_put(b, data, c - (const char*) data);
+                        buffer_putc(b, '\n');
                         le64 = htole64(length - (c - (const char*) data) - 1);
-                        fwrite(&le64, sizeof(le64), 1, f);
-                        fwrite(c + 1, length - (c - (const char*) data) - 1, 1, f);
+                        buffer_put(b, &le64, sizeof(le64));
+                        buffer_put(b, c + 1, length - (c - (const char*) data) - 1);
                 } else
-                        fwrite(data, length, 1, f);
+                        buffer_put(b, data, length);
 
-                fputc('\n', f);
+                buffer_putc(b, '\n');
         }
 
         if (r < 0)
                 return r;
 
-        fputc('\n', f);
+        buffer_putc(b, '\n');
 
         return 0;
 }
 
-void json_escape(
-                FILE *f,
+/* Returns the length of the run of characters at the beginning of p
+ * that may be copied into a JSON string as they are. */
+static size_t json_plain_span(const char *p, size_t l) {
+        const char *s = p;
+
+        while (l >= sizeof(unsigned long)) {
+                unsigned long w;
+
+                memcpy(&w, p, sizeof(w));
+                if (WORD_HAS_LESS(w, ' ') ||
+                    WORD_HAS_BYTE(w, '"') ||
+                    WORD_HAS_BYTE(w, '\\'))
+                        break;
+
+                p += sizeof(w);
+                l -= sizeof(w);
+        }
+
+        while (l > 0 && (uint8_t) *p >= ' ' && *p != '"' && *p != '\\') {
+                p++;
+                l--;
+        }
+
+        return p - s;
+}
+
+static void buffer_json_escape(
+                OutputBuffer *b,
                 const char* p,
                 size_t l,
                 OutputFlags flags) {
 
-        assert(f);
+        assert(b);
         assert(p);
 
         if (!(flags & OUTPUT_SHOW_ALL) && l >= JSON_THRESHOLD)
 
-                fputs("null", f);
+                buffer_puts(b, "null");
 
         else if (!utf8_is_printable(p, l)) {
                 bool not_first = false;
 
-                fputs("[ ", f);
+                buffer_puts(b, "[ ");
 
                 while (l > 0) {
                         if (not_first)
-                                fprintf(f, ", %u", (uint8_t) *p);
-                        else {
+                                buffer_puts(b, ", ");
+                        else
                                 not_first = true;
-                                fprintf(f, "%u", (uint8_t) *p);
-                        }
+
+                        buffer_put_unsigned(b, (uint8_t) *p);
 
                         p++;
                         l--;
                 }
 
-                fputs(" ]", f);
+                buffer_puts(b, " ]");
         } else {
-                fputc('\"', f);
+                buffer_putc(b, '\"');
 
                 while (l > 0) {
+                        size_t n;
+
+                        n = json_plain_span(p, l);
+                        buffer_put(b, p, n);
+                        p += n;
+                        l -= n;
+
+                        if (l <= 0)
+                                break;
+
                         if (*p == '"' || *p == '\\') {
-                                fputc('\\', f);
-                                fputc(*p, f);
+                                buffer_putc(b, '\\');
+                                buffer_putc(b, *p);
                         } else if (*p == '\n')
-                                fputs("\\n", f);
-                        else if (*p < ' ')
-                                fprintf(f, "\\u%04x", *p);
+                                buffer_puts(b, "\\n");
                         else
-                                fputc(*p, f);
+                                buffer_printf(b, "\\u%04x", (uint8_t) *p);
 
                         p++;
                         l--;
                 }
 
-                fputc('\"', f);
+                buffer_putc(b, '\"');
         }
 }
 
-static int output_json(
+void json_escape(
                 FILE *f,
+                const char* p,
+                size_t l,
+                OutputFlags flags) {
+
+        assert(f);
+        assert(p);
+
+        buffer_json_escape(&output_buffer, p, l, flags);
+        buffer_flush(&output_buffer, f);
+}
+
+/* Field names of the entry currently being formatted as JSON, with
+ * the number of times each of them appears, and for each data item of
+ * the entry the index of its field. Kept around between calls like
+ * the output buffer. */
+typedef struct JsonField {
+        size_t name;
+        size_t length;
+        unsigned n;
+} JsonField;
+
+typedef struct JsonFields {
+        char *names;
+        size_t names_size, names_allocated;
+
+        JsonField *fields;
+        unsigned n_fields;
+        size_t fields_allocated;
+
+        unsigned *items;
+        unsigned n_items;
+        size_t items_allocated;
+} JsonFields;
+
+static __thread JsonFields json_fields = {};
+
+static int json_fields_add(JsonFields *t, const char *name, size_t length) {
+        unsigned k;
+
+        assert(t);
+
+        for (k = 0; k < t->n_fields; k++)
+                if (t->fields[k].length == length &&
+                    memcmp(t->names + t->fields[k].name, name, length) == 0)
+                        break;
+
+        if (k < t->n_fields)
+                t->fields[k].n++;
+        else {
+                if (!GREEDY_REALLOC(t->names, t->names_allocated, t->names_size + length) ||
+                    !GREEDY_REALLOC(t->fields, t->fields_allocated, t->n_fields + 1))
+                        return -ENOMEM;
+
+                memcpy(t->names + t->names_size, name, length);
+                t->fields[k] = (JsonField) {
+                        .name = t->names_size,
+                        .length = length,
+                        .n = 1,
+                };
+
+                t->names_size += length;
+                t->n_fields++;
+        }
+
+        if (!GREEDY_REALLOC(t->items, t->items_allocated, t->n_items + 1))
+                return -ENOMEM;
+
+        t->items[t->n_items++] = k;
+
+        return 0;
+}
+
+static const char *json_field_end(const void *data, size_t length) {
+
+        /* We already printed the boot id, from the data in
+         * the header, hence let's suppress it here */
+        if (length >= 9 &&
+            memcmp(data, "_BOOT_ID=", 9) == 0)
+                return NULL;
+
+        return memchr(data, '=', length);
+}
+
+static int output_json(
+                OutputBuffer *b,
                 sd_journal *j,
                 OutputMode mode,
                 unsigned n_columns,
@@ -440,11 +641,13 @@ static int output_json(
         const void *data;
         size_t length;
         sd_id128_t boot_id;
-        char sid[33], *k;
+        char sid[33];
         int r;
-        Hashmap *h = NULL;
-        bool done, separator;
+        JsonFields *t = &json_fields;
+        unsigned i;
+        bool done;
 
+        assert(b);
         assert(j);
 
         sd_journal_set_data_threshold(j, flags & OUTPUT_SHOW_ALL ? 0 : JSON_THRESHOLD);
@@ -468,189 +671,130 @@ static int output_json(
         }
 
         if (mode == OUTPUT_JSON_PRETTY)
-                fprintf(f,
-                        "{\n"
-                        "\t\"__CURSOR\" : \"%s\",\n"
-                        "\t\"__REALTIME_TIMESTAMP\" : \"%llu\",\n"
-                        "\t\"__MONOTONIC_TIMESTAMP\" : \"%llu\",\n"
-                        "\t\"_BOOT_ID\" : \"%s\"",
-                        cursor,
-                        (unsigned long long) realtime,
-                        (unsigned long long) monotonic,
-                        sd_id128_to_string(boot_id, sid));
+                buffer_printf(b,
+                              "{\n"
+                              "\t\"__CURSOR\" : \"%s\",\n"
+                              "\t\"__REALTIME_TIMESTAMP\" : \"%llu\",\n"
+                              "\t\"__MONOTONIC_TIMESTAMP\" : \"%llu\",\n"
+                              "\t\"_BOOT_ID\" : \"%s\"",
+                              cursor,
+                              (unsigned long long) realtime,
+                              (unsigned long long) monotonic,
+                              sd_id128_to_string(boot_id, sid));
         else {
                 if (mode == OUTPUT_JSON_SSE)
-                        fputs("data: ", f);
-
-                fprintf(f,
-                        "{ \"__CURSOR\" : \"%s\", "
-                        "\"__REALTIME_TIMESTAMP\" : \"%llu\", "
-                        "\"__MONOTONIC_TIMESTAMP\" : \"%llu\", "
-                        "\"_BOOT_ID\" : \"%s\"",
-                        cursor,
-                        (unsigned long long) realtime,
-                        (unsigned long long) monotonic,
-                        sd_id128_to_string(boot_id, sid));
+                        buffer_puts(b, "data: ");
+
+                buffer_puts(b, "{ \"__CURSOR\" : \"");
+                buffer_puts(b, cursor);
+                buffer_puts(b, "\", \"__REALTIME_TIMESTAMP\" : \"");
+                buffer_put_unsigned(b, realtime);
+                buffer_puts(b, "\", \"__MONOTONIC_TIMESTAMP\" : \"");
+                buffer_put_unsigned(b, monotonic);
+                buffer_puts(b, "\", \"_BOOT_ID\" : \"");
+                buffer_puts(b, sd_id128_to_string(boot_id, sid));
+                buffer_putc(b, '"');
         }
 
-        h = hashmap_new(string_hash_func, string_compare_func);
-        if (!h)
-                return -ENOMEM;
+        t->names_size = 0;
+        t->n_fields = 0;
+        t->n_items = 0;
 
         /* First round, iterate through the entry and count how often each field appears */
         JOURNAL_FOREACH_DATA_RETVAL(j, data, length, r) {
                 const char *eq;
-                char *n;
-                unsigned u;
-
-                if (length >= 9 &&
-                    memcmp(data, "_BOOT_ID=", 9) == 0)
-                        continue;
 
-                eq = memchr(data, '=', length);
+                eq = json_field_end(data, length);
                 if (!eq)
                         continue;
 
-                n = strndup(data, eq - (const char*) data);
-                if (!n) {
-                        r = -ENOMEM;
-                        goto finish;
-                }
-
-                u = PTR_TO_UINT(hashmap_get(h, n));
-                if (u == 0) {
-                        r = hashmap_put(h, n, UINT_TO_PTR(1));
-                        if (r < 0) {
-                                free(n);
-                                goto finish;
-                        }
-                } else {
-                        r = hashmap_update(h, n, UINT_TO_PTR(u + 1));
-                        free(n);
-                        if (r < 0)
-                                goto finish;
-                }
+                if (json_fields_add(t, data, eq - (const char*) data) < 0)
+                        return log_oom();
         }
 
         if (r < 0)
                 return r;
 
-        separator = true;
         do {
                 done = true;
+                i = 0;
 
                 SD_JOURNAL_FOREACH_DATA(j, data, length) {
                         const char *eq;
-                        char *kk, *n;
+                        JsonField *field;
                         size_t m;
-                        unsigned u;
-
-                        /* We already printed the boot id, from the data in
-                         * the header, hence let's suppress it here */
-                        if (length >= 9 &&
-                            memcmp(data, "_BOOT_ID=", 9) == 0)
-                                continue;
 
-                        eq = memchr(data, '=', length);
+                        eq = json_field_end(data, length);
                         if (!eq)
                                 continue;
 
-                        if (separator) {
-                                if (mode == OUTPUT_JSON_PRETTY)
-                                        fputs(",\n\t", f);
-                                else
-                                        fputs(", ", f);
-                        }
-
-                        m = eq - (const char*) data;
-
-                        n = strndup(data, m);
-                        if (!n) {
-                                r = -ENOMEM;
-                                goto finish;
-                        }
+                        if (i >= t->n_items)
+                                break;
 
-                        u = PTR_TO_UINT(hashmap_get2(h, n, (void**) &kk));
-                        if (u == 0) {
-                                /* We already printed this, let's jump to the next */
-                                free(n);
-                                separator = false;
+                        field = t->fields + t->items[i++];
 
+                        /* We already printed this, let's jump to the next */
+                        if (field->n == 0)
                                 continue;
-                        } else if (u == 1) {
-                                /* Field only appears once, output it directly */
 
-                                json_escape(f, data, m, flags);
-                                fputs(" : ", f);
-
-                                json_escape(f, eq + 1, length - m - 1, flags);
+                        if (mode == OUTPUT_JSON_PRETTY)
+                                buffer_puts(b, ",\n\t");
+                        else
+                                buffer_puts(b, ", ");
 
-                                hashmap_remove(h, n);
-                                free(kk);
-                                free(n);
+                        m = eq - (const char*) data;
+                        buffer_json_escape(b, data, m, flags);
 
-                                separator = true;
+                        if (field->n == 1) {
+                                /* Field only appears once, output it directly */
+                                buffer_puts(b, " : ");
+                                buffer_json_escape(b, eq + 1, length - m - 1, flags);
 
+                                field->n = 0;
                                 continue;
+                        }
 
-                        } else {
-                                /* Field appears multiple times, output it as array */
-                                json_escape(f, data, m, flags);
-                                fputs(" : [ ", f);
-                                json_escape(f, eq + 1, length - m - 1, flags);
-
-                                /* Iterate through the end of the list */
-
-                                while (sd_journal_enumerate_data(j, &data, &length) > 0) {
-                                        if (length < m + 1)
-                                                continue;
-
-                                        if (memcmp(data, n, m) != 0)
-                                                continue;
+                        /* Field appears multiple times, output it as array */
+                        buffer_puts(b, " : [ ");
+                        buffer_json_escape(b, eq + 1, length - m - 1, flags);
 
-                                        if (((const char*) data)[m] != '=')
-                                                continue;
+                        /* Iterate through the end of the list */
+                        while (sd_journal_enumerate_data(j, &data, &length) > 0) {
+                                if (!json_field_end(data, length))
+                                        continue;
 
-                                        fputs(", ", f);
-                                        json_escape(f, (const char*) data + m + 1, length - m - 1, flags);
-                                }
+                                if (i >= t->n_items)
+                                        break;
 
-                                fputs(" ]", f);
+                                if (t->fields + t->items[i++] != field)
+                                        continue;
 
-                                hashmap_remove(h, n);
-                                free(kk);
-                                free(n);
+                                buffer_puts(b, ", ");
+                                buffer_json_escape(b, (const char*) data + m + 1, length - m - 1, flags);
+                        }
 
-                                /* Iterate data fields form the beginning */
-                                done = false;
-                                separator = true;
+                        buffer_puts(b, " ]");
+                        field->n = 0;
 
-                                break;
-                        }
+                        /* Iterate data fields form the beginning */
+                        done = false;
+                        break;
                 }
 
         } while (!done);
 
         if (mode == OUTPUT_JSON_PRETTY)
-                fputs("\n}\n", f);
+                buffer_puts(b, "\n}\n");
         else if (mode == OUTPUT_JSON_SSE)
-                fputs("}\n\n", f);
+                buffer_puts(b, "}\n\n");
         else
-                fputs(" }\n", f);
+                buffer_puts(b, " }\n");
 
-        r = 0;
-
-finish:
-        while ((k = hashmap_steal_first_key(h)))
-                free(k);
-
-        hashmap_free(h);
-
-        return r;
+        return 0;
 }
 
 static int output_cat(
-                FILE *f,
+                OutputBuffer *b,
                 sd_journal *j,
                 OutputMode mode,
                 unsigned n_columns,
@@ -661,7 +805,7 @@ static int output_cat(
         int r;
 
         assert(j);
-        assert(f);
+        assert(b);
 
         sd_journal_set_data_threshold(j, 0);
 
@@ -677,14 +821,14 @@ static int output_cat(
 
         assert(l >= 8);
 
-        fwrite((const char*) data + 8, 1, l - 8, f);
-        fputc('\n', f);
+        buffer_put(b, (const char*) data + 8, l - 8);
+        buffer_putc(b, '\n');
 
         return 0;
 }
 
 static int (*output_funcs[_OUTPUT_MODE_MAX])(
-                FILE *f,
+                OutputBuffer *b,
                 sd_journal*j,
                 OutputMode mode,
                 unsigned n_columns,
@@ -707,15 +851,28 @@ int output_journal(
                 unsigned n_columns,
                 OutputFlags flags) {
 
-        int ret;
+        int ret, r;
         assert(mode >= 0);
         assert(mode < _OUTPUT_MODE_MAX);
 
         if (n_columns <= 0)
                 n_columns = columns();
 
-        ret = output_funcs[mode](f, j, mode, n_columns, flags);
-        fflush(stdout);
+        /* The entry is formatted completely before anything is
+         * written, so that a failure halfway through leaves no
+         * partial entry behind. Flushing f is left to the caller, so
+         * that stdio can batch many entries into one write. */
+        ret = output_funcs[mode](&output_buffer, j, mode, n_columns, flags);
+        if (ret < 0) {
+                output_buffer.size = 0;
+                output_buffer.oom = false;
+                return ret;
+        }
+
+        r = buffer_flush(&output_buffer, f);
+        if (r < 0)
+                return r;
+
         return ret;
 }
 
@@ -804,6 +961,8 @@ static int show_journal(FILE *f,
                 if (!(flags & OUTPUT_FOLLOW))
                         break;
 
+                fflush(f);
+
                 r = sd_journal_wait(j, (usec_t) -1);
                 if (r < 0)
                         goto finish;
@@ -90,6 +90,33 @@ static bool is_unicode_control(uint32_t ch) {
                 (0x7F <= ch && ch <= 0x9F);
 }
 
+/* Returns the length of the run of printable ASCII characters at the
+ * beginning of p. Looks at a whole word at a time as long as it can,
+ * since most of what we validate is plain ASCII. */
+static size_t ascii_printable_span(const uint8_t *p, size_t length) {
+        const uint8_t *s = p;
+
+        while (length >= sizeof(unsigned long)) {
+                unsigned long w;
+
+                memcpy(&w, p, sizeof(w));
+                if ((w & WORD_HIGH_BITS) ||
+                    WORD_HAS_LESS(w, ' ') ||
+                    WORD_HAS_BYTE(w, 0x7F))
+                        break;
+
+                p += sizeof(w);
+                length -= sizeof(w);
+        }
+
+        while (length > 0 && *p >= ' ' && *p < 0x7F) {
+                p++;
+                length--;
+        }
+
+        return p - s;
+}
+
 bool utf8_is_printable(const char* str, size_t length) {
         uint32_t val = 0;
         uint32_t min = 0;
@@ -98,6 +125,14 @@ bool utf8_is_printable(const char* str, size_t length) {
         assert(str);
 
         for (p = (const uint8_t*) str; length; p++, length--) {
+                size_t n;
+
+                n = ascii_printable_span(p, length);
+                p += n;
+                length -= n;
+                if (length <= 0)
+                        break;
+
                 if (*p < 128) {
                         val = *p;
                 } else {
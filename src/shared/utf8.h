@@ -25,6 +25,13 @@
 
 #include "macro.h"
 
+/* Word-at-a-time byte tests: whether any byte of w is below n (for
+ * n <= 128), or equal to c. */
+#define WORD_LOW_BITS (~0UL / 0xFF)
+#define WORD_HIGH_BITS (WORD_LOW_BITS * 0x80)
+#define WORD_HAS_LESS(w, n) (((w) - WORD_LOW_BITS * (n)) & ~(w) & WORD_HIGH_BITS)
+#define WORD_HAS_BYTE(w, c) WORD_HAS_LESS((w) ^ (WORD_LOW_BITS * (c)), 1)
+
 char *utf8_is_valid(const char *s) _pure_;
 char *ascii_is_valid(const char *s) _pure_;
 
@@ -0,0 +1,88 @@
+/*-*- Mode: C; c-basic-offset: 8; indent-tabs-mode: nil -*-*/
+
+/***
+  This file is part of systemd.
+
+  Copyright 2013 Lennart Poettering
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "hashmap.h"
+#include "log.h"
+#include "util.h"
+#include "time-util.h"
+
+/* Measures inserts and lookups for tables of different sizes. Not
+ * part of the test suite, since it only prints numbers. Other sizes
+ * may be passed on the command line. */
+
+static void benchmark_one(unsigned n) {
+        Hashmap *m;
+        usec_t ts, insert, lookup;
+        unsigned j, k;
+        unsigned long long rounds;
+
+        m = hashmap_new(trivial_hash_func, trivial_compare_func);
+        assert_se(m);
+
+        ts = now(CLOCK_MONOTONIC);
+        for (j = 1; j <= n; j++)
+                assert_se(hashmap_put(m, UINT_TO_PTR(j), UINT_TO_PTR(j)) == 1);
+        insert = now(CLOCK_MONOTONIC) - ts;
+
+        /* Do roughly the same number of lookups for each size, so
+         * that the small tables get measurable numbers, too */
+        rounds = MAX(1U, 1000000U / n);
+
+        ts = now(CLOCK_MONOTONIC);
+        for (k = 0; k < rounds; k++)
+                for (j = 1; j <= n; j++)
+                        assert_se(hashmap_get(m, UINT_TO_PTR(j)));
+        lookup = now(CLOCK_MONOTONIC) - ts;
+
+        printf("%8u entries: %10llu inserts/s, %10llu lookups/s\n",
+               n,
+               (unsigned long long) n * USEC_PER_SEC / MAX(insert, (usec_t) 1),
+               (unsigned long long) n * rounds * USEC_PER_SEC / MAX(lookup, (usec_t) 1));
+
+        hashmap_free(m);
+}
+
+int main(int argc, char *argv[]) {
+        int i;
+
+        if (argc <= 1) {
+                benchmark_one(100);
+                benchmark_one(10000);
+                benchmark_one(1000000);
+                return 0;
+        }
+
+        for (i = 1; i < argc; i++) {
+                unsigned n;
+
+                if (safe_atou(argv[i], &n) < 0 || n <= 0) {
+                        log_error("Invalid size: %s", argv[i]);
+                        return EXIT_FAILURE;
+                }
+
+                benchmark_one(n);
+        }
+
+        return 0;
+}
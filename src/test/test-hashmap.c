@@ -467,6 +467,41 @@ static void test_hashmap_get(void) {
         hashmap_free_free(m);
 }
 
+static void test_hashmap_many(void) {
+        Hashmap *m;
+        Iterator i;
+        void *v;
+        unsigned j, n = 0;
+
+        /* Make sure lookups, removals and insertion-ordered
+         * iteration keep working while the table grows */
+
+        m = hashmap_new(trivial_hash_func, trivial_compare_func);
+        assert_se(m);
+
+        for (j = 1; j <= 100000; j++)
+                assert_se(hashmap_put(m, UINT_TO_PTR(j), UINT_TO_PTR(j)) == 1);
+
+        assert_se(hashmap_size(m) == 100000);
+
+        for (j = 1; j <= 100000; j += 2)
+                assert_se(hashmap_remove(m, UINT_TO_PTR(j)) == UINT_TO_PTR(j));
+
+        assert_se(hashmap_size(m) == 50000);
+
+        for (j = 1; j <= 100000; j++)
+                assert_se(hashmap_get(m, UINT_TO_PTR(j)) == (j % 2 == 0 ? UINT_TO_PTR(j) : NULL));
+
+        HASHMAP_FOREACH(v, m, i) {
+                n += 2;
+                assert_se(PTR_TO_UINT(v) == n);
+        }
+
+        assert_se(n == 100000);
+
+        hashmap_free(m);
+}
+
 static void test_uint64_compare_func(void) {
         assert_se(uint64_compare_func("a", "a") == 0);
         assert_se(uint64_compare_func("a", "b") == -1);
@@ -502,6 +537,7 @@ int main(int argc, const char *argv[])
         test_hashmap_isempty();
         test_hashmap_get();
         test_hashmap_size();
+        test_hashmap_many();
         test_uint64_compare_func();
         test_trivial_compare_func();
         test_string_compare_func();